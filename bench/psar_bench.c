@@ -0,0 +1,917 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file psar_bench.c
+ * @brief Throughput benchmark for the PSARc project.
+ *
+ * This file implements psar_bench, which generates synthetic corpora and measures how fast psar
+ * creates, extracts, lists and shows the info of their archives, across compression types,
+ * levels, block sizes and numbers of threads. Each operation runs psar in its own process, so
+ * its peak memory can be measured.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "common.h"
+#include "psarc.h"
+#include "coder.h"
+#include "threads.h"
+#include "file_utils.h"
+
+#define BENCHNAME           "psar_bench"
+
+#define MAX_VALUES          16                  // Max items of the lists of the command line
+#define DEFAULT_SIZE        32                  // Size of each corpus (MB)
+#define SMALL_FILE_MIN      256                 // Size of the files of the "small" corpus
+#define SMALL_FILE_MAX      16384
+#define SMALL_FILES_PER_DIR 100                 // Files in each directory of the "small" corpus
+#define HUGE_FILES          2                   // Files of the "huge" corpus
+#define RANDOM_FILES        4                   // Files of the "random" corpus
+#define TEXT_FILES          16                  // Files of the "text" corpus
+#define WRITE_BUFFER_SIZE   0x100000            // Data generated at once
+
+// Compression types, with the psar option that selects them
+static const struct {
+    const char *name;
+    int type;
+    const char *option;
+} codecs[] = {
+    { "store", PSARC_STORE, NULL },
+    { "zlib", PSARC_ZLIB, "-z" },
+    { "lzma", PSARC_LZMA, "-j" },
+    { "zstd", PSARC_ZSTD, "-Z" },
+    { "lz4", PSARC_LZ4, "-L" },
+    { NULL, 0, NULL }
+};
+
+// Words of the generated text, the first ones are the most frequent
+static const char *words[] = {
+    "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be", "by",
+    "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had",
+    "they", "you", "were", "their", "one", "all", "we", "can", "her", "has", "there", "been", "if",
+    "more", "when", "will", "would", "who", "so", "no", "archive", "block", "texture", "model",
+    "level", "sound", "player", "engine", "shader", "material", "animation", "script", "config",
+    NULL
+};
+
+typedef struct {
+    const char *name;
+    char path[4096];                            // Directory of the corpus
+    uint64_t files;                             // Files generated
+    uint64_t bytes;                             // Bytes generated
+} CORPUS;
+
+typedef struct {
+    double seconds;                             // Wall time
+    long peak_rss_kb;                           // Peak resident memory of psar
+} MEASURE;
+
+typedef struct {
+    const char *psar;
+    char work_dir[4096];
+    uint64_t size;
+    char *corpora;
+    int codecs[MAX_VALUES];
+    int num_codecs;
+    int levels[MAX_VALUES];
+    int num_levels;
+    int block_sizes[MAX_VALUES];
+    int num_block_sizes;
+    int threads[MAX_VALUES];
+    int num_threads;
+    int repeat;
+    int keep;
+    enum FORMAT_VALUE_ENUM output_format;
+} BENCHCONFIG;
+
+static BENCHCONFIG bench;
+static int num_results = 0;                     // Results printed so far
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static struct option long_options[] = {
+    { "psar", required_argument, 0, 'p' },
+    { "work-dir", required_argument, 0, 'd' },
+    { "size", required_argument, 0, 'S' },
+    { "corpus", required_argument, 0, 'C' },
+    { "codecs", required_argument, 0, 'c' },
+    { "levels", required_argument, 0, 'l' },
+    { "block-sizes", required_argument, 0, 'b' },
+    { "num-threads", required_argument, 0, 'n' },
+    { "repeat", required_argument, 0, 'r' },
+    { "keep", no_argument, 0, 'k' },
+    { "output-format", required_argument, 0, 'o' },
+    { "help", no_argument, 0, 'h' },
+    { 0, 0, 0, 0 }
+};
+
+/**
+ * Gets the next pseudo-random number (xorshift64*), so the corpora are the same on every run.
+ *
+ * @return              The number.
+ */
+
+static uint64_t rng_next() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * Gets a word for the generated text, the first words of the list are picked more often.
+ *
+ * @return              The word.
+ */
+
+static const char *next_word() {
+    size_t num_words = sizeof(words) / sizeof(words[0]) - 1;
+    uint64_t r = rng_next();
+
+    return words[( ( r & 0xffff ) % num_words ) * ( ( r >> 16 & 0xffff ) % num_words ) / num_words];
+}
+
+/**
+ * Fills a buffer with text made of words, in lines of different lengths.
+ *
+ * @param buffer        The buffer.
+ * @param size          Size of the buffer.
+ */
+
+static void fill_text(uint8_t *buffer, size_t size) {
+    size_t pos = 0;
+    size_t line = 0;
+
+    while (pos < size) {
+        const char *word = next_word();
+        size_t len = strlen(word);
+
+        for (size_t i = 0; i < len && pos < size; i++) buffer[pos++] = word[i];
+        line += len + 1;
+
+        if (pos < size) buffer[pos++] = line > 60 + rng_next() % 20 ? '\n' : ' ';
+        if (line > 60) line = 0;
+    }
+}
+
+/**
+ * Fills a buffer with records like the ones of game data: small headers, counters, floats
+ * and names, so the data compresses, but not as much as text.
+ *
+ * @param buffer        The buffer.
+ * @param size          Size of the buffer.
+ */
+
+static void fill_records(uint8_t *buffer, size_t size) {
+    static uint32_t counter = 0;
+    size_t pos = 0;
+
+    while (pos < size) {
+        uint8_t record[64];
+        uint32_t id = counter++;
+        float values[4] = { (float)(rng_next() % 1000) / 10, (float)(rng_next() % 100), 1.0f, 0.0f };
+
+        memcpy(record, "REC0", 4);
+        memcpy(record + 4, &id, sizeof(id));
+        memcpy(record + 8, values, sizeof(values));
+        for (int i = 24; i < 40; i++) record[i] = rng_next() & 0xff;
+        snprintf((char *)record + 40, 24, "%-23s", next_word());
+
+        size_t len = size - pos < sizeof(record) ? size - pos : sizeof(record);
+        memcpy(buffer + pos, record, len);
+        pos += len;
+    }
+}
+
+/**
+ * Fills a buffer with incompressible data.
+ *
+ * @param buffer        The buffer.
+ * @param size          Size of the buffer.
+ */
+
+static void fill_random(uint8_t *buffer, size_t size) {
+    for (size_t pos = 0; pos < size; pos += 8) {
+        uint64_t r = rng_next();
+        memcpy(buffer + pos, &r, size - pos < 8 ? size - pos : 8);
+    }
+}
+
+/**
+ * Writes a file of the corpus, generating its data.
+ *
+ * @param corpus        The corpus (its totals are updated).
+ * @param name          Path of the file in the corpus.
+ * @param size          Size of the file.
+ * @param fill          Generator of the data.
+ * @param buffer        Buffer for the data (WRITE_BUFFER_SIZE bytes).
+ *
+ * @return              0 if successful, 1 on error.
+ */
+
+static int write_corpus_file(CORPUS *corpus, const char *name, uint64_t size, void (*fill)(uint8_t *, size_t), uint8_t *buffer) {
+    char path[8192];
+    snprintf(path, sizeof(path), "%s/%s", corpus->path, name);
+
+    // Files in subdirectories
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    if (mkpath(path, 0777)) return 1;
+    *slash = '/';
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return 1;
+
+    uint64_t left = size;
+    while (left) {
+        size_t len = left > WRITE_BUFFER_SIZE ? WRITE_BUFFER_SIZE : left;
+        fill(buffer, len);
+        if (fwrite(buffer, len, 1, fp) != 1) {
+            fclose(fp);
+            return 1;
+        }
+        left -= len;
+    }
+
+    if (fclose(fp)) return 1;
+
+    corpus->files++;
+    corpus->bytes += size;
+
+    return 0;
+}
+
+/**
+ * Generates a corpus.
+ *
+ * - small: many JSON-like files from 256 bytes to 16 KB, in directories of 100 files.
+ * - huge: a few big files of binary records.
+ * - random: incompressible files.
+ * - text: medium text files.
+ *
+ * @param corpus        The corpus (name and path set).
+ * @param size          Approximate size of the corpus.
+ *
+ * @return              0 if successful, 1 on error.
+ */
+
+static int generate_corpus(CORPUS *corpus, uint64_t size) {
+    uint8_t *buffer = malloc(WRITE_BUFFER_SIZE);
+    if (!buffer) return 1;
+
+    char name[256];
+    int ret = 0;
+
+    corpus->files = corpus->bytes = 0;
+
+    if (!strcmp(corpus->name, "small")) {
+        while (!ret && corpus->bytes < size) {
+            uint64_t file_size = SMALL_FILE_MIN + rng_next() % ( SMALL_FILE_MAX - SMALL_FILE_MIN );
+            snprintf(name, sizeof(name), "d%04" PRIu64 "/f%06" PRIu64 ".json", corpus->files / SMALL_FILES_PER_DIR, corpus->files);
+            ret = write_corpus_file(corpus, name, file_size, fill_text, buffer);
+        }
+    } else if (!strcmp(corpus->name, "huge")) {
+        for (int i = 0; i < HUGE_FILES && !ret; i++) {
+            snprintf(name, sizeof(name), "huge%d.bin", i);
+            ret = write_corpus_file(corpus, name, size / HUGE_FILES, fill_records, buffer);
+        }
+    } else if (!strcmp(corpus->name, "random")) {
+        for (int i = 0; i < RANDOM_FILES && !ret; i++) {
+            snprintf(name, sizeof(name), "random%d.bin", i);
+            ret = write_corpus_file(corpus, name, size / RANDOM_FILES, fill_random, buffer);
+        }
+    } else if (!strcmp(corpus->name, "text")) {
+        for (int i = 0; i < TEXT_FILES && !ret; i++) {
+            snprintf(name, sizeof(name), "doc%02d/text%d.txt", i % 4, i);
+            ret = write_corpus_file(corpus, name, size / TEXT_FILES, fill_text, buffer);
+        }
+    } else {
+        fprintf( stderr, BENCHNAME": unknown corpus %s\n", corpus->name );
+        ret = 1;
+    }
+
+    free(buffer);
+
+    return ret;
+}
+
+/**
+ * Removes a file or an empty directory (nftw callback).
+ */
+
+static int remove_item(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    return remove(path);
+}
+
+/**
+ * Removes a directory with all its content.
+ *
+ * @param path          The directory.
+ */
+
+static void remove_tree(const char *path) {
+    struct stat st;
+    if (!lstat(path, &st)) nftw(path, remove_item, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * Runs psar and measures it.
+ *
+ * The output of psar is discarded, only its exit status counts.
+ *
+ * @param args          Arguments of psar (NULL terminated, the first one is the program).
+ * @param measure       The measures (output).
+ *
+ * @return              0 if psar succeeded, 1 otherwise.
+ */
+
+static int run_psar(char **args, MEASURE *measure) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid < 0) return 1;
+
+    if (!pid) {
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        execvp(args[0], args);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) return 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    measure->seconds = (double)( end.tv_sec - start.tv_sec ) + (double)( end.tv_nsec - start.tv_nsec ) / 1e9;
+    measure->peak_rss_kb = usage.ru_maxrss;
+
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+/**
+ * Runs psar the times set with --repeat and keeps the best time (and the highest peak memory).
+ *
+ * @param args          Arguments of psar (NULL terminated, the first one is the program).
+ * @param measure       The measures (output).
+ * @param before        Called before each run (to clean up after the previous one) or NULL.
+ * @param arg           Argument of before().
+ *
+ * @return              0 if psar succeeded, 1 otherwise.
+ */
+
+static int measure_psar(char **args, MEASURE *measure, void (*before)(const char *), const char *arg) {
+    measure->seconds = 0;
+    measure->peak_rss_kb = 0;
+
+    for (int i = 0; i < bench.repeat; i++) {
+        MEASURE m;
+
+        if (before) before(arg);
+        if (run_psar(args, &m)) return 1;
+
+        if (!i || m.seconds < measure->seconds) measure->seconds = m.seconds;
+        if (m.peak_rss_kb > measure->peak_rss_kb) measure->peak_rss_kb = m.peak_rss_kb;
+    }
+
+    return 0;
+}
+
+/**
+ * Prints the header of the results.
+ */
+
+static void print_header() {
+    switch (bench.output_format) {
+        case JSON_FORMAT:
+            printf("{\"psar\":\"%s\",\"results\":[", bench.psar);
+            break;
+
+        case CSV_FORMAT:
+            printf("corpus,files,bytes,operation,codec,level,block_size,threads,seconds,mb_per_s,files_per_s,peak_rss_kb,archive_size\n");
+            break;
+
+        case XML_FORMAT:
+            printf("<benchmark><psar>%s</psar>", bench.psar);
+            break;
+
+        default:
+            printf("%-7s %-8s %-6s %5s %8s %7s %9s %9s %10s %10s %6s\n",
+                   "corpus", "op", "codec", "level", "block", "threads", "seconds", "MB/s", "files/s", "peak KB", "ratio");
+            break;
+    }
+
+    fflush(stdout);
+}
+
+/**
+ * Prints a result.
+ *
+ * @param corpus        The corpus.
+ * @param operation     The operation (create, extract, list or info).
+ * @param codec         Index of the compression type.
+ * @param level         Compression level (-1 = default).
+ * @param block_size    Block size.
+ * @param threads       Number of threads.
+ * @param measure       The measures.
+ * @param archive_size  Size of the archive.
+ */
+
+static void print_result(CORPUS *corpus, const char *operation, int codec, int level, int block_size, int threads, MEASURE *measure, uint64_t archive_size) {
+    double seconds = measure->seconds > 0 ? measure->seconds : 1e-9;
+    double mb_per_s = (double)corpus->bytes / 1e6 / seconds;
+    double files_per_s = (double)corpus->files / seconds;
+    char level_str[16];
+
+    switch (bench.output_format) {
+        case JSON_FORMAT:
+            if (level < 0) strcpy(level_str, "null");
+            else           sprintf(level_str, "%d", level);
+            printf("%s{\"corpus\":\"%s\",\"files\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"operation\":\"%s\",\"codec\":\"%s\",\"level\":%s,"
+                   "\"block_size\":%d,\"threads\":%d,\"seconds\":%.4f,\"mb_per_s\":%.2f,\"files_per_s\":%.1f,\"peak_rss_kb\":%ld,\"archive_size\":%" PRIu64 "}",
+                   num_results ? "," : "", corpus->name, corpus->files, corpus->bytes, operation, codecs[codec].name, level_str,
+                   block_size, threads, measure->seconds, mb_per_s, files_per_s, measure->peak_rss_kb, archive_size);
+            break;
+
+        case CSV_FORMAT:
+            if (level < 0) level_str[0] = '\0';
+            else           sprintf(level_str, "%d", level);
+            printf("%s,%" PRIu64 ",%" PRIu64 ",%s,%s,%s,%d,%d,%.4f,%.2f,%.1f,%ld,%" PRIu64 "\n",
+                   corpus->name, corpus->files, corpus->bytes, operation, codecs[codec].name, level_str,
+                   block_size, threads, measure->seconds, mb_per_s, files_per_s, measure->peak_rss_kb, archive_size);
+            break;
+
+        case XML_FORMAT:
+            if (level < 0) level_str[0] = '\0';
+            else           sprintf(level_str, "%d", level);
+            printf("<result><corpus>%s</corpus><files>%" PRIu64 "</files><bytes>%" PRIu64 "</bytes><operation>%s</operation><codec>%s</codec><level>%s</level>"
+                   "<block_size>%d</block_size><threads>%d</threads><seconds>%.4f</seconds><mb_per_s>%.2f</mb_per_s><files_per_s>%.1f</files_per_s>"
+                   "<peak_rss_kb>%ld</peak_rss_kb><archive_size>%" PRIu64 "</archive_size></result>",
+                   corpus->name, corpus->files, corpus->bytes, operation, codecs[codec].name, level_str,
+                   block_size, threads, measure->seconds, mb_per_s, files_per_s, measure->peak_rss_kb, archive_size);
+            break;
+
+        default:
+            if (level < 0) strcpy(level_str, "-");
+            else           sprintf(level_str, "%d", level);
+            printf("%-7s %-8s %-6s %5s %8d %7d %9.3f %9.2f %10.1f %10ld %5.1f%%\n",
+                   corpus->name, operation, codecs[codec].name, level_str, block_size, threads,
+                   measure->seconds, mb_per_s, files_per_s, measure->peak_rss_kb,
+                   corpus->bytes ? 100.0 * archive_size / corpus->bytes : 0.0);
+            break;
+    }
+
+    fflush(stdout);
+    num_results++;
+}
+
+/**
+ * Prints the end of the results.
+ */
+
+static void print_footer() {
+    switch (bench.output_format) {
+        case JSON_FORMAT:
+            printf("]}");
+            break;
+
+        case XML_FORMAT:
+            printf("</benchmark>");
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Benchmarks the operations on a corpus with one configuration: create, extract, list and info.
+ *
+ * @param corpus        The corpus.
+ * @param codec         Index of the compression type.
+ * @param level         Compression level (-1 = default).
+ * @param block_size    Block size.
+ * @param threads       Number of threads.
+ *
+ * @return              0 if successful, 1 on error.
+ */
+
+static int bench_configuration(CORPUS *corpus, int codec, int level, int block_size, int threads) {
+    char archive[8192], target[8192], level_arg[8], block_arg[16], threads_arg[16];
+
+    snprintf(archive, sizeof(archive), "%s/bench.psarc", bench.work_dir);
+    snprintf(target, sizeof(target), "%s/extract", bench.work_dir);
+    snprintf(level_arg, sizeof(level_arg), "-%d", level);
+    snprintf(block_arg, sizeof(block_arg), "%d", block_size);
+    snprintf(threads_arg, sizeof(threads_arg), "%d", threads);
+
+    char *args[32];
+    int n = 0;
+    MEASURE measure;
+
+    // Create
+    args[n++] = (char *)bench.psar;
+    args[n++] = "-c";
+    if (codecs[codec].option) args[n++] = (char *)codecs[codec].option;
+    if (level >= 0) args[n++] = level_arg;
+    args[n++] = "-b"; args[n++] = block_arg;
+    args[n++] = "-n"; args[n++] = threads_arg;
+    args[n++] = "-y";
+    args[n++] = "-r";
+    args[n++] = "-s"; args[n++] = corpus->path;
+    args[n++] = "-f"; args[n++] = archive;
+    args[n++] = ".";
+    args[n] = NULL;
+
+    if (measure_psar(args, &measure, NULL, NULL)) {
+        fprintf( stderr, BENCHNAME": error creating the archive of the %s corpus (%s)\n", corpus->name, codecs[codec].name );
+        return 1;
+    }
+
+    struct stat st;
+    uint64_t archive_size = stat(archive, &st) ? 0 : (uint64_t)st.st_size;
+
+    print_result(corpus, "create", codec, level, block_size, threads, &measure, archive_size);
+
+    // Extract, to an empty directory each time
+    n = 0;
+    args[n++] = (char *)bench.psar;
+    args[n++] = "-x";
+    args[n++] = "-n"; args[n++] = threads_arg;
+    args[n++] = "-t"; args[n++] = target;
+    args[n++] = "-f"; args[n++] = archive;
+    args[n] = NULL;
+
+    int ret = measure_psar(args, &measure, remove_tree, target);
+    remove_tree(target);
+    if (ret) {
+        fprintf( stderr, BENCHNAME": error extracting the archive of the %s corpus (%s)\n", corpus->name, codecs[codec].name );
+        return 1;
+    }
+
+    print_result(corpus, "extract", codec, level, block_size, threads, &measure, archive_size);
+
+    // List and info
+    const char *modes[] = { "-l", "-i" };
+    const char *operations[] = { "list", "info" };
+
+    for (int i = 0; i < 2; i++) {
+        n = 0;
+        args[n++] = (char *)bench.psar;
+        args[n++] = (char *)modes[i];
+        args[n++] = "-f"; args[n++] = archive;
+        args[n] = NULL;
+
+        if (measure_psar(args, &measure, NULL, NULL)) {
+            fprintf( stderr, BENCHNAME": error reading the archive of the %s corpus (%s)\n", corpus->name, codecs[codec].name );
+            return 1;
+        }
+
+        print_result(corpus, operations[i], codec, level, block_size, threads, &measure, archive_size);
+    }
+
+    unlink(archive);
+
+    return 0;
+}
+
+/**
+ * Benchmarks all the configurations on a corpus.
+ *
+ * @param corpus        The corpus.
+ *
+ * @return              0 if successful, 1 on error.
+ */
+
+static int bench_corpus(CORPUS *corpus) {
+    for (int c = 0; c < bench.num_codecs; c++) {
+        int codec = bench.codecs[c];
+
+        // The level doesn't apply to store
+        int num_levels = bench.num_levels && codecs[codec].type != PSARC_STORE ? bench.num_levels : 1;
+
+        for (int l = 0; l < num_levels; l++) {
+            int level = bench.num_levels && codecs[codec].type != PSARC_STORE ? bench.levels[l] : -1;
+
+            for (int b = 0; b < bench.num_block_sizes; b++) {
+                for (int t = 0; t < bench.num_threads; t++) {
+                    if (bench_configuration(corpus, codec, level, bench.block_sizes[b], bench.threads[t])) return 1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Parses a comma separated list of integers.
+ *
+ * @param list          The list.
+ * @param values        Array for the values (MAX_VALUES items).
+ * @param min           Min valid value.
+ * @param max           Max valid value.
+ *
+ * @return              Number of values, or -1 if the list isn't valid.
+ */
+
+static int parse_int_list(const char *list, int *values, long min, long max) {
+    int count = 0;
+    const char *p = list;
+
+    while (*p) {
+        char *end;
+        long value = strtol(p, &end, 0);
+        if (end == p || ( *end && *end != ',' ) || value < min || value > max || count == MAX_VALUES) return -1;
+
+        values[count++] = (int)value;
+        p = *end ? end + 1 : end;
+    }
+
+    return count ? count : -1;
+}
+
+/**
+ * Parses a comma separated list of compression types.
+ *
+ * @param list          The list.
+ * @param values        Array for the indexes of the compression types (MAX_VALUES items).
+ *
+ * @return              Number of compression types, or -1 if the list isn't valid.
+ */
+
+static int parse_codec_list(const char *list, int *values) {
+    char *copy = strdup(list);
+    if (!copy) return -1;
+
+    int count = 0;
+
+    for (char *name = strtok(copy, ","); name; name = strtok(NULL, ",")) {
+        int i;
+        for (i = 0; codecs[i].name && strcmp(codecs[i].name, name); i++);
+
+        if (!codecs[i].name || count == MAX_VALUES) {
+            fprintf( stderr, BENCHNAME": unknown compression type %s\n", name );
+            free(copy);
+            return -1;
+        }
+
+        if (!coder_is_available(codecs[i].type)) {
+            fprintf( stderr, BENCHNAME": %s compression isn't supported by this build\n", name );
+            free(copy);
+            return -1;
+        }
+
+        values[count++] = i;
+    }
+
+    free(copy);
+
+    return count ? count : -1;
+}
+
+/**
+ * Shows the help of the command line.
+ *
+ * @param program       Name of the program.
+ */
+
+static void show_help(const char *program) {
+    printf( "Usage: %s [options]\n\n", program );
+    printf( "Generates synthetic corpora and measures how fast psar creates, extracts, lists and\n" );
+    printf( "shows the info of their archives.\n" );
+    printf( "\nOptions:\n" );
+    printf( "  -p, --psar=PATH              psar executable (default: psar next to %s)\n", BENCHNAME );
+    printf( "  -d, --work-dir=DIR           directory for the corpora and the archives\n" );
+    printf( "                               (default: a temporary directory)\n" );
+    printf( "  -S, --size=MB                size of each corpus (default: %d)\n", DEFAULT_SIZE );
+    printf( "  -C, --corpus=LIST            corpora: small, huge, random, text (default: all)\n" );
+    printf( "  -c, --codecs=LIST            compression types: store, zlib, lzma, zstd, lz4\n" );
+    printf( "                               (default: all the ones of this build)\n" );
+    printf( "  -l, --levels=LIST            compression levels, 0 to 9 (default: the default\n" );
+    printf( "                               level of each compression type)\n" );
+    printf( "  -b, --block-sizes=LIST       block sizes in bytes (default: 65536)\n" );
+    printf( "  -n, --num-threads=LIST       numbers of threads (default: 0 and the CPUs)\n" );
+    printf( "  -r, --repeat=N               runs of each operation, the best time is kept\n" );
+    printf( "                               (default: 1)\n" );
+    printf( "  -k, --keep                   keep the corpora\n" );
+    printf( "  -o, --output-format=FORMAT   output format of the results: json, csv, xml\n" );
+    printf( "  -h, --help                   display this help and exit\n" );
+    printf( "\nLists are separated by commas, e.g. -n 1,2,4,8\n" );
+}
+
+int main( int argc, char *argv[] ) {
+    char psar_path[4096];
+    char *corpus_dir = NULL;
+    int option;
+
+    // psar is looked for next to the benchmark by default
+    const char *slash = strrchr(argv[0], '/');
+    if (slash) snprintf(psar_path, sizeof(psar_path), "%.*s/psar", (int)(slash - argv[0]), argv[0]);
+    else       strcpy(psar_path, "psar");
+
+    memset(&bench, 0, sizeof(bench));
+    bench.psar = psar_path;
+    bench.size = (uint64_t)DEFAULT_SIZE << 20;
+    bench.corpora = "small,huge,random,text";
+    bench.repeat = 1;
+    bench.output_format = STANDARD_FORMAT;
+
+    while ( ( option = getopt_long( argc, argv, "p:d:S:C:c:l:b:n:r:ko:h", long_options, NULL ) ) != -1 ) {
+        switch ( option ) {
+            case 'p':
+                bench.psar = optarg;
+                break;
+
+            case 'd':
+                corpus_dir = optarg;
+                break;
+
+            case 'S': {
+                long size = atol( optarg );
+                if ( size <= 0 ) {
+                    fprintf( stderr, BENCHNAME": invalid size: %s\n", optarg );
+                    return 1;
+                }
+                bench.size = (uint64_t)size << 20;
+                break;
+            }
+
+            case 'C':
+                bench.corpora = optarg;
+                break;
+
+            case 'c':
+                if ( ( bench.num_codecs = parse_codec_list( optarg, bench.codecs ) ) < 0 ) return 1;
+                break;
+
+            case 'l':
+                if ( ( bench.num_levels = parse_int_list( optarg, bench.levels, 0, 9 ) ) < 0 ) {
+                    fprintf( stderr, BENCHNAME": invalid levels: %s\n", optarg );
+                    return 1;
+                }
+                break;
+
+            case 'b':
+                if ( ( bench.num_block_sizes = parse_int_list( optarg, bench.block_sizes, 1, 0x1000000 ) ) < 0 ) {
+                    fprintf( stderr, BENCHNAME": invalid block sizes: %s\n", optarg );
+                    return 1;
+                }
+                break;
+
+            case 'n':
+                if ( ( bench.num_threads = parse_int_list( optarg, bench.threads, 0, 1024 ) ) < 0 ) {
+                    fprintf( stderr, BENCHNAME": invalid numbers of threads: %s\n", optarg );
+                    return 1;
+                }
+                break;
+
+            case 'r':
+                bench.repeat = atoi( optarg );
+                if ( bench.repeat <= 0 ) {
+                    fprintf( stderr, BENCHNAME": invalid repeat: %s\n", optarg );
+                    return 1;
+                }
+                break;
+
+            case 'k':
+                bench.keep = 1;
+                break;
+
+            case 'o':
+                if ( !strcmp( optarg, "json" ) )     bench.output_format = JSON_FORMAT;
+                else if ( !strcmp( optarg, "csv" ) ) bench.output_format = CSV_FORMAT;
+                else if ( !strcmp( optarg, "xml" ) ) bench.output_format = XML_FORMAT;
+                else {
+                    fprintf( stderr, BENCHNAME": Invalid output format: %s\n", optarg );
+                    return 1;
+                }
+                break;
+
+            case 'h':
+                show_help( argv[0] );
+                return 0;
+
+            default:
+                fprintf( stderr, "Try '%s --help' for more information.\n", argv[0] );
+                return 1;
+        }
+    }
+
+    // All the compression types of this build
+    if ( !bench.num_codecs ) {
+        for ( int i = 0; codecs[i].name; i++ ) {
+            if ( coder_is_available( codecs[i].type ) ) bench.codecs[bench.num_codecs++] = i;
+        }
+    }
+
+    if ( !bench.num_block_sizes ) {
+        bench.block_sizes[0] = 65536;
+        bench.num_block_sizes = 1;
+    }
+
+    if ( !bench.num_threads ) {
+        bench.threads[bench.num_threads++] = 0;
+        if ( threads_get_max() > 1 ) bench.threads[bench.num_threads++] = threads_get_max();
+    }
+
+    if ( corpus_dir ) {
+        if ( snprintf( bench.work_dir, sizeof(bench.work_dir), "%s", corpus_dir ) >= (int)sizeof(bench.work_dir) ) {
+            fprintf( stderr, BENCHNAME": the directory %s is too long\n", corpus_dir );
+            return 1;
+        }
+        if ( mkpath( bench.work_dir, 0777 ) ) {
+            fprintf( stderr, BENCHNAME": can't create the directory %s\n", bench.work_dir );
+            return 1;
+        }
+    } else {
+        const char *tmp = getenv( "TMPDIR" );
+        if ( snprintf( bench.work_dir, sizeof(bench.work_dir), "%s/%s.XXXXXX", tmp && *tmp ? tmp : "/tmp", BENCHNAME ) >= (int)sizeof(bench.work_dir) || !mkdtemp( bench.work_dir ) ) {
+            fprintf( stderr, BENCHNAME": can't create a temporary directory\n" );
+            return 1;
+        }
+    }
+
+    char *corpora = strdup( bench.corpora );
+    if ( !corpora ) {
+        fprintf( stderr, BENCHNAME": not enough memory\n" );
+        return 1;
+    }
+
+    int ret = 0;
+
+    print_header();
+
+    for ( char *name = strtok( corpora, "," ); name && !ret; name = strtok( NULL, "," ) ) {
+        CORPUS corpus = { .name = name };
+        if ( snprintf( corpus.path, sizeof(corpus.path), "%s/%s", bench.work_dir, name ) >= (int)sizeof(corpus.path) ) {
+            fprintf( stderr, BENCHNAME": the path of the %s corpus is too long\n", name );
+            ret = 1;
+            break;
+        }
+
+        if ( generate_corpus( &corpus, bench.size ) ) {
+            fprintf( stderr, BENCHNAME": error generating the %s corpus\n", name );
+            ret = 1;
+        } else {
+            ret = bench_corpus( &corpus );
+        }
+
+        if ( !bench.keep ) remove_tree( corpus.path );
+    }
+
+    print_footer();
+
+    free( corpora );
+
+    // A temporary directory is removed with what a failed run left
+    if ( !corpus_dir && !bench.keep ) remove_tree( bench.work_dir );
+
+    return ret;
+}
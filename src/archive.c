@@ -0,0 +1,529 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file archive.c
+ * @brief Implementation of the archive handle API for the PSARc library.
+ *
+ * This file implements the archive handle API of the PSARc library. The archive tables are decoded
+ * once when it's opened. Reads take an idle reader (coder and buffers) from the archive, so
+ * concurrent reads don't share any decoding state.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+#include "psarc.h"
+#include "inettypes.h"
+#include "toc.h"
+#include "archive.h"
+
+static pthread_mutex_t archive_id_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t archive_last_id = 0;
+
+/**
+ * Gets a range of bytes from the archive.
+ *
+ * If the archive is mapped in memory, the data is returned straight from the mapping.
+ * Otherwise, it's read into the given buffer.
+ *
+ * @param archive       Pointer to the archive.
+ * @param offset        Offset of the data in the archive.
+ * @param size          Size of the data.
+ * @param buffer        Buffer for the data (at least size bytes, not used if the archive is mapped).
+ *
+ * @return              A pointer to the data, or NULL on error.
+ */
+
+static const uint8_t *archive_get_data(PSARC_ARCHIVE *archive, uint64_t offset, size_t size, uint8_t *buffer) {
+    if (archive->map) {
+        if (offset > archive->map->size || size > archive->map->size - offset) return NULL;
+        return archive->map->data + offset;
+    }
+
+    pthread_mutex_lock(&archive->mutex);
+    int ok = !fseek(archive->fp, offset, SEEK_SET) && (!size || fread(buffer, size, 1, archive->fp) == 1);
+    pthread_mutex_unlock(&archive->mutex);
+
+    return ok ? buffer : NULL;
+}
+
+/**
+ * Takes an idle reader from the archive, or creates a new one if all of them are in use.
+ *
+ * @param archive       Pointer to the archive.
+ *
+ * @return              A pointer to the reader, or NULL if memory allocation fails.
+ */
+
+static PSARC_READER *reader_get(PSARC_ARCHIVE *archive) {
+    pthread_mutex_lock(&archive->mutex);
+    PSARC_READER *reader = archive->readers;
+    if (reader) archive->readers = reader->next;
+    pthread_mutex_unlock(&archive->mutex);
+
+    if (reader) return reader;
+
+    reader = (PSARC_READER *)calloc(1, sizeof(PSARC_READER));
+    if (!reader) return NULL;
+
+    reader->coder = coder_new();
+    if (reader->coder) coder_set_dictionary(reader->coder, archive->dictionary, archive->dictionary_size);
+    reader->data_buffer = malloc(archive->block_size);
+    if (!archive->map) reader->block_buffer = malloc(archive->block_size);
+
+    if (!reader->coder || !reader->data_buffer || (!archive->map && !reader->block_buffer)) {
+        coder_free(reader->coder);
+        free(reader->data_buffer);
+        free(reader->block_buffer);
+        free(reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+/**
+ * Returns a reader to the idle list of the archive.
+ *
+ * @param archive       Pointer to the archive.
+ * @param reader        Pointer to the reader.
+ */
+
+static void reader_put(PSARC_ARCHIVE *archive, PSARC_READER *reader) {
+    pthread_mutex_lock(&archive->mutex);
+    reader->next = archive->readers;
+    archive->readers = reader;
+    pthread_mutex_unlock(&archive->mutex);
+}
+
+/**
+ * Decodes a block of the archive.
+ *
+ * @param archive       Pointer to the archive.
+ * @param reader        Reader used to decode the block.
+ * @param offset        Offset of the block in the archive.
+ * @param stored_size   Size of the block in the archive.
+ * @param data_size     Size of the decoded block.
+ * @param out           Buffer for the decoded block (at least data_size bytes).
+ *
+ * @return              0 on success, 1 on error.
+ */
+
+static int archive_decode_block(PSARC_ARCHIVE *archive, PSARC_READER *reader, uint64_t offset, uint32_t stored_size, size_t data_size, uint8_t *out) {
+    // A block as big as its data is stored raw, read it straight to the output
+    if (stored_size == data_size) {
+        const uint8_t *block = archive_get_data(archive, offset, stored_size, out);
+        if (!block) return 1;
+        if (block != out) memcpy(out, block, data_size);
+        return 0;
+    }
+
+    const uint8_t *block = archive_get_data(archive, offset, stored_size, reader->block_buffer);
+    if (!block) return 1;
+
+    size_t decoded_size = 0;
+    if (coder_decode_block(reader->coder, archive->compression_type, block, stored_size, out, data_size, &decoded_size) != 0 || decoded_size != data_size) return 1;
+
+    return 0;
+}
+
+/**
+ * Reads a range of an entry into a buffer.
+ *
+ * @param archive       Pointer to the archive.
+ * @param reader        Reader used to decode the blocks.
+ * @param fi            The entry.
+ * @param offset        Offset of the range in the entry.
+ * @param buffer        Buffer for the data.
+ * @param size          Size of the range (within the entry).
+ *
+ * @return              0 on success, 1 on error.
+ */
+
+static int archive_read_entry(PSARC_ARCHIVE *archive, PSARC_READER *reader, FILEINFO *fi, uint64_t offset, uint8_t *buffer, size_t size) {
+    uint64_t block = offset / archive->block_size;
+    size_t skip = offset % archive->block_size;
+
+    if (!size) return 0;
+    if ((uint64_t)fi->block_index + block >= archive->blocktable_size) return 1;
+
+    // Blocks of an entry are contiguous
+    uint64_t block_offset = fi->offset + archive->block_offsets[fi->block_index + block] - archive->block_offsets[fi->block_index];
+
+    while (size) {
+        uint64_t idx = fi->block_index + block;
+        if (idx >= archive->blocktable_size) return 1;
+
+        uint32_t stored_size = archive->blocktable[idx];
+
+        // stored_size == 0 => is block_size
+        if (!stored_size) stored_size = archive->block_size;
+
+        uint64_t data_size = fi->uncompressed_size - block * archive->block_size;
+        if (data_size > archive->block_size) data_size = archive->block_size;
+
+        size_t len = data_size - skip;
+        if (len > size) len = size;
+
+        int cacheable = archive->cache && stored_size != data_size;
+
+        if (cacheable && blockcache_get(archive->cache, archive->id, idx, skip, buffer, len)) {
+            // Served from the cache
+        } else if (cacheable) {
+            if (archive_decode_block(archive, reader, block_offset, stored_size, data_size, reader->data_buffer)) return 1;
+            blockcache_put(archive->cache, archive->id, idx, reader->data_buffer, data_size);
+            memcpy(buffer, reader->data_buffer + skip, len);
+        } else if (!skip && len == data_size) {
+            // Whole block, decode it in place
+            if (archive_decode_block(archive, reader, block_offset, stored_size, data_size, buffer)) return 1;
+        } else {
+            if (archive_decode_block(archive, reader, block_offset, stored_size, data_size, reader->data_buffer)) return 1;
+            memcpy(buffer, reader->data_buffer + skip, len);
+        }
+
+        buffer += len;
+        size -= len;
+        skip = 0;
+        block_offset += stored_size;
+        block++;
+    }
+
+    return 0;
+}
+
+/**
+ * Calculates the hash of an entry name for the names index.
+ *
+ * @param archive       Pointer to the archive.
+ * @param name          The entry name.
+ *
+ * @return              The hash of the name (FNV-1a, case folded in case-insensitive archives).
+ */
+
+static uint32_t archive_name_hash(PSARC_ARCHIVE *archive, const char *name) {
+    uint32_t hash = 2166136261u;
+    int icase = archive->archive_flags & AF_ICASE;
+
+    for (; *name; name++) {
+        hash ^= (uint8_t)(icase ? tolower((unsigned char)*name) : *name);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Reads a range of bytes of the archive for toc_read().
+ *
+ * @param context       Pointer to the archive.
+ * @param offset        Offset of the data in the archive.
+ * @param size          Size of the data.
+ * @param buffer        Buffer for the data (not used if the archive is mapped).
+ *
+ * @return              A pointer to the data, or NULL on error.
+ */
+
+static const uint8_t *archive_toc_data(void *context, uint64_t offset, size_t size, uint8_t *buffer) {
+    return archive_get_data((PSARC_ARCHIVE *)context, offset, size, buffer);
+}
+
+/**
+ * Reads the header, the TOC, the block table and the preset dictionary of the archive.
+ *
+ * @param archive       Pointer to the archive.
+ *
+ * @return              0 on success, 1 on error.
+ */
+
+static int archive_read_tables(PSARC_ARCHIVE *archive) {
+    TOC_SOURCE source = { .read = archive_toc_data, .context = archive, .mapped = archive->map != NULL };
+
+    if (archive->map) {
+        source.size = archive->map->size;
+    } else {
+        struct stat archive_stat;
+        if (fstat(fileno(archive->fp), &archive_stat)) return 1;
+        source.size = archive_stat.st_size;
+    }
+
+    TOC toc;
+    if (toc_read(&source, &toc)) return 1;
+
+    archive->compression_type = toc.info.compression_type;
+    archive->block_size = toc.info.block_size;
+    archive->archive_flags = toc.info.archive_flags;
+    archive->toc_entries = toc.info.toc_entries;
+    archive->entries = toc.entries;
+    archive->blocktable = toc.blocktable;
+    archive->blocktable_size = toc.num_blocks;
+    archive->dictionary = toc.dictionary;
+    archive->dictionary_size = toc.dictionary_size;
+
+    // Offsets of the blocks from the first one, to seek into an entry without adding up its blocks
+    archive->block_offsets = (uint64_t *)malloc((archive->blocktable_size + 1) * sizeof(uint64_t));
+    if (!archive->block_offsets) return 1;
+
+    archive->block_offsets[0] = 0;
+    for (size_t i = 0; i < archive->blocktable_size; i++) {
+        archive->block_offsets[i + 1] = archive->block_offsets[i] + ( archive->blocktable[i] ? archive->blocktable[i] : archive->block_size );
+    }
+
+    return !coder_is_available(archive->compression_type);
+}
+
+/**
+ * Reads the manifest and builds the names index.
+ *
+ * @param archive       Pointer to the archive.
+ *
+ * @return              0 on success, 1 on error.
+ */
+
+static int archive_read_names(PSARC_ARCHIVE *archive) {
+    FILEINFO *manifest = &archive->entries[0];
+
+    PSARC_READER *reader = reader_get(archive);
+    if (!reader) return 1;
+
+    archive->names = malloc(manifest->uncompressed_size + 1);
+    int ret = !archive->names || archive_read_entry(archive, reader, manifest, 0, (uint8_t *)archive->names, manifest->uncompressed_size);
+
+    reader_put(archive, reader);
+
+    if (ret) return 1;
+
+    archive->names[manifest->uncompressed_size] = '\0';
+
+    // Power of 2, at least twice the number of entries
+    size_t index_size = 16;
+    while (index_size < (size_t)archive->toc_entries * 2) index_size <<= 1;
+    archive->index_mask = index_size - 1;
+
+    archive->index = (uint32_t *)calloc(index_size, sizeof(uint32_t)); // 0 = empty (entry 0 is the manifest)
+    if (!archive->index) return 1;
+
+    toc_split_names(archive->entries, archive->toc_entries, archive->names);
+
+    for (uint32_t i = 1; i < archive->toc_entries; i++) {
+        if (!archive->entries[i].filename) continue;
+
+        size_t h = archive_name_hash(archive, archive->entries[i].filename) & archive->index_mask;
+        while (archive->index[h]) h = (h + 1) & archive->index_mask;
+        archive->index[h] = i;
+    }
+
+    return 0;
+}
+
+/**
+ * Opens an archive.
+ *
+ * The header, the TOC, the block table and the manifest are read once, and an index of the
+ * entry names is built.
+ *
+ * @param path          Path of the archive.
+ *
+ * @return              A pointer to the open archive, or NULL on error.
+ */
+
+PSARC_ARCHIVE *psarc_open(const char *path) {
+    PSARC_ARCHIVE *archive = (PSARC_ARCHIVE *)calloc(1, sizeof(PSARC_ARCHIVE));
+    if (!archive) return NULL;
+
+    pthread_mutex_init(&archive->mutex, NULL);
+
+    pthread_mutex_lock(&archive_id_mutex);
+    archive->id = ++archive_last_id;
+    pthread_mutex_unlock(&archive_id_mutex);
+
+    // Map the archive if possible, otherwise it's read through a file
+    archive->map = mapfile_open(path);
+    if (!archive->map && !(archive->fp = fopen(path, "rb"))) {
+        psarc_close(archive);
+        return NULL;
+    }
+
+    if (archive_read_tables(archive) || archive_read_names(archive)) {
+        psarc_close(archive);
+        return NULL;
+    }
+
+    return archive;
+}
+
+/**
+ * Closes an archive and frees all its resources.
+ *
+ * No read can be in progress.
+ *
+ * @param archive       Pointer to the archive (can be NULL).
+ */
+
+void psarc_close(PSARC_ARCHIVE *archive) {
+    if (!archive) return;
+
+    while (archive->readers) {
+        PSARC_READER *reader = archive->readers;
+        archive->readers = reader->next;
+        coder_free(reader->coder);
+        free(reader->data_buffer);
+        free(reader->block_buffer);
+        free(reader);
+    }
+
+    free(archive->index);
+    free(archive->names);
+    free(archive->block_offsets);
+    free(archive->blocktable);
+    free(archive->entries);
+    free(archive->dictionary);
+
+    mapfile_close(archive->map);
+    if (archive->fp) fclose(archive->fp);
+
+    pthread_mutex_destroy(&archive->mutex);
+
+    free(archive);
+}
+
+/**
+ * Sets the cache of decompressed blocks used by an archive.
+ *
+ * The cache is created with blockcache_new() and can be shared by several archives. It must
+ * outlive them, and it's freed by the caller. Raw blocks are not cached, they are already
+ * copied straight from the archive.
+ *
+ * @param archive       Pointer to the archive.
+ * @param cache         Pointer to the cache (NULL to disable it).
+ */
+
+void psarc_set_cache(PSARC_ARCHIVE *archive, BLOCKCACHE *cache) {
+    archive->cache = cache;
+}
+
+/**
+ * Gets the number of files in an archive.
+ *
+ * @param archive       Pointer to the archive.
+ *
+ * @return              The number of files (the manifest is not counted).
+ */
+
+uint32_t psarc_get_num_files(PSARC_ARCHIVE *archive) {
+    return archive->toc_entries - 1;
+}
+
+/**
+ * Looks up a file by name.
+ *
+ * Names are compared as stored in the manifest (ignoring the case in case-insensitive archives).
+ *
+ * @param archive       Pointer to the archive.
+ * @param name          Name of the file.
+ *
+ * @return              The index of the file, or -1 if it's not found.
+ */
+
+int64_t psarc_find(PSARC_ARCHIVE *archive, const char *name) {
+    int icase = archive->archive_flags & AF_ICASE;
+
+    size_t h = archive_name_hash(archive, name) & archive->index_mask;
+    for (; archive->index[h]; h = (h + 1) & archive->index_mask) {
+        const char *entry_name = archive->entries[archive->index[h]].filename;
+        if (!(icase ? strcasecmp(entry_name, name) : strcmp(entry_name, name))) return archive->index[h] - 1;
+    }
+
+    return -1;
+}
+
+/**
+ * Gets the name of a file.
+ *
+ * @param archive       Pointer to the archive.
+ * @param file          Index of the file.
+ *
+ * @return              The name of the file, or NULL if the index is not valid.
+ */
+
+const char *psarc_get_name(PSARC_ARCHIVE *archive, uint32_t file) {
+    if (file >= archive->toc_entries - 1) return NULL;
+    return archive->entries[file + 1].filename;
+}
+
+/**
+ * Gets the uncompressed size of a file.
+ *
+ * @param archive       Pointer to the archive.
+ * @param file          Index of the file.
+ *
+ * @return              The size of the file (0 if the index is not valid).
+ */
+
+uint64_t psarc_get_size(PSARC_ARCHIVE *archive, uint32_t file) {
+    if (file >= archive->toc_entries - 1) return 0;
+    return archive->entries[file + 1].uncompressed_size;
+}
+
+/**
+ * Reads a range of a file into a buffer.
+ *
+ * Only the blocks covering the range are decompressed. It can be called from several threads
+ * at the same time on the same archive.
+ *
+ * @param archive       Pointer to the archive.
+ * @param file          Index of the file.
+ * @param offset        Offset of the range in the file.
+ * @param buffer        Buffer for the data.
+ * @param size          Size of the range.
+ *
+ * @return              The number of bytes read (less than size at the end of the file),
+ *                      or -1 on error.
+ */
+
+int64_t psarc_read(PSARC_ARCHIVE *archive, uint32_t file, uint64_t offset, void *buffer, size_t size) {
+    if (file >= archive->toc_entries - 1) return -1;
+
+    FILEINFO *fi = &archive->entries[file + 1];
+
+    if (offset >= fi->uncompressed_size) return 0;
+    if (size > fi->uncompressed_size - offset) size = fi->uncompressed_size - offset;
+    if (!size) return 0;
+
+    PSARC_READER *reader = reader_get(archive);
+    if (!reader) return -1;
+
+    int ret = archive_read_entry(archive, reader, fi, offset, (uint8_t *)buffer, size);
+
+    reader_put(archive, reader);
+
+    return ret ? -1 : (int64_t)size;
+}
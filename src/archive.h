@@ -0,0 +1,182 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file archive.h
+ * @brief Archive handle API for the PSARc library.
+ *
+ * This file declares the archive handle API of the PSARc library. An archive is opened once,
+ * and its entries can be looked up and read from any number of threads at the same time.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#ifndef __ARCHIVE_H
+#define __ARCHIVE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "coder.h"
+#include "mapfile.h"
+#include "blockcache.h"
+
+/**
+ * Structure holding the buffers and the coder used by a read.
+ */
+typedef struct PSARC_READER {
+    CODER *coder;                   /**< Coder used to decompress the blocks. */
+    uint8_t *block_buffer;          /**< Buffer for a compressed block (not used if the archive is mapped). */
+    uint8_t *data_buffer;           /**< Buffer for a decompressed block. */
+    struct PSARC_READER *next;      /**< Next idle reader. */
+} PSARC_READER;
+
+/**
+ * Structure representing an open archive.
+ *
+ * Everything but the idle readers list is read-only once the archive is open.
+ */
+typedef struct {
+    MAPFILE *map;                   /**< Archive mapping (NULL if it can't be mapped). */
+    FILE *fp;                       /**< Archive file, used if the archive is not mapped. */
+    pthread_mutex_t mutex;          /**< Protects fp and the idle readers list. */
+
+    int compression_type;           /**< Compression type (PSARC_ZLIB, PSARC_LZMA, PSARC_ZSTD or PSARC_LZ4). */
+    uint32_t block_size;            /**< Block size. */
+    uint32_t archive_flags;         /**< Archive flags (AF_*). */
+    uint8_t *dictionary;            /**< Preset dictionary (NULL = none). */
+    size_t dictionary_size;         /**< Size of the preset dictionary. */
+
+    uint32_t toc_entries;           /**< Number of TOC entries (manifest included). */
+    FILEINFO *entries;              /**< TOC entries, entry 0 is the manifest. */
+    uint32_t *blocktable;           /**< Block sizes. */
+    size_t blocktable_size;         /**< Number of blocks. */
+    uint64_t *block_offsets;        /**< Offset of each block from the first one (blocktable_size + 1 items). */
+
+    char *names;                    /**< Manifest (entry names separated by '\0'). */
+    uint32_t *index;                /**< Open addressing hash table of names (entry indexes, 0 = empty). */
+    size_t index_mask;              /**< Size of the hash table - 1. */
+
+    PSARC_READER *readers;          /**< Idle readers. */
+
+    uint64_t id;                    /**< Unique id of the open archive (cache key). */
+    BLOCKCACHE *cache;              /**< Cache of decompressed blocks (NULL = no cache). */
+} PSARC_ARCHIVE;
+
+/**
+ * Opens an archive.
+ *
+ * The header, the TOC, the block table and the manifest are read once, and an index of the
+ * entry names is built.
+ *
+ * @param path          Path of the archive.
+ *
+ * @return              A pointer to the open archive, or NULL on error.
+ */
+PSARC_ARCHIVE *psarc_open(const char *path);
+
+/**
+ * Closes an archive and frees all its resources.
+ *
+ * No read can be in progress.
+ *
+ * @param archive       Pointer to the archive (can be NULL).
+ */
+void psarc_close(PSARC_ARCHIVE *archive);
+
+/**
+ * Sets the cache of decompressed blocks used by an archive.
+ *
+ * The cache is created with blockcache_new() and can be shared by several archives. It must
+ * outlive them, and it's freed by the caller. Raw blocks are not cached, they are already
+ * copied straight from the archive.
+ *
+ * @param archive       Pointer to the archive.
+ * @param cache         Pointer to the cache (NULL to disable it).
+ */
+void psarc_set_cache(PSARC_ARCHIVE *archive, BLOCKCACHE *cache);
+
+/**
+ * Gets the number of files in an archive.
+ *
+ * @param archive       Pointer to the archive.
+ *
+ * @return              The number of files (the manifest is not counted).
+ */
+uint32_t psarc_get_num_files(PSARC_ARCHIVE *archive);
+
+/**
+ * Looks up a file by name.
+ *
+ * Names are compared as stored in the manifest (ignoring the case in case-insensitive archives).
+ *
+ * @param archive       Pointer to the archive.
+ * @param name          Name of the file.
+ *
+ * @return              The index of the file, or -1 if it's not found.
+ */
+int64_t psarc_find(PSARC_ARCHIVE *archive, const char *name);
+
+/**
+ * Gets the name of a file.
+ *
+ * @param archive       Pointer to the archive.
+ * @param file          Index of the file.
+ *
+ * @return              The name of the file, or NULL if the index is not valid.
+ */
+const char *psarc_get_name(PSARC_ARCHIVE *archive, uint32_t file);
+
+/**
+ * Gets the uncompressed size of a file.
+ *
+ * @param archive       Pointer to the archive.
+ * @param file          Index of the file.
+ *
+ * @return              The size of the file (0 if the index is not valid).
+ */
+uint64_t psarc_get_size(PSARC_ARCHIVE *archive, uint32_t file);
+
+/**
+ * Reads a range of a file into a buffer.
+ *
+ * Only the blocks covering the range are decompressed. It can be called from several threads
+ * at the same time on the same archive.
+ *
+ * @param archive       Pointer to the archive.
+ * @param file          Index of the file.
+ * @param offset        Offset of the range in the file.
+ * @param buffer        Buffer for the data.
+ * @param size          Size of the range.
+ *
+ * @return              The number of bytes read (less than size at the end of the file),
+ *                      or -1 on error.
+ */
+int64_t psarc_read(PSARC_ARCHIVE *archive, uint32_t file, uint64_t offset, void *buffer, size_t size);
+
+#endif /* __ARCHIVE_H */
@@ -0,0 +1,121 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file arena.c
+ * @brief Arena allocator for the PSARc project.
+ *
+ * This file implements a simple bump allocator. Allocations are taken from large chunks, and all
+ * the chunks are released at once when the arena is freed.
+ *
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN         _Alignof(max_align_t)
+#define ARENA_CHUNK_SIZE    65536
+
+/**
+ * Initializes an arena. No memory is allocated until it's used.
+ *
+ * @param arena         Pointer to the arena.
+ * @param chunk_size    Default size of the chunks (0 = 64KB).
+ */
+
+void arena_init(ARENA *arena, size_t chunk_size) {
+    arena->head = NULL;
+    arena->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE;
+}
+
+/**
+ * Allocates memory from an arena.
+ *
+ * Allocations that don't fit in the current chunk start a new one. Allocations larger than the
+ * chunk size get a chunk of their own.
+ *
+ * @param arena         Pointer to the arena.
+ * @param size          Size of the memory.
+ *
+ * @return              A pointer to the memory, or NULL if memory allocation fails.
+ */
+
+void *arena_alloc(ARENA *arena, size_t size) {
+    size = ( size + ARENA_ALIGN - 1 ) & ~( ARENA_ALIGN - 1 );
+
+    ARENA_CHUNK *chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+
+        chunk = malloc(sizeof(ARENA_CHUNK) + chunk_size);
+        if (!chunk) return NULL;
+
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+
+    void *p = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+
+    return p;
+}
+
+/**
+ * Copies a string to an arena.
+ *
+ * @param arena         Pointer to the arena.
+ * @param s             The string.
+ * @param len           Length of the string.
+ *
+ * @return              A pointer to the copy (null terminated), or NULL if memory allocation fails.
+ */
+
+char *arena_strndup(ARENA *arena, const char *s, size_t len) {
+    char *p = arena_alloc(arena, len + 1);
+    if (!p) return NULL;
+
+    memcpy(p, s, len);
+    p[len] = '\0';
+
+    return p;
+}
+
+/**
+ * Frees all the memory of an arena. The arena can be used again.
+ *
+ * @param arena         Pointer to the arena.
+ */
+
+void arena_free(ARENA *arena) {
+    while (arena->head) {
+        ARENA_CHUNK *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
@@ -0,0 +1,96 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file arena.h
+ * @brief Arena allocator for the PSARc project.
+ *
+ * This file declares a simple bump allocator. Memory is taken from large chunks and released all
+ * at once, so many small strings (e.g. file paths) can be stored without a malloc call each.
+ *
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+
+/**
+ * Structure representing a chunk of memory of an arena.
+ */
+typedef struct ARENA_CHUNK {
+    struct ARENA_CHUNK *next;           /**< Previous chunk of the arena. */
+    size_t size;                        /**< Size of the chunk data. */
+    size_t used;                        /**< Bytes of the chunk data in use. */
+    max_align_t data[];                 /**< Chunk data (aligned for any type). */
+} ARENA_CHUNK;
+
+/**
+ * Structure representing an arena.
+ */
+typedef struct {
+    ARENA_CHUNK *head;                  /**< Current chunk. */
+    size_t chunk_size;                  /**< Default size of the chunks. */
+} ARENA;
+
+/**
+ * Initializes an arena. No memory is allocated until it's used.
+ *
+ * @param arena         Pointer to the arena.
+ * @param chunk_size    Default size of the chunks (0 = 64KB).
+ */
+void arena_init(ARENA *arena, size_t chunk_size);
+
+/**
+ * Allocates memory from an arena.
+ *
+ * The memory is aligned for any type, and it's valid until the arena is freed.
+ *
+ * @param arena         Pointer to the arena.
+ * @param size          Size of the memory.
+ *
+ * @return              A pointer to the memory, or NULL if memory allocation fails.
+ */
+void *arena_alloc(ARENA *arena, size_t size);
+
+/**
+ * Copies a string to an arena.
+ *
+ * @param arena         Pointer to the arena.
+ * @param s             The string.
+ * @param len           Length of the string.
+ *
+ * @return              A pointer to the copy (null terminated), or NULL if memory allocation fails.
+ */
+char *arena_strndup(ARENA *arena, const char *s, size_t len);
+
+/**
+ * Frees all the memory of an arena. The arena can be used again.
+ *
+ * @param arena         Pointer to the arena.
+ */
+void arena_free(ARENA *arena);
+
+#endif /* __ARENA_H */
@@ -0,0 +1,568 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file asyncio.c
+ * @brief Asynchronous positioned reads for the PSARc project.
+ *
+ * This file implements the queue of asynchronous reads: io_uring on Linux, overlapped I/O on
+ * Windows, and synchronous positioned reads everywhere else (or when those can't be set up).
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define ASYNCIO_URING
+#endif
+#endif
+#endif
+
+#include "asyncio.h"
+
+/**
+ * Structure representing a read of the queue.
+ */
+typedef struct {
+    int fd;                             /**< File descriptor of the file. */
+    void *buffer;                       /**< Buffer for the data. */
+    size_t size;                        /**< Number of bytes to read. */
+    uint64_t offset;                    /**< Position of the data in the file. */
+    int64_t result;                     /**< Bytes read, or -1 on error. */
+    int done;                           /**< The read has finished. */
+#ifdef ASYNCIO_URING
+    struct iovec iov;                   /**< Buffer of the io_uring request. */
+#endif
+#ifdef _WIN32
+    HANDLE handle;                      /**< Overlapped handle of the read (NULL = synchronous read). */
+    HANDLE event;                       /**< Event signaled when the read finishes (NULL = none). */
+    OVERLAPPED overlapped;              /**< Overlapped structure of the read. */
+#endif
+} ASYNCIO_REQUEST;
+
+/**
+ * Structure representing a queue of asynchronous reads.
+ */
+struct ASYNCIO {
+    ASYNCIO_REQUEST *requests;          /**< Ring of reads, in the order they were queued. */
+    unsigned depth;                     /**< Size of the ring. */
+    unsigned head;                      /**< Index of the oldest pending read. */
+    unsigned count;                     /**< Number of pending reads. */
+#ifdef ASYNCIO_URING
+    int ring_fd;                        /**< File descriptor of the io_uring (-1 = synchronous reads). */
+    void *sq_ring;                      /**< Mapped submission queue ring. */
+    size_t sq_ring_size;                /**< Size of the submission queue ring. */
+    void *cq_ring;                      /**< Mapped completion queue ring (can be the same mapping). */
+    size_t cq_ring_size;                /**< Size of the completion queue ring. */
+    struct io_uring_sqe *sqes;          /**< Mapped submission queue entries. */
+    size_t sqes_size;                   /**< Size of the submission queue entries. */
+    unsigned *sq_tail;                  /**< Tail of the submission queue. */
+    unsigned *sq_mask;                  /**< Mask of the submission queue indexes. */
+    unsigned *sq_array;                 /**< Indexes of the submitted entries. */
+    unsigned *cq_head;                  /**< Head of the completion queue. */
+    unsigned *cq_tail;                  /**< Tail of the completion queue. */
+    unsigned *cq_mask;                  /**< Mask of the completion queue indexes. */
+    struct io_uring_cqe *cqes;          /**< Completion queue entries. */
+#endif
+};
+
+/**
+ * Reads from a position of a file, synchronously.
+ *
+ * @param fd            File descriptor of the file.
+ * @param buffer        Buffer for the data.
+ * @param size          Number of bytes to read.
+ * @param offset        Position of the data in the file.
+ *
+ * @return              The number of bytes read (less than size at the end of the file), or -1 on error.
+ */
+
+static int64_t read_at(int fd, void *buffer, size_t size, uint64_t offset) {
+    size_t total = 0;
+
+    while (total < size) {
+#ifdef _WIN32
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)(offset + total);
+        overlapped.OffsetHigh = (DWORD)((offset + total) >> 32);
+
+        DWORD len = size - total > 0x40000000 ? 0x40000000 : (DWORD)(size - total);
+        DWORD n;
+        if (!ReadFile((HANDLE)_get_osfhandle(fd), (uint8_t *)buffer + total, len, &n, &overlapped)) {
+            if (GetLastError() == ERROR_HANDLE_EOF) break;
+            return -1;
+        }
+#else
+        ssize_t n = pread(fd, (uint8_t *)buffer + total, size - total, offset + total);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+#endif
+        if (!n) break;
+        total += n;
+    }
+
+    return total;
+}
+
+/**
+ * Finishes a read with the result given by the backend.
+ *
+ * Reads that failed or were cut short are completed synchronously, so the backend errors (e.g.
+ * a file type not supported by io_uring) are never seen by the caller.
+ *
+ * @param req           Pointer to the read.
+ * @param result        Bytes read by the backend, or a negative value on error.
+ */
+
+static void finish_read(ASYNCIO_REQUEST *req, int64_t result) {
+    if (result < 0) {
+        result = read_at(req->fd, req->buffer, req->size, req->offset);
+    } else if ((uint64_t)result < req->size) {
+        int64_t rest = read_at(req->fd, (uint8_t *)req->buffer + result, req->size - result, req->offset + result);
+        result = rest < 0 ? -1 : result + rest;
+    }
+
+    req->result = result;
+    req->done = 1;
+}
+
+#ifdef ASYNCIO_URING
+
+/**
+ * Enters the io_uring, submitting and/or waiting for requests.
+ *
+ * @param aio           Pointer to the queue.
+ * @param to_submit     Number of requests to submit.
+ * @param min_complete  Number of requests to wait for.
+ * @param flags         Flags for io_uring_enter.
+ *
+ * @return              The number of requests submitted, or -1 on error.
+ */
+
+static int uring_enter(ASYNCIO *aio, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, aio->ring_fd, to_submit, min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+/**
+ * Unmaps the io_uring rings of a queue and closes it.
+ *
+ * @param aio           Pointer to the queue.
+ * @param ring_fd       File descriptor of the io_uring.
+ */
+
+static void uring_close(ASYNCIO *aio, int ring_fd) {
+    if (aio->sqes) munmap(aio->sqes, aio->sqes_size);
+    if (aio->cq_ring && aio->cq_ring != aio->sq_ring) munmap(aio->cq_ring, aio->cq_ring_size);
+    if (aio->sq_ring) munmap(aio->sq_ring, aio->sq_ring_size);
+    close(ring_fd);
+
+    aio->sqes = NULL;
+    aio->cq_ring = aio->sq_ring = NULL;
+    aio->ring_fd = -1;
+}
+
+/**
+ * Sets up an io_uring for a queue.
+ *
+ * @param aio           Pointer to the queue.
+ *
+ * @return              0 on success, 1 if io_uring isn't available.
+ */
+
+static int uring_init(ASYNCIO *aio) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    aio->ring_fd = -1;
+
+    int ring_fd = syscall(__NR_io_uring_setup, aio->depth, &params);
+    if (ring_fd < 0) return 1;
+
+    aio->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    aio->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Both rings can share a single mapping
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (aio->cq_ring_size > aio->sq_ring_size) aio->sq_ring_size = aio->cq_ring_size;
+        aio->cq_ring_size = aio->sq_ring_size;
+    }
+
+    void *ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        uring_close(aio, ring_fd);
+        return 1;
+    }
+    aio->sq_ring = ring;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        aio->cq_ring = aio->sq_ring;
+    } else {
+        ring = mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (ring == MAP_FAILED) {
+            uring_close(aio, ring_fd);
+            return 1;
+        }
+        aio->cq_ring = ring;
+    }
+
+    aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring = mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ring == MAP_FAILED) {
+        uring_close(aio, ring_fd);
+        return 1;
+    }
+    aio->sqes = (struct io_uring_sqe *)ring;
+
+    aio->sq_tail = (unsigned *)((uint8_t *)aio->sq_ring + params.sq_off.tail);
+    aio->sq_mask = (unsigned *)((uint8_t *)aio->sq_ring + params.sq_off.ring_mask);
+    aio->sq_array = (unsigned *)((uint8_t *)aio->sq_ring + params.sq_off.array);
+    aio->cq_head = (unsigned *)((uint8_t *)aio->cq_ring + params.cq_off.head);
+    aio->cq_tail = (unsigned *)((uint8_t *)aio->cq_ring + params.cq_off.tail);
+    aio->cq_mask = (unsigned *)((uint8_t *)aio->cq_ring + params.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)((uint8_t *)aio->cq_ring + params.cq_off.cqes);
+
+    aio->ring_fd = ring_fd;
+
+    return 0;
+}
+
+/**
+ * Submits a read to the io_uring.
+ *
+ * @param aio           Pointer to the queue.
+ * @param index         Index of the read in the ring of the queue.
+ *
+ * @return              0 on success, 1 if the read must be done synchronously.
+ */
+
+static int uring_read(ASYNCIO *aio, unsigned index) {
+    ASYNCIO_REQUEST *req = &aio->requests[index];
+
+    // The result of a request is an int
+    if (req->size > INT32_MAX) return 1;
+
+    unsigned tail = *aio->sq_tail;
+    unsigned sq_index = tail & *aio->sq_mask;
+
+    req->iov.iov_base = req->buffer;
+    req->iov.iov_len = req->size;
+
+    // IORING_OP_READV works on every kernel with io_uring
+    struct io_uring_sqe *sqe = &aio->sqes[sq_index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = req->fd;
+    sqe->addr = (uintptr_t)&req->iov;
+    sqe->len = 1;
+    sqe->off = req->offset;
+    sqe->user_data = index;
+
+    aio->sq_array[sq_index] = sq_index;
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (uring_enter(aio, 1, 0, 0) == 1) return 0;
+
+    // Not submitted, the kernel only takes the entries on io_uring_enter
+    __atomic_store_n(aio->sq_tail, tail, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/**
+ * Waits for completions of the io_uring and finishes their reads.
+ *
+ * @param aio           Pointer to the queue.
+ *
+ * @return              0 on success, 1 on error.
+ */
+
+static int uring_reap(ASYNCIO *aio) {
+    unsigned head = *aio->cq_head;
+    unsigned tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        if (uring_enter(aio, 0, 1, IORING_ENTER_GETEVENTS) < 0) return 1;
+        tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+        finish_read(&aio->requests[cqe->user_data], cqe->res);
+        head++;
+    }
+
+    __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+#endif
+
+#ifdef _WIN32
+
+typedef HANDLE (WINAPI *REOPENFILE)(HANDLE, DWORD, DWORD, DWORD);
+
+/**
+ * Starts an overlapped read.
+ *
+ * Files are opened with the C library, so they are reopened for overlapped I/O (Windows Vista
+ * or later). Each read has its own handle, closed when the read is waited for, because file
+ * descriptors are reused once their files are closed.
+ *
+ * @param req           Pointer to the read.
+ *
+ * @return              0 on success, 1 if the read must be done synchronously.
+ */
+
+static int overlapped_read(ASYNCIO_REQUEST *req) {
+    if (!req->event || req->size > 0x7fffffff) return 1;
+
+    REOPENFILE reopen_file = (REOPENFILE)GetProcAddress(GetModuleHandleA("kernel32.dll"), "ReOpenFile");
+    if (!reopen_file) return 1;
+
+    HANDLE handle = reopen_file((HANDLE)_get_osfhandle(req->fd), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_FLAG_OVERLAPPED);
+    if (handle == INVALID_HANDLE_VALUE) return 1;
+
+    memset(&req->overlapped, 0, sizeof(req->overlapped));
+    req->overlapped.Offset = (DWORD)req->offset;
+    req->overlapped.OffsetHigh = (DWORD)(req->offset >> 32);
+    req->overlapped.hEvent = req->event;
+
+    if (!ReadFile(handle, req->buffer, (DWORD)req->size, NULL, &req->overlapped) && GetLastError() != ERROR_IO_PENDING) {
+        CloseHandle(handle);
+        return 1;
+    }
+
+    req->handle = handle;
+
+    return 0;
+}
+
+/**
+ * Waits for an overlapped read and finishes it.
+ *
+ * @param req           Pointer to the read.
+ */
+
+static void overlapped_wait(ASYNCIO_REQUEST *req) {
+    DWORD n;
+
+    if (GetOverlappedResult(req->handle, &req->overlapped, &n, TRUE)) {
+        finish_read(req, n);
+    } else {
+        finish_read(req, GetLastError() == ERROR_HANDLE_EOF ? 0 : -1);
+    }
+
+    CloseHandle(req->handle);
+    req->handle = NULL;
+}
+
+#endif
+
+/**
+ * Creates a queue of asynchronous reads.
+ *
+ * @param depth         The maximum number of reads in flight (at least 1).
+ *
+ * @return              A pointer to the queue, or NULL if memory allocation fails.
+ */
+
+ASYNCIO *asyncio_new(unsigned depth) {
+    if (!depth) depth = 1;
+
+    ASYNCIO *aio = (ASYNCIO *)calloc(1, sizeof(ASYNCIO));
+    if (!aio) return NULL;
+
+    aio->requests = (ASYNCIO_REQUEST *)calloc(depth, sizeof(ASYNCIO_REQUEST));
+    if (!aio->requests) {
+        free(aio);
+        return NULL;
+    }
+
+    aio->depth = depth;
+
+#ifdef ASYNCIO_URING
+    uring_init(aio);
+#endif
+
+#ifdef _WIN32
+    for (unsigned i = 0; i < depth; i++) aio->requests[i].event = CreateEvent(NULL, TRUE, FALSE, NULL);
+#endif
+
+    return aio;
+}
+
+/**
+ * Gets the maximum number of reads in flight of a queue.
+ *
+ * @param aio           Pointer to the queue.
+ *
+ * @return              The depth of the queue.
+ */
+
+unsigned asyncio_get_depth(ASYNCIO *aio) {
+    return aio->depth;
+}
+
+/**
+ * Gets the number of reads queued and not waited for yet.
+ *
+ * @param aio           Pointer to the queue.
+ *
+ * @return              The number of pending reads.
+ */
+
+unsigned asyncio_get_pending(ASYNCIO *aio) {
+    return aio->count;
+}
+
+/**
+ * Queues a read from a position of a file.
+ *
+ * The file position isn't used (but it can be changed). The file must be kept open and the buffer
+ * must be kept until the read is waited for with asyncio_wait().
+ *
+ * @param aio           Pointer to the queue.
+ * @param fd            File descriptor of the file.
+ * @param buffer        Buffer for the data.
+ * @param size          Number of bytes to read.
+ * @param offset        Position of the data in the file.
+ *
+ * @return              0 on success, 1 if the queue is full.
+ */
+
+int asyncio_read(ASYNCIO *aio, int fd, void *buffer, size_t size, uint64_t offset) {
+    if (aio->count == aio->depth) return 1;
+
+    unsigned index = (aio->head + aio->count) % aio->depth;
+    ASYNCIO_REQUEST *req = &aio->requests[index];
+
+    req->fd = fd;
+    req->buffer = buffer;
+    req->size = size;
+    req->offset = offset;
+    req->result = -1;
+    req->done = 0;
+#ifdef _WIN32
+    req->handle = NULL;
+#endif
+
+    aio->count++;
+
+#ifdef ASYNCIO_URING
+    if (aio->ring_fd != -1 && !uring_read(aio, index)) return 0;
+#endif
+
+#ifdef _WIN32
+    if (!overlapped_read(req)) return 0;
+#endif
+
+    req->result = read_at(fd, buffer, size, offset);
+    req->done = 1;
+
+    return 0;
+}
+
+/**
+ * Waits for the oldest pending read of a queue.
+ *
+ * Reads are always waited for in the order they were queued.
+ *
+ * @param aio           Pointer to the queue.
+ *
+ * @return              The number of bytes read (less than the size at the end of the file),
+ *                      or -1 on error or if there are no pending reads.
+ */
+
+int64_t asyncio_wait(ASYNCIO *aio) {
+    if (!aio->count) return -1;
+
+    ASYNCIO_REQUEST *req = &aio->requests[aio->head];
+
+#ifdef ASYNCIO_URING
+    while (!req->done) {
+        if (uring_reap(aio)) {
+            // The ring can't be waited for
+            req->result = -1;
+            req->done = 1;
+        }
+    }
+#endif
+
+#ifdef _WIN32
+    if (!req->done) overlapped_wait(req);
+#endif
+
+    aio->head = (aio->head + 1) % aio->depth;
+    aio->count--;
+
+    return req->result;
+}
+
+/**
+ * Waits for all the pending reads of a queue and frees it.
+ *
+ * @param aio           Pointer to the queue (can be NULL).
+ */
+
+void asyncio_free(ASYNCIO *aio) {
+    if (!aio) return;
+
+    while (aio->count) asyncio_wait(aio);
+
+#ifdef ASYNCIO_URING
+    if (aio->ring_fd != -1) uring_close(aio, aio->ring_fd);
+#endif
+
+#ifdef _WIN32
+    for (unsigned i = 0; i < aio->depth; i++) if (aio->requests[i].event) CloseHandle(aio->requests[i].event);
+#endif
+
+    free(aio->requests);
+    free(aio);
+}
@@ -0,0 +1,113 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file asyncio.h
+ * @brief Asynchronous positioned reads for the PSARc project.
+ *
+ * This file declares a small queue of file reads that run in the background, so several blocks
+ * can be in flight while the caller compresses or decompresses the ones already read.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#ifndef __ASYNCIO_H
+#define __ASYNCIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Queue of asynchronous reads.
+ *
+ * The reads are done with io_uring on Linux and with overlapped I/O on Windows. When those aren't
+ * available, every read is done synchronously when it's queued, so callers don't need another
+ * code path.
+ */
+typedef struct ASYNCIO ASYNCIO;
+
+/**
+ * Creates a queue of asynchronous reads.
+ *
+ * @param depth         The maximum number of reads in flight (at least 1).
+ *
+ * @return              A pointer to the queue, or NULL if memory allocation fails.
+ */
+ASYNCIO *asyncio_new(unsigned depth);
+
+/**
+ * Gets the maximum number of reads in flight of a queue.
+ *
+ * @param aio           Pointer to the queue.
+ *
+ * @return              The depth of the queue.
+ */
+unsigned asyncio_get_depth(ASYNCIO *aio);
+
+/**
+ * Gets the number of reads queued and not waited for yet.
+ *
+ * @param aio           Pointer to the queue.
+ *
+ * @return              The number of pending reads.
+ */
+unsigned asyncio_get_pending(ASYNCIO *aio);
+
+/**
+ * Queues a read from a position of a file.
+ *
+ * The file position isn't used (but it can be changed). The file must be kept open and the buffer
+ * must be kept until the read is waited for with asyncio_wait().
+ *
+ * @param aio           Pointer to the queue.
+ * @param fd            File descriptor of the file.
+ * @param buffer        Buffer for the data.
+ * @param size          Number of bytes to read.
+ * @param offset        Position of the data in the file.
+ *
+ * @return              0 on success, 1 if the queue is full.
+ */
+int asyncio_read(ASYNCIO *aio, int fd, void *buffer, size_t size, uint64_t offset);
+
+/**
+ * Waits for the oldest pending read of a queue.
+ *
+ * Reads are always waited for in the order they were queued.
+ *
+ * @param aio           Pointer to the queue.
+ *
+ * @return              The number of bytes read (less than the size at the end of the file),
+ *                      or -1 on error or if there are no pending reads.
+ */
+int64_t asyncio_wait(ASYNCIO *aio);
+
+/**
+ * Waits for all the pending reads of a queue and frees it.
+ *
+ * @param aio           Pointer to the queue (can be NULL).
+ */
+void asyncio_free(ASYNCIO *aio);
+
+#endif /* __ASYNCIO_H */
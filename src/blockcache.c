@@ -0,0 +1,311 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file blockcache.c
+ * @brief Implementation of the cache of decompressed blocks for the PSARc library.
+ *
+ * This file implements the sharded LRU cache of decompressed blocks. Each shard keeps a chained
+ * hash table and a doubly linked list in use order, and evicts from the tail of the list.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "blockcache.h"
+
+/**
+ * Calculates the hash of a block key.
+ *
+ * @param archive_id    Id of the archive of the block.
+ * @param block         Index of the block in the archive.
+ *
+ * @return              The hash of the key.
+ */
+
+static uint64_t blockcache_hash(uint64_t archive_id, uint64_t block) {
+    uint64_t h = (archive_id * 0x9E3779B97F4A7C15ULL) ^ block;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Unlinks an entry from the use list of its shard.
+ *
+ * @param shard         Pointer to the shard.
+ * @param entry         Pointer to the entry.
+ */
+
+static void blockcache_lru_unlink(BLOCKCACHE_SHARD *shard, BLOCKCACHE_ENTRY *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else shard->lru_head = entry->lru_next;
+
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else shard->lru_tail = entry->lru_prev;
+}
+
+/**
+ * Links an entry at the head (most recently used) of the use list of its shard.
+ *
+ * @param shard         Pointer to the shard.
+ * @param entry         Pointer to the entry.
+ */
+
+static void blockcache_lru_push(BLOCKCACHE_SHARD *shard, BLOCKCACHE_ENTRY *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->lru_prev = entry;
+    shard->lru_head = entry;
+    if (!shard->lru_tail) shard->lru_tail = entry;
+}
+
+/**
+ * Removes an entry from its shard and frees it.
+ *
+ * @param shard         Pointer to the shard.
+ * @param entry         Pointer to the entry.
+ */
+
+static void blockcache_remove(BLOCKCACHE_SHARD *shard, BLOCKCACHE_ENTRY *entry) {
+    size_t bucket = (blockcache_hash(entry->archive_id, entry->block) >> 8) & (shard->num_buckets - 1);
+
+    BLOCKCACHE_ENTRY **p = &shard->buckets[bucket];
+    while (*p != entry) p = &(*p)->next;
+    *p = entry->next;
+
+    blockcache_lru_unlink(shard, entry);
+
+    shard->count--;
+    shard->used -= sizeof(BLOCKCACHE_ENTRY) + entry->size;
+
+    free(entry);
+}
+
+/**
+ * Doubles the number of buckets of a shard.
+ *
+ * @param shard         Pointer to the shard.
+ */
+
+static void blockcache_grow(BLOCKCACHE_SHARD *shard) {
+    size_t num_buckets = shard->num_buckets * 2;
+
+    BLOCKCACHE_ENTRY **buckets = (BLOCKCACHE_ENTRY **)calloc(num_buckets, sizeof(BLOCKCACHE_ENTRY *));
+    if (!buckets) return; // Keep the current table, just longer chains
+
+    for (size_t i = 0; i < shard->num_buckets; i++) {
+        BLOCKCACHE_ENTRY *entry = shard->buckets[i];
+        while (entry) {
+            BLOCKCACHE_ENTRY *next = entry->next;
+            size_t bucket = (blockcache_hash(entry->archive_id, entry->block) >> 8) & (num_buckets - 1);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->num_buckets = num_buckets;
+}
+
+/**
+ * Creates a cache.
+ *
+ * @param budget        Memory budget in bytes (split between the shards).
+ *
+ * @return              A pointer to the cache, or NULL if memory allocation fails.
+ */
+
+BLOCKCACHE *blockcache_new(size_t budget) {
+    BLOCKCACHE *cache = (BLOCKCACHE *)calloc(1, sizeof(BLOCKCACHE));
+    if (!cache) return NULL;
+
+    for (int i = 0; i < BLOCKCACHE_SHARDS; i++) {
+        BLOCKCACHE_SHARD *shard = &cache->shards[i];
+
+        shard->num_buckets = 64;
+        shard->buckets = (BLOCKCACHE_ENTRY **)calloc(shard->num_buckets, sizeof(BLOCKCACHE_ENTRY *));
+        if (!shard->buckets) {
+            for (int j = 0; j < i; j++) {
+                free(cache->shards[j].buckets);
+                pthread_mutex_destroy(&cache->shards[j].mutex);
+            }
+            free(cache);
+            return NULL;
+        }
+
+        shard->budget = budget / BLOCKCACHE_SHARDS;
+        pthread_mutex_init(&shard->mutex, NULL);
+    }
+
+    return cache;
+}
+
+/**
+ * Frees a cache and all its blocks.
+ *
+ * @param cache         Pointer to the cache (can be NULL).
+ */
+
+void blockcache_free(BLOCKCACHE *cache) {
+    if (!cache) return;
+
+    for (int i = 0; i < BLOCKCACHE_SHARDS; i++) {
+        BLOCKCACHE_SHARD *shard = &cache->shards[i];
+
+        BLOCKCACHE_ENTRY *entry = shard->lru_head;
+        while (entry) {
+            BLOCKCACHE_ENTRY *next = entry->lru_next;
+            free(entry);
+            entry = next;
+        }
+
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+
+    free(cache);
+}
+
+/**
+ * Copies a part of a cached block.
+ *
+ * @param cache         Pointer to the cache.
+ * @param archive_id    Id of the archive of the block.
+ * @param block         Index of the block in the archive.
+ * @param offset        Offset of the part in the block.
+ * @param out           Buffer for the data.
+ * @param size          Size of the part.
+ *
+ * @return              1 if the block is cached (hit), 0 otherwise (miss).
+ */
+
+int blockcache_get(BLOCKCACHE *cache, uint64_t archive_id, uint64_t block, size_t offset, uint8_t *out, size_t size) {
+    uint64_t h = blockcache_hash(archive_id, block);
+    BLOCKCACHE_SHARD *shard = &cache->shards[h % BLOCKCACHE_SHARDS];
+
+    pthread_mutex_lock(&shard->mutex);
+
+    BLOCKCACHE_ENTRY *entry = shard->buckets[(h >> 8) & (shard->num_buckets - 1)];
+    while (entry && (entry->archive_id != archive_id || entry->block != block)) entry = entry->next;
+
+    if (!entry || offset + size > entry->size) {
+        shard->misses++;
+        pthread_mutex_unlock(&shard->mutex);
+        return 0;
+    }
+
+    // Move it to the head of the use list
+    if (entry != shard->lru_head) {
+        blockcache_lru_unlink(shard, entry);
+        blockcache_lru_push(shard, entry);
+    }
+
+    memcpy(out, entry->data + offset, size);
+    shard->hits++;
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    return 1;
+}
+
+/**
+ * Adds a block to the cache, evicting the least recently used blocks to keep it within budget.
+ *
+ * @param cache         Pointer to the cache.
+ * @param archive_id    Id of the archive of the block.
+ * @param block         Index of the block in the archive.
+ * @param data          Block data.
+ * @param size          Size of the block data.
+ */
+
+void blockcache_put(BLOCKCACHE *cache, uint64_t archive_id, uint64_t block, const uint8_t *data, size_t size) {
+    uint64_t h = blockcache_hash(archive_id, block);
+    BLOCKCACHE_SHARD *shard = &cache->shards[h % BLOCKCACHE_SHARDS];
+
+    size_t entry_size = sizeof(BLOCKCACHE_ENTRY) + size;
+    if (entry_size > shard->budget) return;
+
+    // Copy the block out of the lock
+    BLOCKCACHE_ENTRY *new_entry = (BLOCKCACHE_ENTRY *)malloc(entry_size);
+    if (!new_entry) return;
+
+    new_entry->archive_id = archive_id;
+    new_entry->block = block;
+    new_entry->size = size;
+    memcpy(new_entry->data, data, size);
+
+    pthread_mutex_lock(&shard->mutex);
+
+    // Another thread may have added it meanwhile
+    BLOCKCACHE_ENTRY *entry = shard->buckets[(h >> 8) & (shard->num_buckets - 1)];
+    while (entry && (entry->archive_id != archive_id || entry->block != block)) entry = entry->next;
+    if (entry) {
+        pthread_mutex_unlock(&shard->mutex);
+        free(new_entry);
+        return;
+    }
+
+    while (shard->lru_tail && shard->used + entry_size > shard->budget) blockcache_remove(shard, shard->lru_tail);
+
+    if (shard->count >= shard->num_buckets) blockcache_grow(shard);
+
+    size_t bucket = (h >> 8) & (shard->num_buckets - 1);
+    new_entry->next = shard->buckets[bucket];
+    shard->buckets[bucket] = new_entry;
+    blockcache_lru_push(shard, new_entry);
+
+    shard->count++;
+    shard->used += entry_size;
+
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/**
+ * Gets the hit and miss counters of the cache.
+ *
+ * @param cache         Pointer to the cache.
+ * @param hits          Pointer to receive the number of hits (can be NULL).
+ * @param misses        Pointer to receive the number of misses (can be NULL).
+ */
+
+void blockcache_get_stats(BLOCKCACHE *cache, uint64_t *hits, uint64_t *misses) {
+    uint64_t h = 0, m = 0;
+
+    for (int i = 0; i < BLOCKCACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache->shards[i].mutex);
+        h += cache->shards[i].hits;
+        m += cache->shards[i].misses;
+        pthread_mutex_unlock(&cache->shards[i].mutex);
+    }
+
+    if (hits) *hits = h;
+    if (misses) *misses = m;
+}
@@ -0,0 +1,132 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file blockcache.h
+ * @brief Cache of decompressed blocks for the PSARc library.
+ *
+ * This file declares a bounded LRU cache of decompressed blocks, keyed by archive and block
+ * index. The cache is split in shards, each one with its own lock, so concurrent reads of
+ * different blocks rarely contend.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#ifndef __BLOCKCACHE_H
+#define __BLOCKCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define BLOCKCACHE_SHARDS   16
+
+/**
+ * Structure representing a cached block.
+ */
+typedef struct BLOCKCACHE_ENTRY {
+    uint64_t archive_id;                /**< Id of the archive of the block. */
+    uint64_t block;                     /**< Index of the block in the archive. */
+    size_t size;                        /**< Size of the block data. */
+    struct BLOCKCACHE_ENTRY *next;      /**< Next entry in the hash bucket. */
+    struct BLOCKCACHE_ENTRY *lru_prev;  /**< Previous (more recently used) entry. */
+    struct BLOCKCACHE_ENTRY *lru_next;  /**< Next (less recently used) entry. */
+    uint8_t data[];                     /**< Block data. */
+} BLOCKCACHE_ENTRY;
+
+/**
+ * Structure representing a shard of the cache.
+ */
+typedef struct {
+    pthread_mutex_t mutex;              /**< Protects the shard. */
+    BLOCKCACHE_ENTRY **buckets;         /**< Hash table of entries. */
+    size_t num_buckets;                 /**< Number of buckets (power of 2). */
+    size_t count;                       /**< Number of entries. */
+    size_t used;                        /**< Memory used by the entries. */
+    size_t budget;                      /**< Memory budget of the shard. */
+    BLOCKCACHE_ENTRY *lru_head;         /**< Most recently used entry. */
+    BLOCKCACHE_ENTRY *lru_tail;         /**< Least recently used entry. */
+    uint64_t hits;                      /**< Number of hits. */
+    uint64_t misses;                    /**< Number of misses. */
+} BLOCKCACHE_SHARD;
+
+/**
+ * Structure representing a cache of decompressed blocks.
+ */
+typedef struct {
+    BLOCKCACHE_SHARD shards[BLOCKCACHE_SHARDS];
+} BLOCKCACHE;
+
+/**
+ * Creates a cache.
+ *
+ * @param budget        Memory budget in bytes (split between the shards).
+ *
+ * @return              A pointer to the cache, or NULL if memory allocation fails.
+ */
+BLOCKCACHE *blockcache_new(size_t budget);
+
+/**
+ * Frees a cache and all its blocks.
+ *
+ * @param cache         Pointer to the cache (can be NULL).
+ */
+void blockcache_free(BLOCKCACHE *cache);
+
+/**
+ * Copies a part of a cached block.
+ *
+ * @param cache         Pointer to the cache.
+ * @param archive_id    Id of the archive of the block.
+ * @param block         Index of the block in the archive.
+ * @param offset        Offset of the part in the block.
+ * @param out           Buffer for the data.
+ * @param size          Size of the part.
+ *
+ * @return              1 if the block is cached (hit), 0 otherwise (miss).
+ */
+int blockcache_get(BLOCKCACHE *cache, uint64_t archive_id, uint64_t block, size_t offset, uint8_t *out, size_t size);
+
+/**
+ * Adds a block to the cache, evicting the least recently used blocks to keep it within budget.
+ *
+ * @param cache         Pointer to the cache.
+ * @param archive_id    Id of the archive of the block.
+ * @param block         Index of the block in the archive.
+ * @param data          Block data.
+ * @param size          Size of the block data.
+ */
+void blockcache_put(BLOCKCACHE *cache, uint64_t archive_id, uint64_t block, const uint8_t *data, size_t size);
+
+/**
+ * Gets the hit and miss counters of the cache.
+ *
+ * @param cache         Pointer to the cache.
+ * @param hits          Pointer to receive the number of hits (can be NULL).
+ * @param misses        Pointer to receive the number of misses (can be NULL).
+ */
+void blockcache_get_stats(BLOCKCACHE *cache, uint64_t *hits, uint64_t *misses);
+
+#endif /* __BLOCKCACHE_H */
@@ -0,0 +1,591 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file coder.c
+ * @brief Implementation of reusable compression/decompression contexts for the PSARc project.
+ *
+ * This file implements the block coders used in the PSARc project. The zlib streams are reset
+ * between blocks and the LZMA streams are re-initialized in place, which lets liblzma reuse the
+ * memory already allocated for the previous block.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <lzma.h>
+#ifdef PSARC_WITH_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#include "psarc.h"
+#include "coder.h"
+
+#define CODER_DEFLATE_ENCODER_MEMORY    ( 1 << 20 )     // Rough size of a libdeflate compressor
+#define CODER_DEFLATE_DECODER_MEMORY    ( 1 << 15 )     // Rough size of a libdeflate decompressor
+
+/**
+ * Gets the LZMA options of a level, with the dictionary no bigger than the data.
+ *
+ * Each block is compressed on its own, so a dictionary bigger than the block can't find more
+ * matches. It only takes memory, in the encoder and in the decoder (64 MiB with -9).
+ *
+ * @param options       Options to fill.
+ * @param level         Compression level.
+ * @param extreme       Extreme compression flag.
+ * @param size          Size of the data.
+ */
+
+static void get_lzma_options(lzma_options_lzma *options, int level, int extreme, size_t size) {
+    lzma_lzma_preset(options, level | ( extreme ? LZMA_PRESET_EXTREME : 0 ));
+
+    uint32_t dict_size = LZMA_DICT_SIZE_MIN;
+    while ( dict_size < size && dict_size < options->dict_size ) dict_size <<= 1;
+    options->dict_size = dict_size;
+}
+
+/**
+ * Allocates a new coder. Streams are initialized on first use.
+ *
+ * @return              A pointer to the new coder, or NULL if memory allocation fails.
+ */
+
+CODER *coder_new() {
+    CODER *coder = (CODER *)calloc(1, sizeof(CODER));
+    if (!coder) return NULL;
+
+    coder->zlib_encoder_level = -1;
+    coder->zlib_decoder_ready = 0;
+
+    lzma_stream strm = LZMA_STREAM_INIT;
+    coder->lzma_encoder = strm;
+    coder->lzma_decoder = strm;
+
+    return coder;
+}
+
+/**
+ * Frees a coder and all of its streams.
+ *
+ * The signature allows using it as the destructor of thread local data.
+ *
+ * @param coder         Pointer to the coder to free (can be NULL).
+ */
+
+void coder_free(void *coder) {
+    CODER *c = (CODER *)coder;
+    if (!c) return;
+
+    if (c->zlib_encoder_level != -1) deflateEnd(&c->zlib_encoder);
+    if (c->zlib_decoder_ready) inflateEnd(&c->zlib_decoder);
+#ifdef PSARC_WITH_LIBDEFLATE
+    if (c->deflate_encoder) libdeflate_free_compressor(c->deflate_encoder);
+    if (c->deflate_decoder) libdeflate_free_decompressor(c->deflate_decoder);
+#endif
+    lzma_end(&c->lzma_encoder);
+    lzma_end(&c->lzma_decoder);
+#ifdef PSARC_WITH_ZSTD
+    ZSTD_freeCCtx(c->zstd_encoder);
+    ZSTD_freeDCtx(c->zstd_decoder);
+#endif
+#ifdef PSARC_WITH_LZ4
+    free(c->lz4_state);
+    free(c->lz4_hc_state);
+#endif
+
+    free(c);
+}
+
+/**
+ * Sets the preset dictionary of a coder.
+ *
+ * zlib blocks are compressed with the dictionary, and the blocks that need it are decompressed
+ * with it. The dictionary is not copied, it must outlive the coder.
+ *
+ * @param coder         The coder.
+ * @param dictionary    The dictionary (NULL = none).
+ * @param size          Size of the dictionary.
+ */
+
+void coder_set_dictionary(CODER *coder, const uint8_t *dictionary, size_t size) {
+    coder->dictionary = size ? dictionary : NULL;
+    coder->dictionary_size = dictionary ? size : 0;
+}
+
+/**
+ * Checks if a compression type is supported by this build.
+ *
+ * @param type          Compression type (PSARC_*).
+ *
+ * @return              1 if it's supported, 0 otherwise.
+ */
+
+int coder_is_available(int type) {
+    switch (type) {
+        case PSARC_STORE:
+        case PSARC_ZLIB:
+        case PSARC_LZMA:
+            return 1;
+
+#ifdef PSARC_WITH_ZSTD
+        case PSARC_ZSTD:
+            return 1;
+#endif
+
+#ifdef PSARC_WITH_LZ4
+        case PSARC_LZ4:
+            return 1;
+#endif
+
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Gets the name of a compression type, as stored in the archive header.
+ *
+ * @param type          Compression type (PSARC_*).
+ *
+ * @return              The name (up to 4 characters, zero-padded to 4 bytes). Stored archives are
+ *                      named "zlib".
+ */
+
+const char *coder_get_name(int type) {
+    switch (type) {
+        case PSARC_LZMA:
+            return "lzma";
+
+        case PSARC_ZSTD:
+            return "zstd";
+
+        case PSARC_LZ4:
+            return "lz4\0";
+
+        default:
+            return "zlib";
+    }
+}
+
+/**
+ * Gets a compression type from its name in the archive header.
+ *
+ * @param name          The name (4 characters, not null terminated).
+ *
+ * @return              The compression type. Unknown names are taken as zlib.
+ */
+
+int coder_get_type(const char *name) {
+    if (!memcmp(name, "lzma", 4)) return PSARC_LZMA;
+    if (!memcmp(name, "zstd", 4)) return PSARC_ZSTD;
+    if (!memcmp(name, "lz4\0", 4)) return PSARC_LZ4;
+    return PSARC_ZLIB;
+}
+
+/**
+ * Detects the compression of a block.
+ *
+ * zstd and lz4 blocks are told by the archive header: a block smaller than its data is
+ * compressed with the compression of the archive. The blocks of zlib and lzma archives are
+ * detected from their stream header, as an archive may mix both. zlib streams with a preset
+ * dictionary are only detected if the coder has one.
+ *
+ * @param coder             The coder that will decompress the block (can be NULL).
+ * @param compression_type  Compression type of the archive.
+ * @param block             The block data.
+ * @param size              Size of the block.
+ * @param data_size         Size of the decompressed block.
+ *
+ * @return                  The compression type of the block, PSARC_STORE if it's raw.
+ */
+
+int coder_get_block_type(const CODER *coder, int compression_type, const uint8_t *block, size_t size, size_t data_size) {
+    // zstd and lz4 archives go by the header, lz4 blocks can't be detected
+    if (compression_type == PSARC_ZSTD || compression_type == PSARC_LZ4) {
+        return size < data_size ? compression_type : PSARC_STORE;
+    }
+
+    /*
+    78 01   No Compression (no preset dictionary)
+    78 5E   Best speed (no preset dictionary)
+    78 9C   Default Compression (no preset dictionary)
+    78 DA   Best Compression (no preset dictionary)
+    78 20   No Compression (with preset dictionary)
+    78 7D   Best speed (with preset dictionary)
+    78 BB   Default Compression (with preset dictionary)
+    78 F9   Best Compression (with preset dictionary)
+    */
+
+    // Check if it's a valid zlib block
+    if (size > 2 && block[0] == 0x78 &&
+        (block[1] == 0x01 || block[1] == 0x5E || block[1] == 0x9C || block[1] == 0xDA)) {
+        return PSARC_ZLIB;
+    }
+
+    // Preset dictionary headers only count with a dictionary, so fewer raw blocks are taken for zlib ones
+    if (coder && coder->dictionary && size > 6 && block[0] == 0x78 &&
+        (block[1] == 0x20 || block[1] == 0x7D || block[1] == 0xBB || block[1] == 0xF9)) {
+        return PSARC_ZLIB;
+    }
+
+    // Check if it's a valid LZMA block
+    if (size > 6 && memcmp(block, "\xFD\x37\x7A\x58\x5A\x00", 6) == 0) {
+        return PSARC_LZMA;
+    }
+
+    return PSARC_STORE;
+}
+
+/**
+ * Compresses a block.
+ *
+ * @param coder         The coder.
+ * @param type          Compression type (PSARC_ZLIB or PSARC_LZMA).
+ * @param level         Compression level.
+ * @param extreme       Extreme compression flag (only for LZMA).
+ * @param in            Input data.
+ * @param in_size       Size of the input data.
+ * @param out           Output buffer.
+ * @param out_size      Size of the output buffer.
+ *
+ * @return              Size of the compressed data, or 0 on error or if it doesn't fit in the output buffer.
+ */
+
+size_t coder_compress(CODER *coder, int type, int level, int extreme, const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size) {
+    switch (type) {
+        case PSARC_ZLIB: {
+#ifdef PSARC_WITH_LIBDEFLATE
+            // libdeflate compresses the whole block at once, but it can't use a preset dictionary
+            if (!coder->dictionary) {
+                if (coder->deflate_encoder && coder->deflate_encoder_level != level) {
+                    libdeflate_free_compressor(coder->deflate_encoder);
+                    coder->deflate_encoder = NULL;
+                }
+                if (!coder->deflate_encoder) {
+                    if (!(coder->deflate_encoder = libdeflate_alloc_compressor(level))) return 0;
+                    coder->deflate_encoder_level = level;
+                }
+
+                return libdeflate_zlib_compress(coder->deflate_encoder, in, in_size, out, out_size);
+            }
+#endif
+
+            z_stream *strm = &coder->zlib_encoder;
+
+            if (coder->zlib_encoder_level != level) {
+                if (coder->zlib_encoder_level != -1) deflateEnd(strm);
+                coder->zlib_encoder_level = -1;
+                memset(strm, 0, sizeof(*strm));
+                if (deflateInit(strm, level) != Z_OK) return 0;
+                coder->zlib_encoder_level = level;
+            } else if (deflateReset(strm) != Z_OK) {
+                return 0;
+            }
+
+            // The dictionary is set again on every block, each block is a stream of its own
+            if (coder->dictionary && deflateSetDictionary(strm, coder->dictionary, coder->dictionary_size) != Z_OK) return 0;
+
+            strm->next_in = (Bytef *)in;
+            strm->avail_in = in_size;
+            strm->next_out = out;
+            strm->avail_out = out_size;
+
+            if (deflate(strm, Z_FINISH) != Z_STREAM_END) return 0;
+
+            return out_size - strm->avail_out;
+        }
+
+        case PSARC_LZMA: {
+            lzma_stream *strm = &coder->lzma_encoder;
+
+            // Structure for configuring compression options
+            lzma_options_lzma lzma_options;
+            get_lzma_options(&lzma_options, level, extreme, in_size);
+
+            // Structure for configuring compression filter
+            lzma_filter filters[] = {
+                { .id = LZMA_FILTER_LZMA2, .options = &lzma_options },
+                { .id = LZMA_VLI_UNKNOWN, .options = NULL },
+            };
+
+            // Re-initializing an existing stream reuses its memory
+            if (lzma_stream_encoder(strm, filters, LZMA_CHECK_CRC64) != LZMA_OK) return 0;
+
+            strm->next_in = in;
+            strm->avail_in = in_size;
+            strm->next_out = out;
+            strm->avail_out = out_size;
+
+            if (lzma_code(strm, LZMA_FINISH) != LZMA_STREAM_END) return 0;
+
+            return out_size - strm->avail_out;
+        }
+
+#ifdef PSARC_WITH_ZSTD
+        case PSARC_ZSTD: {
+            if (!coder->zstd_encoder && !(coder->zstd_encoder = ZSTD_createCCtx())) return 0;
+
+            // Long distance matching only pays off with blocks bigger than the window of the level
+            if (ZSTD_isError(ZSTD_CCtx_setParameter(coder->zstd_encoder, ZSTD_c_compressionLevel, level)) ||
+                ZSTD_isError(ZSTD_CCtx_setParameter(coder->zstd_encoder, ZSTD_c_enableLongDistanceMatching, extreme ? 1 : 0))) return 0;
+
+            size_t ret = ZSTD_compress2(coder->zstd_encoder, out, out_size, in, in_size);
+            return ZSTD_isError(ret) ? 0 : ret;
+        }
+#endif
+
+#ifdef PSARC_WITH_LZ4
+        case PSARC_LZ4: {
+            if (in_size > LZ4_MAX_INPUT_SIZE) return 0;
+
+            int capacity = out_size > (size_t)LZ4_compressBound(in_size) ? LZ4_compressBound(in_size) : (int)out_size;
+            int ret;
+
+            // The first levels use the fast compressor, the rest the high compression one
+            if (level < LZ4HC_CLEVEL_MIN) {
+                if (!coder->lz4_state && !(coder->lz4_state = malloc(LZ4_sizeofState()))) return 0;
+                ret = LZ4_compress_fast_extState(coder->lz4_state, (const char *)in, (char *)out, in_size, capacity, 1);
+            } else {
+                if (!coder->lz4_hc_state && !(coder->lz4_hc_state = malloc(LZ4_sizeofStateHC()))) return 0;
+                ret = LZ4_compress_HC_extStateHC(coder->lz4_hc_state, (const char *)in, (char *)out, in_size, capacity, level);
+            }
+
+            return ret > 0 ? ret : 0;
+        }
+#endif
+
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Decompresses a block.
+ *
+ * @param coder         The coder.
+ * @param type          Compression type (PSARC_ZLIB or PSARC_LZMA).
+ * @param in            Compressed data.
+ * @param in_size       Size of the compressed data.
+ * @param out           Output buffer.
+ * @param out_size      Expected size of the decompressed data.
+ * @param decoded_size  Pointer to receive the size of the decompressed data (can be NULL).
+ *
+ * @return              0 on success, 1 on error.
+ */
+
+int coder_decompress(CODER *coder, int type, const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size, size_t *decoded_size) {
+    switch (type) {
+        case PSARC_ZLIB: {
+#ifdef PSARC_WITH_LIBDEFLATE
+            // Streams with a preset dictionary (FDICT flag) are left to zlib
+            if (in_size > 2 && !(in[1] & 0x20)) {
+                if (!coder->deflate_decoder && !(coder->deflate_decoder = libdeflate_alloc_decompressor())) return 1;
+
+                size_t actual_size = 0;
+                if (libdeflate_zlib_decompress(coder->deflate_decoder, in, in_size, out, out_size, &actual_size) != LIBDEFLATE_SUCCESS) return 1;
+
+                if (decoded_size) *decoded_size = actual_size;
+                return 0;
+            }
+#endif
+
+            z_stream *strm = &coder->zlib_decoder;
+
+            if (!coder->zlib_decoder_ready) {
+                memset(strm, 0, sizeof(*strm));
+                if (inflateInit(strm) != Z_OK) return 1;
+                coder->zlib_decoder_ready = 1;
+            } else if (inflateReset(strm) != Z_OK) {
+                return 1;
+            }
+
+            strm->next_in = (Bytef *)in;
+            strm->avail_in = in_size;
+            strm->next_out = out;
+            strm->avail_out = out_size;
+
+            int ret = inflate(strm, Z_FINISH);
+
+            // Streams compressed with a preset dictionary ask for it after the header
+            if (ret == Z_NEED_DICT) {
+                if (!coder->dictionary || inflateSetDictionary(strm, coder->dictionary, coder->dictionary_size) != Z_OK) return 1;
+                ret = inflate(strm, Z_FINISH);
+            }
+
+            if (ret != Z_STREAM_END) return 1;
+
+            if (decoded_size) *decoded_size = out_size - strm->avail_out;
+            return 0;
+        }
+
+        case PSARC_LZMA: {
+            lzma_stream *strm = &coder->lzma_decoder;
+
+            // Re-initializing an existing stream reuses its memory
+            if (lzma_stream_decoder(strm, UINT64_MAX, 0) != LZMA_OK) return 1;
+
+            strm->next_in = in;
+            strm->avail_in = in_size;
+            strm->next_out = out;
+            strm->avail_out = out_size;
+
+            if (lzma_code(strm, LZMA_FINISH) != LZMA_STREAM_END) return 1;
+
+            if (decoded_size) *decoded_size = out_size - strm->avail_out;
+            return 0;
+        }
+
+#ifdef PSARC_WITH_ZSTD
+        case PSARC_ZSTD: {
+            if (!coder->zstd_decoder && !(coder->zstd_decoder = ZSTD_createDCtx())) return 1;
+
+            size_t ret = ZSTD_decompressDCtx(coder->zstd_decoder, out, out_size, in, in_size);
+            if (ZSTD_isError(ret)) return 1;
+
+            if (decoded_size) *decoded_size = ret;
+            return 0;
+        }
+#endif
+
+#ifdef PSARC_WITH_LZ4
+        case PSARC_LZ4: {
+            if (in_size > INT32_MAX) return 1;
+
+            int ret = LZ4_decompress_safe((const char *)in, (char *)out, in_size, out_size > INT32_MAX ? INT32_MAX : (int)out_size);
+            if (ret < 0) return 1;
+
+            if (decoded_size) *decoded_size = ret;
+            return 0;
+        }
+#endif
+
+        default:
+            return 1;
+    }
+}
+
+/**
+ * Decodes a block of an entry.
+ *
+ * The compression of the block is detected (see coder_get_block_type()), and the block is
+ * decompressed unless it's raw. What to do with raw blocks is left to the caller.
+ *
+ * @param coder             The coder.
+ * @param compression_type  Compression type of the archive.
+ * @param block             The block data.
+ * @param size              Size of the block.
+ * @param out               Output buffer.
+ * @param data_size         Expected size of the decompressed data.
+ * @param decoded_size      Pointer to receive the size of the decompressed data (can be NULL).
+ *
+ * @return                  0 on success, 1 on error, -1 if it isn't a compressed block.
+ */
+
+int coder_decode_block(CODER *coder, int compression_type, const uint8_t *block, size_t size, uint8_t *out, size_t data_size, size_t *decoded_size) {
+    int type = coder_get_block_type(coder, compression_type, block, size, data_size);
+    if (type == PSARC_STORE) return -1;
+
+    return coder_decompress(coder, type, block, size, out, data_size, decoded_size);
+}
+
+/**
+ * Estimates the memory a coder takes to compress or decompress blocks.
+ *
+ * zstd only tells the size of its context once it has been used, so a block of zeros is
+ * compressed with a scratch coder.
+ *
+ * @param type          Compression type.
+ * @param level         Compression level (compression only).
+ * @param extreme       Extreme compression flag (compression only).
+ * @param block_size    Block size.
+ * @param decoder       0 for compression, 1 for decompression.
+ *
+ * @return              The estimated bytes.
+ */
+
+size_t coder_get_memory_usage(int type, int level, int extreme, size_t block_size, int decoder) {
+    switch (type) {
+        case PSARC_ZLIB: {
+            // Window and hash chains of deflateInit() (memLevel 8), window and state of inflateInit()
+            size_t size = decoder ? ( 1 << MAX_WBITS ) + 8192 : ( 1 << ( MAX_WBITS + 2 ) ) + ( 1 << ( 8 + 9 ) );
+#ifdef PSARC_WITH_LIBDEFLATE
+            size += decoder ? CODER_DEFLATE_DECODER_MEMORY : CODER_DEFLATE_ENCODER_MEMORY;
+#endif
+            return size;
+        }
+
+        case PSARC_LZMA: {
+            // The decoder allocates the dictionary of the stream, this is the one of the blocks written
+            // here (archives from other tools may use the one of their level, up to 64 MiB)
+            lzma_options_lzma lzma_options;
+            get_lzma_options(&lzma_options, decoder ? LZMA_PRESET_DEFAULT : level, decoder ? 0 : extreme, block_size);
+
+            lzma_filter filters[] = {
+                { .id = LZMA_FILTER_LZMA2, .options = &lzma_options },
+                { .id = LZMA_VLI_UNKNOWN, .options = NULL },
+            };
+
+            uint64_t size = decoder ? lzma_raw_decoder_memusage(filters) : lzma_raw_encoder_memusage(filters);
+            return size == UINT64_MAX ? 0 : (size_t)size;
+        }
+
+#ifdef PSARC_WITH_ZSTD
+        case PSARC_ZSTD: {
+            size_t size = 0;
+
+            if ( decoder ) {
+                ZSTD_DCtx *dctx = ZSTD_createDCtx();
+                if (dctx) size = ZSTD_sizeof_DCtx(dctx);
+                ZSTD_freeDCtx(dctx);
+                return size;
+            }
+
+            CODER *coder = coder_new();
+            uint8_t *in = (uint8_t *)calloc(1, block_size);
+            size_t out_size = ZSTD_compressBound(block_size);
+            uint8_t *out = (uint8_t *)malloc(out_size);
+
+            if ( coder && in && out && coder_compress(coder, PSARC_ZSTD, level, extreme, in, block_size, out, out_size) ) size = ZSTD_sizeof_CCtx(coder->zstd_encoder);
+
+            free(out);
+            free(in);
+            if (coder) coder_free(coder);
+            return size;
+        }
+#endif
+
+#ifdef PSARC_WITH_LZ4
+        case PSARC_LZ4:
+            if ( decoder ) return 0;
+            return level < LZ4HC_CLEVEL_MIN ? LZ4_sizeofState() : LZ4_sizeofStateHC();
+#endif
+
+        default:
+            return 0;
+    }
+}
@@ -0,0 +1,217 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file coder.h
+ * @brief Reusable compression/decompression contexts for the PSARc project.
+ *
+ * This header file contains declarations for the block coders used in the PSARc project.
+ * A coder keeps its zlib and LZMA streams alive between blocks, so the coder state (and the
+ * LZMA dictionary) is allocated once per thread instead of once per block.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#ifndef __CODER_H
+#define __CODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zlib.h>
+#include <lzma.h>
+#ifdef PSARC_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef PSARC_WITH_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#define CODER_ZSTD_LEVEL_DEFAULT    3       // Default level for zstd (its own default)
+#define CODER_LZ4_LEVEL_DEFAULT     1       // Default level for lz4 (the fast compressor)
+
+/**
+ * Structure holding the persistent coder streams.
+ */
+typedef struct {
+    z_stream zlib_encoder;          /**< zlib deflate stream. */
+    int zlib_encoder_level;         /**< Level of the deflate stream (-1 = not initialized). */
+    z_stream zlib_decoder;          /**< zlib inflate stream. */
+    int zlib_decoder_ready;         /**< Inflate stream initialized flag. */
+#ifdef PSARC_WITH_LIBDEFLATE
+    struct libdeflate_compressor *deflate_encoder;      /**< libdeflate compressor (NULL = not created). */
+    int deflate_encoder_level;                          /**< Level of the libdeflate compressor. */
+    struct libdeflate_decompressor *deflate_decoder;    /**< libdeflate decompressor (NULL = not created). */
+#endif
+    lzma_stream lzma_encoder;       /**< LZMA (xz) encoder stream. */
+    lzma_stream lzma_decoder;       /**< LZMA (xz) decoder stream. */
+#ifdef PSARC_WITH_ZSTD
+    ZSTD_CCtx *zstd_encoder;        /**< zstd compression context (NULL = not created). */
+    ZSTD_DCtx *zstd_decoder;        /**< zstd decompression context (NULL = not created). */
+#endif
+#ifdef PSARC_WITH_LZ4
+    void *lz4_state;                /**< State of the lz4 fast compressor (NULL = not allocated). */
+    void *lz4_hc_state;             /**< State of the lz4 high compression compressor (NULL = not allocated). */
+#endif
+    const uint8_t *dictionary;      /**< Preset dictionary for zlib (not owned, NULL = none). */
+    size_t dictionary_size;         /**< Size of the preset dictionary. */
+} CODER;
+
+/**
+ * Allocates a new coder. Streams are initialized on first use.
+ *
+ * @return              A pointer to the new coder, or NULL if memory allocation fails.
+ */
+CODER *coder_new();
+
+/**
+ * Frees a coder and all of its streams.
+ *
+ * The signature allows using it as the destructor of thread local data.
+ *
+ * @param coder         Pointer to the coder to free (can be NULL).
+ */
+void coder_free(void *coder);
+
+/**
+ * Sets the preset dictionary of a coder.
+ *
+ * zlib blocks are compressed with the dictionary, and the blocks that need it are decompressed
+ * with it. The dictionary is not copied, it must outlive the coder.
+ *
+ * @param coder         The coder.
+ * @param dictionary    The dictionary (NULL = none).
+ * @param size          Size of the dictionary.
+ */
+void coder_set_dictionary(CODER *coder, const uint8_t *dictionary, size_t size);
+
+/**
+ * Checks if a compression type is supported by this build.
+ *
+ * @param type          Compression type (PSARC_*).
+ *
+ * @return              1 if it's supported, 0 otherwise.
+ */
+int coder_is_available(int type);
+
+/**
+ * Gets the name of a compression type, as stored in the archive header.
+ *
+ * @param type          Compression type (PSARC_*).
+ *
+ * @return              The name (up to 4 characters, zero-padded to 4 bytes). Stored archives are
+ *                      named "zlib".
+ */
+const char *coder_get_name(int type);
+
+/**
+ * Gets a compression type from its name in the archive header.
+ *
+ * @param name          The name (4 characters, not null terminated).
+ *
+ * @return              The compression type. Unknown names are taken as zlib.
+ */
+int coder_get_type(const char *name);
+
+/**
+ * Detects the compression of a block.
+ *
+ * zstd and lz4 blocks are told by the archive header: a block smaller than its data is
+ * compressed with the compression of the archive. The blocks of zlib and lzma archives are
+ * detected from their stream header, as an archive may mix both. zlib streams with a preset
+ * dictionary are only detected if the coder has one.
+ *
+ * @param coder             The coder that will decompress the block (can be NULL).
+ * @param compression_type  Compression type of the archive.
+ * @param block             The block data.
+ * @param size              Size of the block.
+ * @param data_size         Size of the decompressed block.
+ *
+ * @return                  The compression type of the block, PSARC_STORE if it's raw.
+ */
+int coder_get_block_type(const CODER *coder, int compression_type, const uint8_t *block, size_t size, size_t data_size);
+
+/**
+ * Compresses a block.
+ *
+ * @param coder         The coder.
+ * @param type          Compression type (PSARC_ZLIB, PSARC_LZMA, PSARC_ZSTD or PSARC_LZ4).
+ * @param level         Compression level.
+ * @param extreme       Extreme compression flag (LZMA, or long distance matching for zstd).
+ * @param in            Input data.
+ * @param in_size       Size of the input data.
+ * @param out           Output buffer.
+ * @param out_size      Size of the output buffer.
+ *
+ * @return              Size of the compressed data, or 0 on error or if it doesn't fit in the output buffer.
+ */
+size_t coder_compress(CODER *coder, int type, int level, int extreme, const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size);
+
+/**
+ * Decompresses a block.
+ *
+ * @param coder         The coder.
+ * @param type          Compression type (PSARC_ZLIB, PSARC_LZMA, PSARC_ZSTD or PSARC_LZ4).
+ * @param in            Compressed data.
+ * @param in_size       Size of the compressed data.
+ * @param out           Output buffer.
+ * @param out_size      Expected size of the decompressed data.
+ * @param decoded_size  Pointer to receive the size of the decompressed data (can be NULL).
+ *
+ * @return              0 on success, 1 on error.
+ */
+int coder_decompress(CODER *coder, int type, const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size, size_t *decoded_size);
+
+/**
+ * Decodes a block of an entry.
+ *
+ * The compression of the block is detected (see coder_get_block_type()), and the block is
+ * decompressed unless it's raw. What to do with raw blocks is left to the caller.
+ *
+ * @param coder             The coder.
+ * @param compression_type  Compression type of the archive.
+ * @param block             The block data.
+ * @param size              Size of the block.
+ * @param out               Output buffer.
+ * @param data_size         Expected size of the decompressed data.
+ * @param decoded_size      Pointer to receive the size of the decompressed data (can be NULL).
+ *
+ * @return                  0 on success, 1 on error, -1 if it isn't a compressed block.
+ */
+int coder_decode_block(CODER *coder, int compression_type, const uint8_t *block, size_t size, uint8_t *out, size_t data_size, size_t *decoded_size);
+
+/**
+ * Estimates the memory a coder takes to compress or decompress blocks.
+ *
+ * @param type          Compression type.
+ * @param level         Compression level (compression only).
+ * @param extreme       Extreme compression flag (compression only).
+ * @param block_size    Block size.
+ * @param decoder       0 for compression, 1 for decompression.
+ *
+ * @return              The estimated bytes.
+ */
+size_t coder_get_memory_usage(int type, int level, int extreme, size_t block_size, int decoder);
+
+#endif
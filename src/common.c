@@ -33,11 +33,16 @@
  * @date September 2023
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
 #include "common.h"
 #include "psarc.h"
+#include "md5.h"
+#include "stats.h"
+
+#define DIGEST_LANES    64          // Names hashed in each call to md5_multi()
 
 // Global variables
 
@@ -45,14 +50,26 @@ CONFIG _Config = {
     .archive_file = NULL,                   // Archive name (input/output)
     .compression_level = 5,                 // Compression level (default for zlib)
     .extreme_compression_flag = 0,          // Extreme compression flag for LZMA
+    .adaptive_flag = 0,                     // Don't compress blocks that aren't worth it
+    .dictionary_flag = 0,                   // Compress with a preset dictionary trained from the small files
+    .checksum_flag = 0,                     // Store the CRC32C of each file
     .overwrite_flag = 0,                    // Overwrite flag
     .verbose_flag = 0,                      // Verbose flag
+    .stats_flag = 0,                        // Print the timing breakdown of the hot paths
+    .progress_flag = 0,                     // Print the overall progress instead of each file
     .recursive_flag = 0,                    // Recursive flag
     .source_dir = NULL,                     // Source directory
     .target_dir = NULL,                     // Target directory
     .trim_path_flag = 0,                    // Remove path from path file name flag
     .skip_existing_files_flag = 0,          // Skip existing files flag
     .num_threads = 0,                       // Number of threads
+    .reorder_window = 0,                    // Blocks in flight between workers and writer (0 = auto)
+    .memory_limit = 0,                      // Memory for the buffers and coders (0 = no limit)
+    .range_offset = 0,                      // Offset of the range to extract from each file
+    .range_size = 0,                        // Size of the range to extract from each file (0 = up to the end)
+    .dedup_flag = 0,                        // Store identical files only once
+    .stream_flag = 0,                       // Add files to the archive as they're found
+    .files_from = NULL,                     // File with the list of files to add ("-" for stdin)
     .output_format = STANDARD_FORMAT,       // Output format for information
 };
 
@@ -86,6 +103,122 @@ char *lcase(char *s) {
     return so; // Return the lowercase string (the caller is responsible for freeing its memory)
 }
 
+/**
+ * Calculates the digest of an entry name, as stored in the TOC.
+ *
+ * The digest is the MD5 of the name as it appears in the manifest. In case-insensitive archives
+ * the name is hashed in uppercase.
+ *
+ * @param name              The entry name.
+ * @param len               Length of the name.
+ * @param digest            Buffer to receive the digest (16 bytes).
+ *
+ * @return                  0 on success, 1 on error.
+ */
+
+int get_name_digest(const char *name, size_t len, uint8_t *digest) {
+    uint64_t start = STATS_BEGIN();
+    int ret;
+
+    if ( !( _ArchiveInfo.archive_flags & AF_ICASE ) ) {
+        ret = md5((uint8_t *)name, len, digest) != 0;
+    } else {
+        char *uname = malloc(len + 1);
+        if (!uname) return 1;
+        for (size_t i = 0; i < len; i++) uname[i] = toupper((unsigned char)name[i]);
+        uname[len] = '\0';
+
+        ret = md5((uint8_t *)uname, len, digest) != 0;
+        free(uname);
+    }
+
+    STATS_END(STATS_DIGEST, start, len);
+
+    return ret;
+}
+
+/**
+ * Calculates the digests of a batch of entry names, as stored in the TOC.
+ *
+ * The names are hashed several at a time (see md5_multi()). Only case-insensitive archives need
+ * memory, for the uppercase copy of the names.
+ *
+ * @param names             The entry names.
+ * @param num_names         Number of names.
+ * @param fi                The entries that receive the digests (one per name).
+ *
+ * @return                  0 on success, 1 on error.
+ */
+
+int get_name_digests(char **names, size_t num_names, FILEINFO *fi) {
+    const uint8_t *msgs[DIGEST_LANES];
+    size_t lens[DIGEST_LANES];
+    uint8_t *digests[DIGEST_LANES];
+
+    char *unames = NULL;
+    size_t unames_size = 0;
+    size_t names_size = 0;
+
+    uint64_t start = STATS_BEGIN();
+
+    for (size_t first = 0; first < num_names; first += DIGEST_LANES) {
+        size_t count = num_names - first < DIGEST_LANES ? num_names - first : DIGEST_LANES;
+        size_t total = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            msgs[i] = (uint8_t *)names[first + i];
+            lens[i] = strlen(names[first + i]);
+            digests[i] = fi[first + i].name_digest;
+            total += lens[i];
+        }
+
+        names_size += total;
+
+        if ( _ArchiveInfo.archive_flags & AF_ICASE ) {
+            if (total > unames_size) {
+                char *p = realloc(unames, total);
+                if (!p && total) {
+                    free(unames);
+                    return 1;
+                }
+                unames = p;
+                unames_size = total;
+            }
+
+            size_t pos = 0;
+            for (size_t i = 0; i < count; i++) {
+                for (size_t j = 0; j < lens[i]; j++) unames[pos + j] = toupper((unsigned char)names[first + i][j]);
+                msgs[i] = (uint8_t *)unames + pos;
+                pos += lens[i];
+            }
+        }
+
+        md5_multi(msgs, lens, count, digests);
+    }
+
+    free(unames);
+
+    STATS_END(STATS_DIGEST, start, names_size);
+
+    return 0;
+}
+
+/**
+ * Get the size of the block type based on a block size.
+ *
+ * @param block_size    The block size of the archive.
+ *
+ * @return              The size of the block type (1, 2, 3, or 4) or -1 for an invalid block size.
+ */
+
+int get_blocktable_item_size_of(uint64_t block_size) {
+    if (block_size <= 0x100) return 1;          // 1 byte block size
+    if (block_size <= 0x10000) return 2;        // 2 bytes block size
+    if (block_size <= 0x1000000) return 3;      // 3 bytes block size
+    if (block_size <= 0x100000000ULL) return 4; // 4 bytes block size
+    return -1; // Invalid block size
+}
+
 /**
  * Get the size of the block type based on the block size.
  *
@@ -93,11 +226,66 @@ char *lcase(char *s) {
  */
 
 int get_blocktable_item_size() {
-    if (_ArchiveInfo.block_size <= 0x100) return 1;          // 1 byte block size
-    if (_ArchiveInfo.block_size <= 0x10000) return 2;        // 2 bytes block size
-    if (_ArchiveInfo.block_size <= 0x1000000) return 3;      // 3 bytes block size
-    if (_ArchiveInfo.block_size <= 0x100000000ULL) return 4; // 4 bytes block size
-    return -1; // Invalid block size
+    return get_blocktable_item_size_of(_ArchiveInfo.block_size);
+}
+
+/**
+ * Get the number of tasks in flight for the threads pool.
+ *
+ * This is the reorder window between the workers and the writer. By default it's twice the
+ * number of threads, so a slow block doesn't stall the rest of the workers.
+ *
+ * @return              The number of slots for the threads pool.
+ */
+
+int get_reorder_window() {
+    if (_Config.reorder_window > 0) {
+        return _Config.reorder_window < _Config.num_threads ? _Config.num_threads : _Config.reorder_window;
+    }
+    return _Config.num_threads * 2;
+}
+
+/**
+ * Fits the threads pool in the memory limit (see --memory-limit).
+ *
+ * The reorder window shrinks first, down to one block per worker, and then the number of workers.
+ * If not even one worker fits, the work is done without threads. Updates _Config.num_threads and
+ * _Config.reorder_window.
+ *
+ * @param slot_size     Memory of each task in flight (its buffers).
+ * @param worker_size   Memory of each worker (its coder), and of the main thread without threads.
+ * @param fixed_size    Memory used in any case.
+ *
+ * @return              0 on success, 1 if not even the work without threads fits.
+ */
+
+int fit_memory_limit(size_t slot_size, size_t worker_size, size_t fixed_size) {
+    if (!_Config.memory_limit) return 0;
+
+    uint64_t limit = _Config.memory_limit;
+    if ((uint64_t)fixed_size + worker_size > limit) return 1;
+
+    if (_Config.num_threads <= 0) return 0;
+
+    uint64_t available = limit - fixed_size;
+    uint64_t window = get_reorder_window();
+    int threads = _Config.num_threads;
+
+    for (; threads > 0; threads--) {
+        uint64_t workers_size = (uint64_t)threads * worker_size;
+        if (workers_size > available) continue;
+
+        uint64_t slots = slot_size ? ( available - workers_size ) / slot_size : window;
+        if (slots < (uint64_t)threads) continue;
+
+        if (slots < window) window = slots;
+        break;
+    }
+
+    _Config.num_threads = threads;
+    if (threads > 0) _Config.reorder_window = (int)window;
+
+    return 0;
 }
 
 /**
@@ -69,6 +69,8 @@ typedef struct {
                                     // 0 = relative paths (default)
                                     // 1 = ignore case in paths
                                     // 2 = absolute paths
+                                    // 0x40000000 = preset dictionary
+                                    // 0x80000000 = checksums
 } ARCHIVEINFO;
 
 // Structure to store information about a file in the entry table
@@ -80,20 +82,34 @@ typedef struct {
     uint32_t num_blocks;                    // Blocks used for this file
     size_t compressed_size;                 // Size of the file when compressed
     uint64_t uncompressed_size;             // Size of the file when uncompressed
+    uint32_t duplicate_of;                  // Entry with the same data, shared with this one (0 = none)
+    uint32_t checksum;                      // CRC32C of the data (archives with AF_CHECKSUMS)
 } FILEINFO;
 
 typedef struct {
     char *archive_file;                     // Archive name (input/output)
     int compression_level;                  // Compression level
     int extreme_compression_flag;           // Extreme compression flag for LZMA
+    int adaptive_flag;                      // Don't compress blocks that aren't worth it
+    int dictionary_flag;                    // Compress with a preset dictionary trained from the small files
+    int checksum_flag;                      // Store the CRC32C of each file
     int overwrite_flag;                     // Overwrite flag
     int verbose_flag;                       // Verbose flag
+    int stats_flag;                         // Print the timing breakdown of the hot paths
+    int progress_flag;                      // Print the overall progress instead of each file
     int recursive_flag;                     // Recursive flag
     char *source_dir;                       // Source directory
     char *target_dir;                       // Target directory
     int trim_path_flag;                     // Remove path from path file name flag
     int skip_existing_files_flag;           // Skip existing files flag
     int num_threads;                        // Number of threads
+    int reorder_window;                     // Blocks in flight between workers and writer (0 = auto)
+    uint64_t memory_limit;                  // Memory for the buffers and coders (0 = no limit)
+    uint64_t range_offset;                  // Offset of the range to extract from each file
+    uint64_t range_size;                    // Size of the range to extract from each file (0 = up to the end)
+    int dedup_flag;                         // Store identical files only once
+    int stream_flag;                        // Add files to the archive as they're found
+    char *files_from;                       // File with the list of files to add ("-" for stdin)
     enum FORMAT_VALUE_ENUM output_format;   // Output format for information
 } CONFIG;
 
@@ -101,8 +117,38 @@ extern ARCHIVEINFO _ArchiveInfo;        // Archive information
 extern CONFIG _Config;                  // config options
 
 int get_blocktable_item_size();         // Retrieve the size of a single item in the block table based on the block size.
+int get_blocktable_item_size_of(uint64_t block_size); // Retrieve the size of a single item in the block table for a block size.
+int get_reorder_window();               // Retrieve the number of tasks in flight for the threads pool.
+int fit_memory_limit(size_t slot_size, size_t worker_size, size_t fixed_size); // Fit the threads pool in the memory limit.
 char *lcase(char *s);
 
+/**
+ * Calculates the digest of an entry name, as stored in the TOC.
+ *
+ * The digest is the MD5 of the name as it appears in the manifest. In case-insensitive archives
+ * the name is hashed in uppercase.
+ *
+ * @param name              The entry name.
+ * @param len               Length of the name.
+ * @param digest            Buffer to receive the digest (16 bytes).
+ *
+ * @return                  0 on success, 1 on error.
+ */
+
+int get_name_digest(const char *name, size_t len, uint8_t *digest);
+
+/**
+ * Calculates the digests of a batch of entry names, as stored in the TOC.
+ *
+ * @param names             The entry names.
+ * @param num_names         Number of names.
+ * @param fi                The entries that receive the digests (one per name).
+ *
+ * @return                  0 on success, 1 on error.
+ */
+
+int get_name_digests(char **names, size_t num_names, FILEINFO *fi);
+
 /**
  * Calculates the compressed size of a file within the PSARC archive.
  *
@@ -0,0 +1,231 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file crc32c.c
+ * @brief CRC32C (Castagnoli) checksums for the PSARc project.
+ *
+ * This file implements the CRC32C of the entries. It uses the SSE4.2 or ARMv8 CRC32 instructions
+ * when the CPU has them, and a slicing-by-8 table otherwise.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if ( defined(__x86_64__) || defined(__i386__) ) && ( defined(__GNUC__) || defined(__clang__) )
+#include <nmmintrin.h>
+#define CRC32C_SSE42                            // Checked at runtime, SSE4.2 isn't part of the base ISA
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM
+#endif
+
+#include "crc32c.h"
+#include "stats.h"
+
+#define CRC32C_POLY     0x82f63b78              // Castagnoli polynomial (reversed)
+
+static uint32_t crc32c_table[8][256];           // Slicing-by-8 tables
+static uint32_t x2n_table[32];                  // x^(2^n) modulo the polynomial, for crc32c_combine()
+static int hardware = 0;                        // The CPU has CRC32 instructions
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Multiplies two polynomials modulo the CRC32C polynomial.
+ *
+ * @param a             The first polynomial (bit 31 is x^0).
+ * @param b             The second polynomial (bit 31 is x^0).
+ *
+ * @return              The product, reduced.
+ */
+
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+/**
+ * Builds the tables, once for all the threads.
+ */
+
+static void crc32c_init() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = crc32c_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+
+    uint32_t p = (uint32_t)1 << 30; // x^1
+    x2n_table[0] = p;
+    for (int n = 1; n < 32; n++) x2n_table[n] = p = multmodp(p, p);
+
+#if defined(CRC32C_SSE42)
+    hardware = __builtin_cpu_supports("sse4.2");
+#elif defined(CRC32C_ARM)
+    hardware = 1;
+#endif
+}
+
+#if defined(CRC32C_SSE42)
+/**
+ * Updates a CRC32C (without the final inversion) with the SSE4.2 CRC32 instruction.
+ */
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const uint8_t *data, size_t size) {
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for (; size >= 4; data += 4, size -= 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+    }
+    while (size--) crc = _mm_crc32_u8(crc, *data++);
+
+    return crc;
+}
+#elif defined(CRC32C_ARM)
+/**
+ * Updates a CRC32C (without the final inversion) with the ARMv8 CRC32 instructions.
+ */
+
+static uint32_t crc32c_hardware(uint32_t crc, const uint8_t *data, size_t size) {
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    while (size--) crc = __crc32cb(crc, *data++);
+
+    return crc;
+}
+#endif
+
+/**
+ * Updates a CRC32C with more data, with the CRC32 instructions or the tables.
+ *
+ * @param crc           The CRC32C of the previous data (0 to start).
+ * @param data          The data.
+ * @param size          Size of the data.
+ *
+ * @return              The CRC32C of the previous data followed by this data.
+ */
+
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *data, size_t size) {
+    pthread_once(&tables_once, crc32c_init);
+
+    crc = ~crc;
+
+#if defined(CRC32C_SSE42) || defined(CRC32C_ARM)
+    if (hardware) return ~crc32c_hardware(crc, data, size);
+#endif
+
+    // The words are read little endian, as the table works on the low byte first
+    for (; size >= 8; data += 8, size -= 8) {
+        uint32_t lo = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        uint32_t hi = (uint32_t)data[4] | (uint32_t)data[5] << 8 | (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    }
+    while (size--) crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+/**
+ * Updates a CRC32C with more data.
+ *
+ * @param crc           The CRC32C of the previous data (0 to start).
+ * @param data          The data.
+ * @param size          Size of the data.
+ *
+ * @return              The CRC32C of the previous data followed by this data.
+ */
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t size) {
+    uint64_t start = STATS_BEGIN();
+
+    crc = crc32c_update(crc, data, size);
+
+    STATS_END(STATS_CHECKSUM, start, size);
+
+    return crc;
+}
+
+/**
+ * Combines the CRC32Cs of two consecutive pieces of data.
+ *
+ * The CRC of the first piece is shifted over the size of the second one, multiplying it by
+ * x^(8 * size2), and added to the CRC of the second piece.
+ *
+ * @param crc1          The CRC32C of the first piece.
+ * @param crc2          The CRC32C of the second piece.
+ * @param size2         Size of the second piece.
+ *
+ * @return              The CRC32C of the two pieces, one after the other.
+ */
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t size2) {
+    pthread_once(&tables_once, crc32c_init);
+
+    // x^(8 * size2), from the powers x^(2^k) of the bits of size2 (starting at 2^3 = 8)
+    uint32_t p = (uint32_t)1 << 31; // x^0
+    for (unsigned k = 3; size2; size2 >>= 1, k++) {
+        if (size2 & 1) p = multmodp(x2n_table[k & 31], p);
+    }
+
+    return multmodp(p, crc1) ^ crc2;
+}
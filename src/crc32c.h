@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file crc32c.h
+ * @brief CRC32C (Castagnoli) checksums for the PSARc project.
+ *
+ * This file declares the functions that calculate the checksums of the entries (see
+ * AF_CHECKSUMS), using the CRC32 instructions of the CPU where available.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#ifndef __CRC32C_H
+#define __CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Updates a CRC32C with more data.
+ *
+ * @param crc           The CRC32C of the previous data (0 to start).
+ * @param data          The data.
+ * @param size          Size of the data.
+ *
+ * @return              The CRC32C of the previous data followed by this data.
+ */
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t size);
+
+/**
+ * Combines the CRC32Cs of two consecutive pieces of data.
+ *
+ * This way the pieces can be checksummed separately (and in parallel) and combined in order.
+ *
+ * @param crc1          The CRC32C of the first piece.
+ * @param crc2          The CRC32C of the second piece.
+ * @param size2         Size of the second piece.
+ *
+ * @return              The CRC32C of the two pieces, one after the other.
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+
+#endif /* __CRC32C_H */
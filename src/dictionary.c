@@ -0,0 +1,190 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file dictionary.c
+ * @brief Preset dictionary training for the PSARc project.
+ *
+ * This file builds a preset dictionary from a sample of the files being added. The samples are
+ * split in epochs, and the segment of each epoch with the most substrings shared by other samples
+ * goes to the dictionary (a simplified version of the COVER algorithm).
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dictionary.h"
+
+#define DMER_SIZE       8                       // Size of the substrings counted
+#define SEGMENT_SIZE    256                     // Size of the segments taken from the samples
+#define HASH_BITS       20                      // Size of the counters tables (log2)
+#define EPOCH_MIN_SEGMENTS  4                   // Min size of an epoch, in segments
+
+// Segment of the samples chosen for the dictionary
+typedef struct {
+    size_t offset;                              // Offset in the samples
+    uint64_t score;                             // Samples sharing its substrings
+} SEGMENT;
+
+/**
+ * Hashes the substring at the given position.
+ *
+ * @param data          Pointer to the substring (DMER_SIZE bytes).
+ *
+ * @return              The hash (HASH_BITS bits).
+ */
+
+static uint32_t dmer_hash(const uint8_t *data) {
+    uint64_t v;
+    memcpy(&v, data, sizeof(v));
+    return (uint32_t)((v * 0x9E3779B185EBCA87ULL) >> (64 - HASH_BITS));
+}
+
+/**
+ * Compares two segments by score, then by offset (qsort callback).
+ */
+
+static int segment_cmp(const void *a, const void *b) {
+    const SEGMENT *sa = (const SEGMENT *)a;
+    const SEGMENT *sb = (const SEGMENT *)b;
+
+    if (sa->score != sb->score) return sa->score < sb->score ? -1 : 1;
+    return sa->offset < sb->offset ? -1 : sa->offset > sb->offset;
+}
+
+/**
+ * Trains a preset dictionary from a set of samples.
+ *
+ * The dictionary is made of the segments of the samples whose substrings are shared by most
+ * samples. The most useful segments are placed at the end, where the matches are closer.
+ *
+ * @param samples           The samples, one after the other.
+ * @param sample_sizes      Size of each sample.
+ * @param num_samples       Number of samples.
+ * @param dictionary        Buffer for the dictionary.
+ * @param dictionary_size   Size of the buffer.
+ *
+ * @return                  Size of the dictionary, or 0 if there's nothing worth sharing (or not
+ *                          enough memory).
+ */
+
+size_t dictionary_train(const uint8_t *samples, const size_t *sample_sizes, size_t num_samples, uint8_t *dictionary, size_t dictionary_size) {
+    size_t total_size = 0;
+    for (size_t i = 0; i < num_samples; i++) total_size += sample_sizes[i];
+
+    size_t max_segments = dictionary_size / SEGMENT_SIZE;
+    if (num_samples < 2 || !max_segments || total_size < SEGMENT_SIZE * 2) return 0;
+
+    // Samples containing each substring, and the last sample that counted it
+    uint32_t *freqs = (uint32_t *)calloc((size_t)1 << HASH_BITS, sizeof(uint32_t));
+    uint32_t *marks = (uint32_t *)calloc((size_t)1 << HASH_BITS, sizeof(uint32_t));
+    SEGMENT *segments = (SEGMENT *)malloc(max_segments * sizeof(SEGMENT));
+    if (!freqs || !marks || !segments) {
+        free(freqs);
+        free(marks);
+        free(segments);
+        return 0;
+    }
+
+    size_t offset = 0;
+    for (size_t i = 0; i < num_samples; i++) {
+        for (size_t pos = 0; pos + DMER_SIZE <= sample_sizes[i]; pos++) {
+            uint32_t h = dmer_hash(samples + offset + pos);
+            if (marks[h] != i + 1) {
+                marks[h] = i + 1;
+                freqs[h]++;
+            }
+        }
+        offset += sample_sizes[i];
+    }
+
+    // A substring found in a single sample isn't shared
+    for (size_t h = 0; h < (size_t)1 << HASH_BITS; h++) {
+        if (freqs[h] < 2) freqs[h] = 0;
+        marks[h] = 0;
+    }
+
+    // The best segment of each epoch is chosen, marks count the substrings in the window.
+    // With few samples there are fewer epochs, each one long enough to choose from
+    size_t epoch_size = total_size / max_segments;
+    if (epoch_size < SEGMENT_SIZE * EPOCH_MIN_SEGMENTS) epoch_size = SEGMENT_SIZE * EPOCH_MIN_SEGMENTS;
+
+    size_t window_dmers = SEGMENT_SIZE - DMER_SIZE + 1;
+    size_t num_segments = 0;
+
+    for (size_t begin = 0; begin + SEGMENT_SIZE <= total_size && num_segments < max_segments; begin += epoch_size) {
+        size_t end = begin + epoch_size > total_size ? total_size : begin + epoch_size;
+
+        uint64_t score = 0;
+        uint64_t best_score = 0;
+        size_t best_offset = 0;
+
+        for (size_t pos = begin; pos + DMER_SIZE <= end; pos++) {
+            // Distinct substrings of the window count once
+            uint32_t h = dmer_hash(samples + pos);
+            if (!marks[h]++) score += freqs[h];
+
+            if (pos >= begin + window_dmers) {
+                uint32_t old = dmer_hash(samples + pos - window_dmers);
+                if (!--marks[old]) score -= freqs[old];
+            }
+
+            if (pos + 1 >= begin + window_dmers && score > best_score) {
+                best_score = score;
+                best_offset = pos + 1 - window_dmers;
+            }
+        }
+
+        // Clear the window counters
+        size_t last = end >= DMER_SIZE ? end - DMER_SIZE + 1 : begin;
+        for (size_t pos = last > begin + window_dmers ? last - window_dmers : begin; pos < last; pos++) marks[dmer_hash(samples + pos)] = 0;
+
+        if (!best_score) continue;
+
+        // The substrings taken don't count again for the next segments
+        for (size_t pos = best_offset; pos < best_offset + window_dmers; pos++) freqs[dmer_hash(samples + pos)] = 0;
+
+        segments[num_segments].offset = best_offset;
+        segments[num_segments].score = best_score;
+        num_segments++;
+    }
+
+    // The best segments go last
+    qsort(segments, num_segments, sizeof(SEGMENT), segment_cmp);
+
+    size_t size = 0;
+    for (size_t i = 0; i < num_segments; i++) {
+        memcpy(dictionary + size, samples + segments[i].offset, SEGMENT_SIZE);
+        size += SEGMENT_SIZE;
+    }
+
+    free(freqs);
+    free(marks);
+    free(segments);
+
+    return size;
+}
@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file dictionary.h
+ * @brief Preset dictionary training for the PSARc project.
+ *
+ * This file declares the function that builds a preset dictionary from a sample of the files
+ * being added, so small files can reference the content they share with their siblings.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#ifndef __DICTIONARY_H
+#define __DICTIONARY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Trains a preset dictionary from a set of samples.
+ *
+ * The dictionary is made of the segments of the samples whose substrings are shared by most
+ * samples. The most useful segments are placed at the end, where the matches are closer.
+ *
+ * @param samples           The samples, one after the other.
+ * @param sample_sizes      Size of each sample.
+ * @param num_samples       Number of samples.
+ * @param dictionary        Buffer for the dictionary.
+ * @param dictionary_size   Size of the buffer.
+ *
+ * @return                  Size of the dictionary, or 0 if there's nothing worth sharing (or not
+ *                          enough memory).
+ */
+size_t dictionary_train(const uint8_t *samples, const size_t *sample_sizes, size_t num_samples, uint8_t *dictionary, size_t dictionary_size);
+
+#endif /* __DICTIONARY_H */
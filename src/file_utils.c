@@ -35,6 +35,10 @@
  * @date September 2023
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,17 +48,26 @@
 #ifdef _WIN32
 #include <windows.h>
 #include <direct.h>
+#include <io.h>
 #define stat _stat
 #define mkdir(path, mode) _mkdir(path)
 #define snprintf _snprintf
 #else
 #include <glob.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include <errno.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
 #endif
 
 #include "file_utils.h"
+#include "stats.h"
 
 #ifdef _WIN32
 typedef struct {
@@ -327,18 +340,62 @@ void rm_dot_dir_from_path(char *path) {
  *
  * @param list           Pointer to the FILELIST structure to initialize.
  * @param initialCapacity The initial capacity for the list of files.
- * @param hashSize       The initial capacity for the associated HASHSET.
+ * @param hashSize       The initial capacity for the associated HASHSET (it grows as needed).
  */
 
 void filelist_init(FILELIST *list, size_t initialCapacity, size_t hashSize) {
     list->files = (char **)malloc(initialCapacity * sizeof(char *));
     list->count = 0;
     list->capacity = initialCapacity;
+    list->callback = NULL;
+    list->num_walkers = 0;
+    arena_init(&list->arena, 0);
 
     // Initialize the HASHSET with the specified size
     list->set = hashset_init(hashSize);
 }
 
+/**
+ * Add a file to the file list, given its canonical path.
+ *
+ * @param list          Pointer to the FILELIST structure.
+ * @param filename      The filename (path) to add to the list.
+ * @param canonicalPath The canonical path of the file.
+ *
+ * @return              1 if the file was successfully added, 0 on error or if it already exists.
+ */
+
+static int filelist_add_canonical(FILELIST *list, char *filename, char *canonicalPath) {
+    // Check if the canonical path already exists in the set
+    if (!hashset_add(list->set, canonicalPath)) {
+        // The file with the same canonical path is already in the set, do not add it
+        return 0;
+    }
+
+    rm_dot_dir_from_path(filename);
+
+    // Files out of the current directory are added with the canonical path
+    const char *parentDir = strstr(filename, "../");
+    char *path = (parentDir == filename || (parentDir > filename && parentDir[-1] == '/')) ? canonicalPath : filename;
+
+    // The file is handed over instead of stored
+    if (list->callback) return list->callback(path);
+
+    // If the list is full, increase its capacity
+    if (list->count >= list->capacity) {
+        char **files = (char **)realloc(list->files, list->capacity * 2 * sizeof(char *));
+        if (!files) return 0;
+        list->files = files;
+        list->capacity *= 2;
+    }
+
+    list->files[list->count] = arena_strndup(&list->arena, path, strlen(path));
+    if (!list->files[list->count]) return 0;
+
+    list->count++;
+    return 1; // Indicates that the file was added
+}
+
 /**
  * Add a file to the file list while ensuring uniqueness based on canonical paths.
  *
@@ -359,31 +416,96 @@ int filelist_add(FILELIST *list, char *filename) {
         return 0;
     }
 
-    // Check if the canonical path already exists in the set
-    if (!hashset_add(list->set, canonicalPath)) {
-        // The file with the same canonical path is already in the set, do not add it
-        free(canonicalPath);
-        return 0;
-    }
+    int ret = filelist_add_canonical(list, filename, canonicalPath);
+    free(canonicalPath);
+    return ret;
+}
 
-    // If the list is full, increase its capacity
-    if (list->count >= list->capacity) {
-        list->capacity *= 2;
-        list->files = (char **)realloc(list->files, list->capacity * sizeof(char *));
-    }
+/**
+ * Sets a function that receives the files as they're added, instead of storing them in the list.
+ *
+ * The list still filters out duplicate entries, only new files are passed to the callback.
+ *
+ * @param list      Pointer to the FILELIST structure.
+ * @param callback  Function that receives each file path (returns 1 if the file was added, 0 on error).
+ */
 
-    rm_dot_dir_from_path(filename);
+void filelist_set_callback(FILELIST *list, int (*callback)(char *filename)) {
+    list->callback = callback;
+}
 
-    // Add the canonical path to the list
-    const char *parentDir = strstr(filename, "../");
-    if (parentDir == filename || (parentDir > filename && parentDir[-1] == '/')) {
-        list->files[list->count] = strdup(canonicalPath);
-    } else {
-        list->files[list->count] = strdup(filename);
-        free(canonicalPath);
+/**
+ * Sets the number of threads that read directories for a recursive listing.
+ *
+ * @param list          Pointer to the FILELIST structure.
+ * @param num_walkers   Number of threads (0 = directories are read as they're listed).
+ */
+
+void filelist_set_walkers(FILELIST *list, int num_walkers) {
+    list->num_walkers = num_walkers > 0 ? num_walkers : 0;
+}
+
+/**
+ * Adds the files listed in a text file, one path per line.
+ *
+ * Paths are taken literally (they aren't expanded as patterns). Directories are only added with
+ * FLAG_RECURSIVE, and paths that don't exist are ignored, as with process_pattern().
+ *
+ * @param list      Pointer to the FILELIST structure.
+ * @param fp        The text file (it can be stdin).
+ * @param flags     Flags to control the processing, e.g., FLAG_RECURSIVE for recursive listing.
+ *
+ * @return          0 if successful, -1 on error.
+ */
+
+int filelist_add_from_file(FILELIST *list, FILE *fp, uint16_t flags) {
+    size_t size = 4096;
+    size_t len = 0;
+    char *line = malloc(size);
+    if (!line) return -1;
+
+    for (;;) {
+        int eof = !fgets(line + len, size - len, fp);
+        if (eof && !len) break;
+
+        if (!eof) len += strlen(line + len);
+
+        // Long line, read the rest of it
+        if (!eof && len == size - 1 && line[len - 1] != '\n') {
+            char *p = realloc(line, size * 2);
+            if (!p) {
+                free(line);
+                return -1;
+            }
+            line = p;
+            size *= 2;
+            continue;
+        }
+
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+
+        struct stat info;
+        if (len && stat(line, &info) == 0) {
+            if (S_ISDIR(info.st_mode)) {
+                if ( flags & FLAG_RECURSIVE ) {
+                    // Directories are walked with a trailing slash
+                    char dpath[PATH_MAX];
+                    snprintf(dpath, sizeof(dpath), "%s%s", line, line[len - 1] == '/' ? "" : "/");
+                    list_files_recursively(dpath, list, flags);
+                }
+            } else if (S_ISREG(info.st_mode)) {
+                filelist_add(list, line);
+            }
+        }
+
+        len = 0;
+
+        if (eof) break;
     }
-    list->count++;
-    return 1; // Indicates that the file was added
+
+    free(line);
+
+    return ferror(fp) ? -1 : 0;
 }
 
 /**
@@ -393,9 +515,7 @@ int filelist_add(FILELIST *list, char *filename) {
  */
 
 void filelist_free(FILELIST *list) {
-    for (size_t i = 0; i < list->count; i++) {
-        free(list->files[i]);
-    }
+    arena_free(&list->arena);
     free(list->files);
     list->count = 0;
     list->capacity = 0;
@@ -407,9 +527,272 @@ void filelist_free(FILELIST *list) {
     }
 }
 
+#ifndef _WIN32
+#define WALK_PENDING    0
+#define WALK_READING    1
+#define WALK_DONE       2
+
+typedef struct WALKDIR WALKDIR;
+
+// Entry of a directory, in the order it was read
+typedef struct {
+    char *path;                 // Path of the entry (directories end with '/')
+    const char *name;           // Name of the entry, within path
+    WALKDIR *dir;               // The directory to list, NULL for files
+    int resolve;                // The entry is a link, its canonical path must be resolved
+} WALKENTRY;
+
+// Directory of a recursive listing
+struct WALKDIR {
+    char *path;                 // Path of the directory (ends with '/')
+    char *canonical;            // Canonical path of the directory (ends with '/'), NULL if unknown
+    WALKENTRY *entries;         // Entries of the directory
+    size_t num_entries;         // Number of entries
+    int state;                  // WALK_PENDING, WALK_READING or WALK_DONE
+    WALKDIR *next;              // Next directory to read
+};
+
+// Directories waiting to be read
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // Signaled when directories are queued or read
+    WALKDIR *head;
+    WALKDIR *tail;
+    int stop;
+} WALKER;
+
+// State of a thread that reads directories
+typedef struct {
+    WALKER *walker;
+    ARENA arena;                // Memory of the directories read by this thread
+    WALKENTRY *entries;         // Entries of the directory being read
+    size_t capacity;
+    char *canonical;            // Canonical path of the file being listed
+    size_t canonical_size;
+} WALKCONTEXT;
+
+/**
+ * Gets the type of a directory entry, without a stat call when the directory already tells it.
+ *
+ * @param fd                The file descriptor of the directory.
+ * @param entry             The directory entry.
+ * @param resolve           Set to 1 if the entry is a link.
+ *
+ * @return                  1 for directories, 0 for regular files, -1 for anything else.
+ */
+
+static int walk_entry_type(int fd, struct dirent *entry, int *resolve) {
+    struct stat info;
+
+    *resolve = 0;
+
+#ifdef DT_DIR
+    if (entry->d_type == DT_DIR) return 1;
+    if (entry->d_type == DT_REG) return 0;
+    if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) return -1;
+#endif
+
+    if (fstatat(fd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW)) return -1;
+
+    // Links are followed
+    if (S_ISLNK(info.st_mode)) {
+        *resolve = 1;
+        if (fstatat(fd, entry->d_name, &info, 0)) return -1;
+    }
+
+    return S_ISDIR(info.st_mode) ? 1 : S_ISREG(info.st_mode) ? 0 : -1;
+}
+
+/**
+ * Reads a directory, and queues its subdirectories to be read.
+ *
+ * @param dir               The directory (it must be claimed with WALK_READING).
+ * @param ctx               The state of the calling thread.
+ */
+
+static void walk_read(WALKDIR *dir, WALKCONTEXT *ctx) {
+    WALKER *walker = ctx->walker;
+    WALKDIR *subdirs = NULL, *last_subdir = NULL;
+    size_t num_entries = 0;
+    size_t path_len = strlen(dir->path);
+
+    uint64_t start = STATS_BEGIN();
+
+    int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d && fd >= 0) close(fd);
+
+    if (d) {
+        // The canonical path of the files is taken from the directory
+        char *real_dir = realpath(dir->path, NULL);
+        if (real_dir) {
+            size_t len = strlen(real_dir);
+            int add_slash = !len || real_dir[len - 1] != '/';
+            dir->canonical = arena_alloc(&ctx->arena, len + add_slash + 1);
+            if (dir->canonical) {
+                memcpy(dir->canonical, real_dir, len);
+                strcpy(dir->canonical + len, add_slash ? "/" : "");
+            }
+            free(real_dir);
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(d)) != NULL) {
+            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+
+            int resolve;
+            int is_dir = walk_entry_type(fd, entry, &resolve);
+            if (is_dir < 0) continue;
+
+            if (num_entries == ctx->capacity) {
+                size_t capacity = ctx->capacity ? ctx->capacity * 2 : 256;
+                WALKENTRY *entries = realloc(ctx->entries, capacity * sizeof(WALKENTRY));
+                if (!entries) break;
+                ctx->entries = entries;
+                ctx->capacity = capacity;
+            }
+
+            size_t name_len = strlen(entry->d_name);
+            char *path = arena_alloc(&ctx->arena, path_len + name_len + 2);
+            WALKDIR *subdir = is_dir ? arena_alloc(&ctx->arena, sizeof(WALKDIR)) : NULL;
+            if (!path || (is_dir && !subdir)) break;
+
+            memcpy(path, dir->path, path_len);
+            memcpy(path + path_len, entry->d_name, name_len);
+            strcpy(path + path_len + name_len, is_dir ? "/" : "");
+
+            if (subdir) {
+                memset(subdir, 0, sizeof(WALKDIR));
+                subdir->path = path;
+                if (last_subdir) last_subdir->next = subdir;
+                else             subdirs = subdir;
+                last_subdir = subdir;
+            }
+
+            ctx->entries[num_entries].path = path;
+            ctx->entries[num_entries].name = path + path_len;
+            ctx->entries[num_entries].dir = subdir;
+            ctx->entries[num_entries].resolve = resolve;
+            num_entries++;
+        }
+
+        closedir(d);
+    }
+
+    STATS_END(STATS_WALK, start, 0);
+
+    WALKENTRY *entries = num_entries ? arena_alloc(&ctx->arena, num_entries * sizeof(WALKENTRY)) : NULL;
+    if (entries) memcpy(entries, ctx->entries, num_entries * sizeof(WALKENTRY));
+
+    pthread_mutex_lock(&walker->mutex);
+
+    // Without memory for the entries, the subdirectories are never listed
+    if (entries && subdirs) {
+        if (walker->tail) walker->tail->next = subdirs;
+        else              walker->head = subdirs;
+        walker->tail = last_subdir;
+    }
+
+    dir->entries = entries;
+    dir->num_entries = entries ? num_entries : 0;
+    dir->state = WALK_DONE;
+
+    pthread_cond_broadcast(&walker->cond);
+    pthread_mutex_unlock(&walker->mutex);
+}
+
+/**
+ * Thread function that reads the queued directories ahead of the listing.
+ *
+ * @param arg               Pointer to the WALKCONTEXT structure of the thread.
+ */
+
+static void *walk_thread(void *arg) {
+    WALKCONTEXT *ctx = (WALKCONTEXT *)arg;
+    WALKER *walker = ctx->walker;
+
+    pthread_mutex_lock(&walker->mutex);
+    for (;;) {
+        while (!walker->stop && !walker->head) pthread_cond_wait(&walker->cond, &walker->mutex);
+        if (walker->stop) break;
+
+        WALKDIR *dir = walker->head;
+        walker->head = dir->next;
+        if (!walker->head) walker->tail = NULL;
+
+        // The listing could have got to it first
+        if (dir->state != WALK_PENDING) continue;
+        dir->state = WALK_READING;
+
+        pthread_mutex_unlock(&walker->mutex);
+        walk_read(dir, ctx);
+        pthread_mutex_lock(&walker->mutex);
+    }
+    pthread_mutex_unlock(&walker->mutex);
+
+    return NULL;
+}
+
+/**
+ * Adds the files of a directory and its subdirectories to the list, in the order they're read.
+ *
+ * If the directory isn't read yet, it's read by the calling thread.
+ *
+ * @param dir               The directory.
+ * @param ctx               The state of the calling thread.
+ * @param filelist          The FILELIST structure to store the file list.
+ */
+
+static void walk_list(WALKDIR *dir, WALKCONTEXT *ctx, FILELIST *filelist) {
+    WALKER *walker = ctx->walker;
+
+    pthread_mutex_lock(&walker->mutex);
+    if (dir->state == WALK_PENDING) {
+        dir->state = WALK_READING;
+        pthread_mutex_unlock(&walker->mutex);
+        walk_read(dir, ctx);
+        pthread_mutex_lock(&walker->mutex);
+    }
+    while (dir->state != WALK_DONE) pthread_cond_wait(&walker->cond, &walker->mutex);
+    pthread_mutex_unlock(&walker->mutex);
+
+    size_t canonical_len = dir->canonical ? strlen(dir->canonical) : 0;
+
+    for (size_t i = 0; i < dir->num_entries; i++) {
+        WALKENTRY *entry = &dir->entries[i];
+
+        if (entry->dir) {
+            walk_list(entry->dir, ctx, filelist);
+            continue;
+        }
+
+        if (entry->resolve || !dir->canonical) {
+            filelist_add(filelist, entry->path);
+            continue;
+        }
+
+        // No need to resolve the path of each file
+        size_t len = canonical_len + strlen(entry->name) + 1;
+        if (len > ctx->canonical_size) {
+            char *canonical = realloc(ctx->canonical, len);
+            if (!canonical) continue;
+            ctx->canonical = canonical;
+            ctx->canonical_size = len;
+        }
+        memcpy(ctx->canonical, dir->canonical, canonical_len);
+        strcpy(ctx->canonical + canonical_len, entry->name);
+
+        filelist_add_canonical(filelist, entry->path, ctx->canonical);
+    }
+}
+#endif
+
 /**
  * Recursively lists files in a directory and its subdirectories.
  *
+ * Where available, the directories are read ahead by filelist->num_walkers threads, while the
+ * files are added in the same order a sequential listing would give.
+ *
  * @param path              The path of the directory to open listing from.
  * @param filelist          The FILELIST structure to store the file list.
  */
@@ -441,28 +824,66 @@ void list_files_recursively(const char *path, FILELIST *filelist, uint16_t flags
 
     FindClose(hFind);
 #else
-    DIR *dir;
-    struct dirent *entry;
-    struct stat info;
+    WALKER walker;
+    int num_walkers = filelist->num_walkers;
+
+    WALKCONTEXT *ctx = calloc(num_walkers + 1, sizeof(WALKCONTEXT));
+    pthread_t *threads = num_walkers ? malloc(num_walkers * sizeof(pthread_t)) : NULL;
+    if (!ctx || (num_walkers && !threads)) {
+        free(ctx);
+        free(threads);
+        return;
+    }
 
-    if (!(dir = opendir(path))) return; // Error opening directory
+    pthread_mutex_init(&walker.mutex, NULL);
+    pthread_cond_init(&walker.cond, NULL);
+    walker.head = walker.tail = NULL;
+    walker.stop = 0;
 
-    while ((entry = readdir(dir)) != NULL) {
-        char fpath[PATH_MAX];
-        snprintf(fpath, sizeof(fpath), "%s%s", path, entry->d_name);
-        if (stat(fpath, &info) == 0) {
-            if (S_ISDIR(info.st_mode)) {
-                if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-                    strcat(fpath, "/");
-                    list_files_recursively(fpath, filelist, flags);
-                }
-            } else if (S_ISREG(info.st_mode)) {
-                filelist_add(filelist, fpath);
-            }
-        }
+    for (int i = 0; i <= num_walkers; i++) {
+        ctx[i].walker = &walker;
+        arena_init(&ctx[i].arena, 0);
     }
 
-    closedir(dir);
+    // The last context is for the listing
+    WALKCONTEXT *list_ctx = &ctx[num_walkers];
+
+    size_t path_len = strlen(path);
+    int add_slash = !path_len || path[path_len - 1] != '/';
+
+    WALKDIR *root = arena_alloc(&list_ctx->arena, sizeof(WALKDIR));
+    char *root_path = arena_alloc(&list_ctx->arena, path_len + add_slash + 1);
+
+    if (root && root_path) {
+        memset(root, 0, sizeof(WALKDIR));
+        memcpy(root_path, path, path_len);
+        strcpy(root_path + path_len, add_slash ? "/" : "");
+        root->path = root_path;
+
+        int started = 0;
+        while (started < num_walkers && !pthread_create(&threads[started], NULL, walk_thread, &ctx[started])) started++;
+
+        walk_list(root, list_ctx, filelist);
+
+        pthread_mutex_lock(&walker.mutex);
+        walker.stop = 1;
+        pthread_cond_broadcast(&walker.cond);
+        pthread_mutex_unlock(&walker.mutex);
+
+        for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i <= num_walkers; i++) {
+        arena_free(&ctx[i].arena);
+        free(ctx[i].entries);
+        free(ctx[i].canonical);
+    }
+
+    pthread_cond_destroy(&walker.cond);
+    pthread_mutex_destroy(&walker.mutex);
+
+    free(threads);
+    free(ctx);
 #endif
 }
 
@@ -704,3 +1125,174 @@ int process_pattern(char *pattern, FILELIST *filelist, uint16_t flags) {
 #endif
     return 0;
 }
+
+/**
+ * Copy a range of a file to the current position of an output file inside the kernel.
+ *
+ * On Linux, the data is moved with copy_file_range (or sendfile if it is not supported for the
+ * pair of files), so it never goes through user space. The input file position is not used nor
+ * modified.
+ *
+ * @param input_fd          The file descriptor of the input file.
+ * @param offset            The offset of the range in the input file.
+ * @param output_file       The output file.
+ * @param size              The size of the range.
+ *
+ * @return                  The number of bytes copied. If it's less than size, the kernel copy is
+ *                          not supported or failed, and the caller must copy the rest.
+ */
+
+uint64_t file_copy_range(int input_fd, uint64_t offset, FILE *output_file, uint64_t size) {
+    uint64_t copied = 0;
+
+#ifdef __linux__
+    if (input_fd < 0 || fflush(output_file)) return 0;
+
+    int output_fd = fileno(output_file);
+    loff_t off_in = offset;
+    int use_sendfile = 0;
+
+    while (copied < size) {
+        size_t len = size - copied > 0x40000000 ? 0x40000000 : size - copied;
+        ssize_t n;
+
+        if (!use_sendfile) {
+            n = copy_file_range(input_fd, &off_in, output_fd, NULL, len, 0);
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+                use_sendfile = 1;
+                continue;
+            }
+        } else {
+            off_t off = off_in;
+            n = sendfile(output_fd, input_fd, &off, len);
+            if (n > 0) off_in = off;
+        }
+
+        if (n <= 0) break;
+
+        copied += n;
+    }
+
+    // Resync the stream with the file descriptor position
+    if (copied) fseek(output_file, 0, SEEK_CUR);
+#endif
+
+    return copied;
+}
+
+/**
+ * Read from a file at an offset, without using nor modifying its position.
+ *
+ * Several threads can read from the same file descriptor at once.
+ *
+ * @param fd                The file descriptor.
+ * @param buffer            Buffer for the data.
+ * @param size              The number of bytes to read.
+ * @param offset            The offset in the file.
+ *
+ * @return                  0 on success, 1 on error or if the file ends before.
+ */
+
+int file_read_at(int fd, void *buffer, size_t size, uint64_t offset) {
+    size_t total = 0;
+
+    while (total < size) {
+#ifdef _WIN32
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)(offset + total);
+        overlapped.OffsetHigh = (DWORD)((offset + total) >> 32);
+
+        DWORD len = size - total > 0x40000000 ? 0x40000000 : (DWORD)(size - total);
+        DWORD n;
+        if (!ReadFile((HANDLE)_get_osfhandle(fd), (uint8_t *)buffer + total, len, &n, &overlapped)) return 1;
+#else
+        ssize_t n = pread(fd, (uint8_t *)buffer + total, size - total, offset + total);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+#endif
+        if (!n) return 1;
+        total += n;
+    }
+
+    return 0;
+}
+
+/**
+ * Write to a file at an offset, without using nor modifying its position.
+ *
+ * Several threads can write different ranges of the same file descriptor at once.
+ *
+ * @param fd                The file descriptor.
+ * @param data              The data.
+ * @param size              The number of bytes to write.
+ * @param offset            The offset in the file.
+ *
+ * @return                  0 on success, 1 on error.
+ */
+
+int file_write_at(int fd, const void *data, size_t size, uint64_t offset) {
+    size_t total = 0;
+
+    while (total < size) {
+#ifdef _WIN32
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)(offset + total);
+        overlapped.OffsetHigh = (DWORD)((offset + total) >> 32);
+
+        DWORD len = size - total > 0x40000000 ? 0x40000000 : (DWORD)(size - total);
+        DWORD n;
+        if (!WriteFile((HANDLE)_get_osfhandle(fd), (const uint8_t *)data + total, len, &n, &overlapped)) return 1;
+#else
+        ssize_t n = pwrite(fd, (const uint8_t *)data + total, size - total, offset + total);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+#endif
+        if (!n) return 1;
+        total += n;
+    }
+
+    return 0;
+}
+
+/**
+ * Reserve the space of a file before writing it out of order.
+ *
+ * The blocks are allocated at once, so the file isn't fragmented by the writes at scattered
+ * offsets, and a full disk is found before writing. Where the file system can't allocate them
+ * the file is only extended to its size. On Linux this uses fallocate, because posix_fallocate
+ * would fall back to writing every block of the file.
+ *
+ * @param fd                The file descriptor.
+ * @param size              The size of the file.
+ *
+ * @return                  0 on success, 1 on error.
+ */
+
+int file_preallocate(int fd, uint64_t size) {
+#ifdef _WIN32
+    return _chsize_s(fd, size) != 0;
+#else
+    if (!size) return 0;
+
+#ifdef __linux__
+    if (fallocate(fd, 0, 0, size) == 0) return 0;
+
+    // Not supported by the file system
+    if (errno != EOPNOTSUPP && errno != ENOSYS) return 1;
+#else
+    int ret = posix_fallocate(fd, 0, size);
+    if (!ret) return 0;
+
+    // Not supported by the file system
+    if (ret != EINVAL && ret != EOPNOTSUPP) return 1;
+#endif
+
+    return ftruncate(fd, size) != 0;
+#endif
+}
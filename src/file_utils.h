@@ -51,6 +51,7 @@
 #endif
 
 #include "hashset.h"
+#include "arena.h"
 
 // Flags
 #define FLAG_RECURSIVE  0x01
@@ -68,6 +69,9 @@ typedef struct {
     size_t count;       /**< The number of files in the list. */
     size_t capacity;    /**< The capacity of the list. */
     HASHSET *set;       /**< A hashset to filter out duplicate entries. */
+    int (*callback)(char *filename); /**< Receives the files instead of storing them (optional). */
+    ARENA arena;        /**< Memory of the file paths. */
+    int num_walkers;    /**< Threads that read directories ahead of the recursive listing (0 = none). */
 } FILELIST;
 
 /**
@@ -153,7 +157,7 @@ char *path_to_unix(const char* path, char *converted_path);
  *
  * @param list              A pointer to the FILELIST structure to initialize.
  * @param initialCapacity   The initial capacity for the file list.
- * @param hashSize          The size of the hashset used for duplicate filtering.
+ * @param hashSize          The initial size of the hashset used for duplicate filtering (it grows as needed).
  */
 void filelist_init(FILELIST *list, size_t initialCapacity, size_t hashSize);
 
@@ -169,6 +173,42 @@ void filelist_init(FILELIST *list, size_t initialCapacity, size_t hashSize);
  */
 int filelist_add(FILELIST *list, char *filename);
 
+/**
+ * Set a function that receives the files as they're added to a FILELIST.
+ *
+ * The files are handed over to the callback instead of stored in the list, after filtering
+ * out duplicates.
+ *
+ * @param list              A pointer to the FILELIST structure.
+ * @param callback          Function that receives each file path.
+ */
+void filelist_set_callback(FILELIST *list, int (*callback)(char *filename));
+
+/**
+ * Set the number of threads that read directories for a recursive listing.
+ *
+ * The threads read the directories ahead of the listing, but the files are added in the same
+ * order as without them.
+ *
+ * @param list              A pointer to the FILELIST structure.
+ * @param num_walkers       Number of threads (0 = directories are read as they're listed).
+ */
+void filelist_set_walkers(FILELIST *list, int num_walkers);
+
+/**
+ * Add the files listed in a text file to a FILELIST.
+ *
+ * This function reads one path per line and adds the files to a FILELIST, without expanding
+ * them as patterns.
+ *
+ * @param list              A pointer to the FILELIST structure.
+ * @param fp                The text file (it can be stdin).
+ * @param flags             Flags to control the processing, e.g., FLAG_RECURSIVE for recursive listing.
+ *
+ * @return                  0 if successful, -1 on error.
+ */
+int filelist_add_from_file(FILELIST *list, FILE *fp, uint16_t flags);
+
 /**
  * Free resources associated with a FILELIST structure.
  *
@@ -203,4 +243,64 @@ void list_files_recursively(const char *path, FILELIST *filelist, uint16_t flags
 
 int process_pattern(char *pattern, FILELIST *filelist, uint16_t flags);
 
+/**
+ * Copy a range of a file to the current position of an output file inside the kernel.
+ *
+ * On Linux, the data is moved with copy_file_range (or sendfile if it is not supported for the
+ * pair of files), so it never goes through user space. The input file position is not used nor
+ * modified.
+ *
+ * @param input_fd          The file descriptor of the input file.
+ * @param offset            The offset of the range in the input file.
+ * @param output_file       The output file.
+ * @param size              The size of the range.
+ *
+ * @return                  The number of bytes copied. If it's less than size, the kernel copy is
+ *                          not supported or failed, and the caller must copy the rest.
+ */
+uint64_t file_copy_range(int input_fd, uint64_t offset, FILE *output_file, uint64_t size);
+
+/**
+ * Read from a file at an offset, without using nor modifying its position.
+ *
+ * Several threads can read from the same file descriptor at once.
+ *
+ * @param fd                The file descriptor.
+ * @param buffer            Buffer for the data.
+ * @param size              The number of bytes to read.
+ * @param offset            The offset in the file.
+ *
+ * @return                  0 on success, 1 on error or if the file ends before.
+ */
+int file_read_at(int fd, void *buffer, size_t size, uint64_t offset);
+
+/**
+ * Write to a file at an offset, without using nor modifying its position.
+ *
+ * Several threads can write different ranges of the same file descriptor at once.
+ *
+ * @param fd                The file descriptor.
+ * @param data              The data.
+ * @param size              The number of bytes to write.
+ * @param offset            The offset in the file.
+ *
+ * @return                  0 on success, 1 on error.
+ */
+int file_write_at(int fd, const void *data, size_t size, uint64_t offset);
+
+/**
+ * Reserve the space of a file before writing it out of order.
+ *
+ * The blocks are allocated at once, so the file isn't fragmented by the writes at scattered
+ * offsets, and a full disk is found before writing. Where the file system can't allocate them
+ * the file is only extended to its size. On Linux this uses fallocate, because posix_fallocate
+ * would fall back to writing every block of the file.
+ *
+ * @param fd                The file descriptor.
+ * @param size              The size of the file.
+ *
+ * @return                  0 on success, 1 on error.
+ */
+int file_preallocate(int fd, uint64_t size);
+
 #endif /* FILE_UTILS_H */
@@ -38,10 +38,14 @@
 
 #include "hashset.h"
 
+#define HASHSET_MIN_CAPACITY    16
+
 /**
  * Initializes the hash set with the specified size.
  *
- * @param size The size of the hash set.
+ * The set grows as needed, the size is only the number of values expected.
+ *
+ * @param size The number of values expected.
  *
  * @return     A pointer to the initialized hash set, or NULL if memory allocation fails.
  */
@@ -52,52 +56,119 @@ HASHSET *hashset_init(size_t size) {
         return NULL;
     }
 
-    set->size = size;
-    set->table = (HASH_NODE **)calloc(size, sizeof(HASH_NODE *));
-    if (!set->table) {
+    // Room for the expected values below the maximum load
+    set->capacity = HASHSET_MIN_CAPACITY;
+    while (set->capacity - set->capacity / 8 < size) set->capacity *= 2;
+
+    set->count = 0;
+    set->slots = (HASH_SLOT *)calloc(set->capacity, sizeof(HASH_SLOT));
+    if (!set->slots) {
         free(set);
         return NULL;
     }
 
+    arena_init(&set->arena, 0);
+
     return set;
 }
 
 /**
- * Simple hash function to calculate the index for a given string in the hash table.
+ * Hash function (FNV-1a) to calculate the hash for a given string.
  *
  * @param str  The input string.
- * @param size The size of the hash table.
+ * @param len  Pointer to receive the length of the string.
  *
- * @return     The calculated hash index.
+ * @return     The calculated hash.
  */
 
-size_t hash(const char *str, size_t size) {
-    size_t hash = 0;
-    for (size_t i = 0; str[i] != '\0'; i++) {
-        hash = (hash * 31) + str[i];
+static uint32_t hashset_hash(const char *str, size_t *len) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; str[i] != '\0'; i++) {
+        hash = (hash ^ (uint8_t)str[i]) * 16777619u;
     }
-    return hash % size;
+    *len = i;
+    return hash;
 }
 
 /**
- * Checks if a string value exists in the hash set.
+ * Finds the slot of a string value in the hash set.
  *
  * @param set           Pointer to the hash set.
- * @param value         Value to check for existence.
- * @param index         Pre-calculated hash index for the value.
+ * @param value         Value to find.
+ * @param hash          Pre-calculated hash of the value.
  *
- * @return              1 if the value exists in the set, 0 otherwise.
+ * @return              The index of the slot, or the capacity of the set if the value doesn't exist.
+ */
+
+static size_t hashset_find(HASHSET *set, const char *value, uint32_t hash) {
+    size_t mask = set->capacity - 1;
+    size_t index = hash & mask;
+
+    for (uint32_t distance = 1; ; distance++) {
+        HASH_SLOT *slot = &set->slots[index];
+
+        // An empty slot, or a value closer to its own slot, ends the probe
+        if (slot->distance < distance) return set->capacity;
+        if (slot->hash == hash && strcmp(slot->value, value) == 0) return index;
+
+        index = (index + 1) & mask;
+    }
+}
+
+/**
+ * Places a value in the table, moving the values that are closer to their own slot.
+ *
+ * @param slots         The slots of the table.
+ * @param mask          Capacity of the table minus 1.
+ * @param item          The value to place.
  */
 
-static int hashset_containsAtIndex(HASHSET *set, const char *value, size_t index) {
-    HASH_NODE *current = set->table[index];
-    while (current) {
-        if (strcmp(current->value, value) == 0) {
-            return 1; // Value exists in the table
+static void hashset_place(HASH_SLOT *slots, size_t mask, HASH_SLOT item) {
+    size_t index = item.hash & mask;
+
+    for (item.distance = 1; ; item.distance++) {
+        HASH_SLOT *slot = &slots[index];
+
+        if (!slot->distance) {
+            *slot = item;
+            return;
+        }
+
+        if (slot->distance < item.distance) {
+            HASH_SLOT tmp = *slot;
+            *slot = item;
+            item = tmp;
         }
-        current = current->next;
+
+        index = (index + 1) & mask;
+    }
+}
+
+/**
+ * Doubles the capacity of the hash set.
+ *
+ * @param set           Pointer to the hash set.
+ *
+ * @return              1 if successful, 0 if memory allocation fails.
+ */
+
+static int hashset_grow(HASHSET *set) {
+    size_t capacity = set->capacity * 2;
+    HASH_SLOT *slots = (HASH_SLOT *)calloc(capacity, sizeof(HASH_SLOT));
+    if (!slots) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < set->capacity; i++) {
+        if (set->slots[i].distance) hashset_place(slots, capacity - 1, set->slots[i]);
     }
-    return 0; // Value does not exist in the set
+
+    free(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+
+    return 1;
 }
 
 /**
@@ -114,7 +185,8 @@ int hashset_contains(HASHSET *set, const char *value) {
         return 0;
     }
 
-    return hashset_containsAtIndex(set, value, hash(value, set->size));
+    size_t len;
+    return hashset_find(set, value, hashset_hash(value, &len)) != set->capacity;
 }
 
 /**
@@ -131,22 +203,28 @@ int hashset_add(HASHSET *set, const char *value) {
         return 0;
     }
 
-    size_t index = hash(value, set->size);
+    size_t len;
+    uint32_t hash = hashset_hash(value, &len);
 
     // Check if the value already exists in the set
-    if (hashset_containsAtIndex(set, value, index)) {
+    if (hashset_find(set, value, hash) != set->capacity) {
         return 0; // Value already exists in the set
     }
 
-    // Insert the new string value into the table
-    HASH_NODE *new_node = (HASH_NODE *)malloc(sizeof(HASH_NODE));
-    if (!new_node) {
+    // Keep the load below 7/8
+    if (set->count + 1 > set->capacity - set->capacity / 8 && !hashset_grow(set)) {
         return 0; // Memory allocation failed
     }
 
-    new_node->value = strdup(value);
-    new_node->next = set->table[index];
-    set->table[index] = new_node;
+    HASH_SLOT item;
+    item.value = arena_strndup(&set->arena, value, len);
+    if (!item.value) {
+        return 0; // Memory allocation failed
+    }
+    item.hash = hash;
+
+    hashset_place(set->slots, set->capacity - 1, item);
+    set->count++;
 
     return 1; // Insertion successful
 }
@@ -154,10 +232,12 @@ int hashset_add(HASHSET *set, const char *value) {
 /**
  * Removes a string value from the hash set.
  *
+ * The memory of the value is released when the set is freed.
+ *
  * @param set           Pointer to the hash set.
  * @param value         Value to remove.
  *
- * @return              1 if removal is successful, 0 if the value doesn't exist or memory allocation fails.
+ * @return              1 if removal is successful, 0 if the value doesn't exist.
  */
 
 int hashset_del(HASHSET *set, const char *value) {
@@ -165,34 +245,30 @@ int hashset_del(HASHSET *set, const char *value) {
         return 0;
     }
 
-    size_t index = hash(value, set->size);
-
-    // Check if the value exists in the set
-    HASH_NODE *current = set->table[index];
-    HASH_NODE *previous = NULL;
-
-    while (current) {
-        if (strcmp(current->value, value) == 0) {
-            // Found the value to remove
-            if (previous) {
-                previous->next = current->next;
-            } else {
-                set->table[index] = current->next;
-            }
+    size_t len;
+    size_t index = hashset_find(set, value, hashset_hash(value, &len));
+    if (index == set->capacity) {
+        return 0; // Value not found in the set
+    }
 
-            free(current->value);
-            free(current);
-            return 1; // Removal successful
-        }
-        previous = current;
-        current = current->next;
+    // Shift back the following values that aren't in their own slot
+    size_t mask = set->capacity - 1;
+    size_t next = (index + 1) & mask;
+    while (set->slots[next].distance > 1) {
+        set->slots[index] = set->slots[next];
+        set->slots[index].distance--;
+        index = next;
+        next = (next + 1) & mask;
     }
 
-    return 0; // Value not found in the set
+    memset(&set->slots[index], 0, sizeof(HASH_SLOT));
+    set->count--;
+
+    return 1; // Removal successful
 }
 
 /**
- * Frees the memory used by the hash set and its nodes.
+ * Frees the memory used by the hash set and its values.
  *
  * @param set   Pointer to the hash set to free.
  */
@@ -202,16 +278,7 @@ void hashset_free(HASHSET *set) {
         return;
     }
 
-    for (size_t i = 0; i < set->size; i++) {
-        HASH_NODE *current = set->table[i];
-        while (current) {
-            HASH_NODE *next = current->next;
-            free(current->value);
-            free(current);
-            current = next;
-        }
-    }
-
-    free(set->table);
+    arena_free(&set->arena);
+    free(set->slots);
     free(set);
 }
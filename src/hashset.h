@@ -36,16 +36,24 @@
 #ifndef __HASHSET_H
 #define __HASHSET_H
 
-// Define the HASH_NODE structure for individual elements in the hash table
-typedef struct HASH_NODE {
-    char *value;
-    struct HASH_NODE *next;
-} HASH_NODE;
+#include <stddef.h>
+#include <stdint.h>
 
-// Define the HASHSET structure for the hash table
+#include "arena.h"
+
+// Define the HASH_SLOT structure for the slots of the hash table
+typedef struct {
+    const char *value;          // String value, stored in the arena of the set
+    uint32_t hash;              // Hash of the value
+    uint32_t distance;          // Distance to the slot of the hash plus 1 (0 = empty slot)
+} HASH_SLOT;
+
+// Define the HASHSET structure for the hash table (open addressing, Robin Hood probing)
 typedef struct {
-    size_t size;
-    HASH_NODE **table;
+    size_t capacity;            // Number of slots (power of 2)
+    size_t count;               // Number of values
+    HASH_SLOT *slots;
+    ARENA arena;                // Memory of the values (released when the set is freed)
 } HASHSET;
 
 // Function prototypes
@@ -37,6 +37,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <getopt.h>
@@ -47,6 +50,8 @@
 #include "unpak.h"
 #include "file_utils.h"
 #include "threads.h"
+#include "coder.h"
+#include "stats.h"
 
 // Define command-line options
 static struct option long_options[] = {
@@ -54,23 +59,38 @@ static struct option long_options[] = {
     { "extract", no_argument, 0, 'x' },
     { "list", no_argument, 0, 'l' },
     { "info", no_argument, 0, 'i' },
+    { "update", no_argument, 0, 'u' },
+    { "test", no_argument, 0, 'W' },
     { "file", required_argument, 0, 'f' },
     { "block-size", required_argument, 0, 'b' },
+    { "range", required_argument, 0, 'R' },
+    { "dedup", no_argument, 0, 'D' },
+    { "stream", no_argument, 0, 'p' },
+    { "files-from", required_argument, 0, 'F' },
     { "recursive", no_argument, 0, 'r' },
     { "gzip", no_argument, 0, 'z' },
     { "lzma", no_argument, 0, 'j' },
+    { "zstd", no_argument, 0, 'Z' },
+    { "lz4", no_argument, 0, 'L' },
     { "fast", no_argument, 0, '1' },
     { "best", no_argument, 0, '9' },
     { "extreme", no_argument, 0, 'e' },
+    { "adaptive", no_argument, 0, 'a' },
+    { "dictionary", no_argument, 0, 'd' },
     { "ignore-case", no_argument, 0, 'I' },
     { "absolute-paths", no_argument, 0, 'A' },
+    { "checksum", no_argument, 0, 'k' },
     { "source-dir", required_argument, 0, 's' },
     { "target-dir", required_argument, 0, 't' },
     { "trim-path", no_argument, 0, 'T' },
     { "overwrite", no_argument, 0, 'y' },
     { "skip-existing-files", no_argument, 0, 'S' },
     { "num-threads", required_argument, 0, 'n' },
+    { "reorder-window", required_argument, 0, 'w' },
+    { "memory-limit", required_argument, 0, 'M' },
     { "output-format", required_argument, 0, 'o' },
+    { "stats", no_argument, 0, 'X' },
+    { "progress", no_argument, 0, 'P' },
     { "verbose", no_argument, 0, 'v' },
     { "help", no_argument, 0, 'h' },
     { "version", no_argument, 0, 'V' },
@@ -89,10 +109,48 @@ static struct {
     {NULL, UNKNOWN_FORMAT} // Marks the end of the table
 };
 
+/**
+ * Parses a size given on the command line.
+ *
+ * Sizes are decimal, without a sign or a base prefix (010 is ten). A K, M or G suffix is only
+ * allowed if asked for.
+ *
+ * @param text          The text to parse.
+ * @param suffix        Whether a K, M or G suffix is allowed.
+ * @param value         Pointer to receive the size.
+ *
+ * @return              A pointer to the first unparsed character, or NULL if there's no
+ *                      number or the size doesn't fit in 64 bits.
+ */
+
+static const char *parse_size( const char *text, int suffix, uint64_t *value ) {
+    if ( !isdigit( (unsigned char) *text ) ) return NULL;
+
+    char *end;
+    errno = 0;
+    *value = strtoull( text, &end, 10 );
+    if ( errno == ERANGE ) return NULL;
+
+    int shift = 0;
+    if ( suffix ) {
+        switch ( *end ) {
+            case 'k': case 'K': shift = 10; end++; break;
+            case 'm': case 'M': shift = 20; end++; break;
+            case 'g': case 'G': shift = 30; end++; break;
+            default: break;
+        }
+    }
+
+    if ( *value > ( UINT64_MAX >> shift ) ) return NULL;
+    *value <<= shift;
+
+    return end;
+}
+
 int main( int argc, char *argv[] ) {
     int exit_value = EXIT_FAILURE;
     char *archive_file = NULL;
-    int mode = 0; // 1 for create, 2 for extract, 3 for list, 4 for info
+    int mode = 0; // 1 for create, 2 for extract, 3 for list, 4 for info, 5 for update, 6 for test
     int mode_count = 0;
     int compression_count = 0;
     int compression_level_count = 0;
@@ -100,7 +158,7 @@ int main( int argc, char *argv[] ) {
     _Config.num_threads = threads_get_max(); // Default number of threads
 
     int option;
-    while ( ( option = getopt_long( argc, argv, "cxlif:b:zj0123456789eIAs:t:rTySn:o:vhV", long_options, NULL ) ) != -1 ) {
+    while ( ( option = getopt_long( argc, argv, "cxliuWf:b:R:DpF:zjZL0123456789eadIAks:t:rTySn:w:M:o:XPvhV", long_options, NULL ) ) != -1 ) {
         switch ( option ) {
             case 'c':
                 if ( mode != 1 ) mode_count++;
@@ -122,6 +180,16 @@ int main( int argc, char *argv[] ) {
                 mode = 4; // Set mode to info
                 break;
 
+            case 'u':
+                if ( mode != 5 ) mode_count++;
+                mode = 5; // Set mode to update
+                break;
+
+            case 'W':
+                if ( mode != 6 ) mode_count++;
+                mode = 6; // Set mode to test
+                break;
+
             case 'f':
                 _Config.archive_file = archive_file = optarg; // Set the file path
 #ifdef _WIN32
@@ -133,6 +201,33 @@ int main( int argc, char *argv[] ) {
                 _ArchiveInfo.block_size = atoi( optarg ); // Set block size
                 break;
 
+            case 'R': { // --range=OFFSET[:LENGTH]
+                const char *end = parse_size( optarg, 0, &_Config.range_offset );
+                _Config.range_size = 0;
+                if ( end && *end == ':' ) {
+                    end = parse_size( end + 1, 0, &_Config.range_size );
+                    if ( !_Config.range_size ) end = NULL; // 0 would mean up to the end of the file
+                }
+                if ( !end || *end ) {
+                    fprintf( stderr, APPNAME": Invalid range: %s\n", optarg );
+                    fprintf( stderr, "Try '%s --help' for more information.\n", argv[0] );
+                    return 1;
+                }
+                break;
+            }
+
+            case 'D': // --dedup
+                _Config.dedup_flag = 1;
+                break;
+
+            case 'p': // --stream
+                _Config.stream_flag = 1;
+                break;
+
+            case 'F': // --files-from=FILE
+                _Config.files_from = optarg;
+                break;
+
             case 'z':
                 _ArchiveInfo.compression_type = PSARC_ZLIB; // Set compression type to zlib
                 if ( _ArchiveInfo.compression_type != PSARC_ZLIB ) compression_count++;
@@ -143,6 +238,16 @@ int main( int argc, char *argv[] ) {
                 if ( _ArchiveInfo.compression_type != PSARC_LZMA ) compression_count++;
                 break;
 
+            case 'Z': // --zstd
+                _ArchiveInfo.compression_type = PSARC_ZSTD; // Set compression type to zstd
+                if ( _ArchiveInfo.compression_type != PSARC_ZSTD ) compression_count++;
+                break;
+
+            case 'L': // --lz4
+                _ArchiveInfo.compression_type = PSARC_LZ4; // Set compression type to lz4
+                if ( _ArchiveInfo.compression_type != PSARC_LZ4 ) compression_count++;
+                break;
+
             case '0':
             case '1':
             case '2':
@@ -161,6 +266,18 @@ int main( int argc, char *argv[] ) {
                 _Config.extreme_compression_flag = 1;
                 break;
 
+            case 'a': // --adaptive
+                _Config.adaptive_flag = 1;
+                break;
+
+            case 'd': // --dictionary
+                _Config.dictionary_flag = 1;
+                break;
+
+            case 'k': // --checksum
+                _Config.checksum_flag = 1;
+                break;
+
             case 'I': // --ignore-case
                 _ArchiveInfo.archive_flags |= AF_ICASE; // Set the ignore-case flag
                 break;
@@ -204,6 +321,20 @@ int main( int argc, char *argv[] ) {
                 printf("num_threads %d\n", _Config.num_threads);
                 break;
 
+            case 'w':
+                _Config.reorder_window = atoi( optarg ); // Blocks in flight between workers and writer
+                break;
+
+            case 'M': { // --memory-limit=SIZE[K|M|G]
+                const char *end = parse_size( optarg, 1, &_Config.memory_limit );
+                if ( !end || *end || !_Config.memory_limit ) {
+                    fprintf( stderr, APPNAME": Invalid memory limit: %s\n", optarg );
+                    fprintf( stderr, "Try '%s --help' for more information.\n", argv[0] );
+                    return 1;
+                }
+                break;
+            }
+
             case 'o':
                 _Config.output_format = UNKNOWN_FORMAT;
                 // Search for the numeric value in the mapping table
@@ -221,6 +352,14 @@ int main( int argc, char *argv[] ) {
                 }
                 break;
 
+            case 'X': // --stats
+                _Config.stats_flag = 1;
+                break;
+
+            case 'P': // --progress
+                _Config.progress_flag = 1;
+                break;
+
             case 'v':
                 _Config.verbose_flag = 1; // Set verbose flag
                 break;
@@ -239,24 +378,43 @@ int main( int argc, char *argv[] ) {
                 printf( "  -x, --extract                extract files\n" );
                 printf( "  -l, --list                   list contents\n" );
                 printf( "  -i, --info                   show archive information\n" );
+                printf( "  -u, --update                 add new and changed files to an archive\n" );
+                printf( "  -W, --test                   test the integrity of the archive, without\n" );
+                printf( "                               extracting it\n" );
                 printf( "\n" );
                 printf( " Operation modifiers:\n" );
                 printf( "  -f, --file=FILE              specify file (mandatory)\n" );
                 printf( "  -b, --block-size=BYTES       block size in bytes (default: 65536)\n" );
+                printf( "  -R, --range=OFFSET[:LENGTH]  extract only LENGTH bytes from OFFSET of each file\n" );
+                printf( "                               (decimal bytes, default length: up to the end of\n" );
+                printf( "                               the file)\n" );
+                printf( "  -D, --dedup                  store identical files only once\n" );
+                printf( "  -p, --stream                 compress files as they're found, without listing\n" );
+                printf( "                               them first (only for create mode)\n" );
+                printf( "  -F, --files-from=FILE        add the files listed in FILE, one per line\n" );
+                printf( "                               (- for standard input)\n" );
                 printf( "\n" );
                 printf( " Compression (default: no compression -store-):\n" );
                 printf( "  -z, --zlib                   use zlib\n" );
                 printf( "  -j, --lzma                   use lzma\n" );
+                printf( "  -Z, --zstd                   use zstd (if available in this build)\n" );
+                printf( "  -L, --lz4                    use lz4 (if available in this build)\n" );
                 printf( "  -0                           compress faster (only for lzma)\n" );
                 printf( "  -1, --fast                   compress faster\n" );
                 printf( "  -9, --best                   compress better\n" );
-                printf( "  -e, --extreme                extreme compress (only for lzma)\n" );
+                printf( "  -e, --extreme                extreme compress (lzma), long distance matching (zstd)\n" );
+                printf( "  -a, --adaptive               don't compress blocks that aren't worth it\n" );
+                printf( "                               (compressed formats and high entropy data)\n" );
+                printf( "  -d, --dictionary             share a dictionary trained from the small files\n" );
+                printf( "                               (only for zlib, not with --stream)\n" );
                 printf( "\n" );
                 printf( " Archive flags (default: relative paths and case-sensitive):\n" );
                 printf( "  -I, --ignore-case            ignore case when matching file selection patterns\n" );
                 printf( "                               during creation\n" );
                 printf( "                               (ignored during extraction, uses creation setting)\n" );
                 printf( "  -A, --absolute-paths         use absolute paths for file names\n" );
+                printf( "  -k, --checksum               store the checksum (CRC32C) of each file, verified\n" );
+                printf( "                               on extraction and test\n" );
                 printf( "\n" );
                 printf( " File name selection:\n" );
                 printf( "  -s, --source-dir=DIR         base directory for source files\n" );
@@ -271,11 +429,21 @@ int main( int argc, char *argv[] ) {
                 printf( "\n" );
                 printf( " Other options:\n" );
                 printf( "  -n, --num-threads=NUM        specify the number of threads (default: auto, based on CPU cores)\n" );
+                printf( "  -w, --reorder-window=NUM     blocks in flight waiting to be written in order\n" );
+                printf( "                               (default: twice the number of threads)\n" );
+                printf( "  -M, --memory-limit=SIZE      keep the block buffers and coders within SIZE bytes\n" );
+                printf( "                               (decimal, K, M or G suffix), using fewer blocks in\n" );
+                printf( "                               flight and fewer threads when needed\n" );
                 printf( "  -o, --output-format=FORMAT   specify the output format for information display\n" );
                 printf( "                               available formats:\n" );
                 printf( "                                   json\n" );
                 printf( "                                   csv\n" );
                 printf( "                                   xml\n" );
+                printf( "  -X, --stats                  show where the time went (reading, compressing,\n" );
+                printf( "                               writing, waiting...) after creating, updating,\n" );
+                printf( "                               extracting or testing\n" );
+                printf( "  -P, --progress               show the overall progress (rate and ETA) on stderr\n" );
+                printf( "                               instead of each file\n" );
                 printf( "  -v, --verbose                list processed files in detail\n" );
                 printf( "  -h, --help                   show this help\n" );
                 printf( "  -V, --version                show program version\n" );
@@ -329,8 +497,16 @@ int main( int argc, char *argv[] ) {
     }
 
     // Check for valid compression count and mode combination
-    if ( compression_count && mode != 1 ) {
-        fprintf( stderr, APPNAME": compression type is only for create mode\n" );
+    if ( compression_count && mode != 1 && mode != 5 ) {
+        fprintf( stderr, APPNAME": compression type is only for create and update modes\n" );
+        fprintf( stderr, "Try '%s --help' for more information.\n", argv[0] );
+
+        return 1;
+    }
+
+    // Ranges only apply to extraction, test mode always decodes whole files
+    if ( ( _Config.range_offset || _Config.range_size ) && mode != 2 ) {
+        fprintf( stderr, APPNAME": range is only for extract mode\n" );
         fprintf( stderr, "Try '%s --help' for more information.\n", argv[0] );
 
         return 1;
@@ -347,9 +523,13 @@ int main( int argc, char *argv[] ) {
     char *current_dir = NULL;
     char *new_archive = NULL;
 
+    // The wall clock of the stats includes listing the files
+    if ( _Config.stats_flag ) stats_start();
+
     // Implement logic specific to each mode
     switch ( mode ) {
-        case 1: { // Create mode ( -c )
+        case 1:   // Create mode ( -c )
+        case 5: { // Update mode ( -u )
             // Check for parameters specific to the create mode
             if ( _ArchiveInfo.block_size <= 0 ) { 
                 fprintf( stderr, APPNAME": block size must be a positive integer for create mode\n" );
@@ -359,25 +539,42 @@ int main( int argc, char *argv[] ) {
             }
 
             // Check for parameters specific to the create mode
-            if ( optind >= argc ) { 
+            if ( optind >= argc && !_Config.files_from ) { 
                 fprintf( stderr, APPNAME": no files to add\n");
                 fprintf( stderr, "Try '%s --help' for more information.\n", argv[0] );
 
                 return 1;
             }
 
+            if ( _Config.stream_flag && ( mode != 1 || _Config.dedup_flag ) ) {
+                fprintf( stderr, APPNAME": stream is only for create mode, without dedup\n" );
+                fprintf( stderr, "Try '%s --help' for more information.\n", argv[0] );
+
+                return 1;
+            }
+
+            if ( !coder_is_available( _ArchiveInfo.compression_type ) ) {
+                fprintf( stderr, APPNAME": %s compression isn't supported by this build\n", coder_get_name( _ArchiveInfo.compression_type ) );
+
+                return 1;
+            }
+
             if ( _ArchiveInfo.compression_type == PSARC_LZMA ) {
                 // Set default compression level for create mode with LZMA
                 if ( compression_level_count == 0 ) _Config.compression_level = LZMA_PRESET_DEFAULT;
             } else {
+                // zstd and lz4 default to their fastest usual levels
+                if ( compression_level_count == 0 && _ArchiveInfo.compression_type == PSARC_ZSTD ) _Config.compression_level = CODER_ZSTD_LEVEL_DEFAULT;
+                if ( compression_level_count == 0 && _ArchiveInfo.compression_type == PSARC_LZ4 ) _Config.compression_level = CODER_LZ4_LEVEL_DEFAULT;
+
                 if ( _Config.compression_level == 0 ) {
                     fprintf( stderr, APPNAME": invalid compression level\n" );
                     fprintf( stderr, "Try '%s --help' for more information.\n", argv[0] );
 
                     return 1;
                 }
-                if ( _Config.extreme_compression_flag ) {
-                    fprintf( stderr, APPNAME": extreme compression isn't valid option for zlib\n" );
+                if ( _Config.extreme_compression_flag && _ArchiveInfo.compression_type != PSARC_ZSTD ) {
+                    fprintf( stderr, APPNAME": extreme compression isn't valid option for %s\n", coder_get_name( _ArchiveInfo.compression_type ) );
                     fprintf( stderr, "Try '%s --help' for more information.\n", argv[0] );
 
                     return 1;
@@ -401,11 +598,24 @@ int main( int argc, char *argv[] ) {
                 return 1;
             }
 
+            // The list of files is relative to the current directory
+            FILE *files_from = NULL;
+            if ( _Config.files_from ) {
+                files_from = strcmp( _Config.files_from, "-" ) ? fopen( _Config.files_from, "r" ) : stdin;
+                if ( !files_from ) {
+                    fprintf( stderr, APPNAME": error opening %s\n", _Config.files_from );
+
+                    return 1;
+                }
+            }
+
             if ( _Config.source_dir ) {
                 new_archive = fullpath(archive_file);
                 if (!new_archive) {
                     fprintf( stderr, APPNAME": no enough memory\n" );
 
+                    if ( files_from && files_from != stdin ) fclose( files_from );
+
                     return 1;
                 }
 
@@ -415,6 +625,7 @@ int main( int argc, char *argv[] ) {
                 if ( !current_dir ) {
                     fprintf( stderr, APPNAME": no enough memory\n" );
 
+                    if ( files_from && files_from != stdin ) fclose( files_from );
                     free( new_archive );
 
                     return 1;
@@ -424,21 +635,66 @@ int main( int argc, char *argv[] ) {
             }
 
             FILELIST filelist;
-            filelist_init(&filelist, 100, 65536);
+            filelist_init(&filelist, 100, 1024);
+
+            // Directories are read ahead by the same number of threads used to compress
+            filelist_set_walkers(&filelist, _Config.num_threads);
+
+            // Files are compressed as they're found
+            if ( _Config.stream_flag ) {
+                if ( create_archive_begin( archive_file ) ) {
+                    filelist_free(&filelist);
 
-            for ( int i = optind; i < argc; i++ ) {
-                if ( process_pattern(argv[i], &filelist, ( _Config.recursive_flag ? FLAG_RECURSIVE : 0 ) | ( ( _ArchiveInfo.archive_flags & AF_ICASE ) ? FLAG_ICASE : 0 ) ) ) {
-                    // The search pattern refers to too many directories
                     if ( current_dir ) {
                         int dummy = chdir(current_dir);
                         dummy = dummy;
                         free(current_dir);
                     }
 
+                    if ( files_from && files_from != stdin ) fclose( files_from );
                     free( new_archive );
 
                     return 1;
                 }
+                filelist_set_callback(&filelist, create_archive_add);
+            }
+
+            uint16_t flags = ( _Config.recursive_flag ? FLAG_RECURSIVE : 0 ) | ( ( _ArchiveInfo.archive_flags & AF_ICASE ) ? FLAG_ICASE : 0 );
+            int list_error = 0;
+
+            for ( int i = optind; i < argc && !list_error; i++ ) {
+                // The search pattern refers to too many directories
+                list_error = process_pattern(argv[i], &filelist, flags);
+            }
+
+            if ( !list_error && files_from && filelist_add_from_file(&filelist, files_from, flags) ) {
+                fprintf( stderr, APPNAME": error reading %s\n", _Config.files_from );
+                list_error = 1;
+            }
+
+            if ( files_from && files_from != stdin ) fclose( files_from );
+
+            if ( list_error ) {
+                if ( _Config.stream_flag ) create_archive_end(1);
+                filelist_free(&filelist);
+
+                if ( current_dir ) {
+                    int dummy = chdir(current_dir);
+                    dummy = dummy;
+                    free(current_dir);
+                }
+
+                free( new_archive );
+
+                return 1;
+            }
+
+            if ( _Config.stream_flag ) {
+                exit_value = create_archive_end(0);
+
+                filelist_free(&filelist);
+
+                break;
             }
 
             if ( !filelist.count ) {
@@ -457,7 +713,8 @@ int main( int argc, char *argv[] ) {
                 return 1;
             }
 
-            exit_value = create_archive( archive_file, filelist.files, filelist.count );
+            if ( mode == 5 ) exit_value = update_archive( archive_file, filelist.files, filelist.count );
+            else             exit_value = create_archive( archive_file, filelist.files, filelist.count );
 
             filelist_free(&filelist);
 
@@ -494,6 +751,7 @@ int main( int argc, char *argv[] ) {
 
         case 3: // List mode ( -l )
         case 4: // Info mode ( -i )
+        case 6: // Test mode ( -W )
             exit_value = process_archive( archive_file, mode, &argv[optind], argc - optind );
             break;
 
@@ -0,0 +1,139 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file mapfile.c
+ * @brief Implementation of read-only memory mapped files for the PSARc project.
+ *
+ * This file implements the memory mapping of archives, using mmap on POSIX systems and
+ * CreateFileMapping on Windows.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mapfile.h"
+
+/**
+ * Maps a whole file in memory for reading.
+ *
+ * @param path          Path of the file to map.
+ *
+ * @return              A pointer to the mapped file, or NULL if the file can't be mapped
+ *                      (memory mapping not supported, empty file or error).
+ */
+
+MAPFILE *mapfile_open(const char *path) {
+    MAPFILE *mf = (MAPFILE *)calloc(1, sizeof(MAPFILE));
+    if (!mf) return NULL;
+
+    mf->fd = -1;
+
+#ifdef _WIN32
+    mf->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mf->file == INVALID_HANDLE_VALUE) {
+        free(mf);
+        return NULL;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(mf->file, &size) || !size.QuadPart) {
+        CloseHandle(mf->file);
+        free(mf);
+        return NULL;
+    }
+    mf->size = size.QuadPart;
+
+    mf->mapping = CreateFileMapping(mf->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mf->mapping) {
+        CloseHandle(mf->file);
+        free(mf);
+        return NULL;
+    }
+
+    mf->data = (const uint8_t *)MapViewOfFile(mf->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!mf->data) {
+        CloseHandle(mf->mapping);
+        CloseHandle(mf->file);
+        free(mf);
+        return NULL;
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        free(mf);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size || (uint64_t)st.st_size != (size_t)st.st_size) {
+        close(fd);
+        free(mf);
+        return NULL;
+    }
+    mf->size = st.st_size;
+
+    void *data = mmap(NULL, mf->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        free(mf);
+        return NULL;
+    }
+
+    mf->data = (const uint8_t *)data;
+    mf->fd = fd;
+#endif
+
+    return mf;
+}
+
+/**
+ * Unmaps a file and frees its resources.
+ *
+ * @param mf            Pointer to the mapped file (can be NULL).
+ */
+
+void mapfile_close(MAPFILE *mf) {
+    if (!mf) return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(mf->data);
+    CloseHandle(mf->mapping);
+    CloseHandle(mf->file);
+#else
+    munmap((void *)mf->data, mf->size);
+    close(mf->fd);
+#endif
+
+    free(mf);
+}
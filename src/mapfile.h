@@ -0,0 +1,76 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file mapfile.h
+ * @brief Read-only memory mapped files for the PSARc project.
+ *
+ * This file declares the functions used to map a whole archive in memory, so its tables and
+ * blocks can be decoded without copying them to intermediate buffers.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#ifndef __MAPFILE_H
+#define __MAPFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/**
+ * Structure representing a read-only mapped file.
+ */
+typedef struct {
+    const uint8_t *data;            /**< Start of the mapped file. */
+    uint64_t size;                  /**< Size of the mapped file. */
+    int fd;                         /**< File descriptor, kept open for in-kernel copies (-1 on Windows). */
+#ifdef _WIN32
+    HANDLE file;                    /**< File handle. */
+    HANDLE mapping;                 /**< File mapping handle. */
+#endif
+} MAPFILE;
+
+/**
+ * Maps a whole file in memory for reading.
+ *
+ * @param path          Path of the file to map.
+ *
+ * @return              A pointer to the mapped file, or NULL if the file can't be mapped
+ *                      (memory mapping not supported, empty file or error).
+ */
+MAPFILE *mapfile_open(const char *path);
+
+/**
+ * Unmaps a file and frees its resources.
+ *
+ * @param mf            Pointer to the mapped file (can be NULL).
+ */
+void mapfile_close(MAPFILE *mf);
+
+#endif /* __MAPFILE_H */
@@ -37,13 +37,214 @@
 #include <string.h>
 #include <stdint.h>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MD5_SSE2
+#endif
+
+#include "md5.h"
+
 // leftrotate function definition
 #define LEFTROTATE(x, c) (((x) << (c)) | ((x) >> (32 - (c))))
- 
+
+// Round functions
+#define MD5_F(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))  // (b & c) | (~b & d)
+#define MD5_G(b, c, d) ((c) ^ ((d) & ((b) ^ (c))))  // (d & b) | (~d & c)
+#define MD5_H(b, c, d) ((b) ^ (c) ^ (d))
+#define MD5_I(b, c, d) ((c) ^ ((b) | (~(d))))
+
+// The 64 steps of a chunk: function, variables, message word, constant and shift amount
+#define MD5_STEPS(STEP) \
+    STEP(F, a, b, c, d,  0, 0xd76aa478,  7) STEP(F, d, a, b, c,  1, 0xe8c7b756, 12) STEP(F, c, d, a, b,  2, 0x242070db, 17) STEP(F, b, c, d, a,  3, 0xc1bdceee, 22) \
+    STEP(F, a, b, c, d,  4, 0xf57c0faf,  7) STEP(F, d, a, b, c,  5, 0x4787c62a, 12) STEP(F, c, d, a, b,  6, 0xa8304613, 17) STEP(F, b, c, d, a,  7, 0xfd469501, 22) \
+    STEP(F, a, b, c, d,  8, 0x698098d8,  7) STEP(F, d, a, b, c,  9, 0x8b44f7af, 12) STEP(F, c, d, a, b, 10, 0xffff5bb1, 17) STEP(F, b, c, d, a, 11, 0x895cd7be, 22) \
+    STEP(F, a, b, c, d, 12, 0x6b901122,  7) STEP(F, d, a, b, c, 13, 0xfd987193, 12) STEP(F, c, d, a, b, 14, 0xa679438e, 17) STEP(F, b, c, d, a, 15, 0x49b40821, 22) \
+    STEP(G, a, b, c, d,  1, 0xf61e2562,  5) STEP(G, d, a, b, c,  6, 0xc040b340,  9) STEP(G, c, d, a, b, 11, 0x265e5a51, 14) STEP(G, b, c, d, a,  0, 0xe9b6c7aa, 20) \
+    STEP(G, a, b, c, d,  5, 0xd62f105d,  5) STEP(G, d, a, b, c, 10, 0x02441453,  9) STEP(G, c, d, a, b, 15, 0xd8a1e681, 14) STEP(G, b, c, d, a,  4, 0xe7d3fbc8, 20) \
+    STEP(G, a, b, c, d,  9, 0x21e1cde6,  5) STEP(G, d, a, b, c, 14, 0xc33707d6,  9) STEP(G, c, d, a, b,  3, 0xf4d50d87, 14) STEP(G, b, c, d, a,  8, 0x455a14ed, 20) \
+    STEP(G, a, b, c, d, 13, 0xa9e3e905,  5) STEP(G, d, a, b, c,  2, 0xfcefa3f8,  9) STEP(G, c, d, a, b,  7, 0x676f02d9, 14) STEP(G, b, c, d, a, 12, 0x8d2a4c8a, 20) \
+    STEP(H, a, b, c, d,  5, 0xfffa3942,  4) STEP(H, d, a, b, c,  8, 0x8771f681, 11) STEP(H, c, d, a, b, 11, 0x6d9d6122, 16) STEP(H, b, c, d, a, 14, 0xfde5380c, 23) \
+    STEP(H, a, b, c, d,  1, 0xa4beea44,  4) STEP(H, d, a, b, c,  4, 0x4bdecfa9, 11) STEP(H, c, d, a, b,  7, 0xf6bb4b60, 16) STEP(H, b, c, d, a, 10, 0xbebfbc70, 23) \
+    STEP(H, a, b, c, d, 13, 0x289b7ec6,  4) STEP(H, d, a, b, c,  0, 0xeaa127fa, 11) STEP(H, c, d, a, b,  3, 0xd4ef3085, 16) STEP(H, b, c, d, a,  6, 0x04881d05, 23) \
+    STEP(H, a, b, c, d,  9, 0xd9d4d039,  4) STEP(H, d, a, b, c, 12, 0xe6db99e5, 11) STEP(H, c, d, a, b, 15, 0x1fa27cf8, 16) STEP(H, b, c, d, a,  2, 0xc4ac5665, 23) \
+    STEP(I, a, b, c, d,  0, 0xf4292244,  6) STEP(I, d, a, b, c,  7, 0x432aff97, 10) STEP(I, c, d, a, b, 14, 0xab9423a7, 15) STEP(I, b, c, d, a,  5, 0xfc93a039, 21) \
+    STEP(I, a, b, c, d, 12, 0x655b59c3,  6) STEP(I, d, a, b, c,  3, 0x8f0ccc92, 10) STEP(I, c, d, a, b, 10, 0xffeff47d, 15) STEP(I, b, c, d, a,  1, 0x85845dd1, 21) \
+    STEP(I, a, b, c, d,  8, 0x6fa87e4f,  6) STEP(I, d, a, b, c, 15, 0xfe2ce6e0, 10) STEP(I, c, d, a, b,  6, 0xa3014314, 15) STEP(I, b, c, d, a, 13, 0x4e0811a1, 21) \
+    STEP(I, a, b, c, d,  4, 0xf7537e82,  6) STEP(I, d, a, b, c, 11, 0xbd3af235, 10) STEP(I, c, d, a, b,  2, 0x2ad7d2bb, 15) STEP(I, b, c, d, a,  9, 0xeb86d391, 21)
+
+// Message word j of a 512-bit chunk (little endian)
+#define MD5_WORD(p, j) ( (uint32_t)(p)[(j) * 4] | ( (uint32_t)(p)[(j) * 4 + 1] << 8 ) | ( (uint32_t)(p)[(j) * 4 + 2] << 16 ) | ( (uint32_t)(p)[(j) * 4 + 3] << 24 ) )
+
+// State of a message being hashed
+typedef struct {
+    const uint8_t *msg;         // The message
+    size_t full_chunks;         // Chunks taken from the message as is
+    size_t num_chunks;          // Total chunks, including the padding
+    uint8_t tail[128];          // Last chunks: the rest of the message and the padding
+} MD5_MSG;
+
+/**
+ * Prepares the padding of a message: a "1" bit, "0" bits until the length in bits is 448 (mod
+ * 512), and the length of the message in bits (mod 2^64).
+ *
+ * @param m              The state of the message.
+ * @param msg            The message.
+ * @param len            The length of the message.
+ */
+
+static void md5_prepare(MD5_MSG *m, const uint8_t *msg, size_t len) {
+    size_t rest = len % 64;
+
+    m->msg = msg;
+    m->full_chunks = len / 64;
+    m->num_chunks = m->full_chunks + ( rest < 56 ? 1 : 2 );
+
+    memset(m->tail, 0, sizeof(m->tail));
+    memcpy(m->tail, msg + m->full_chunks * 64, rest);
+    m->tail[rest] = 128; // write the "1" bit
+
+    uint64_t bits_len = (uint64_t)len * 8;
+    uint8_t *p = m->tail + ( m->num_chunks - m->full_chunks ) * 64 - 8;
+    for (int i = 0; i < 8; i++) p[i] = (uint8_t)( bits_len >> ( i * 8 ) );
+}
+
+/**
+ * Gets a 512-bit chunk of a prepared message.
+ *
+ * @param m              The state of the message.
+ * @param chunk          The index of the chunk.
+ *
+ * @return               Pointer to the 64 bytes of the chunk.
+ */
+
+static const uint8_t *md5_chunk(const MD5_MSG *m, size_t chunk) {
+    return chunk < m->full_chunks ? m->msg + chunk * 64 : m->tail + ( chunk - m->full_chunks ) * 64;
+}
+
+/**
+ * Stores the hash of a message (little endian).
+ *
+ * @param h              The hash.
+ * @param result         A buffer to store the hash (16 bytes).
+ */
+
+static void md5_store(const uint32_t *h, uint8_t *result) {
+    for (int i = 0; i < 16; i++) result[i] = (uint8_t)( h[i / 4] >> ( ( i % 4 ) * 8 ) );
+}
+
+/**
+ * Processes a 512-bit chunk of a message.
+ *
+ * @param h              The hash so far.
+ * @param chunk          The chunk.
+ */
+
+static void md5_process(uint32_t *h, const uint8_t *chunk) {
+    // break chunk into sixteen 32-bit words w[j], 0 ≤ j ≤ 15
+    uint32_t w[16];
+    for (int j = 0; j < 16; j++) w[j] = MD5_WORD(chunk, j);
+
+    // Initialize hash value for this chunk:
+    uint32_t a = h[0];
+    uint32_t b = h[1];
+    uint32_t c = h[2];
+    uint32_t d = h[3];
+
+    // Main loop:
+#define STEP(fn, a, b, c, d, g, t, s) a = b + LEFTROTATE(a + MD5_##fn(b, c, d) + t + w[g], s);
+    MD5_STEPS(STEP)
+#undef STEP
+
+    // Add this chunk's hash to result so far:
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+#ifdef MD5_SSE2
+/**
+ * Hashes 4 messages at once, one in each 32-bit lane of the SSE2 registers.
+ *
+ * Lanes whose message has no more chunks keep their hash while the longer messages finish.
+ *
+ * @param msgs           The 4 messages.
+ * @param lens           The lengths of the messages.
+ * @param results        Buffers to store the hashes (16 bytes each).
+ */
+
+static void md5_x4(const uint8_t **msgs, const size_t *lens, uint8_t **results) {
+    MD5_MSG m[4];
+    size_t num_chunks = 0;
+
+    for (int l = 0; l < 4; l++) {
+        md5_prepare(&m[l], msgs[l], lens[l]);
+        if (m[l].num_chunks > num_chunks) num_chunks = m[l].num_chunks;
+    }
+
+    __m128i h[4] = {
+        _mm_set1_epi32(0x67452301),
+        _mm_set1_epi32(0xefcdab89),
+        _mm_set1_epi32(0x98badcfe),
+        _mm_set1_epi32(0x10325476)
+    };
+    const __m128i ones = _mm_set1_epi32(-1);
+
+    // Round functions on the 4 lanes
+#define MD5_F_X4(b, c, d) _mm_xor_si128(d, _mm_and_si128(b, _mm_xor_si128(c, d)))
+#define MD5_G_X4(b, c, d) _mm_xor_si128(c, _mm_and_si128(d, _mm_xor_si128(b, c)))
+#define MD5_H_X4(b, c, d) _mm_xor_si128(_mm_xor_si128(b, c), d)
+#define MD5_I_X4(b, c, d) _mm_xor_si128(c, _mm_or_si128(b, _mm_xor_si128(d, ones)))
+
+    for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+        const uint8_t *p[4];
+        uint32_t active[4];
+
+        for (int l = 0; l < 4; l++) {
+            active[l] = chunk < m[l].num_chunks ? 0xffffffff : 0;
+            p[l] = md5_chunk(&m[l], active[l] ? chunk : m[l].num_chunks - 1);
+        }
+
+        // Word j of the chunk of each lane
+        __m128i w[16];
+        for (int j = 0; j < 16; j++) w[j] = _mm_set_epi32(MD5_WORD(p[3], j), MD5_WORD(p[2], j), MD5_WORD(p[1], j), MD5_WORD(p[0], j));
+
+        __m128i a = h[0];
+        __m128i b = h[1];
+        __m128i c = h[2];
+        __m128i d = h[3];
+
+#define STEP(fn, a, b, c, d, g, t, s) { \
+            __m128i x = _mm_add_epi32(_mm_add_epi32(a, MD5_##fn##_X4(b, c, d)), _mm_add_epi32(_mm_set1_epi32(t), w[g])); \
+            a = _mm_add_epi32(b, _mm_or_si128(_mm_slli_epi32(x, s), _mm_srli_epi32(x, 32 - s))); \
+        }
+        MD5_STEPS(STEP)
+#undef STEP
+
+        // Only the lanes with this chunk are updated
+        __m128i mask = _mm_set_epi32(active[3], active[2], active[1], active[0]);
+        h[0] = _mm_add_epi32(h[0], _mm_and_si128(a, mask));
+        h[1] = _mm_add_epi32(h[1], _mm_and_si128(b, mask));
+        h[2] = _mm_add_epi32(h[2], _mm_and_si128(c, mask));
+        h[3] = _mm_add_epi32(h[3], _mm_and_si128(d, mask));
+    }
+
+    uint32_t lanes[4][4];
+    for (int i = 0; i < 4; i++) _mm_storeu_si128((__m128i *)lanes[i], h[i]);
+
+    for (int l = 0; l < 4; l++) {
+        uint32_t hl[4] = { lanes[0][l], lanes[1][l], lanes[2][l], lanes[3][l] };
+        md5_store(hl, results[l]);
+    }
+}
+#endif
+
 /**
  * This function calculates the MD5 hash of a given message, represented by the `initial_msg` buffer
  * with a specified length `initial_len`. The resulting MD5 hash is stored in the `result` buffer.
  *
+ * The message is processed in place, only the last chunks (with the padding) are copied.
+ *
  * @param initial_msg    The input message for which to calculate the MD5 hash.
  * @param initial_len    The length of the input message.
  * @param result         A buffer to store the resulting MD5 hash (must have space for 16 bytes).
@@ -52,119 +253,37 @@
  */
 
 int md5(uint8_t *initial_msg, size_t initial_len, uint8_t * result) {
- 
-    // Message (to prepare)
-    uint8_t *msg = NULL;
- 
-    // Note: All variables are unsigned 32 bit and wrap modulo 2^32 when calculating
- 
-    // r specifies the per-round shift amounts
- 
-    uint32_t r[] = {7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
-                    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
-                    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
-                    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
-
-    // Use binary integer part of the sines of integers (in radians) as constants// Initialize variables:
-    uint32_t k[] = {
-        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
-        0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
-        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
-        0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
-        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
-        0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
-        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
-        0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
-        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
-        0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
-        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
-        0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
-        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
-        0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
-        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
-        0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+    MD5_MSG m;
+    md5_prepare(&m, initial_msg, initial_len);
 
     // These vars will contain the hash
-//    uint32_t h[] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
-    uint32_t *h = ( uint32_t * ) result;
-    h[0] = 0x67452301;
-    h[1] = 0xefcdab89;
-    h[2] = 0x98badcfe;
-    h[3] = 0x10325476;
-
-    // Pre-processing: adding a single 1 bit
-    //append "1" bit to message    
-    /* Notice: the input bytes are considered as bits strings,
-       where the first bit is the most significant bit of the byte.[37] */
- 
-    // Pre-processing: padding with zeros
-    //append "0" bit until message length in bit ≡ 448 (mod 512)
-    //append length mod (2 pow 64) to message
- 
-    int new_len = ((((initial_len + 8) / 64) + 1) * 64) - 8;
- 
-    msg = calloc(new_len + 64, 1); // also appends "0" bits 
-                                   // (we alloc also 64 extra bytes...)
-
-    if ( !msg ) return 1;
-
-    memcpy(msg, initial_msg, initial_len);
-    msg[initial_len] = 128; // write the "1" bit
- 
-    uint32_t bits_len = 8*initial_len; // note, we append the len
-    memcpy(msg + new_len, &bits_len, 4);           // in bits at the end of the buffer
-
-    uint32_t i;
- 
+    uint32_t h[] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
     // Process the message in successive 512-bit chunks:
-    //for each 512-bit chunk of message:
-    int offset;
-    for(offset=0; offset<new_len; offset += (512/8)) { 
-        // break chunk into sixteen 32-bit words w[j], 0 ≤ j ≤ 15
-        uint32_t *w = (uint32_t *) (msg + offset);
- 
-        // Initialize hash value for this chunk:
-        uint32_t a = h[0];
-        uint32_t b = h[1];
-        uint32_t c = h[2];
-        uint32_t d = h[3];
- 
-        // Main loop:
-        for(i = 0; i<64; i++) {
-            uint32_t f, g;
- 
-            if (i < 16) {
-                f = (b & c) | ((~b) & d);
-                g = i;
-            } else if (i < 32) {
-                f = (d & b) | ((~d) & c);
-                g = (5*i + 1) % 16;
-            } else if (i < 48) {
-                f = b ^ c ^ d;
-                g = (3*i + 5) % 16;          
-            } else {
-                f = c ^ (b | (~d));
-                g = (7*i) % 16;
-            }
-
-            uint32_t temp = d;
-            d = c;
-            c = b;
-            b = b + LEFTROTATE((a + f + k[i] + w[g]), r[i]);
-            a = temp;
-        }
- 
-        // Add this chunk's hash to result so far:
- 
-        h[0] += a;
-        h[1] += b;
-        h[2] += c;
-        h[3] += d;
- 
-    }
- 
-    // cleanup
-    free(msg);
- 
+    for (size_t chunk = 0; chunk < m.num_chunks; chunk++) md5_process(h, md5_chunk(&m, chunk));
+
+    md5_store(h, result);
+
     return 0;
 }
+
+/**
+ * Calculates the MD5 hashes of several messages.
+ *
+ * With SSE2, the messages are hashed 4 at a time, one in each lane.
+ *
+ * @param msgs           The messages.
+ * @param lens           The lengths of the messages.
+ * @param count          The number of messages.
+ * @param results        Buffers to store the hashes (16 bytes each).
+ */
+
+void md5_multi(const uint8_t **msgs, const size_t *lens, size_t count, uint8_t **results) {
+    size_t i = 0;
+
+#ifdef MD5_SSE2
+    for ( ; i + 4 <= count; i += 4) md5_x4(&msgs[i], &lens[i], &results[i]);
+#endif
+
+    for ( ; i < count; i++) md5((uint8_t *)msgs[i], lens[i], results[i]);
+}
@@ -37,6 +37,7 @@
 #define __MD5_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 /**
  * This function calculates the MD5 hash of a given message, represented by the `initial_msg` buffer
@@ -51,4 +52,16 @@
 
 extern int md5(uint8_t *initial_msg, size_t initial_len, uint8_t * result);
 
+/**
+ * This function calculates the MD5 hashes of several messages at once, using SIMD lanes where
+ * available. It doesn't allocate memory.
+ *
+ * @param msgs           The input messages.
+ * @param lens           The lengths of the input messages.
+ * @param count          The number of messages.
+ * @param results        Buffers to store the resulting MD5 hashes (16 bytes each).
+ */
+
+extern void md5_multi(const uint8_t **msgs, const size_t *lens, size_t count, uint8_t **results);
+
 #endif
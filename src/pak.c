@@ -39,136 +39,361 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
 #include <unistd.h>
-#include <zlib.h>
-#include <lzma.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <zlib.h>
 
 #include "common.h"
 #include "psarc.h"
-#include "md5.h"
 #include "inettypes.h"
 #include "file_utils.h"
 #include "report.h"
 #include "threads.h"
+#include "coder.h"
+#include "unpak.h"
+#include "asyncio.h"
+#include "dictionary.h"
+#include "crc32c.h"
+#include "stats.h"
 
 static uint8_t *source_buffer = NULL;
 static uint8_t *target_buffer = NULL;
 static REPORT * report = NULL;
+static CODER * archive_coder = NULL;
+static FILE * source_archive = NULL;            // Archive being updated
+static uint32_t * source_blocktable = NULL;     // Block table of the archive being updated
+static int copy_errors = 0;                     // Errors copying entries from the archive being updated
+static int digest_errors = 0;                   // Errors calculating the digests of the names
+static ASYNCIO * read_queue = NULL;             // Blocks read ahead from the files being added (threads mode)
+
+#define DIGEST_BATCH    1024                    // Names hashed by each task (threads mode)
+#define READ_AHEAD_MAX  32                      // Max blocks read ahead from the files being added (threads mode)
+
+#define DICTIONARY_MAX_SIZE     32768           // Size of the preset dictionary (the zlib window)
+#define DICTIONARY_SAMPLES_SIZE 0x400000        // Data of the small files sampled to train the dictionary
+
+#define ADAPTIVE_PROBE_BLOCKS   2               // First blocks of a file that decide if the rest is worth compressing
+#define ADAPTIVE_MAX_ENTROPY    7.9             // Bits per byte above which a block isn't compressed (--adaptive)
+
+// How a block is stored
+#define BLOCK_COMPRESS  0                       // Compressed (unless it doesn't get smaller)
+#define BLOCK_ESTIMATE  1                       // Compressed only if its estimated entropy is low enough
+#define BLOCK_STORE     2                       // Stored without trying to compress it
+
+// Extensions of formats that are already compressed (--adaptive)
+static const char *adaptive_extensions[] = {
+    "png", "jpg", "jpeg", "gif", "webp",
+    "ogg", "oga", "opus", "mp3", "m4a", "aac", "flac", "wem",
+    "mp4", "m4v", "webm", "mkv", "bik", "bk2", "usm",
+    "zip", "gz", "tgz", "bz2", "xz", "lzma", "7z", "rar", "zst", "lz4", "psarc",
+    NULL
+};
+
+// Magic bytes of formats that are already compressed (--adaptive)
+static const struct {
+    size_t offset;
+    size_t size;
+    const char *bytes;
+} adaptive_magics[] = {
+    { 0, 8, "\x89PNG\r\n\x1a\n" },
+    { 0, 3, "\xff\xd8\xff" },                    // JPEG
+    { 0, 4, "GIF8" },
+    { 8, 4, "WEBP" },
+    { 0, 4, "OggS" },
+    { 0, 4, "fLaC" },
+    { 0, 3, "ID3" },                                // MP3
+    { 4, 4, "ftyp" },                               // MP4, M4A
+    { 0, 4, "PK\x03\x04" },                       // ZIP
+    { 0, 2, "\x1f\x8b" },                          // gzip
+    { 0, 3, "BZh" },
+    { 0, 6, "\xfd" "7zXZ\x00" },                   // xz
+    { 0, 6, "7z\xbc\xaf\x27\x1c" },
+    { 0, 4, "Rar!" },
+    { 0, 4, "\x28\xb5\x2f\xfd" },               // zstd
+    { 0, 4, "\x04\x22\x4d\x18" },               // lz4
+    { 0, 4, "PSAR" },
+    { 0, 0, NULL }
+};
+
+// Adaptive compression state of the file being added (--adaptive)
+static struct {
+    int store;                                  // The rest of the file is stored without compression
+    uint32_t probed;                            // Blocks of the file probed so far
+    uint32_t incompressible;                    // Probed blocks that aren't worth compressing
+} adaptive;
+
+// Preset dictionary of the archive (--dictionary, or kept from the archive being updated)
+static uint8_t dictionary_buffer[DICTIONARY_MAX_SIZE];  // Dictionary trained for the archive
+static const uint8_t *dictionary = NULL;                // Dictionary in use (NULL = none)
+static size_t dictionary_size = 0;                      // Size of the dictionary in use
 
 typedef struct {
     int is_first_block;
     int is_last_block;
     int is_not_last_file;
+    int is_duplicate;
+    FILEINFO *original;
+    FILEINFO *source;
+    char **names;
+    size_t num_names;
+    int digest_error;
     size_t data_size;
     FILE *fp;
     FILEINFO *fi;
     size_t *total_size;
     uint32_t *blocktable;
     uint32_t blocktable_idx;
+    uint8_t *write_buffer;
+    size_t bytes_write;
+    int block_mode;
+    uint32_t checksum;
     // allocate buffers data from here
     uint8_t buffers;
 } PAKDATA;
 
-void *compress_entry_thread(void *arg) {
-    THREADS_INFO *ti = (THREADS_INFO *) arg;
-    PAKDATA *pkd = (PAKDATA *)THREAD_GET_USER_DATA(ti);
+// Block being read ahead, its task is started once the read finishes
+typedef struct {
+    int slot;                   // Slot of the task
+    PAKDATA *pkd;               // Data of the task
+    FILE *fp;                   // File closed once the block is read (last block of the file)
+} READ_TASK;
 
-    uint8_t *buffers[2] = {
-            &pkd->buffers,
-            &pkd->buffers + _ArchiveInfo.block_size * 2
-        };
+static READ_TASK read_tasks[READ_AHEAD_MAX];    // Blocks being read ahead, in order
+static unsigned read_head = 0;                  // Oldest block being read ahead
 
-    size_t bytes_write;
+/**
+ * Estimates the entropy of a block, in bits per byte.
+ *
+ * It's the order-0 entropy (byte frequencies only), which bounds what the entropy coder of zlib
+ * or LZMA can get from the data. It's cheap compared to compressing the block.
+ *
+ * @param data          The data.
+ * @param size          Size of the data.
+ *
+ * @return              The entropy, from 0 to 8.
+ */
 
-    uint8_t *write_buffer = buffers[1];
+static double get_entropy(const uint8_t *data, size_t size) {
+    // Four histograms, so consecutive equal bytes don't wait on the same counter
+    uint32_t counts[4][256];
+    memset(counts, 0, sizeof(counts));
+
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        counts[0][data[i]]++;
+        counts[1][data[i + 1]]++;
+        counts[2][data[i + 2]]++;
+        counts[3][data[i + 3]]++;
+    }
+    for (; i < size; i++) counts[0][data[i]]++;
+
+    double entropy = 0;
+    for (int c = 0; c < 256; c++) {
+        uint32_t n = counts[0][c] + counts[1][c] + counts[2][c] + counts[3][c];
+        if (n) {
+            double p = (double)n / size;
+            entropy -= p * log2(p);
+        }
+    }
 
-    // Compress based on the compression type
-    switch (_ArchiveInfo.compression_type) {
-        case PSARC_ZLIB: {
-//            uLongf dest_len = compressBound(pkd->data_size);
-            uLongf dest_len = _ArchiveInfo.block_size * 2;
+    return entropy;
+}
 
-            compress2(write_buffer, &dest_len, buffers[0], pkd->data_size, _Config.compression_level);
-            bytes_write = dest_len;
+/**
+ * Checks whether a file is in a format that's already compressed, by its extension or its
+ * magic bytes.
+ *
+ * @param filename      Name of the file.
+ * @param data          The first block of the file.
+ * @param size          Size of the block.
+ *
+ * @return              1 if the file is already compressed, 0 otherwise.
+ */
 
-            // if compressed is > that plain data, then save plain data
-            if (bytes_write >= pkd->data_size) {
-                bytes_write = pkd->data_size;
-                write_buffer = buffers[0];
-            }
-            break;
+static int is_compressed_format(const char *filename, const uint8_t *data, size_t size) {
+    const char *ext = strrchr(filename, '.');
+    if (ext && !strchr(ext, '/') && !strchr(ext, '\\')) {
+        ext++;
+        for (int i = 0; adaptive_extensions[i]; i++) {
+            const char *e = adaptive_extensions[i];
+            size_t j = 0;
+            while (e[j] && tolower((unsigned char)ext[j]) == e[j]) j++;
+            if (!e[j] && !ext[j]) return 1;
         }
+    }
 
-        case PSARC_LZMA: {
-            lzma_ret ret;
-
-            uint64_t dest_len = _ArchiveInfo.block_size * 2;
-
-            // Structure for configuring compression options
-            lzma_options_lzma lzma_options;
-            lzma_lzma_preset(&lzma_options, _Config.compression_level | ( _Config.extreme_compression_flag ? LZMA_PRESET_EXTREME : 0 ));
-
-            // Structure for configuring compression filter
-            lzma_filter filters[] = {
-//                    { .id = LZMA_FILTER_X86, .options = NULL },
-//                    { .id = LZMA_FILTER_ARM, .options = NULL },
-//                    { .id = LZMA_FILTER_ARM64, .options = NULL },
-//                    { .id = LZMA_FILTER_ARMTHUMB, .options = NULL },
-//                    { .id = LZMA_FILTER_POWERPC, .options = NULL },
-//                    { .id = LZMA_FILTER_POWERPC, .options = NULL },
-//                    { .id = LZMA_FILTER_IA64, .options = NULL },
-//                    { .id = LZMA_FILTER_SPARC, .options = NULL },
-//                    { .id = LZMA_FILTER_DELTA, .options = NULL },
-                { .id = LZMA_FILTER_LZMA2, .options = &lzma_options },
-                { .id = LZMA_VLI_UNKNOWN, .options = NULL },
-            };
-
-            // Structure for compression
-            lzma_stream strm = LZMA_STREAM_INIT;
-
-            // Initialize the compression object
-            if ((ret = lzma_stream_encoder(&strm, filters, LZMA_CHECK_CRC64)) == LZMA_OK) {
-                strm.next_in = buffers[0];
-                strm.avail_in = pkd->data_size;
-                strm.next_out = write_buffer;
-                strm.avail_out = dest_len;
-
-                if ((ret = lzma_code(&strm, LZMA_FINISH)) == LZMA_STREAM_END || ret == LZMA_OK) {
-                    bytes_write = dest_len - strm.avail_out;
-                    // if compressed is >= that plain data, then save plain data
-                    if (bytes_write >= pkd->data_size) {
-                        bytes_write = pkd->data_size;
-                        write_buffer = buffers[0];
-                    }
-                } else {
-                    // Error, save block without compression
-                    bytes_write = pkd->data_size;
-                    write_buffer = buffers[0];
-                }
+    for (int i = 0; adaptive_magics[i].bytes; i++) {
+        if (size >= adaptive_magics[i].offset + adaptive_magics[i].size &&
+            !memcmp(data + adaptive_magics[i].offset, adaptive_magics[i].bytes, adaptive_magics[i].size)) return 1;
+    }
 
-                lzma_end(&strm);
-            } else {
-                // Error, save block without compression
-                bytes_write = pkd->data_size;
-                write_buffer = buffers[0];
-            }
+    return 0;
+}
 
-            break;
-        }
+/**
+ * Decides how a block of a file is stored (--adaptive).
+ *
+ * Files in a compressed format are stored as they're. Otherwise, the first blocks of the file
+ * are probed: if none of them is worth compressing, the rest of the file is stored too; if not,
+ * each block is estimated when it's compressed. The blocks of a file must be passed in order.
+ *
+ * @param fi            Information about the file.
+ * @param data          The block data.
+ * @param data_size     Size of the block data.
+ * @param is_first_block Flag indicating whether it's the first block of the file.
+ *
+ * @return              BLOCK_COMPRESS, BLOCK_ESTIMATE or BLOCK_STORE.
+ */
 
-        default:
-        case PSARC_STORE: {
-            // Store compression type, simply copy the input to the output
-            bytes_write = pkd->data_size;
-            write_buffer = buffers[0];
-            break;
-        }
+static int get_block_mode(FILEINFO *fi, const uint8_t *data, size_t data_size, int is_first_block) {
+    if (!_Config.adaptive_flag || _ArchiveInfo.compression_type == PSARC_STORE) return BLOCK_COMPRESS;
+
+    if (is_first_block) {
+        adaptive.store = is_compressed_format(fi->filename, data, data_size);
+        adaptive.probed = adaptive.incompressible = 0;
+    }
+
+    if (adaptive.store) return BLOCK_STORE;
+
+    if (adaptive.probed == ADAPTIVE_PROBE_BLOCKS) return BLOCK_ESTIMATE;
+
+    int is_incompressible = get_entropy(data, data_size) > ADAPTIVE_MAX_ENTROPY;
+
+    adaptive.probed++;
+    adaptive.incompressible += is_incompressible;
+    if (adaptive.incompressible == ADAPTIVE_PROBE_BLOCKS) adaptive.store = 1;
+
+    return is_incompressible ? BLOCK_STORE : BLOCK_COMPRESS;
+}
+
+/**
+ * Compresses a block based on the archive compression type.
+ *
+ * If the compressed block is not smaller than the plain data (or the compression fails), the
+ * block is stored without compression.
+ *
+ * @param coder         The coder used to compress the block.
+ * @param data          The plain data.
+ * @param data_size     Size of the plain data.
+ * @param out           Output buffer for the compressed data (at least data_size bytes).
+ * @param write_buffer  Pointer to receive the buffer to write (out or data).
+ * @param block_mode    How the block is stored (see get_block_mode()).
+ *
+ * @return              The number of bytes to write.
+ */
+
+static size_t compress_block(CODER *coder, uint8_t *data, size_t data_size, uint8_t *out, uint8_t **write_buffer, int block_mode) {
+    size_t bytes_write = 0;
+
+    if (block_mode == BLOCK_ESTIMATE) block_mode = get_entropy(data, data_size) > ADAPTIVE_MAX_ENTROPY ? BLOCK_STORE : BLOCK_COMPRESS;
+
+    // Anything that doesn't fit in data_size bytes is stored without compression
+    if (coder && _ArchiveInfo.compression_type != PSARC_STORE && block_mode == BLOCK_COMPRESS) {
+        uint64_t start = STATS_BEGIN();
+        bytes_write = coder_compress(coder, _ArchiveInfo.compression_type, _Config.compression_level, _Config.extreme_compression_flag, data, data_size, out, data_size);
+        STATS_END(STATS_COMPRESS, start, data_size);
+    }
+
+    if (!bytes_write || bytes_write >= data_size) {
+        *write_buffer = data;
+        return data_size;
     }
 
-    threads_wait_for_orderer_continue(ti);
+    *write_buffer = out;
+    return bytes_write;
+}
+
+/**
+ * Makes an entry share the data of an identical entry (--dedup).
+ *
+ * @param fi        The duplicate entry.
+ * @param original  The first copy of the data.
+ */
+
+static void share_entry_data(FILEINFO *fi, FILEINFO *original) {
+    fi->offset = original->offset;
+    fi->block_index = original->block_index;
+    fi->compressed_size = 0;
+    fi->checksum = original->checksum;
+}
+
+/**
+ * Copies the blocks of an entry of the archive being updated, without recompressing them.
+ *
+ * @param archive_file      File pointer to the archive output file.
+ * @param fi                Information about the new entry (output).
+ * @param source            The entry in the archive being updated.
+ * @param total_size        Total size of compressed data processed so far (output).
+ * @param blocktable        Table of compressed block sizes (output).
+ * @param blocktable_idx    Index of the first block of the entry in the block table.
+ *
+ * @return                  0 if successful, 1 on error.
+ */
+
+static int copy_entry(FILE *archive_file, FILEINFO *fi, FILEINFO *source, size_t *total_size, uint32_t *blocktable, uint32_t blocktable_idx) {
+    uint64_t size = get_compressed_size(source, source_blocktable);
+
+    fi->offset = *total_size;
+    fi->block_index = blocktable_idx;
+    fi->compressed_size = size;
+    fi->checksum = source->checksum;
+
+    memcpy(&blocktable[blocktable_idx], &source_blocktable[source->block_index], fi->num_blocks * sizeof(uint32_t));
+
+    *total_size += size;
+
+    uint64_t start = STATS_BEGIN();
+
+    if (size && copy_archive_data(source_archive, archive_file, source->offset, size)) {
+        copy_errors++;
+        return 1;
+    }
+
+    STATS_END(STATS_WRITE, start, size);
+
+    return 0;
+}
+
+/**
+ * Commits a compressed block to the archive.
+ *
+ * Runs on the writer stage, strictly in block order: writes the block and fills the block table
+ * and the file information.
+ *
+ * @param ti    Pointer to the THREADS_INFO structure of the finished task.
+ */
+
+static void compress_entry_writer(THREADS_INFO *ti) {
+    PAKDATA *pkd = (PAKDATA *)THREAD_GET_USER_DATA(ti);
 
-    fwrite(write_buffer, bytes_write, 1, pkd->fp);
+    if ( pkd->names ) {
+        digest_errors += pkd->digest_error;
+        return;
+    }
+
+    if ( pkd->source ) {
+        // Entries kept from the archive being updated aren't reported
+        if ( pkd->fi->duplicate_of ) share_entry_data(pkd->fi, pkd->original);
+        else                         copy_entry(pkd->fp, pkd->fi, pkd->source, pkd->total_size, pkd->blocktable, pkd->blocktable_idx);
+        return;
+    }
+
+    if ( pkd->is_duplicate ) {
+        // The first copy is already committed, blocks are committed in order
+        report_open_file_item(report, pkd->fi);
+        share_entry_data(pkd->fi, pkd->original);
+        report_close_file_item(report, pkd->fi->uncompressed_size, pkd->fi->compressed_size, NULL, pkd->is_not_last_file);
+        return;
+    }
+
+    size_t bytes_write = pkd->bytes_write;
+
+    uint64_t start = STATS_BEGIN();
+    fwrite(pkd->write_buffer, bytes_write, 1, pkd->fp);
+    STATS_END(STATS_WRITE, start, bytes_write);
 
     if ( pkd->is_first_block ) {
         report_open_file_item(report, pkd->fi);
@@ -179,21 +404,195 @@ void *compress_entry_thread(void *arg) {
         pkd->fi->compressed_size += bytes_write;
     }
 
+    // The checksums of the blocks are combined in order
+    if ( _ArchiveInfo.archive_flags & AF_CHECKSUMS ) {
+        pkd->fi->checksum = pkd->is_first_block ? pkd->checksum : crc32c_combine(pkd->fi->checksum, pkd->checksum, pkd->data_size);
+    }
+
     *(pkd->total_size) += bytes_write;
     pkd->blocktable[pkd->blocktable_idx] = bytes_write;
 
     if ( pkd->is_last_block ) {
         report_close_file_item(report, pkd->fi->uncompressed_size, pkd->fi->compressed_size, NULL, pkd->is_not_last_file);
     }
+}
+
+/**
+ * Compresses a block on a worker thread.
+ *
+ * The compressed block is handed to the writer stage, so the worker is free to take the next
+ * block without waiting for its turn.
+ *
+ * @param arg   Pointer to the THREADS_INFO structure of the thread.
+ */
+
+void *compress_entry_thread(void *arg) {
+    THREADS_INFO *ti = (THREADS_INFO *) arg;
+    PAKDATA *pkd = (PAKDATA *)THREAD_GET_USER_DATA(ti);
+
+    if ( pkd->names ) {
+        pkd->digest_error = get_name_digests(pkd->names, pkd->num_names, pkd->fi);
+        threads_task_done(ti);
+        return NULL;
+    }
+
+    if ( pkd->is_duplicate || pkd->source ) {
+        threads_task_done(ti);
+        return NULL;
+    }
+
+    uint8_t *buffers[2] = {
+            &pkd->buffers,
+            &pkd->buffers + _ArchiveInfo.block_size * 2
+        };
+
+    // The coder is kept by the worker and reused for all its blocks
+    CODER *coder = (CODER *)THREAD_LOCAL_DATA(ti);
+    if (!coder) {
+        coder = THREAD_LOCAL_DATA(ti) = coder_new();
+        if (coder) coder_set_dictionary(coder, dictionary, dictionary_size);
+    }
 
-    threads_completed(ti);
+    if ( _ArchiveInfo.archive_flags & AF_CHECKSUMS ) pkd->checksum = crc32c(0, buffers[0], pkd->data_size);
+
+    uint8_t *write_buffer;
+    size_t bytes_write = compress_block(coder, buffers[0], pkd->data_size, buffers[1], &write_buffer, pkd->block_mode);
+
+    pkd->write_buffer = write_buffer;
+    pkd->bytes_write = bytes_write;
+
+    threads_task_done(ti);
 
     return NULL;
 }
 
+/**
+ * Queues an entry that shares the data of a previous entry (threads mode).
+ *
+ * The entry doesn't have blocks of its own; the task only takes its turn on the writer stage,
+ * once the data of the first copy is committed.
+ *
+ * @param fi                 Information about the duplicate file (output).
+ * @param original           The first copy of the data.
+ * @param is_not_last_file   Whether more files follow (for the report).
+ */
+
+static void share_entry_multi(FILEINFO *fi, FILEINFO *original, int is_not_last_file) {
+    PAKDATA *pkd;
+
+    int slot = threads_get_free_slot( (void **) &pkd );
+
+    pkd->is_duplicate = 1;
+    pkd->source = NULL;
+    pkd->names = NULL;
+    pkd->fi = fi;
+    pkd->original = original;
+    pkd->is_not_last_file = is_not_last_file;
+
+    threads_start_task( slot, compress_entry_thread, pkd );
+}
+
+/**
+ * Queues an entry kept from the archive being updated (threads mode).
+ *
+ * Its blocks are copied on the writer stage, in order with the rest of the entries.
+ *
+ * @param archive_file       File pointer to the archive output file.
+ * @param fi                 Information about the new entry (output).
+ * @param source             The entry in the archive being updated.
+ * @param original           The first copy of the data, if the entry shares it (or NULL).
+ * @param total_size         Total size of compressed data processed so far (output).
+ * @param blocktable         Table of compressed block sizes (output).
+ * @param blocktable_idx     Index for the next entry in the block table (output).
+ */
+
+static void copy_entry_multi(FILE *archive_file, FILEINFO *fi, FILEINFO *source, FILEINFO *original, size_t *total_size, uint32_t *blocktable, uint32_t *blocktable_idx) {
+    PAKDATA *pkd;
+
+    int slot = threads_get_free_slot( (void **) &pkd );
+
+    pkd->is_duplicate = 0;
+    pkd->source = source;
+    pkd->names = NULL;
+    pkd->original = original;
+    pkd->fp = archive_file;
+    pkd->fi = fi;
+    pkd->total_size = total_size;
+    pkd->blocktable = blocktable;
+    pkd->blocktable_idx = *blocktable_idx;
+
+    threads_start_task( slot, compress_entry_thread, pkd );
+
+    if ( !fi->duplicate_of ) *blocktable_idx += fi->num_blocks;
+}
+
+/**
+ * Queues the calculation of the digests of a batch of entry names (threads mode).
+ *
+ * The batches are queued along with the entries, so the digests are calculated by the workers
+ * while the files are compressed.
+ *
+ * @param names              The entry names, as stored in the manifest.
+ * @param num_names          Number of names.
+ * @param fi                 The entries that receive the digests (one per name).
+ */
+
+static void digest_names_multi(char **names, size_t num_names, FILEINFO *fi) {
+    PAKDATA *pkd;
+
+    int slot = threads_get_free_slot( (void **) &pkd );
+
+    pkd->is_duplicate = 0;
+    pkd->source = NULL;
+    pkd->names = names;
+    pkd->num_names = num_names;
+    pkd->fi = fi;
+    pkd->digest_error = 0;
+
+    threads_start_task( slot, compress_entry_thread, pkd );
+}
+
+/**
+ * Starts the task of the oldest block being read ahead, once its read finishes.
+ *
+ * The file of the block is closed if it's the last one of the file.
+ */
+
+static void read_queue_dispatch() {
+    uint64_t start = STATS_BEGIN();
+    int64_t bytes_read = asyncio_wait(read_queue);
+    STATS_END(STATS_READ, start, bytes_read > 0 ? bytes_read : 0);
+
+    READ_TASK *rt = &read_tasks[read_head];
+    if ( bytes_read != rt->pkd->data_size ) rt->pkd->data_size = 0;
+
+    rt->pkd->block_mode = get_block_mode(rt->pkd->fi, &rt->pkd->buffers, rt->pkd->data_size, rt->pkd->is_first_block);
+
+    threads_start_task( rt->slot, compress_entry_thread, rt->pkd );
+
+    if ( rt->fp ) fclose(rt->fp);
+
+    read_head = ( read_head + 1 ) % asyncio_get_depth(read_queue);
+}
+
+/**
+ * Starts the tasks of all the blocks being read ahead.
+ *
+ * Tasks are committed in the order they're started, so this must be called before starting any
+ * other kind of entry task, and before waiting for the threads pool.
+ */
+
+static void read_queue_flush() {
+    while ( read_queue && asyncio_get_pending(read_queue) ) read_queue_dispatch();
+}
+
 /**
  * Compresses an entry based on the specified compression type.
  *
+ * The blocks are read ahead through the read queue, which keeps several reads in flight (from
+ * this and the next files) while the workers compress the blocks already read. The input file
+ * is owned by the function, it's closed once its last block is read.
+ *
  * @param input_mem          Pointer to the input memory buffer (for in-memory data).
  * @param input_size         Size of the input data.
  * @param input_fp           File pointer to the input file (if reading from a file).
@@ -208,19 +607,23 @@ void *compress_entry_thread(void *arg) {
 
 static int compress_entry_multi(FILE *input_fp, FILE *archive_file, FILEINFO *fi, size_t *total_size, uint32_t *blocktable, uint32_t *blocktable_idx, int is_not_last_file) {
     uint64_t to_read;
-    size_t bytes_uncompressed = 0;
+    uint64_t offset = 0;
 
     if ( fi->uncompressed_size ) {
         uint32_t blocks = ( fi->uncompressed_size + _ArchiveInfo.block_size - 1 ) / _ArchiveInfo.block_size;
         uint32_t first_block = 1;
+        unsigned depth = read_queue ? asyncio_get_depth(read_queue) : 0;
+
+#ifdef POSIX_FADV_WILLNEED
+        // Small files are read by the kernel at once, big ones with a larger read-ahead window
+        posix_fadvise(fileno(input_fp), 0, 0, blocks <= depth ? POSIX_FADV_WILLNEED : POSIX_FADV_SEQUENTIAL);
+#endif
 
         while(blocks) {
-            if ( blocks > 1 ) {
-                to_read = _ArchiveInfo.block_size;
-            } else {
-                to_read = fi->uncompressed_size - bytes_uncompressed;
-                if (to_read > _ArchiveInfo.block_size ) to_read = _ArchiveInfo.block_size;
-            }
+            if ( depth && asyncio_get_pending(read_queue) == depth ) read_queue_dispatch();
+
+            to_read = fi->uncompressed_size - offset;
+            if (to_read > _ArchiveInfo.block_size ) to_read = _ArchiveInfo.block_size;
 
             PAKDATA *pkd;
 
@@ -240,18 +643,38 @@ static int compress_entry_multi(FILE *input_fp, FILE *archive_file, FILEINFO *fi
             pkd->blocktable = blocktable;
             pkd->blocktable_idx = *blocktable_idx;
             pkd->is_not_last_file = is_not_last_file;
+            pkd->is_duplicate = 0;
+            pkd->source = NULL;
+            pkd->names = NULL;
+
+            if ( depth ) {
+                READ_TASK *rt = &read_tasks[( read_head + asyncio_get_pending(read_queue) ) % depth];
+                rt->slot = slot;
+                rt->pkd = pkd;
+                rt->fp = blocks == 1 ? input_fp : NULL;
+
+                pkd->data_size = to_read;
+                asyncio_read(read_queue, fileno(input_fp), buffers[0], to_read, offset);
+            } else {
+                uint64_t start = STATS_BEGIN();
+                pkd->data_size = fread(buffers[0], to_read, 1, input_fp) * to_read;
+                STATS_END(STATS_READ, start, pkd->data_size);
+                pkd->block_mode = get_block_mode(fi, buffers[0], pkd->data_size, first_block);
 
-            pkd->data_size = fread(buffers[0], to_read, 1, input_fp) * to_read;
-
-            threads_start_task( slot, compress_entry_thread, pkd );
+                threads_start_task( slot, compress_entry_thread, pkd );
+            }
 
-            bytes_uncompressed += pkd->data_size;
+            offset += to_read;
             (*blocktable_idx)++;
             blocks--;
             first_block = 0;
         }
+
+        if ( !depth ) fclose(input_fp);
     } else {
         fi->compressed_size = 0;
+        fi->checksum = 0;
+        fclose(input_fp);
     }
 
     return 0;
@@ -282,13 +705,17 @@ static int compress_entry(const unsigned char *input_mem, size_t input_size, FIL
 
     fi->offset = *total_size;
     fi->block_index = *blocktable_idx;
+    fi->checksum = 0;
 
     uint32_t blocks = fi->num_blocks;
     uint64_t to_read;
     unsigned char *read_buffer;
 
+    // The coder is kept and reused for all the blocks of the archive
+    if (!archive_coder) archive_coder = coder_new();
+
     while (blocks) {
-        uint8_t *write_buffer = target_buffer;
+        uint8_t *write_buffer;
 
         if ( blocks > 1 ) {
             to_read = chunk_size;
@@ -298,96 +725,24 @@ static int compress_entry(const unsigned char *input_mem, size_t input_size, FIL
         }
 
         if ( input_fp ) {
+            uint64_t start = STATS_BEGIN();
             bytes_read = fread(source_buffer, to_read, 1, input_fp) * to_read;
+            STATS_END(STATS_READ, start, bytes_read);
             read_buffer = source_buffer;
         } else {
             bytes_read = to_read;
             read_buffer = &((unsigned char *)input_mem)[bytes_uncompressed];
         }
 
-        // Compress based on the compression type
-        switch (_ArchiveInfo.compression_type) {
-            case PSARC_ZLIB: {
-                uLongf dest_len = compressBound(bytes_read);
-
-                compress2(write_buffer, &dest_len, read_buffer, bytes_read, _Config.compression_level);
-                bytes_write = dest_len;
-
-                // if compressed is > that plain data, then save plain data
-                if (bytes_write >= bytes_read) {
-                    bytes_write = bytes_read;
-                    write_buffer = read_buffer;
-                }
-                break;
-            }
-
-            case PSARC_LZMA: {
-                lzma_ret ret;
-
-                uint64_t dest_len = chunk_size;
-
-                // Structure for configuring compression options
-                lzma_options_lzma lzma_options;
-                lzma_lzma_preset(&lzma_options, _Config.compression_level | ( _Config.extreme_compression_flag ? LZMA_PRESET_EXTREME : 0 ));
-    
-                // Structure for configuring compression filter
-                lzma_filter filters[] = {
-//                    { .id = LZMA_FILTER_X86, .options = NULL },
-//                    { .id = LZMA_FILTER_ARM, .options = NULL },
-//                    { .id = LZMA_FILTER_ARM64, .options = NULL },
-//                    { .id = LZMA_FILTER_ARMTHUMB, .options = NULL },
-//                    { .id = LZMA_FILTER_POWERPC, .options = NULL },
-//                    { .id = LZMA_FILTER_POWERPC, .options = NULL },
-//                    { .id = LZMA_FILTER_IA64, .options = NULL },
-//                    { .id = LZMA_FILTER_SPARC, .options = NULL },
-//                    { .id = LZMA_FILTER_DELTA, .options = NULL },
-                    { .id = LZMA_FILTER_LZMA2, .options = &lzma_options },
-                    { .id = LZMA_VLI_UNKNOWN, .options = NULL },
-                };
-
-                // Structure for compression
-                lzma_stream strm = LZMA_STREAM_INIT;
-
-                // Initialize the compression object
-                if ((ret = lzma_stream_encoder(&strm, filters, LZMA_CHECK_CRC64)) == LZMA_OK) {
-                    strm.next_in = read_buffer;
-                    strm.avail_in = bytes_read;
-                    strm.next_out = write_buffer;
-                    strm.avail_out = dest_len;
-
-                    if ((ret = lzma_code(&strm, LZMA_FINISH)) == LZMA_STREAM_END || ret == LZMA_OK) {
-                        bytes_write = dest_len - strm.avail_out;
-                        // if compressed is >= that plain data, then save plain data
-                        if (bytes_write >= bytes_read) {
-                            bytes_write = bytes_read;
-                            write_buffer = read_buffer;
-                        }
-                    } else {
-                        // Error, save block without compression
-                        bytes_write = bytes_read;
-                        write_buffer = read_buffer;
-                    }
-
-                    lzma_end(&strm);
-                } else {
-                    // Error, save block without compression
-                    bytes_write = bytes_read;
-                    write_buffer = read_buffer;
-                }
-                lzma_end(&strm);
-                break;
-            }
+        if ( _ArchiveInfo.archive_flags & AF_CHECKSUMS ) fi->checksum = crc32c(fi->checksum, read_buffer, bytes_read);
 
-            default:
-            case PSARC_STORE: {
-                // Store compression type, simply copy the input to the output
-                bytes_write = bytes_read;
-                write_buffer = read_buffer;
-                break;
-            }
-        }
+        // The manifest is always compressed
+        int block_mode = input_fp ? get_block_mode(fi, read_buffer, bytes_read, blocks == fi->num_blocks) : BLOCK_COMPRESS;
+        bytes_write = compress_block(archive_coder, read_buffer, bytes_read, target_buffer, &write_buffer, block_mode);
 
+        uint64_t start = STATS_BEGIN();
         fwrite(write_buffer, bytes_write, 1, archive_file);
+        STATS_END(STATS_WRITE, start, bytes_write);
 
         bytes_compressed += bytes_write;
         bytes_uncompressed += bytes_read;
@@ -410,6 +765,9 @@ static int compress_entry(const unsigned char *input_mem, size_t input_size, FIL
  * This function takes an array of file paths and calculates the block table size
  * based on the file sizes and _ArchiveInfo.block_size.
  *
+ * Entries without a file path (kept from the archive being updated) must have their size already
+ * set.
+ *
  * @param files             Array of file paths to process.
  * @param num_files         Number of files in the array.
  * @param fi                Array of TOC entries
@@ -421,10 +779,13 @@ static uint32_t get_blocktable_size(char **files, size_t num_files, FILEINFO * f
     uint32_t block_off = 0;
 
     for (size_t i = 0; i < num_files; ++i) {
-        struct stat file_stat;
-        if ( stat(files[i], &file_stat) ) return 0;
+        if ( files[i] ) {
+            struct stat file_stat;
+            if ( stat(files[i], &file_stat) ) return 0;
 
-        fi[i].uncompressed_size = (uint64_t) file_stat.st_size;
+            fi[i].uncompressed_size = (uint64_t) file_stat.st_size;
+        }
+        fi[i].duplicate_of = 0;
         fi[i].num_blocks = ( fi[i].uncompressed_size + _ArchiveInfo.block_size - 1 ) / _ArchiveInfo.block_size;
 
         // Calculate the next block_offset        
@@ -434,56 +795,338 @@ static uint32_t get_blocktable_size(char **files, size_t num_files, FILEINFO * f
     return block_off;
 }
 
+// File size and index, for sorting the files by size
+typedef struct {
+    uint64_t size;
+    uint32_t index;
+    uint32_t crc;
+} DEDUPITEM;
+
 /**
- * Writes the PSARC file header to the output file.
+ * Compares two files by size, crc and index (qsort callback).
+ */
+
+static int dedup_item_cmp(const void *a, const void *b) {
+    const DEDUPITEM *da = (const DEDUPITEM *)a;
+    const DEDUPITEM *db = (const DEDUPITEM *)b;
+
+    if (da->size != db->size) return da->size < db->size ? -1 : 1;
+    if (da->crc != db->crc) return da->crc < db->crc ? -1 : 1;
+    if (da->index != db->index) return da->index < db->index ? -1 : 1;
+    return 0;
+}
+
+/**
+ * Calculates the CRC-32 of a file.
  *
- * @param output_file        File pointer to the PSARC output file.
+ * @param filename          The file path.
+ * @param buffer            Buffer for reading the file.
+ * @param buffer_size       Size of the buffer.
+ * @param crc               Pointer to receive the CRC-32.
+ *
+ * @return                  0 if successful, 1 on error.
  */
 
-static void write_header(FILE *output_file) {
-    // Create an instance of the PSARCHEADER structure and initialize its fields
-    PSARCHEADER header;
+static int get_file_crc(const char *filename, uint8_t *buffer, size_t buffer_size, uint32_t *crc) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return 1;
 
-    fseek(output_file, 0, SEEK_SET);
+    uLong c = crc32(0L, Z_NULL, 0);
+    size_t n;
+    while ((n = fread(buffer, 1, buffer_size, fp)) > 0) c = crc32(c, buffer, n);
 
-    strcpy(header.magic, "PSAR"); // 'PSAR'
-    header.version = htonl(0x00010004); // v1.4
-    if ( _ArchiveInfo.compression_type == PSARC_LZMA ) {
-        strcpy(header.compression_type, "lzma"); // 'lzma'
-    } else {
-        strcpy(header.compression_type, "zlib"); // 'zlib'
-    }
-    header.toc_length = htonl(_ArchiveInfo.toc_length);
-    header.toc_entry_size = htonl(0x1E);
-    header.toc_entries = htonl(_ArchiveInfo.toc_entries);
-    header.block_size = htonl(_ArchiveInfo.block_size);
-    header.archive_flags = htonl(_ArchiveInfo.archive_flags);
+    int ret = ferror(fp) ? 1 : 0;
+    fclose(fp);
 
-    // Write the header uncompressed
-    fwrite(&header, sizeof(header), 1, output_file);
+    *crc = c;
+    return ret;
 }
 
 /**
- * Writes the table of contents (TOC) entries to the output file.
+ * Compares the contents of two files of the same size.
  *
- * @param output_file        File pointer to the PSARC output file.
- * @param files_info_table         Array of FILEINFO structures containing TOC information.
+ * @param filename1         The first file path.
+ * @param filename2         The second file path.
+ * @param buffer1           Buffer for reading the first file.
+ * @param buffer2           Buffer for reading the second file.
+ * @param buffer_size       Size of the buffers.
+ *
+ * @return                  1 if the files are identical, 0 otherwise (or on error).
  */
 
-static void write_toc_table(FILE *output_file, FILEINFO *files_info_table) {
-    PSARCTOC toc;
+static int files_are_equal(const char *filename1, const char *filename2, uint8_t *buffer1, uint8_t *buffer2, size_t buffer_size) {
+    FILE *fp1 = fopen(filename1, "rb");
+    if (!fp1) return 0;
 
-    fseek(output_file, sizeof(PSARCHEADER), SEEK_SET);
+    FILE *fp2 = fopen(filename2, "rb");
+    if (!fp2) {
+        fclose(fp1);
+        return 0;
+    }
 
-    for (int i = 0; i < _ArchiveInfo.toc_entries; i++) {
-        // Write name_digest (16 bytes) uncompressed
-        if (i) md5((uint8_t *)files_info_table[i].filename, strlen(files_info_table[i].filename), (uint8_t *)toc.name_digest);
+    int equal = 1;
+    size_t n;
+    while (equal && (n = fread(buffer1, 1, buffer_size, fp1)) > 0) {
+        equal = fread(buffer2, 1, n, fp2) == n && !memcmp(buffer1, buffer2, n);
+    }
+    if (ferror(fp1)) equal = 0;
+
+    fclose(fp1);
+    fclose(fp2);
+
+    return equal;
+}
+
+/**
+ * Finds the files with the same contents as a previous file (--dedup).
+ *
+ * Files are grouped by size, only files with the same size are hashed (CRC-32), and files with
+ * the same hash are compared byte by byte. Each duplicate gets the entry of its first copy in
+ * duplicate_of, so it can share its data.
+ *
+ * Entries must point to a run of consecutive blocks, so only whole files are deduplicated.
+ *
+ * @param files             Array of file paths to process.
+ * @param num_files         Number of files in the array.
+ * @param fi                Array of TOC entries (the first file is entry 1).
+ *
+ * @return                  The number of blocks saved, or -1 on error.
+ */
+
+static int64_t find_duplicates(char **files, size_t num_files, FILEINFO * fi) {
+    DEDUPITEM *items = (DEDUPITEM *)malloc((num_files ? num_files : 1) * sizeof(DEDUPITEM));
+    uint8_t *buffers = malloc(2 * 65536);
+    if (!items || !buffers) {
+        free(items);
+        free(buffers);
+        return -1;
+    }
+
+    // Entries without a file path are left out
+    for (size_t i = 0; i < num_files; i++) {
+        items[i].size = files[i] ? fi[i].uncompressed_size : 0;
+        items[i].index = i;
+        items[i].crc = 0;
+    }
+
+    qsort(items, num_files, sizeof(DEDUPITEM), dedup_item_cmp);
+
+    // Hash only the files that share their size with other files
+    for (size_t i = 0; i < num_files; ) {
+        size_t j = i + 1;
+        while (j < num_files && items[j].size == items[i].size) j++;
+
+        if (j - i > 1 && items[i].size) {
+            for (size_t k = i; k < j; k++) {
+                if (get_file_crc(files[items[k].index], buffers, 65536, &items[k].crc)) {
+                    free(items);
+                    free(buffers);
+                    return -1;
+                }
+            }
+        }
+
+        i = j;
+    }
+
+    qsort(items, num_files, sizeof(DEDUPITEM), dedup_item_cmp);
+
+    int64_t blocks_saved = 0;
+
+    // In a run with the same size and hash, compare each file with the previous distinct files
+    for (size_t i = 0; i < num_files; ) {
+        size_t j = i + 1;
+        while (j < num_files && items[j].size == items[i].size && items[j].crc == items[i].crc) j++;
+
+        if (items[i].size) {
+            for (size_t k = i + 1; k < j; k++) {
+                for (size_t o = i; o < k; o++) {
+                    if (fi[items[o].index].duplicate_of) continue;
+                    if (files_are_equal(files[items[o].index], files[items[k].index], buffers, buffers + 65536, 65536)) {
+                        fi[items[k].index].duplicate_of = items[o].index + 1;
+                        blocks_saved += fi[items[k].index].num_blocks;
+                        break;
+                    }
+                }
+            }
+        }
+
+        i = j;
+    }
+
+    free(items);
+    free(buffers);
+
+    return blocks_saved;
+}
+
+/**
+ * Finds the kept entries that share their data with a previous kept entry (update mode).
+ *
+ * Entries deduplicated in the archive being updated start at the same block. They get the
+ * first of them in duplicate_of, so they keep sharing the data in the new archive.
+ *
+ * @param sources           Array of entries of the archive being updated.
+ * @param files             Array of file paths (NULL for the kept entries).
+ * @param num_files         Number of entries in the arrays.
+ * @param fi                Array of TOC entries (the first file is entry 1).
+ *
+ * @return                  The number of blocks saved.
+ */
+
+static uint32_t find_shared_sources(FILEINFO **sources, char **files, size_t num_files, FILEINFO * fi) {
+    DEDUPITEM *items = (DEDUPITEM *)malloc((num_files ? num_files : 1) * sizeof(DEDUPITEM));
+    if (!items) return 0; // The data is copied for each entry
+
+    // Sorted by first block in the archive being updated
+    size_t num_items = 0;
+    for (size_t i = 0; i < num_files; i++) {
+        if (files[i] || !sources[i]->uncompressed_size) continue;
+        items[num_items].size = sources[i]->block_index;
+        items[num_items].index = i;
+        items[num_items].crc = 0;
+        num_items++;
+    }
+
+    qsort(items, num_items, sizeof(DEDUPITEM), dedup_item_cmp);
+
+    uint32_t blocks_saved = 0;
+
+    for (size_t i = 1, first = 0; i < num_items; i++) {
+        if (items[i].size != items[first].size) {
+            first = i;
+            continue;
+        }
+
+        if (sources[items[i].index]->uncompressed_size == sources[items[first].index]->uncompressed_size) {
+            fi[items[i].index].duplicate_of = items[first].index + 1;
+            blocks_saved += fi[items[i].index].num_blocks;
+        }
+    }
+
+    free(items);
+
+    return blocks_saved;
+}
+
+/**
+ * Trains the preset dictionary of the archive from a sample of the small files (--dictionary).
+ *
+ * Only the files smaller than a block are sampled, the ones that get no context from their
+ * siblings. If they don't fit in DICTIONARY_SAMPLES_SIZE, they are sampled evenly over the list.
+ *
+ * @param files             Array of file paths (NULL for the entries kept from the archive being updated).
+ * @param num_files         Number of files in the array.
+ * @param fi                Array of TOC entries (with their sizes).
+ *
+ * @return                  Size of the dictionary (in dictionary_buffer), 0 if there's none.
+ */
+
+static size_t train_dictionary(char **files, size_t num_files, FILEINFO *fi) {
+    uint64_t total_size = 0;
+    size_t num_small = 0;
+
+    for (size_t i = 0; i < num_files; i++) {
+        if ( files[i] && !fi[i].duplicate_of && fi[i].uncompressed_size && fi[i].uncompressed_size < _ArchiveInfo.block_size ) {
+            total_size += fi[i].uncompressed_size;
+            num_small++;
+        }
+    }
+
+    if ( num_small < 2 ) return 0;
+
+    // Every step-th small file is sampled
+    uint64_t step = total_size / DICTIONARY_SAMPLES_SIZE + 1;
+    size_t samples_size = total_size < DICTIONARY_SAMPLES_SIZE ? total_size : DICTIONARY_SAMPLES_SIZE;
+
+    uint8_t *samples = malloc(samples_size);
+    size_t *sample_sizes = malloc((num_small / step + 1) * sizeof(size_t));
+    if ( !samples || !sample_sizes ) {
+        free(samples);
+        free(sample_sizes);
+        return 0;
+    }
+
+    size_t num_samples = 0;
+    size_t used = 0;
+    size_t small = 0;
+
+    for (size_t i = 0; i < num_files; i++) {
+        if ( !files[i] || fi[i].duplicate_of || !fi[i].uncompressed_size || fi[i].uncompressed_size >= _ArchiveInfo.block_size ) continue;
+        if ( small++ % step ) continue;
+
+        size_t size = fi[i].uncompressed_size;
+        if ( used + size > samples_size ) break;
+
+        FILE *fp = fopen(files[i], "rb");
+        if ( !fp ) continue;
+
+        if ( fread(samples + used, size, 1, fp) == 1 ) {
+            sample_sizes[num_samples++] = size;
+            used += size;
+        }
+
+        fclose(fp);
+    }
+
+    size_t size = dictionary_train(samples, sample_sizes, num_samples, dictionary_buffer, DICTIONARY_MAX_SIZE);
+
+    free(samples);
+    free(sample_sizes);
+
+    return size;
+}
+
+/**
+ * Writes the PSARC file header to the output file.
+ *
+ * @param output_file        File pointer to the PSARC output file.
+ */
+
+static void write_header(FILE *output_file) {
+    // Create an instance of the PSARCHEADER structure and initialize its fields
+    PSARCHEADER header;
+
+    fseek(output_file, 0, SEEK_SET);
+
+    strcpy(header.magic, "PSAR"); // 'PSAR'
+    header.version = htonl(0x00010004); // v1.4
+    memcpy(header.compression_type, coder_get_name(_ArchiveInfo.compression_type), sizeof(header.compression_type)); // 'zlib', 'lzma', 'zstd' or 'lz4\0'
+    header.toc_length = htonl(_ArchiveInfo.toc_length);
+    header.toc_entry_size = htonl(0x1E);
+    header.toc_entries = htonl(_ArchiveInfo.toc_entries);
+    header.block_size = htonl(_ArchiveInfo.block_size);
+    header.archive_flags = htonl(_ArchiveInfo.archive_flags);
+
+    // Write the header uncompressed
+    fwrite(&header, sizeof(header), 1, output_file);
+}
+
+/**
+ * Writes the table of contents (TOC) entries to the output file.
+ *
+ * @param output_file        File pointer to the PSARC output file.
+ * @param files_info_table         Array of FILEINFO structures containing TOC information.
+ */
+
+static void write_toc_table(FILE *output_file, FILEINFO *files_info_table) {
+    PSARCTOC toc;
+
+    uint64_t start = STATS_BEGIN();
+
+    fseek(output_file, sizeof(PSARCHEADER), SEEK_SET);
+
+    for (int i = 0; i < _ArchiveInfo.toc_entries; i++) {
+        // Write name_digest (16 bytes) uncompressed
+        if (i) memmove((uint8_t *)toc.name_digest, files_info_table[i].name_digest, sizeof(toc.name_digest));
         else   memset((uint8_t *)&toc.name_digest,'\0', sizeof(toc.name_digest));
         toc.block_offset = htonl(files_info_table[i].block_index);
         hton40((uint8_t *)&toc.uncompressed_size, files_info_table[i].uncompressed_size);
         hton40((uint8_t *)&toc.file_offset,(uint64_t) files_info_table[i].offset + _ArchiveInfo.toc_length);
         fwrite(&toc, sizeof(toc), 1, output_file);
     }
+
+    STATS_END(STATS_WRITE, start, (uint64_t)_ArchiveInfo.toc_entries * sizeof(toc));
 }
 
 /**
@@ -497,6 +1140,8 @@ static void write_toc_table(FILE *output_file, FILEINFO *files_info_table) {
 static void write_blocktable(FILE *output_file, uint32_t *blocktable, uint32_t blocktable_size) {
     int item_size = get_blocktable_item_size();
 
+    uint64_t start = STATS_BEGIN();
+
     for (int i = 0; i < blocktable_size; i++) {
         switch(item_size) {
             case 1: {
@@ -525,26 +1170,120 @@ static void write_blocktable(FILE *output_file, uint32_t *blocktable, uint32_t b
             }
         }
     }
+
+    STATS_END(STATS_WRITE, start, (uint64_t)blocktable_size * item_size);
 }
 
 /**
- * Creates a PSARC archive from specified files and stores it in the output file.
+ * Writes the checksums of the entries at the end of the archive (AF_CHECKSUMS).
  *
- * @param output_path        Path to the PSARC output file.
- * @param files              Array of input file paths.
- * @param num_files          Number of input files.
+ * The trailer is the CRC32C of each TOC entry, in TOC order (the manifest first), so it takes
+ * the last toc_entries * 4 bytes of the archive. Readers unaware of the flag never get to it.
+ *
+ * @param output_file        File pointer to the PSARC output file.
+ * @param files_info_table   Array of FILEINFO structures containing TOC information.
+ *
+ * @return                   0 if successful, 1 on error.
+ */
+
+static int write_checksums(FILE *output_file, FILEINFO *files_info_table) {
+    if (fseek(output_file, 0, SEEK_END)) return 1;
+
+    for (uint32_t i = 0; i < _ArchiveInfo.toc_entries; i++) {
+        uint32_t val = htonl(files_info_table[i].checksum);
+        if (fwrite(&val, sizeof(val), 1, output_file) != 1) return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Gets the name of a file as stored in the manifest.
+ *
+ * The path is trimmed (-T) and made absolute or relative according to the archive flags.
+ *
+ * @param file               The file path (converted to '/' separators on Windows).
+ *
+ * @return                   The name (dynamically allocated), or NULL on error.
+ */
+
+static char *get_entry_name(char *file) {
+    char *fname = file;
+
+    char *px;
+
+#ifdef __WIN32
+    fname = path_to_unix(NULL, fname);
+
+    // Remove Drive:
+    if (( px = strchr( fname, ':' ))) {
+        fname = ++px;
+    }
+#endif
+
+    if ( _Config.trim_path_flag ) {
+        px = strrchr( fname, '/' );
+        if ( px ) fname = ++px;
+    }
+
+    if ( _ArchiveInfo.archive_flags & AF_ABSPATH ) {
+        // Add / to begin if not exists
+        if ( *fname != '/' ) {
+            char *name = malloc(strlen(fname) + 2);
+            if ( name ) {
+                *name = '/';
+                strcpy(name + 1, fname);
+            }
+            return name;
+        }
+    } else {
+        // Remove '/' from begin
+        while ( *fname == '/' ) fname++;
+    }
+
+    return strdup(fname);
+}
+
+/**
+ * Fits the threads pool that compresses the blocks in the memory limit (see fit_memory_limit()).
+ *
+ * Each task in flight holds its blocks, each worker its coder, and the main thread its own
+ * buffers.
  *
  * @return                   0 if successful
- *                           1 on error.
- *                           2 on error with output format
+ *                           1 if the memory limit is too low.
  */
 
-int create_archive(char *output_path, char **files, size_t num_files ) {
-    if (!_Config.overwrite_flag && access(output_path, F_OK) == 0) {
-        fprintf( stderr, APPNAME": archive already exists (use -y for overwrite)\n" );
+static int fit_pak_memory_limit() {
+    size_t coder_size = coder_get_memory_usage(_ArchiveInfo.compression_type, _Config.compression_level, _Config.extreme_compression_flag, _ArchiveInfo.block_size, 0);
+
+    if ( fit_memory_limit(sizeof(PAKDATA) + (size_t)_ArchiveInfo.block_size * 4, coder_size, (size_t)_ArchiveInfo.block_size * 4) ) {
+        fprintf( stderr, APPNAME": memory limit too low for blocks of %u bytes\n", _ArchiveInfo.block_size );
         return 1;
     }
 
+    return 0;
+}
+
+/**
+ * Writes a PSARC archive.
+ *
+ * The entries are compressed from their files, or copied without recompressing them from the
+ * archive being updated when they don't have a file.
+ *
+ * @param output_path        Path to the PSARC output file.
+ * @param names              Array of entry names, as stored in the manifest.
+ * @param files              Array of input file paths (NULL for the entries kept from the archive being updated).
+ * @param sources            Array of entries of the archive being updated (NULL for create mode).
+ * @param num_files          Number of entries.
+ *
+ * @return                   0 if successful
+ *                           1 on error.
+ */
+
+static int write_archive(char *output_path, char **names, char **files, FILEINFO **sources, size_t num_files) {
+    if ( fit_pak_memory_limit() ) return 1;
+
     source_buffer = malloc(_ArchiveInfo.block_size * 2);
     if (!source_buffer) {
         fprintf( stderr, APPNAME": not enough memory\n" );
@@ -575,41 +1314,7 @@ int create_archive(char *output_path, char **files, size_t num_files ) {
     size_t filenames_len = 0;
 
     for ( int i = 0; i < _ArchiveInfo.toc_entries; i++ ) {
-        char *fname;
-#ifdef __WIN32
-        fname = path_to_unix(NULL, files[i]);
-#else
-        fname = files[i];
-#endif
-
-        char *px;
-
-        size_t len;
-
-        if ( _Config.trim_path_flag ) {
-            px = strrchr( fname, '/' );
-            if ( px ) fname = ++px;
-        }
-
-#ifdef __WIN32
-        // Remove Drive:
-        if (( px = strchr( fname, ':' ))) {
-            fname = ++px;
-        }
-#endif
-        len = strlen(fname);
-        if ( _ArchiveInfo.archive_flags & AF_ABSPATH ) {
-            // Add 1 to len for begin if not '/'
-            if ( *fname != '/' ) len++;
-        } else {
-            // Remove '/' from begin
-            while ( *fname == '/' ) {
-                fname++;
-                len--;
-            }
-        }
-
-        filenames_len += len + ( ( i < _ArchiveInfo.toc_entries - 1 ) ? 1 : 0 );
+        filenames_len += strlen(names[i]) + ( ( i < _ArchiveInfo.toc_entries - 1 ) ? 1 : 0 );
     }
 
     filenames = malloc(filenames_len+1);
@@ -621,37 +1326,31 @@ int create_archive(char *output_path, char **files, size_t num_files ) {
         free(target_buffer);
         return 1;
     }
-    *filenames = '\0';
-    
-    for ( int i = 0; i < _ArchiveInfo.toc_entries; i++ ) {
-        char *fname = files[i];
+    size_t filenames_pos = 0;
 
-        char *px;
-
-#ifdef __WIN32
-        // Remove Drive:
-        if (( px = strchr( fname, ':' ))) {
-            fname = ++px;
-        }
-#endif
+    for ( int i = 0; i < _ArchiveInfo.toc_entries; i++ ) {
+        size_t len = strlen(names[i]);
+        memcpy(filenames + filenames_pos, names[i], len);
+        filenames_pos += len;
 
-        if ( _Config.trim_path_flag ) {
-            px = strrchr( fname, '/' );
-            if ( px ) fname = ++px;
-        }
+        if ( i < _ArchiveInfo.toc_entries - 1 ) filenames[filenames_pos++] = '\x0a';
 
-        if ( _ArchiveInfo.archive_flags & AF_ABSPATH ) {
-            // Add / to begin if not exists
-            if ( *fname != '/' ) strcat( filenames, "/" );
-        } else {
-            // Remove '/' from begin
-            while ( *fname == '/' ) fname++;
-        }
+        // Entries kept from the archive being updated keep their size
+        if ( sources && !files[i] ) files_info_table[i + 1].uncompressed_size = sources[i]->uncompressed_size;
+    }
+    filenames[filenames_pos] = '\0';
 
-        strcat(filenames, fname);
+    // The digests are calculated on the names as stored in the manifest (with threads, along with the compression)
+    if ( _Config.num_threads <= 0 && get_name_digests( names, _ArchiveInfo.toc_entries, &files_info_table[1] ) ) {
+        fprintf( stderr, APPNAME": not enough memory\n" );
 
-        if ( i < _ArchiveInfo.toc_entries - 1 ) strcat(filenames, "\x0a" );
+        free(filenames);
+        free(files_info_table);
+        free(target_buffer);
+        free(source_buffer);
+        return 1;
     }
+
     // First block for files
     uint32_t blocktable_size = ( filenames_len + _ArchiveInfo.block_size - 1 ) / _ArchiveInfo.block_size;
     files_info_table[0].uncompressed_size = filenames_len;
@@ -668,6 +1367,42 @@ int create_archive(char *output_path, char **files, size_t num_files ) {
     }
     blocktable_size += bsize;
 
+    if ( sources ) blocktable_size -= find_shared_sources(sources, files, _ArchiveInfo.toc_entries, &files_info_table[1]);
+
+    if ( _Config.dedup_flag ) {
+        int64_t blocks_saved = find_duplicates(files, _ArchiveInfo.toc_entries, &files_info_table[1]);
+        if ( blocks_saved < 0 ) {
+            fprintf( stderr, APPNAME": error reading files for deduplication\n" );
+
+            free(filenames);
+            free(files_info_table);
+            free(target_buffer);
+            free(source_buffer);
+            return 1;
+        }
+        blocktable_size -= blocks_saved;
+    }
+
+    // The dictionary of the archive being updated is kept, the blocks copied from it may use it
+    dictionary = sources ? get_archive_dictionary(&dictionary_size) : NULL;
+    if ( !dictionary && _Config.dictionary_flag && _ArchiveInfo.compression_type == PSARC_ZLIB ) {
+        dictionary_size = train_dictionary(files, _ArchiveInfo.toc_entries, &files_info_table[1]);
+        if ( dictionary_size ) dictionary = dictionary_buffer;
+    }
+    if ( !dictionary ) dictionary_size = 0;
+
+    if ( dictionary ) {
+        _ArchiveInfo.archive_flags |= AF_DICTIONARY;
+    } else {
+        _ArchiveInfo.archive_flags &= ~AF_DICTIONARY;
+    }
+
+    // The archive being updated keeps its checksums, the ones of the entries copied from it are kept too
+    if ( !sources ) {
+        if ( _Config.checksum_flag ) _ArchiveInfo.archive_flags |= AF_CHECKSUMS;
+        else                         _ArchiveInfo.archive_flags &= ~AF_CHECKSUMS;
+    }
+
     // Allocate the compressed sizes array
     uint32_t *blocktable = malloc(blocktable_size * sizeof(uint32_t));
     if (!blocktable) {
@@ -680,6 +1415,16 @@ int create_archive(char *output_path, char **files, size_t num_files ) {
         return 1;
     }
 
+    // Only the entries compressed from files are reported
+    uint32_t last_reported = 0;
+    uint32_t num_reported = 0;
+    for ( uint32_t i = 0; i < _ArchiveInfo.toc_entries; i++ ) {
+        if ( files[i] ) {
+            last_reported = i + 1;
+            num_reported++;
+        }
+    }
+
     _ArchiveInfo.toc_entries++;
 
     // Write the header and the entry table at the beginning of the uncompressed file
@@ -701,11 +1446,19 @@ int create_archive(char *output_path, char **files, size_t num_files ) {
 
     fseek(archive_file, _ArchiveInfo.toc_length, SEEK_SET);
 
+    // The dictionary goes right after the tables, the manifest starts where it ends
+    if ( dictionary ) {
+        fwrite(dictionary, dictionary_size, 1, archive_file);
+        total_size = dictionary_size;
+    }
+
     uint32_t blocktable_idx = 0;
 
     if (compress_entry((unsigned char *)filenames, filenames_len, NULL, archive_file, &files_info_table[0], &total_size, blocktable, &blocktable_idx) != 0) {
         fprintf( stderr, APPNAME": error getting filenames from archive\n" );
 
+        coder_free(archive_coder);
+        archive_coder = NULL;
         fclose(archive_file);
         free(filenames);
         free(files_info_table);
@@ -718,6 +1471,9 @@ int create_archive(char *output_path, char **files, size_t num_files ) {
 
     free(filenames);
 
+    // The manifest is compressed without the dictionary, so any reader can list the archive
+    if ( archive_coder ) coder_set_dictionary(archive_coder, dictionary, dictionary_size);
+
     uint64_t files_compressed = 0LL;
     uint64_t files_uncompressed = 0LL;
     uint64_t manifest_compressed = files_info_table[0].compressed_size;
@@ -727,6 +1483,8 @@ int create_archive(char *output_path, char **files, size_t num_files ) {
     if (!report) {
         fprintf( stderr, APPNAME": fatal error\n" );
 
+        coder_free(archive_coder);
+        archive_coder = NULL;
         fclose(archive_file);
         free(files_info_table);
         free(blocktable);
@@ -738,67 +1496,837 @@ int create_archive(char *output_path, char **files, size_t num_files ) {
 
     report_open_file_section(report);
 
-    int user_data_size = sizeof(PAKDATA) + _ArchiveInfo.block_size * 4;
+    if ( _Config.progress_flag ) {
+        uint64_t bytes_reported = 0;
+        for (int i = 1; i < _ArchiveInfo.toc_entries; i++) if ( files[i-1] ) bytes_reported += files_info_table[i].uncompressed_size;
+        report_set_progress_total(report, num_reported, bytes_reported);
+    }
 
-    if ( _Config.num_threads > 0 ) threads_init( _Config.num_threads, user_data_size);
+    int user_data_size = sizeof(PAKDATA) + _ArchiveInfo.block_size * 4;
 
-    for (int i = 1; i < _ArchiveInfo.toc_entries; i++) {
-        FILE *fp = NULL;
-        files_info_table[i].filename = strdup(files[i-1]);
-        if (!files_info_table[i].filename || !(fp = fopen(files_info_table[i].filename, "rb"))) {
-            fprintf( stderr, APPNAME": error processing %s\n", files[i-1]);
-            report_close(report, 1, files_compressed, files_uncompressed, manifest_compressed, manifest_uncompressed, i - 1, 1);
+    if ( _Config.num_threads > 0 ) {
+        if ( threads_init( _Config.num_threads, get_reorder_window(), user_data_size) || threads_start_writer( compress_entry_writer ) ) {
+            fprintf( stderr, APPNAME": fatal error\n" );
 
-            for( ; i > 0; i--){
-                free(files_info_table[i].filename);
-                files_info_table[i].filename = NULL;
-            }
+            report_close(report, 0, 0, 0, 0, 0, 0, 0);
+            threads_free();
+            coder_free(archive_coder);
+            archive_coder = NULL;
             fclose(archive_file);
             free(files_info_table);
             free(blocktable);
             free(target_buffer);
             free(source_buffer);
             unlink(output_path);
-            if ( _Config.num_threads > 0 ) threads_free();
             return 1;
         }
+        threads_set_local_data_free(coder_free);
 
-        if ( _Config.num_threads > 0 ) {
-            compress_entry_multi(fp, archive_file, &files_info_table[i], &total_size, blocktable, &blocktable_idx, i < _ArchiveInfo.toc_entries - 1);
-        } else {
-            report_open_file_item(report, &files_info_table[i]);
-            compress_entry(NULL, 0, fp, archive_file, &files_info_table[i], &total_size, blocktable, &blocktable_idx);
-            report_close_file_item(report, files_info_table[i].uncompressed_size, files_info_table[i].compressed_size, NULL, i < _ArchiveInfo.toc_entries - 1);
-            files_compressed += files_info_table[i].compressed_size;
-        }
+        // Without a queue the blocks are read synchronously. A window of one slot has no room for
+        // a read in flight, the other tasks (digests, copies) would wait for it forever
+        unsigned depth = get_reorder_window() / 2;
+        read_queue = depth ? asyncio_new(depth > READ_AHEAD_MAX ? READ_AHEAD_MAX : depth) : NULL;
+        read_head = 0;
+    }
 
-        fclose(fp);
+    copy_errors = 0;
+    digest_errors = 0;
+
+    for (int i = 1; i < _ArchiveInfo.toc_entries; i++) {
+        FILE *fp = NULL;
+        char *path = files[i-1] ? files[i-1] : names[i-1];
+        int is_not_last_file = i < last_reported;
+
+        // The digests of the next batch of names are calculated before their entries are committed
+        if ( _Config.num_threads > 0 && ( i - 1 ) % DIGEST_BATCH == 0 ) {
+            size_t num_names = _ArchiveInfo.toc_entries - i < DIGEST_BATCH ? _ArchiveInfo.toc_entries - i : DIGEST_BATCH;
+            digest_names_multi(&names[i-1], num_names, &files_info_table[i]);
+        }
+
+        // The paths are kept by the caller until the archive is written
+        files_info_table[i].filename = path;
+
+        if ( !files[i-1] ) {
+            FILEINFO *original = files_info_table[i].duplicate_of ? &files_info_table[files_info_table[i].duplicate_of] : NULL;
+
+            if ( _Config.num_threads > 0 ) {
+                read_queue_flush();
+                copy_entry_multi(archive_file, &files_info_table[i], sources[i-1], original, &total_size, blocktable, &blocktable_idx);
+            } else {
+                if ( original ) {
+                    share_entry_data(&files_info_table[i], original);
+                } else {
+                    copy_entry(archive_file, &files_info_table[i], sources[i-1], &total_size, blocktable, blocktable_idx);
+                    blocktable_idx += files_info_table[i].num_blocks;
+                }
+            }
+            continue;
+        }
+
+        if ( files_info_table[i].duplicate_of ) {
+            if ( _Config.num_threads > 0 ) {
+                read_queue_flush();
+                share_entry_multi(&files_info_table[i], &files_info_table[files_info_table[i].duplicate_of], is_not_last_file);
+            } else {
+                report_open_file_item(report, &files_info_table[i]);
+                share_entry_data(&files_info_table[i], &files_info_table[files_info_table[i].duplicate_of]);
+                report_close_file_item(report, files_info_table[i].uncompressed_size, files_info_table[i].compressed_size, NULL, is_not_last_file);
+            }
+            files_uncompressed += files_info_table[i].uncompressed_size;
+            continue;
+        }
+
+        if (!(fp = fopen(files_info_table[i].filename, "rb"))) {
+            fprintf( stderr, APPNAME": error processing %s\n", path);
+
+            // The writer reports the entries still in flight
+            read_queue_flush();
+            if ( _Config.num_threads > 0 ) threads_free();
+
+            report_close(report, 1, files_compressed, files_uncompressed, manifest_compressed, manifest_uncompressed, i - 1, 1);
+            asyncio_free(read_queue);
+            read_queue = NULL;
+            fclose(archive_file);
+            free(files_info_table);
+            free(blocktable);
+            free(target_buffer);
+            free(source_buffer);
+            unlink(output_path);
+            coder_free(archive_coder);
+            archive_coder = NULL;
+            return 1;
+        }
+
+        if ( _Config.num_threads > 0 ) {
+            compress_entry_multi(fp, archive_file, &files_info_table[i], &total_size, blocktable, &blocktable_idx, is_not_last_file);
+        } else {
+            report_open_file_item(report, &files_info_table[i]);
+            compress_entry(NULL, 0, fp, archive_file, &files_info_table[i], &total_size, blocktable, &blocktable_idx);
+            report_close_file_item(report, files_info_table[i].uncompressed_size, files_info_table[i].compressed_size, NULL, is_not_last_file);
+            files_compressed += files_info_table[i].compressed_size;
+            fclose(fp);
+        }
 
         files_uncompressed += files_info_table[i].uncompressed_size;
     }
 
     if ( _Config.num_threads > 0 ) {
+        read_queue_flush();
         threads_wait_for_completion();
-        for (int i = 1; i < _ArchiveInfo.toc_entries; i++)files_compressed += files_info_table[i].compressed_size;
+        for (int i = 1; i < _ArchiveInfo.toc_entries; i++) if ( files[i-1] ) files_compressed += files_info_table[i].compressed_size;
     }
 
     report_close_file_section(report);
     
     if ( _Config.num_threads > 0 ) threads_free();
 
+    asyncio_free(read_queue);
+    read_queue = NULL;
+
     // Write the Toc table and block offsets
     write_toc_table(archive_file, files_info_table);
     write_blocktable(archive_file, blocktable, blocktable_size);
 
-    fclose(archive_file);
+    int checksums_error = ( _ArchiveInfo.archive_flags & AF_CHECKSUMS ) && write_checksums(archive_file, files_info_table);
 
-    report_close(report, 1, files_compressed, files_uncompressed, manifest_compressed, manifest_uncompressed, _ArchiveInfo.toc_entries - 1, 0);
+    if ( digest_errors ) fprintf( stderr, APPNAME": not enough memory\n" );
+
+    int write_error = fclose(archive_file) != 0 || copy_errors || digest_errors || checksums_error;
+
+    report_close(report, 1, files_compressed, files_uncompressed, manifest_compressed, manifest_uncompressed, num_reported, 0);
+
+    coder_free(archive_coder);
+    archive_coder = NULL;
 
     free(target_buffer);
     free(source_buffer);
     free(blocktable);
-    for (int i = 1; i < _ArchiveInfo.toc_entries; i++) free(files_info_table[i].filename); // Free filenames
     free(files_info_table);
 
+    if ( write_error ) {
+        fprintf( stderr, APPNAME": error writing archive\n" );
+        unlink(output_path);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Creates a PSARC archive from specified files and stores it in the output file.
+ *
+ * @param output_path        Path to the PSARC output file.
+ * @param files              Array of input file paths.
+ * @param num_files          Number of input files.
+ *
+ * @return                   0 if successful
+ *                           1 on error.
+ *                           2 on error with output format
+ */
+
+int create_archive(char *output_path, char **files, size_t num_files ) {
+    if (!_Config.overwrite_flag && access(output_path, F_OK) == 0) {
+        fprintf( stderr, APPNAME": archive already exists (use -y for overwrite)\n" );
+        return 1;
+    }
+
+    char **names = (char **)calloc(num_files ? num_files : 1, sizeof(char *));
+    if (!names) {
+        fprintf( stderr, APPNAME": not enough memory\n" );
+        return 1;
+    }
+
+    int ret = 0;
+
+    for (size_t i = 0; i < num_files; i++) {
+        if (!(names[i] = get_entry_name(files[i]))) {
+            fprintf( stderr, APPNAME": not enough memory\n" );
+            ret = 1;
+            break;
+        }
+    }
+
+    if (!ret) ret = write_archive(output_path, names, files, NULL, num_files);
+
+    for (size_t i = 0; i < num_files; i++) free(names[i]);
+    free(names);
+
+    return ret;
+}
+
+// Archive being created by create_archive_begin(), create_archive_add() and create_archive_end()
+typedef struct {
+    char *output_path;                  // Path to the PSARC output file
+    char *spool_path;                   // Path to the spool file
+    FILE *spool;                        // Data of the entries, moved after the index when the archive is complete
+    FILEINFO *entries;                  // TOC entries (entry 0 is the manifest)
+    size_t num_entries;
+    size_t entries_capacity;
+    char *names;                        // Manifest
+    size_t names_len;
+    size_t names_capacity;
+    uint32_t *blocktable;               // Block table (without the manifest blocks)
+    uint32_t blocktable_idx;
+    size_t blocktable_capacity;
+    size_t total_size;                  // Size of the data in the spool file
+    uint64_t files_uncompressed;
+    int errors;
+} PAKSTREAM;
+
+static PAKSTREAM stream;
+
+/**
+ * Makes sure an array of the archive being created has room for the needed items.
+ *
+ * @param array             Pointer to the array (it may be moved).
+ * @param capacity          Pointer to the capacity of the array, in items.
+ * @param item_size         Size of an item.
+ * @param needed            Number of items needed.
+ * @param in_flight         Whether tasks in flight may hold pointers into the array. They're
+ *                          completed before the array is moved.
+ *
+ * @return                  0 if successful, 1 on error.
+ */
+
+static int stream_reserve(void **array, size_t *capacity, size_t item_size, size_t needed, int in_flight) {
+    if (needed <= *capacity) return 0;
+
+    size_t new_capacity = *capacity ? *capacity : 4096;
+    while (new_capacity < needed) new_capacity *= 2;
+
+    if (in_flight && _Config.num_threads > 0) threads_wait_for_completion();
+
+    void *new_array = realloc(*array, new_capacity * item_size);
+    if (!new_array) return 1;
+
+    *array = new_array;
+    *capacity = new_capacity;
+
+    return 0;
+}
+
+/**
+ * Compresses an entry to the spool file, reading its file up to the end.
+ *
+ * The size of the entry is what is read, so files that change their size while the archive
+ * is created don't leave it inconsistent.
+ *
+ * @param input_fp          File pointer to the input file.
+ * @param fi                Information about the compressed file (output).
+ *
+ * @return                  0 if successful, 1 on error.
+ */
+
+static int stream_entry(FILE *input_fp, FILEINFO *fi) {
+    uint64_t bytes_uncompressed = 0;
+    uint32_t blocks = 0;
+    int c;
+
+    fi->compressed_size = 0;
+    fi->uncompressed_size = 0;
+    fi->num_blocks = 0;
+    fi->checksum = 0;
+
+    // With threads, the writer sets the position of the entry when it commits the first block
+    if ( _Config.num_threads <= 0 ) {
+        fi->offset = stream.total_size;
+        fi->block_index = stream.blocktable_idx;
+
+        report_open_file_item(report, fi);
+
+        // The coder is kept and reused for all the blocks of the archive
+        if (!archive_coder) archive_coder = coder_new();
+    }
+
+    while ((c = fgetc(input_fp)) != EOF) {
+        ungetc(c, input_fp);
+
+        if (stream.blocktable_idx == UINT32_MAX ||
+            stream_reserve((void **)&stream.blocktable, &stream.blocktable_capacity, sizeof(uint32_t), (size_t)stream.blocktable_idx + 1, 1)) return 1;
+
+        uint8_t *read_buffer = source_buffer;
+        PAKDATA *pkd = NULL;
+        int slot = 0;
+
+        if ( _Config.num_threads > 0 ) {
+            slot = threads_get_free_slot( (void **) &pkd );
+            read_buffer = &pkd->buffers;
+        }
+
+        uint64_t start = STATS_BEGIN();
+        size_t bytes_read = fread(read_buffer, 1, _ArchiveInfo.block_size, input_fp);
+        STATS_END(STATS_READ, start, bytes_read);
+
+        // The file could be truncated while it's read
+        int is_last_block = bytes_read < _ArchiveInfo.block_size || (c = fgetc(input_fp)) == EOF;
+        if (!is_last_block) ungetc(c, input_fp);
+
+        bytes_uncompressed += bytes_read;
+        blocks++;
+
+        if (is_last_block) {
+            fi->uncompressed_size = bytes_uncompressed;
+            fi->num_blocks = blocks;
+        }
+
+        int block_mode = get_block_mode(fi, read_buffer, bytes_read, blocks == 1);
+
+        if ( pkd ) {
+            pkd->is_first_block = blocks == 1;
+            pkd->is_last_block = is_last_block;
+            pkd->is_not_last_file = REPORT_NOT_LAST_UNKNOWN;
+            pkd->is_duplicate = 0;
+            pkd->source = NULL;
+            pkd->names = NULL;
+            pkd->fp = stream.spool;
+            pkd->fi = fi;
+            pkd->total_size = &stream.total_size;
+            pkd->blocktable = stream.blocktable;
+            pkd->blocktable_idx = stream.blocktable_idx;
+            pkd->data_size = bytes_read;
+            pkd->block_mode = block_mode;
+
+            threads_start_task( slot, compress_entry_thread, pkd );
+        } else {
+            if ( _ArchiveInfo.archive_flags & AF_CHECKSUMS ) fi->checksum = crc32c(fi->checksum, read_buffer, bytes_read);
+
+            uint8_t *write_buffer;
+            size_t bytes_write = compress_block(archive_coder, read_buffer, bytes_read, target_buffer, &write_buffer, block_mode);
+
+            start = STATS_BEGIN();
+            if (fwrite(write_buffer, bytes_write, 1, stream.spool) != 1) return 1;
+            STATS_END(STATS_WRITE, start, bytes_write);
+
+            stream.blocktable[stream.blocktable_idx] = bytes_write;
+            stream.total_size += bytes_write;
+            fi->compressed_size += bytes_write;
+        }
+
+        stream.blocktable_idx++;
+
+        if (is_last_block) break;
+    }
+
+    if ( _Config.num_threads <= 0 ) report_close_file_item(report, fi->uncompressed_size, fi->compressed_size, NULL, REPORT_NOT_LAST_UNKNOWN);
+
+    return ferror(input_fp) ? 1 : 0;
+}
+
+/**
+ * Frees the archive being created by create_archive_begin(), and removes its spool file.
+ */
+
+static void stream_free() {
+    if (stream.spool) fclose(stream.spool);
+    if (stream.spool_path) unlink(stream.spool_path);
+    free(stream.spool_path);
+
+    for (size_t i = 1; i < stream.num_entries; i++) free(stream.entries[i].filename);
+    free(stream.entries);
+    free(stream.names);
+    free(stream.blocktable);
+
+    memset(&stream, 0, sizeof(stream));
+
+    coder_free(archive_coder);
+    archive_coder = NULL;
+
+    free(target_buffer);
+    free(source_buffer);
+    target_buffer = source_buffer = NULL;
+}
+
+/**
+ * Starts the creation of a PSARC archive, to which files are added as they're found.
+ *
+ * Unlike create_archive(), the list of files doesn't have to be known in advance. The data of
+ * the files is compressed to a spool file (the archive name with a .tmp suffix) as they're
+ * added, and create_archive_end() writes the archive.
+ *
+ * @param output_path        Path to the PSARC output file.
+ *
+ * @return                   0 if successful, 1 on error.
+ */
+
+int create_archive_begin(char *output_path) {
+    if (!_Config.overwrite_flag && access(output_path, F_OK) == 0) {
+        fprintf( stderr, APPNAME": archive already exists (use -y for overwrite)\n" );
+        return 1;
+    }
+
+    memset(&stream, 0, sizeof(stream));
+    stream.output_path = output_path;
+
+    // The files aren't known in advance, there's nothing to train a dictionary from
+    dictionary = NULL;
+    dictionary_size = 0;
+    _ArchiveInfo.archive_flags &= ~AF_DICTIONARY;
+    stream.num_entries = 1; // The manifest
+
+    if ( _Config.checksum_flag ) _ArchiveInfo.archive_flags |= AF_CHECKSUMS;
+    else                         _ArchiveInfo.archive_flags &= ~AF_CHECKSUMS;
+
+    if ( fit_pak_memory_limit() ) return 1;
+
+    if (!(source_buffer = malloc(_ArchiveInfo.block_size * 2)) ||
+        !(target_buffer = malloc(_ArchiveInfo.block_size * 2)) ||
+        !(stream.spool_path = malloc(strlen(output_path) + 5)) ||
+        stream_reserve((void **)&stream.entries, &stream.entries_capacity, sizeof(FILEINFO), 1, 0)) {
+        fprintf( stderr, APPNAME": not enough memory\n" );
+        stream_free();
+        return 1;
+    }
+
+    sprintf(stream.spool_path, "%s.tmp", output_path);
+
+    stream.spool = fopen(stream.spool_path, "w+b");
+    if (!stream.spool) {
+        fprintf( stderr, APPNAME": error creating archive\n" );
+        stream_free();
+        return 1;
+    }
+
+    report = report_open(REPORT_TYPE_PAK, output_path);
+    if (!report) {
+        fprintf( stderr, APPNAME": fatal error\n" );
+        stream_free();
+        return 1;
+    }
+
+    report_open_file_section(report);
+
+    if ( _Config.num_threads > 0 ) {
+        if ( threads_init( _Config.num_threads, get_reorder_window(), sizeof(PAKDATA) + _ArchiveInfo.block_size * 4) || threads_start_writer( compress_entry_writer ) ) {
+            fprintf( stderr, APPNAME": fatal error\n" );
+
+            report_close(report, 0, 0, 0, 0, 0, 0, 0);
+            threads_free();
+            stream_free();
+            return 1;
+        }
+        threads_set_local_data_free(coder_free);
+    }
+
     return 0;
 }
+
+/**
+ * Adds a file to the archive started by create_archive_begin().
+ *
+ * The file is compressed right away. After an error the rest of the files are ignored, and
+ * create_archive_end() fails.
+ *
+ * @param file               The file path.
+ *
+ * @return                   1 if the file was added, 0 on error.
+ */
+
+int create_archive_add(char *file) {
+    if (stream.errors) return 0;
+
+    char *name = get_entry_name(file);
+    size_t len = name ? strlen(name) : 0;
+
+    if (!name ||
+        stream_reserve((void **)&stream.names, &stream.names_capacity, 1, stream.names_len + len + 2, 0) ||
+        stream_reserve((void **)&stream.entries, &stream.entries_capacity, sizeof(FILEINFO), stream.num_entries + 1, 1)) {
+        fprintf( stderr, APPNAME": not enough memory\n" );
+        free(name);
+        stream.errors++;
+        return 0;
+    }
+
+    FILEINFO *fi = &stream.entries[stream.num_entries];
+    memset(fi, 0, sizeof(FILEINFO));
+
+    size_t names_len = stream.names_len;
+    if (stream.num_entries > 1) stream.names[names_len++] = '\x0a';
+    memcpy(stream.names + names_len, name, len);
+    free(name);
+
+    FILE *fp = NULL;
+
+    // The digest is calculated on the name as stored in the manifest
+    if (get_name_digest(stream.names + names_len, len, fi->name_digest) ||
+        !(fi->filename = strdup(file)) ||
+        !(fp = fopen(file, "rb"))) {
+        fprintf( stderr, APPNAME": error processing %s\n", file );
+        free(fi->filename);
+        stream.errors++;
+        return 0;
+    }
+
+    stream.names_len = names_len + len;
+    stream.num_entries++;
+
+    if (stream_entry(fp, fi)) {
+        fprintf( stderr, APPNAME": error processing %s\n", file );
+        stream.errors++;
+    }
+
+    fclose(fp);
+
+    stream.files_uncompressed += fi->uncompressed_size;
+
+    return !stream.errors;
+}
+
+/**
+ * Completes the archive started by create_archive_begin().
+ *
+ * The header, the TOC, the block table and the manifest are written to the archive, followed by
+ * the data of the spool file, so the archive is the same as the one create_archive() writes.
+ *
+ * @param abort              If set, the archive isn't written.
+ *
+ * @return                   0 if successful
+ *                           1 on error.
+ */
+
+int create_archive_end(int abort) {
+    if ( _Config.num_threads > 0 ) threads_wait_for_completion();
+
+    uint64_t files_compressed = 0LL;
+    for (size_t i = 1; i < stream.num_entries; i++) files_compressed += stream.entries[i].compressed_size;
+
+    if ( abort || stream.errors || stream.num_entries < 2 ) {
+        if ( !abort && !stream.errors ) fprintf( stderr, APPNAME": no matching files found to create an archive\n" );
+
+        report_close(report, 1, files_compressed, stream.files_uncompressed, 0, 0, stream.num_entries - 1, 1);
+        if ( _Config.num_threads > 0 ) threads_free();
+        stream_free();
+        return 1;
+    }
+
+    report_close_file_section(report);
+
+    if ( _Config.num_threads > 0 ) threads_free();
+
+    // The manifest blocks go first
+    size_t filenames_len = stream.names_len;
+    uint32_t data_blocks = stream.blocktable_idx;
+    uint32_t manifest_blocks = ( filenames_len + _ArchiveInfo.block_size - 1 ) / _ArchiveInfo.block_size;
+    uint32_t blocktable_size = data_blocks + manifest_blocks;
+
+    FILEINFO *files_info_table = stream.entries;
+    files_info_table[0].uncompressed_size = filenames_len;
+    files_info_table[0].num_blocks = manifest_blocks;
+
+    if ( stream_reserve((void **)&stream.blocktable, &stream.blocktable_capacity, sizeof(uint32_t), blocktable_size ? blocktable_size : 1, 0) ) {
+        fprintf( stderr, APPNAME": not enough memory\n" );
+        report_close(report, 0, 0, 0, 0, 0, 0, 0);
+        stream_free();
+        return 1;
+    }
+    memmove(stream.blocktable + manifest_blocks, stream.blocktable, data_blocks * sizeof(uint32_t));
+
+    _ArchiveInfo.toc_entries = stream.num_entries;
+
+    // Write the header and the entry table at the beginning of the uncompressed file
+    _ArchiveInfo.toc_length = sizeof(PSARCHEADER) + _ArchiveInfo.toc_entries * sizeof(PSARCTOC) + blocktable_size * get_blocktable_item_size();
+
+    FILE *archive_file = fopen(stream.output_path, "wb");
+    if (!archive_file) {
+        fprintf( stderr, APPNAME": error creating archive\n" );
+        report_close(report, 0, 0, 0, 0, 0, 0, 0);
+        stream_free();
+        return 1;
+    }
+
+    write_header(archive_file);
+
+    fseek(archive_file, _ArchiveInfo.toc_length, SEEK_SET);
+
+    size_t total_size = 0;
+    uint32_t blocktable_idx = 0;
+
+    compress_entry((unsigned char *)stream.names, filenames_len, NULL, archive_file, &files_info_table[0], &total_size, stream.blocktable, &blocktable_idx);
+
+    uint64_t manifest_compressed = files_info_table[0].compressed_size;
+    uint64_t manifest_uncompressed = files_info_table[0].uncompressed_size;
+
+    // Move the data after the manifest
+    uint64_t start = STATS_BEGIN();
+    int write_error = fflush(stream.spool) != 0;
+    uint64_t copied = write_error ? 0 : file_copy_range(fileno(stream.spool), 0, archive_file, stream.total_size);
+
+    if (!write_error && copied < stream.total_size) {
+        uint64_t left = stream.total_size - copied;
+
+        write_error = fseek(stream.spool, copied, SEEK_SET) != 0;
+        while (!write_error && left) {
+            size_t len = left > _ArchiveInfo.block_size ? _ArchiveInfo.block_size : left;
+            write_error = fread(source_buffer, len, 1, stream.spool) != 1 || fwrite(source_buffer, len, 1, archive_file) != 1;
+            left -= len;
+        }
+    }
+
+    STATS_END(STATS_WRITE, start, stream.total_size);
+
+    for (size_t i = 1; i < stream.num_entries; i++) {
+        // With threads, empty entries are never committed by the writer and don't have a position
+        if ( _Config.num_threads > 0 && !files_info_table[i].num_blocks ) continue;
+        files_info_table[i].offset += manifest_compressed;
+        files_info_table[i].block_index += manifest_blocks;
+    }
+
+    // Write the Toc table and block offsets
+    write_toc_table(archive_file, files_info_table);
+    write_blocktable(archive_file, stream.blocktable, blocktable_size);
+
+    if ( ( _ArchiveInfo.archive_flags & AF_CHECKSUMS ) && write_checksums(archive_file, files_info_table) ) write_error = 1;
+
+    if (fclose(archive_file) != 0) write_error = 1;
+
+    report_close(report, 1, files_compressed, stream.files_uncompressed, manifest_compressed, manifest_uncompressed, stream.num_entries - 1, 0);
+
+    if (write_error) {
+        fprintf( stderr, APPNAME": error writing archive\n" );
+        unlink(stream.output_path);
+    }
+
+    stream_free();
+
+    return write_error;
+}
+
+/**
+ * Compares two entries by name (qsort and bsearch callback).
+ *
+ * Names are compared ignoring case in case-insensitive archives.
+ */
+
+static int entry_name_cmp(const void *a, const void *b) {
+    const FILEINFO *fa = *(const FILEINFO **)a;
+    const FILEINFO *fb = *(const FILEINFO **)b;
+
+    if ( _ArchiveInfo.archive_flags & AF_ICASE ) return strcasecmp(fa->filename, fb->filename);
+    return strcmp(fa->filename, fb->filename);
+}
+
+/**
+ * Selects the entries of the updated archive.
+ *
+ * The entries of the archive are kept in their order, replaced by the files that changed, and
+ * the files that aren't in the archive are added at the end.
+ *
+ * @param archive_path       Path to the PSARC archive.
+ * @param archive_mtime      Modification time of the archive.
+ * @param entries            The TOC entries of the archive.
+ * @param num_entries        Number of TOC entries.
+ * @param num_blocks         Number of blocks in the block table of the archive.
+ * @param files              Array of input file paths.
+ * @param num_files          Number of input files.
+ * @param new_names          Array to receive the entry names of the input files (num_files items).
+ * @param names              Array to receive the entry names (num_entries - 1 + num_files items).
+ * @param paths              Array to receive the file paths to compress (NULL for kept entries).
+ * @param sources            Array to receive the archive entries to keep (NULL for compressed entries).
+ * @param sorted             Array for sorting the entries by name (num_entries items).
+ * @param count              Pointer to receive the number of entries.
+ *
+ * @return                   The number of changes, or -1 on error.
+ */
+
+static int get_update_entries(char *archive_path, time_t archive_mtime, FILEINFO *entries, uint32_t num_entries, size_t num_blocks, char **files, size_t num_files,
+                              char **new_names, char **names, char **paths, FILEINFO **sources, FILEINFO **sorted, size_t *count) {
+    size_t n = 0;
+    int changes = 0;
+
+    // Kept entries, in the archive order
+    for (uint32_t i = 1; i < num_entries; i++) {
+        if (!entries[i].filename ||
+            ( entries[i].uncompressed_size && (uint64_t)entries[i].block_index + ( entries[i].uncompressed_size + _ArchiveInfo.block_size - 1 ) / _ArchiveInfo.block_size > num_blocks ) ) {
+            fprintf( stderr, APPNAME": error reading archive %s\n", archive_path );
+            return -1;
+        }
+        names[n] = entries[i].filename;
+        paths[n] = NULL;
+        sources[n] = &entries[i];
+        sorted[n] = &entries[i];
+        n++;
+    }
+
+    qsort(sorted, n, sizeof(FILEINFO *), entry_name_cmp);
+
+    for (size_t i = 0; i < num_files; i++) {
+        if (!(new_names[i] = get_entry_name(files[i]))) {
+            fprintf( stderr, APPNAME": not enough memory\n" );
+            return -1;
+        }
+
+        struct stat file_stat;
+        if (stat(files[i], &file_stat)) {
+            fprintf( stderr, APPNAME": error processing %s\n", files[i] );
+            return -1;
+        }
+
+        FILEINFO key = { .filename = new_names[i] };
+        FILEINFO *pkey = &key;
+        FILEINFO **found = (FILEINFO **)bsearch(&pkey, sorted, num_entries - 1, sizeof(FILEINFO *), entry_name_cmp);
+
+        if (!found) {
+            // New file
+            names[n] = new_names[i];
+            paths[n] = files[i];
+            sources[n] = NULL;
+            n++;
+            changes++;
+            continue;
+        }
+
+        size_t idx = *found - &entries[1];
+        if (paths[idx]) continue; // Already replaced
+
+        if ((uint64_t) file_stat.st_size != (*found)->uncompressed_size || file_stat.st_mtime >= archive_mtime) {
+            // Changed file
+            names[idx] = new_names[i];
+            paths[idx] = files[i];
+            sources[idx] = NULL;
+            changes++;
+        }
+    }
+
+    *count = n;
+
+    return changes;
+}
+
+/**
+ * Updates a PSARC archive with the specified files.
+ *
+ * Files that aren't in the archive are added at the end, and files that changed (their size
+ * differs, or they were modified since the archive was written) replace their entries. The rest of the
+ * entries are kept, and their blocks are copied to the new archive without recompressing them.
+ *
+ * The new archive is written to a temporary file, that replaces the archive when complete.
+ * If the archive doesn't exist, it's created.
+ *
+ * @param output_path        Path to the PSARC archive.
+ * @param files              Array of input file paths.
+ * @param num_files          Number of input files.
+ *
+ * @return                   0 if successful
+ *                           1 on error.
+ */
+
+int update_archive(char *output_path, char **files, size_t num_files) {
+    struct stat archive_stat;
+    if (stat(output_path, &archive_stat)) return create_archive(output_path, files, num_files);
+
+    // Compression comes from the command line, block size and flags from the archive
+    int compression_type = _ArchiveInfo.compression_type;
+
+    size_t num_blocks;
+    FILEINFO *entries = open_archive_index(output_path, &source_archive, &source_blocktable, &num_blocks);
+    if (!entries) {
+        fprintf( stderr, APPNAME": error reading archive %s\n", output_path );
+        return 1;
+    }
+
+    // zstd and lz4 blocks are told apart by the archive header only, so those archives keep their compression
+    int source_type = _ArchiveInfo.compression_type;
+    int by_header = source_type == PSARC_ZSTD || source_type == PSARC_LZ4 || compression_type == PSARC_ZSTD || compression_type == PSARC_LZ4;
+
+    if ( by_header && compression_type == PSARC_STORE ) compression_type = source_type;
+
+    if ( by_header && compression_type != source_type ) {
+        fprintf( stderr, APPNAME": the compression of archive %s can't be changed from %s to %s\n", output_path, coder_get_name(source_type), coder_get_name(compression_type) );
+        close_archive_index(source_archive, entries, source_blocktable);
+        source_archive = NULL;
+        source_blocktable = NULL;
+        return 1;
+    }
+
+    _ArchiveInfo.compression_type = compression_type;
+
+    uint32_t num_entries = _ArchiveInfo.toc_entries;
+    size_t max_files = num_entries - 1 + num_files;
+
+    char **new_names = (char **)calloc(num_files ? num_files : 1, sizeof(char *));
+    char **names = (char **)malloc((max_files ? max_files : 1) * sizeof(char *));
+    char **paths = (char **)malloc((max_files ? max_files : 1) * sizeof(char *));
+    FILEINFO **sources = (FILEINFO **)malloc((max_files ? max_files : 1) * sizeof(FILEINFO *));
+    FILEINFO **sorted = (FILEINFO **)malloc((num_entries ? num_entries : 1) * sizeof(FILEINFO *));
+    char *tmp_path = malloc(strlen(output_path) + 5);
+
+    int ret = 1;
+    int changes = 0;
+
+    if (!new_names || !names || !paths || !sources || !sorted || !tmp_path) {
+        fprintf( stderr, APPNAME": not enough memory\n" );
+    } else {
+        size_t count = 0;
+        changes = get_update_entries(output_path, archive_stat.st_mtime, entries, num_entries, num_blocks, files, num_files, new_names, names, paths, sources, sorted, &count);
+        if (changes == 0) {
+            ret = 0; // Up to date
+        } else if (changes > 0) {
+            sprintf(tmp_path, "%s.tmp", output_path);
+            ret = write_archive(tmp_path, names, paths, sources, count);
+        }
+    }
+
+    close_archive_index(source_archive, entries, source_blocktable);
+    source_archive = NULL;
+    source_blocktable = NULL;
+
+    if (!ret && changes > 0) {
+#ifdef __WIN32
+        remove(output_path);
+#endif
+        if (rename(tmp_path, output_path)) {
+            fprintf( stderr, APPNAME": error replacing archive %s\n", output_path );
+            unlink(tmp_path);
+            ret = 1;
+        }
+    }
+
+    if (new_names) for (size_t i = 0; i < num_files; i++) free(new_names[i]);
+    free(new_names);
+    free(names);
+    free(paths);
+    free(sources);
+    free(sorted);
+    free(tmp_path);
+
+    return ret;
+}
@@ -55,4 +55,52 @@
 
 int create_archive(char *output_path, char **files, size_t num_files);
 
+/**
+ * Updates a PSARC archive with the specified files.
+ *
+ * New and changed files (by size and modification time) are compressed, the rest of the
+ * entries are copied without recompressing them. The archive is created if it doesn't exist.
+ *
+ * @param output_path       Path to the PSARC archive.
+ * @param files             Array of input file paths.
+ * @param num_files         Number of input files.
+ *
+ * @return                  0 if successful, 1 on error.
+ */
+
+int update_archive(char *output_path, char **files, size_t num_files);
+
+/**
+ * Starts the creation of a PSARC archive, to which files are added as they're found.
+ *
+ * The data of the files is compressed to a spool file as they're added with
+ * create_archive_add(), and create_archive_end() writes the archive.
+ *
+ * @param output_path       Path to the PSARC output file.
+ *
+ * @return                  0 if successful, 1 on error.
+ */
+
+int create_archive_begin(char *output_path);
+
+/**
+ * Adds a file to the archive started by create_archive_begin().
+ *
+ * @param file              The file path.
+ *
+ * @return                  1 if the file was added, 0 on error.
+ */
+
+int create_archive_add(char *file);
+
+/**
+ * Completes the archive started by create_archive_begin().
+ *
+ * @param abort             If set, the archive isn't written.
+ *
+ * @return                  0 if successful, 1 on error.
+ */
+
+int create_archive_end(int abort);
+
 #endif
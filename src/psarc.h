@@ -42,10 +42,16 @@
 #define PSARC_STORE 0
 #define PSARC_ZLIB  1
 #define PSARC_LZMA  2
+#define PSARC_ZSTD  3
+#define PSARC_LZ4   4
 
 // Archive flags
 #define AF_ICASE    1
 #define AF_ABSPATH  2
+// PSARc-only extensions, other tools don't know them. They use the high bits, the low ones are
+// taken by other implementations (bit 2 is the encrypted TOC of Rocksmith archives).
+#define AF_DICTIONARY 0x40000000  // zlib preset dictionary, stored between the TOC and the manifest
+#define AF_CHECKSUMS  0x80000000  // CRC32C of each entry, stored in a trailer at the end of the archive
 
 #pragma pack(1)
 typedef struct {
@@ -65,6 +71,9 @@ typedef struct {
     uint32_t archive_flags;         // Offset 0x1C: Archive flags:
                                     // Bit 0: 0 = Relative paths (default), 1 = Ignore case paths
                                     // Bit 1: 0 = Relative paths (default), 1 = Absolute paths
+                                    // Bit 2: 1 = Encrypted TOC (Rocksmith, not supported)
+                                    // Bit 30: 1 = Blocks may use the preset dictionary (PSARc only)
+                                    // Bit 31: 1 = Checksums trailer (PSARc only)
 } PSARCHEADER;
 
 typedef struct {
@@ -42,10 +42,52 @@
 #include <libgen.h>
 #include <stdarg.h>
 #include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "psarc.h"
 #include "report.h"
+#include "stats.h"
+
+#define REPORT_SINK_RECORDS             4096    // File items queued for the sink thread
+#define REPORT_PROGRESS_INTERVAL        250     // Milliseconds between updates of the progress line (terminal)
+#define REPORT_PROGRESS_LOG_INTERVAL    5000    // Milliseconds between progress lines (not a terminal)
+
+// File item queued for the sink thread
+typedef struct {
+    REPORT_OPERATION operation;             // REPORT_OPEN_FILE_ITEM, REPORT_CLOSE_FILE_ITEM or REPORT_FILE_ITEM
+    FILEINFO fi;                            // Copy of the entry, the table of the caller can be reallocated
+    uint64_t uncompressed_size;
+    uint64_t compressed_size;
+    const char *status;
+    int is_not_last;
+} REPORT_RECORD;
+
+struct REPORT_SINK {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t records_available;       // Records queued, or the sink is stopping
+    pthread_cond_t records_done;            // Records printed
+    REPORT_RECORD records[REPORT_SINK_RECORDS];
+    size_t head;                            // First record queued
+    size_t count;                           // Records queued or being printed
+    int stop;
+
+    int progress;                           // Print the progress line instead of the file items
+    int is_tty;                             // stderr is a terminal
+    int line_len;                           // Length of the last progress line (terminal)
+    uint64_t start;                         // When the report was opened (stats_now())
+    uint32_t total_files;                   // Files to report (0 = unknown)
+    uint64_t total_bytes;                   // Bytes of those files (0 = unknown)
+    uint32_t done_files;
+    uint64_t done_bytes;
+};
+
+static int report_sink_start(REPORT *report, int progress);
+static void report_sink_flush(REPORT *report);
+static void report_sink_stop(REPORT *report);
 
 /**
  * Prints formatted output with custom placeholders.
@@ -53,7 +95,7 @@
  * This function allows for custom formatting by specifying placeholders in the format string.
  * The supported placeholders are:
  *   - '%H':  Prints md5hash
- *   - '%T':  Prints the compression type based on the integer argument (e.g., PSARC_STORE, PSARC_ZLIB, PSARC_LZMA).
+ *   - '%T':  Prints the compression type based on the integer argument (e.g., PSARC_STORE, PSARC_ZLIB, PSARC_LZMA, PSARC_ZSTD).
  *   - '%M':  Prints "stored" or "deflated" based on two uint64_t arguments (partial and total)(for compression).
  *   - '%m':  Prints "extracting" or "inflating" based on two uint64_t arguments (partial and total)(for decompression).
  *   - '%R':  Prints the compression ratio as a percentage based on two uint64_t arguments (partial and total).
@@ -108,6 +150,14 @@ static void printc(const char *mask, ...) {
                             printf("%*s", width, "lzma");
                             break;
 
+                        case PSARC_ZSTD:
+                            printf("%*s", width, "zstd");
+                            break;
+
+                        case PSARC_LZ4:
+                            printf("%*s", width, "lz4");
+                            break;
+
                         default:
                             break;
                     }
@@ -197,10 +247,131 @@ REPORT * report_open(REPORT_TYPE type, const char *archive_name) {
 
     report->type = type;
     report->last_operation = REPORT_OPEN;
+    report->pending_separator = 0;
+    report->sink = NULL;
+    report->item_size = 0;
+
+    // With threads the file items are printed by the sink, out of the way of the writer
+    if ( type == REPORT_TYPE_PAK || type == REPORT_TYPE_UNPAK ) {
+        if ( _Config.progress_flag || _Config.num_threads > 0 ) report_sink_start(report, _Config.progress_flag);
+    }
 
     return report;
 }
 
+/**
+ * Gets the label of a bucket of the queue depth histogram (see stats_add_queue_depth()).
+ *
+ * @param bucket        The bucket.
+ * @param label         Buffer for the label (at least 16 bytes).
+ *
+ * @return              The label.
+ */
+
+static const char *get_queue_bucket_label(int bucket, char *label) {
+    if (bucket < 2)                              sprintf(label, "%d", bucket);
+    else if (bucket == STATS_QUEUE_BUCKETS - 1)  sprintf(label, "%d+", 1 << (bucket - 1));
+    else                                         sprintf(label, "%d-%d", 1 << (bucket - 1), (1 << bucket) - 1);
+    return label;
+}
+
+/**
+ * Prints the timing breakdown of the hot paths (--stats).
+ *
+ * The time of each stage is the sum over all the threads, so stages run by the workers can take
+ * more than the wall time. The standard format only shows the non-empty buckets of the histograms.
+ */
+
+static void report_stats() {
+    STATS stats;
+    char label[16];
+
+    stats_get(&stats);
+
+    double wall = stats.wall_ns / 1e9;
+    double busy = stats.totals.busy_ns / 1e9;
+    double idle = stats.totals.idle_ns / 1e9;
+
+    switch ( _Config.output_format ) {
+        case STANDARD_FORMAT:
+            printf("stats: %.3fs wall, %u workers, %" PRIu64 " tasks, %.1f%% busy\n",
+                   wall, stats.workers, stats.totals.tasks, busy + idle > 0 ? 100.0 * busy / (busy + idle) : 0.0);
+            printf("%-12s %12s %16s %12s %8s\n", "stage", "calls", "bytes", "seconds", "wall%");
+            for (int i = 0; i < STATS_NUM_STAGES; i++) {
+                printf("%-12s %12" PRIu64 " %16" PRIu64 " %12.6f %8.1f\n",
+                       stats_get_stage_name(i), stats.totals.calls[i], stats.totals.bytes[i], stats.totals.ns[i] / 1e9,
+                       stats.wall_ns ? 100.0 * stats.totals.ns[i] / stats.wall_ns : 0.0);
+            }
+            printf("%-12s %12s\n", "queue depth", "tasks");
+            for (int i = 0; i < STATS_QUEUE_BUCKETS; i++) {
+                if (stats.totals.queue_depth[i]) printf("%-12s %12" PRIu64 "\n", get_queue_bucket_label(i, label), stats.totals.queue_depth[i]);
+            }
+            printf("%-12s %12s\n", "utilization", "workers");
+            for (int i = 0; i < STATS_UTILIZATION_BUCKETS; i++) {
+                sprintf(label, "%d-%d%%", i * 10, i * 10 + 10);
+                if (stats.utilization[i]) printf("%-12s %12u\n", label, stats.utilization[i]);
+            }
+            break;
+
+        case JSON_FORMAT:
+            printf(",\"stats\":{\"wall_seconds\":%.6f,\"workers\":%u,\"tasks\":%" PRIu64 ",\"busy_seconds\":%.6f,\"idle_seconds\":%.6f,\"stages\":{",
+                   wall, stats.workers, stats.totals.tasks, busy, idle);
+            for (int i = 0; i < STATS_NUM_STAGES; i++) {
+                printf("%s\"%s\":{\"calls\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"seconds\":%.6f}", i ? "," : "",
+                       stats_get_stage_name(i), stats.totals.calls[i], stats.totals.bytes[i], stats.totals.ns[i] / 1e9);
+            }
+            printf("},\"queue_depth\":{");
+            for (int i = 0; i < STATS_QUEUE_BUCKETS; i++) {
+                printf("%s\"%s\":%" PRIu64, i ? "," : "", get_queue_bucket_label(i, label), stats.totals.queue_depth[i]);
+            }
+            printf("},\"worker_utilization\":{");
+            for (int i = 0; i < STATS_UTILIZATION_BUCKETS; i++) {
+                printf("%s\"%d-%d%%\":%u", i ? "," : "", i * 10, i * 10 + 10, stats.utilization[i]);
+            }
+            printf("}}");
+            break;
+
+        case CSV_FORMAT:
+            printf("type_record,stats_name,stats_count,stats_bytes,stats_seconds\n");
+            printf("wall,,,,%.6f\n", wall);
+            printf("workers,,%u,,\n", stats.workers);
+            printf("tasks,busy,%" PRIu64 ",,%.6f\n", stats.totals.tasks, busy);
+            printf("tasks,idle,%" PRIu64 ",,%.6f\n", stats.totals.tasks, idle);
+            for (int i = 0; i < STATS_NUM_STAGES; i++) {
+                printf("stage,%s,%" PRIu64 ",%" PRIu64 ",%.6f\n",
+                       stats_get_stage_name(i), stats.totals.calls[i], stats.totals.bytes[i], stats.totals.ns[i] / 1e9);
+            }
+            for (int i = 0; i < STATS_QUEUE_BUCKETS; i++) {
+                printf("queue_depth,%s,%" PRIu64 ",,\n", get_queue_bucket_label(i, label), stats.totals.queue_depth[i]);
+            }
+            for (int i = 0; i < STATS_UTILIZATION_BUCKETS; i++) {
+                printf("worker_utilization,%d-%d%%,%u,,\n", i * 10, i * 10 + 10, stats.utilization[i]);
+            }
+            break;
+
+        case XML_FORMAT:
+            printf("<stats><wall_seconds>%.6f</wall_seconds><workers>%u</workers><tasks>%" PRIu64 "</tasks><busy_seconds>%.6f</busy_seconds><idle_seconds>%.6f</idle_seconds><stages>",
+                   wall, stats.workers, stats.totals.tasks, busy, idle);
+            for (int i = 0; i < STATS_NUM_STAGES; i++) {
+                printf("<stage><name>%s</name><calls>%" PRIu64 "</calls><bytes>%" PRIu64 "</bytes><seconds>%.6f</seconds></stage>",
+                       stats_get_stage_name(i), stats.totals.calls[i], stats.totals.bytes[i], stats.totals.ns[i] / 1e9);
+            }
+            printf("</stages><queue_depth>");
+            for (int i = 0; i < STATS_QUEUE_BUCKETS; i++) {
+                printf("<bucket><depth>%s</depth><tasks>%" PRIu64 "</tasks></bucket>", get_queue_bucket_label(i, label), stats.totals.queue_depth[i]);
+            }
+            printf("</queue_depth><worker_utilization>");
+            for (int i = 0; i < STATS_UTILIZATION_BUCKETS; i++) {
+                printf("<bucket><utilization>%d-%d%%</utilization><workers>%u</workers></bucket>", i * 10, i * 10 + 10, stats.utilization[i]);
+            }
+            printf("</worker_utilization></stats>");
+            break;
+
+        default:
+            break;
+    }
+}
+
 /**
  * Closes a report of the specified type, including compression statistics and totals.
  *
@@ -239,6 +410,8 @@ static const char *report_close_list_mask[] = {
 };
 
 void report_close(REPORT *report, int show_totals, uint64_t total_compressed, uint64_t total_uncompressed, uint64_t manifest_compressed, uint64_t manifest_uncompressed, uint32_t successful, uint32_t errors) {
+    if ( report ) report_sink_stop(report);
+
     if ( report && show_totals ) {
         int idx = _Config.output_format;
         if (idx > XML_FORMAT || idx < 0) idx = 0;
@@ -273,6 +446,8 @@ void report_close(REPORT *report, int show_totals, uint64_t total_compressed, ui
             default:
                 break;
         }
+
+        if ( _Config.stats_flag && ( report->type == REPORT_TYPE_PAK || report->type == REPORT_TYPE_UNPAK ) ) report_stats();
     }
 
     switch ( _Config.output_format ) {
@@ -304,6 +479,8 @@ void report_close(REPORT *report, int show_totals, uint64_t total_compressed, ui
 void report_open_file_section(REPORT *report) {
     if (!report) return;
 
+    report_sink_flush(report);
+
     switch ( _Config.output_format ) {
         default:
             break;
@@ -345,6 +522,8 @@ void report_open_file_section(REPORT *report) {
 void report_close_file_section(REPORT *report) {
     if (!report) return;
 
+    report_sink_flush(report);
+
     switch ( _Config.output_format ) {
         default:
             break;
@@ -417,12 +596,15 @@ static const char *report_file_item_list_verbose_mask[] = {
     "<file><name>%s</name><name_digest>%H</name_digest><compression_method>%M</compression_method><uncompressed>%L</uncompressed><compressed>%L</compressed><savings>%R</savings></file>" // XML_FORMAT
 };
 
-void report_open_file_item(REPORT *report, FILEINFO *fi) {
+static void print_open_file_item(REPORT *report, FILEINFO *fi) {
     if (!report) return;
 
     int idx = _Config.output_format;
     if ( idx > XML_FORMAT || idx < 0 ) idx = 0;
 
+    if (idx == JSON_FORMAT && report->pending_separator) printf(",");
+    report->pending_separator = 0;
+
     switch ( _Config.output_format ) {
         case STANDARD_FORMAT:
             switch ( report->type ) {
@@ -554,7 +736,7 @@ static const char *report_close_file_item_unpak_mask[] = {
     "<status>%s</status></file>" // XML_FORMAT
 };
 
-void report_close_file_item(REPORT *report, uint64_t uncompressed_size, uint64_t compressed_size, const char *status, int is_not_last) {
+static void print_close_file_item(REPORT *report, uint64_t uncompressed_size, uint64_t compressed_size, const char *status, int is_not_last) {
     if (!report) return;
 
     int idx = _Config.output_format;
@@ -596,7 +778,8 @@ void report_close_file_item(REPORT *report, uint64_t uncompressed_size, uint64_t
             break;
     }
 
-    if (idx == JSON_FORMAT && is_not_last) printf(",");
+    if (is_not_last == REPORT_NOT_LAST_UNKNOWN) report->pending_separator = 1;
+    else if (idx == JSON_FORMAT && is_not_last) printf(",");
 
     report->last_operation = REPORT_CLOSE_FILE_ITEM;
 }
@@ -643,7 +826,7 @@ static const char *report_file_item_unpak_verbose_mask[] = {
     "<file><name>%s</name><compression_method>%m</compression_method><uncompressed>%L</uncompressed><status>%s</status></file>" // XML_FORMAT
 };
 
-void report_file_item(REPORT *report, FILEINFO *fi, uint64_t uncompressed_size, uint64_t compressed_size, const char *status, int is_not_last) {
+static void print_file_item(REPORT *report, FILEINFO *fi, uint64_t uncompressed_size, uint64_t compressed_size, const char *status, int is_not_last) {
     if (!report) return;
 
     int idx = _Config.output_format;
@@ -776,6 +959,377 @@ void report_file_item(REPORT *report, FILEINFO *fi, uint64_t uncompressed_size,
     report->last_operation = REPORT_FILE_ITEM;
 }
 
+/**
+ * Prints a file item queued for the sink thread.
+ *
+ * @param report    The report structure.
+ * @param record    The queued file item.
+ */
+
+static void print_record(REPORT *report, REPORT_RECORD *record) {
+    switch ( record->operation ) {
+        case    REPORT_OPEN_FILE_ITEM:
+            print_open_file_item(report, &record->fi);
+            break;
+
+        case    REPORT_CLOSE_FILE_ITEM:
+            print_close_file_item(report, record->uncompressed_size, record->compressed_size, record->status, record->is_not_last);
+            break;
+
+        case    REPORT_FILE_ITEM:
+            print_file_item(report, &record->fi, record->uncompressed_size, record->compressed_size, record->status, record->is_not_last);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Formats a size in bytes for the progress line.
+ *
+ * @param bytes     The size.
+ * @param text      Buffer for the text (at least 16 bytes).
+ *
+ * @return          The text.
+ */
+
+static const char *get_progress_size(uint64_t bytes, char *text) {
+    static const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+    double size = (double) bytes;
+    int unit = 0;
+
+    while ( size >= 1024.0 && unit < 4 ) {
+        size /= 1024.0;
+        unit++;
+    }
+
+    if ( unit ) snprintf(text, 16, "%.1f %s", size, units[unit]);
+    else        snprintf(text, 16, "%u %s", (unsigned) bytes, units[unit]); // Less than 1024
+
+    return text;
+}
+
+/**
+ * Prints the progress line to stderr.
+ *
+ * On a terminal the line is redrawn in place, otherwise a new line is printed each time.
+ *
+ * @param sink      The sink of the report.
+ * @param files     Files done.
+ * @param bytes     Bytes done.
+ * @param now       Current time (stats_now()).
+ * @param last      Whether it's the last update (the line is ended on a terminal).
+ */
+
+static void print_progress(REPORT_SINK *sink, uint32_t files, uint64_t bytes, uint64_t now, int last) {
+    char done[16], total[16], rate[16];
+    char line[160];
+    int len;
+
+    double elapsed = (double) ( now - sink->start ) / 1e9;
+    uint64_t bytes_per_second = elapsed > 0 ? (uint64_t) ( bytes / elapsed ) : 0;
+
+    if ( sink->total_files ) {
+        double fraction = sink->total_bytes ? (double) bytes / sink->total_bytes : (double) files / sink->total_files;
+        if ( fraction > 1.0 ) fraction = 1.0;
+
+        len = snprintf(line, sizeof(line), "%5.1f%% %" PRIu32 "/%" PRIu32 " files %s", fraction * 100.0, files, sink->total_files, get_progress_size(bytes, done));
+        if ( sink->total_bytes ) len += snprintf(line + len, sizeof(line) - len, "/%s", get_progress_size(sink->total_bytes, total));
+        len += snprintf(line + len, sizeof(line) - len, " %s/s", get_progress_size(bytes_per_second, rate));
+
+        if ( fraction > 0 && fraction < 1.0 ) {
+            uint64_t eta = (uint64_t) ( elapsed * ( 1.0 - fraction ) / fraction + 0.5 );
+            len += snprintf(line + len, sizeof(line) - len, " ETA %" PRIu64 ":%02" PRIu64 ":%02" PRIu64, eta / 3600, eta / 60 % 60, eta % 60);
+        }
+    } else {
+        len = snprintf(line, sizeof(line), "%" PRIu32 " files %s %s/s", files, get_progress_size(bytes, done), get_progress_size(bytes_per_second, rate));
+    }
+
+    if ( len >= (int) sizeof(line) ) len = sizeof(line) - 1;
+
+    if ( sink->is_tty ) {
+        // Blank what's left of a longer previous line
+        fprintf(stderr, "\r%s%*s%s", line, sink->line_len > len ? sink->line_len - len : 0, "", last ? "\n" : "");
+        sink->line_len = len;
+    } else {
+        fprintf(stderr, "%s\n", line);
+    }
+    fflush(stderr);
+}
+
+/**
+ * Sink thread of a report.
+ *
+ * Prints the file items queued by the callers in batches, so the formatting doesn't delay the
+ * stage that commits the entries, and updates the progress line at a fixed rate.
+ *
+ * @param arg       The report.
+ *
+ * @return          NULL.
+ */
+
+static void *report_sink_thread(void *arg) {
+    REPORT *report = (REPORT *)arg;
+    REPORT_SINK *sink = report->sink;
+
+    uint64_t interval = ( sink->is_tty ? REPORT_PROGRESS_INTERVAL : REPORT_PROGRESS_LOG_INTERVAL ) * 1000000ULL;
+    uint64_t next_update = sink->start + interval;
+
+    pthread_mutex_lock(&sink->mutex);
+
+    for (;;) {
+        while ( !sink->count && !sink->stop ) {
+            if ( !sink->progress ) {
+                pthread_cond_wait(&sink->records_available, &sink->mutex);
+                continue;
+            }
+
+            uint64_t now = stats_now();
+            if ( now >= next_update ) {
+                uint32_t files = sink->done_files;
+                uint64_t bytes = sink->done_bytes;
+
+                pthread_mutex_unlock(&sink->mutex);
+                print_progress(sink, files, bytes, now, 0);
+                pthread_mutex_lock(&sink->mutex);
+
+                next_update = now + interval;
+                continue;
+            }
+
+            // The deadline of the condition is in CLOCK_REALTIME
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            uint64_t ns = deadline.tv_nsec + ( next_update - now );
+            deadline.tv_sec += ns / 1000000000ULL;
+            deadline.tv_nsec = ns % 1000000000ULL;
+
+            pthread_cond_timedwait(&sink->records_available, &sink->mutex, &deadline);
+        }
+
+        if ( !sink->count ) break;
+
+        // The records are printed without the lock, the callers only append after them
+        size_t head = sink->head;
+        size_t count = sink->count;
+
+        pthread_mutex_unlock(&sink->mutex);
+        for (size_t i = 0; i < count; i++) print_record(report, &sink->records[( head + i ) % REPORT_SINK_RECORDS]);
+        pthread_mutex_lock(&sink->mutex);
+
+        sink->head = ( head + count ) % REPORT_SINK_RECORDS;
+        sink->count -= count;
+        pthread_cond_broadcast(&sink->records_done);
+    }
+
+    pthread_mutex_unlock(&sink->mutex);
+
+    return NULL;
+}
+
+/**
+ * Starts the sink thread of a report.
+ *
+ * @param report    The report structure.
+ * @param progress  Whether to print the progress line instead of the file items.
+ *
+ * @return          0 on success, 1 on error (the caller prints the file items).
+ */
+
+static int report_sink_start(REPORT *report, int progress) {
+    REPORT_SINK *sink = (REPORT_SINK *)calloc(1, sizeof(REPORT_SINK));
+    if (!sink) return 1;
+
+    pthread_mutex_init(&sink->mutex, NULL);
+    pthread_cond_init(&sink->records_available, NULL);
+    pthread_cond_init(&sink->records_done, NULL);
+
+    sink->progress = progress;
+    sink->is_tty = isatty(fileno(stderr));
+    sink->start = stats_now();
+
+    report->sink = sink;
+
+    if ( pthread_create(&sink->thread, NULL, report_sink_thread, report) ) {
+        pthread_cond_destroy(&sink->records_done);
+        pthread_cond_destroy(&sink->records_available);
+        pthread_mutex_destroy(&sink->mutex);
+        free(sink);
+        report->sink = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Waits until the sink thread of a report has printed the queued file items.
+ *
+ * @param report    The report structure.
+ */
+
+static void report_sink_flush(REPORT *report) {
+    REPORT_SINK *sink = report->sink;
+    if (!sink) return;
+
+    pthread_mutex_lock(&sink->mutex);
+    while ( sink->count ) pthread_cond_wait(&sink->records_done, &sink->mutex);
+    pthread_mutex_unlock(&sink->mutex);
+}
+
+/**
+ * Stops the sink thread of a report, once the queued file items are printed.
+ *
+ * @param report    The report structure.
+ */
+
+static void report_sink_stop(REPORT *report) {
+    REPORT_SINK *sink = report->sink;
+    if (!sink) return;
+
+    pthread_mutex_lock(&sink->mutex);
+    sink->stop = 1;
+    pthread_cond_signal(&sink->records_available);
+    pthread_mutex_unlock(&sink->mutex);
+
+    pthread_join(sink->thread, NULL);
+
+    if ( sink->progress ) print_progress(sink, sink->done_files, sink->done_bytes, stats_now(), 1);
+
+    pthread_cond_destroy(&sink->records_done);
+    pthread_cond_destroy(&sink->records_available);
+    pthread_mutex_destroy(&sink->mutex);
+    free(sink);
+    report->sink = NULL;
+}
+
+/**
+ * Queues a file item for the sink thread of a report.
+ *
+ * Waits if the queue is full.
+ *
+ * @param report                The report structure.
+ * @param operation             REPORT_OPEN_FILE_ITEM, REPORT_CLOSE_FILE_ITEM or REPORT_FILE_ITEM.
+ * @param fi                    The entry (NULL for REPORT_CLOSE_FILE_ITEM).
+ * @param uncompressed_size     The uncompressed size of the file.
+ * @param compressed_size       The compressed size of the file.
+ * @param status                The status of the file operation (a string literal).
+ * @param is_not_last           Flag indicating whether this is the last file in the section.
+ */
+
+static void report_sink_push(REPORT *report, REPORT_OPERATION operation, FILEINFO *fi, uint64_t uncompressed_size, uint64_t compressed_size, const char *status, int is_not_last) {
+    REPORT_SINK *sink = report->sink;
+
+    pthread_mutex_lock(&sink->mutex);
+    while ( sink->count == REPORT_SINK_RECORDS ) pthread_cond_wait(&sink->records_done, &sink->mutex);
+
+    REPORT_RECORD *record = &sink->records[( sink->head + sink->count ) % REPORT_SINK_RECORDS];
+    record->operation = operation;
+    if (fi) record->fi = *fi;
+    record->uncompressed_size = uncompressed_size;
+    record->compressed_size = compressed_size;
+    record->status = status;
+    record->is_not_last = is_not_last;
+
+    if ( !sink->count++ ) pthread_cond_signal(&sink->records_available);
+    pthread_mutex_unlock(&sink->mutex);
+}
+
+/**
+ * Counts a file in the progress line of a report.
+ *
+ * @param report    The report structure.
+ * @param bytes     The uncompressed size of the file.
+ */
+
+static void report_sink_count(REPORT *report, uint64_t bytes) {
+    REPORT_SINK *sink = report->sink;
+
+    pthread_mutex_lock(&sink->mutex);
+    sink->done_files++;
+    sink->done_bytes += bytes;
+    pthread_mutex_unlock(&sink->mutex);
+}
+
+/**
+ * Sets the totals of the progress line of the report (see --progress).
+ *
+ * Without totals the progress line only shows what's done and the rate.
+ *
+ * @param report                The report structure.
+ * @param total_files           The number of files that will be reported (0 = unknown).
+ * @param total_bytes           The uncompressed size of those files (0 = unknown).
+ */
+
+void report_set_progress_total(REPORT *report, uint32_t total_files, uint64_t total_bytes) {
+    if ( !report || !report->sink ) return;
+
+    REPORT_SINK *sink = report->sink;
+
+    pthread_mutex_lock(&sink->mutex);
+    sink->total_files = total_files;
+    sink->total_bytes = total_bytes;
+    pthread_mutex_unlock(&sink->mutex);
+}
+
+/**
+ * Marks the open of describing an individual file within the file section of the report.
+ *
+ * With a sink thread the file item is queued for it, with the progress line it's only counted
+ * when it's closed.
+ *
+ * @param report    The report structure to which the error is associated.
+ * @param fi        Pointer to a FILEINFO structure containing file information.
+ */
+
+void report_open_file_item(REPORT *report, FILEINFO *fi) {
+    if (!report) return;
+
+    report->item_size = fi->uncompressed_size;
+
+    if ( !report->sink ) print_open_file_item(report, fi);
+    else if ( !report->sink->progress ) report_sink_push(report, REPORT_OPEN_FILE_ITEM, fi, 0, 0, NULL, 0);
+}
+
+/**
+ * Marks the end of describing an individual file within the file section of the report.
+ *
+ * @param report                The report structure to which the error is associated.
+ * @param uncompressed_size     The uncompressed size of the file (0 = the size of the entry).
+ * @param compressed_size       The compressed size of the file.
+ * @param status                The status of the file operation (a string literal).
+ * @param is_not_last           Flag indicating whether this is the last file in the section
+ *                              (REPORT_NOT_LAST_UNKNOWN if it isn't known yet).
+ */
+
+void report_close_file_item(REPORT *report, uint64_t uncompressed_size, uint64_t compressed_size, const char *status, int is_not_last) {
+    if (!report) return;
+
+    if ( !report->sink ) print_close_file_item(report, uncompressed_size, compressed_size, status, is_not_last);
+    else if ( !report->sink->progress ) report_sink_push(report, REPORT_CLOSE_FILE_ITEM, NULL, uncompressed_size, compressed_size, status, is_not_last);
+    else report_sink_count(report, uncompressed_size ? uncompressed_size : report->item_size);
+}
+
+/**
+ * Marks the describing an individual file within the file section of the report.
+ *
+ * @param report                The report structure to which the error is associated.
+ * @param fi                    Pointer to a FILEINFO structure containing file information.
+ * @param uncompressed_size     The uncompressed size of the file.
+ * @param compressed_size       The compressed size of the file.
+ * @param status                The status of the file operation (a string literal).
+ * @param is_not_last           Flag indicating whether this is the last file in the section.
+ */
+
+void report_file_item(REPORT *report, FILEINFO *fi, uint64_t uncompressed_size, uint64_t compressed_size, const char *status, int is_not_last) {
+    if (!report) return;
+
+    if ( !report->sink ) print_file_item(report, fi, uncompressed_size, compressed_size, status, is_not_last);
+    else if ( !report->sink->progress ) report_sink_push(report, REPORT_FILE_ITEM, fi, uncompressed_size, compressed_size, status, is_not_last);
+    else report_sink_count(report, uncompressed_size ? uncompressed_size : fi->uncompressed_size);
+}
+
 /**
  * Displays information about the PSARC archive.
  *
@@ -798,6 +1352,8 @@ static const char *info_mask[] = {
                         "manifest        : %L -> %L bytes (%T - %M %R%%)\n"
                         "files           : %L -> %L bytes (%T - %M %R%%)\n"
                         "total           : %L -> %L bytes (%M %R%%)\n"
+                        "deduplicated    : %d files, %L bytes\n"
+                        "stored blocks   : %L of %L blocks (not compressed)\n"
                         "physical size   : %L bytes\n",
 
                         // JSON_FORMAT
@@ -827,12 +1383,20 @@ static const char *info_mask[] = {
                             "\"compression_method\":\"%M\","
                             "\"savings\":%R"
                           "},"
+                          "\"deduplicated\":{"
+                            "\"files\":%d,"
+                            "\"bytes\":%L"
+                          "},"
+                          "\"blocks\":{"
+                            "\"stored\":%L,"
+                            "\"total\":%L"
+                          "},"
                           "\"physical_size\":%L"
                         "}",
 
                         // CSV_FORMAT
-                        "type,archive,version,total_files,block_size,archive_flags,manifest_uncompressed,manifest_compressed,manifest_compression_type,manifest_compression_method,manifest_savings,files_uncompressed,files_compressed,files_compression_type,files_compression_method,files_savings,totals_uncompressed,totals_compressed,totals_compression_method,totals_savings,physical_size\n"
-                        "totals,%s,%d.%d,%d,%d,\"%s\",%L,%L,\"%T\",\"%M\",%R,%L,%L,\"%T\",\"%M\",%R,%L,%L,\"%M\",%R,%L\n",
+                        "type,archive,version,total_files,block_size,archive_flags,manifest_uncompressed,manifest_compressed,manifest_compression_type,manifest_compression_method,manifest_savings,files_uncompressed,files_compressed,files_compression_type,files_compression_method,files_savings,totals_uncompressed,totals_compressed,totals_compression_method,totals_savings,deduplicated_files,deduplicated_bytes,stored_blocks,total_blocks,physical_size\n"
+                        "totals,%s,%d.%d,%d,%d,\"%s\",%L,%L,\"%T\",\"%M\",%R,%L,%L,\"%T\",\"%M\",%R,%L,%L,\"%M\",%R,%d,%L,%L,%L,%L\n",
 
                         // XML_FORMAT
                         "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
@@ -864,10 +1428,124 @@ static const char *info_mask[] = {
                             "<compression_method>%M</compression_method>"
                             "<savings>%R</savings>"
                           "</totals>"
+                          "<deduplicated>"
+                            "<files>%d</files>"
+                            "<bytes>%L</bytes>"
+                          "</deduplicated>"
+                          "<blocks>"
+                            "<stored>%L</stored>"
+                            "<total>%L</total>"
+                          "</blocks>"
                           "<physical_size>%L</physical_size>"
                         "</archive>"
                     };
 
+/**
+ * Compares two entries by first block and position in the TOC (qsort callback).
+ */
+
+static int entry_block_cmp(const void *a, const void *b) {
+    const FILEINFO *fa = *(const FILEINFO **)a;
+    const FILEINFO *fb = *(const FILEINFO **)b;
+
+    if (fa->block_index != fb->block_index) return fa->block_index < fb->block_index ? -1 : 1;
+    return fa < fb ? -1 : fa > fb;
+}
+
+/**
+ * Calculates the size of the data shared by deduplicated entries.
+ *
+ * Entries that start at the same block as a previous entry share its data, so they don't take
+ * space in the archive.
+ *
+ * @param files_info_table  The TOC entries.
+ * @param blocktable        The table containing block sizes for the PSARC archive.
+ * @param shared_files      Pointer to receive the number of entries sharing data.
+ *
+ * @return                  The number of bytes saved by the shared entries.
+ */
+
+static uint64_t get_shared_size(FILEINFO *files_info_table, uint32_t *blocktable, int *shared_files) {
+    uint64_t shared_size = 0;
+    *shared_files = 0;
+
+    if (_ArchiveInfo.toc_entries < 2) return 0;
+
+    FILEINFO **entries = malloc(_ArchiveInfo.toc_entries * sizeof(FILEINFO *));
+    if (!entries) return 0;
+
+    size_t num_entries = 0;
+    for (uint32_t i = 0; i < _ArchiveInfo.toc_entries; i++) {
+        if (files_info_table[i].uncompressed_size) entries[num_entries++] = &files_info_table[i];
+    }
+
+    qsort(entries, num_entries, sizeof(FILEINFO *), entry_block_cmp);
+
+    for (size_t i = 1; i < num_entries; i++) {
+        if (entries[i]->block_index == entries[i - 1]->block_index) {
+            shared_size += get_compressed_size(entries[i], blocktable);
+            (*shared_files)++;
+        }
+    }
+
+    free(entries);
+
+    return shared_size;
+}
+
+/**
+ * Counts the blocks of the files that are stored without compression.
+ *
+ * A block as big as its data is stored raw: its data wasn't worth compressing (or the archive
+ * isn't compressed). The blocks shared by deduplicated entries are counted once.
+ *
+ * @param files_info_table  The TOC entries.
+ * @param blocktable        The table containing block sizes for the PSARC archive.
+ * @param total_blocks      Pointer to receive the number of blocks of the files.
+ *
+ * @return                  The number of blocks stored without compression.
+ */
+
+static uint64_t get_stored_blocks(FILEINFO *files_info_table, uint32_t *blocktable, uint64_t *total_blocks) {
+    uint64_t stored_blocks = 0;
+    *total_blocks = 0;
+
+    if (_ArchiveInfo.toc_entries < 2) return 0;
+
+    FILEINFO **entries = malloc(_ArchiveInfo.toc_entries * sizeof(FILEINFO *));
+    if (!entries) return 0;
+
+    size_t num_entries = 0;
+    for (uint32_t i = 1; i < _ArchiveInfo.toc_entries; i++) {
+        if (files_info_table[i].uncompressed_size) entries[num_entries++] = &files_info_table[i];
+    }
+
+    qsort(entries, num_entries, sizeof(FILEINFO *), entry_block_cmp);
+
+    uint64_t chunk_size = _ArchiveInfo.block_size;
+
+    for (size_t i = 0; i < num_entries; i++) {
+        if (i && entries[i]->block_index == entries[i - 1]->block_index) continue;
+
+        uint64_t pos = 0;
+        for (uint32_t index = entries[i]->block_index; pos < entries[i]->uncompressed_size; index++) {
+            uint64_t data_size = entries[i]->uncompressed_size - pos;
+            if (data_size > chunk_size) data_size = chunk_size;
+
+            // block_size == 0 => is chunk_size
+            uint64_t block_size = blocktable[index] ? blocktable[index] : chunk_size;
+            if (block_size == data_size) stored_blocks++;
+
+            (*total_blocks)++;
+            pos += data_size;
+        }
+    }
+
+    free(entries);
+
+    return stored_blocks;
+}
+
 void show_info(char *input_file, FILEINFO *files_info_table, uint32_t *blocktable) {
     int compression_type = PSARC_STORE;
     int manifest_compression_type = PSARC_STORE;
@@ -893,6 +1571,21 @@ void show_info(char *input_file, FILEINFO *files_info_table, uint32_t *blocktabl
         total_uncompressed += files_info_table[i].uncompressed_size;
     }
 
+    int dedup_files = 0;
+    uint64_t dedup_bytes = get_shared_size(files_info_table, blocktable, &dedup_files);
+
+    uint64_t total_blocks = 0;
+    uint64_t stored_blocks = get_stored_blocks(files_info_table, blocktable, &total_blocks);
+
+    // The preset dictionary is stored between the TOC and the manifest
+    uint64_t dictionary_size = 0;
+    if ( ( _ArchiveInfo.archive_flags & AF_DICTIONARY ) && files_info_table[0].offset > _ArchiveInfo.toc_length ) {
+        dictionary_size = files_info_table[0].offset - _ArchiveInfo.toc_length;
+    }
+
+    // The checksums trailer goes after the data
+    uint64_t checksums_size = ( _ArchiveInfo.archive_flags & AF_CHECKSUMS ) ? (uint64_t)_ArchiveInfo.toc_entries * sizeof(uint32_t) : 0;
+
 #if 0
 #ifdef _WIN32
     setlocale(LC_NUMERIC, "en_US");
@@ -904,23 +1597,29 @@ void show_info(char *input_file, FILEINFO *files_info_table, uint32_t *blocktabl
     int idx = _Config.output_format;
     if ( idx > XML_FORMAT || idx < 0 ) idx = 0;
 
-    char archive_flags_str[128];
+    char archive_flags_str[256];
 
     switch ( _Config.output_format ) {
         default:
         case CSV_FORMAT:
-            sprintf(archive_flags_str, "%s%s", (_ArchiveInfo.archive_flags & AF_ABSPATH) ? "Absolute Paths" : "Relative Paths",
-                                               (_ArchiveInfo.archive_flags & AF_ICASE) ? " | Case-Insensitive Path" : "" );
+            sprintf(archive_flags_str, "%s%s%s%s", (_ArchiveInfo.archive_flags & AF_ABSPATH) ? "Absolute Paths" : "Relative Paths",
+                                                 (_ArchiveInfo.archive_flags & AF_ICASE) ? " | Case-Insensitive Path" : "",
+                                                 (_ArchiveInfo.archive_flags & AF_DICTIONARY) ? " | Preset Dictionary" : "",
+                                                 (_ArchiveInfo.archive_flags & AF_CHECKSUMS) ? " | Checksums" : "" );
             break;
 
         case JSON_FORMAT:
-            sprintf(archive_flags_str, "%s%s", (_ArchiveInfo.archive_flags & AF_ABSPATH) ? "\"Absolute Paths\"" : "\"Relative Paths\"",
-                                               (_ArchiveInfo.archive_flags & AF_ICASE) ? ",\"Case-Insensitive Path\"" : "" );
+            sprintf(archive_flags_str, "%s%s%s%s", (_ArchiveInfo.archive_flags & AF_ABSPATH) ? "\"Absolute Paths\"" : "\"Relative Paths\"",
+                                                 (_ArchiveInfo.archive_flags & AF_ICASE) ? ",\"Case-Insensitive Path\"" : "",
+                                                 (_ArchiveInfo.archive_flags & AF_DICTIONARY) ? ",\"Preset Dictionary\"" : "",
+                                                 (_ArchiveInfo.archive_flags & AF_CHECKSUMS) ? ",\"Checksums\"" : "" );
             break;
 
         case XML_FORMAT:
-            sprintf(archive_flags_str, "<flag>%s</flag>%s", (_ArchiveInfo.archive_flags & AF_ABSPATH) ? "Absolute Paths" : "Relative Paths",
-                                                            (_ArchiveInfo.archive_flags & AF_ICASE) ? "<flag>Case-Insensitive Path</flag>" : "" );
+            sprintf(archive_flags_str, "<flag>%s</flag>%s%s%s", (_ArchiveInfo.archive_flags & AF_ABSPATH) ? "Absolute Paths" : "Relative Paths",
+                                                              (_ArchiveInfo.archive_flags & AF_ICASE) ? "<flag>Case-Insensitive Path</flag>" : "",
+                                                              (_ArchiveInfo.archive_flags & AF_DICTIONARY) ? "<flag>Preset Dictionary</flag>" : "",
+                                                              (_ArchiveInfo.archive_flags & AF_CHECKSUMS) ? "<flag>Checksums</flag>" : "" );
             break;
 
         }
@@ -934,6 +1633,8 @@ void show_info(char *input_file, FILEINFO *files_info_table, uint32_t *blocktabl
                         "manifest        : %L -> %L bytes (%T - %M %R%%)\n"
                         "files           : %L -> %L bytes (%T - %M %R%%)\n"
                         "total           : %L -> %L bytes (%M %R%%)\n"
+                        "deduplicated    : %d files, %L bytes\n"
+                        "stored blocks   : %L of %L blocks (not compressed)\n"
                         "physical size   : %L bytes\n",
 */
     printc(info_mask[idx],
@@ -956,7 +1657,9 @@ void show_info(char *input_file, FILEINFO *files_info_table, uint32_t *blocktabl
             (uint64_t) total_compressed,
             total_compressed, total_uncompressed,
             (double) total_compressed / total_uncompressed,
-            total_compressed + _ArchiveInfo.toc_length
+            dedup_files, dedup_bytes,
+            stored_blocks, total_blocks,
+            total_compressed - dedup_bytes + _ArchiveInfo.toc_length + dictionary_size + checksums_size
         );
 }
 
@@ -975,6 +1678,8 @@ void report_error(REPORT *report, const char *message, ...) {
     va_start(args, message);
 
     if ( report ) {
+        report_sink_flush(report);
+
         switch (report->last_operation) {
             case    REPORT_OPEN:
                 break;
@@ -56,9 +56,17 @@ typedef enum {
     REPORT_CLOSE_FILE_SECTION
 } REPORT_OPERATION;
 
+// is_not_last value for items when it's unknown if more items follow (they're separated when the next one opens)
+#define REPORT_NOT_LAST_UNKNOWN     -1
+
+typedef struct REPORT_SINK REPORT_SINK;
+
 typedef struct {
     REPORT_TYPE type;
     REPORT_OPERATION last_operation;
+    int pending_separator;
+    REPORT_SINK *sink;              // Thread that prints the file items and the progress (NULL = the caller prints them)
+    uint64_t item_size;             // Uncompressed size of the open item, counted in the progress when it's closed
 } REPORT;
 
 /**
@@ -137,7 +145,8 @@ void report_open_file_item(REPORT *report, FILEINFO *fi);
  * @param uncompressed_size     The uncompressed size of the file.
  * @param compressed_size       The compressed size of the file.
  * @param status                The status of the file operation.
- * @param is_not_last           Flag indicating whether this is the last file in the section.
+ * @param is_not_last           Flag indicating whether this is the last file in the section
+ *                              (REPORT_NOT_LAST_UNKNOWN if it isn't known yet).
  */
 
 void report_close_file_item(REPORT *report, uint64_t uncompressed_size, uint64_t compressed_size, const char *status, int is_not_last);
@@ -158,6 +167,18 @@ void report_close_file_item(REPORT *report, uint64_t uncompressed_size, uint64_t
 
 void report_file_item(REPORT *report, FILEINFO *fi, uint64_t uncompressed_size, uint64_t compressed_size, const char *status, int is_not_last);
 
+/**
+ * Sets the totals of the progress line of the report (see --progress).
+ *
+ * Without totals the progress line only shows what's done and the rate.
+ *
+ * @param report                The report structure.
+ * @param total_files           The number of files that will be reported (0 = unknown).
+ * @param total_bytes           The uncompressed size of those files (0 = unknown).
+ */
+
+void report_set_progress_total(REPORT *report, uint32_t total_files, uint64_t total_bytes);
+
 /**
  * Displays information about the PSARC archive.
  *
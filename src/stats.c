@@ -0,0 +1,226 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file stats.c
+ * @brief Timing counters for the PSARc project (--stats).
+ *
+ * This file implements the counters of the hot paths. Each thread updates its own counters in
+ * thread local storage, without locking; when a thread exits, its counters are merged into the
+ * totals of the exited threads.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+int stats_enabled = 0;
+
+typedef struct {
+    STATS_COUNTERS counters;
+    int registered;                         // The thread exit merges the counters
+} STATS_THREAD;
+
+static __thread STATS_THREAD stats_local;   // Counters of the calling thread
+
+static STATS stats_exited;                  // Merged counters of the exited threads
+static uint64_t stats_start_time = 0;
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+static const char *stage_names[STATS_NUM_STAGES] = {
+    "walk",
+    "read",
+    "compress",
+    "decompress",
+    "checksum",
+    "digest",
+    "write",
+    "slot_wait",
+    "order_wait"
+};
+
+/**
+ * Adds the counters of a thread to the merged counters.
+ *
+ * @param stats         The merged counters.
+ * @param counters      The counters of the thread.
+ */
+
+static void merge_counters(STATS *stats, const STATS_COUNTERS *counters) {
+    for (int i = 0; i < STATS_NUM_STAGES; i++) {
+        stats->totals.ns[i] += counters->ns[i];
+        stats->totals.calls[i] += counters->calls[i];
+        stats->totals.bytes[i] += counters->bytes[i];
+    }
+
+    for (int i = 0; i < STATS_QUEUE_BUCKETS; i++) stats->totals.queue_depth[i] += counters->queue_depth[i];
+
+    stats->totals.tasks += counters->tasks;
+    stats->totals.busy_ns += counters->busy_ns;
+    stats->totals.idle_ns += counters->idle_ns;
+
+    // Each worker counts once in the utilization histogram
+    if (counters->tasks) {
+        uint64_t total = counters->busy_ns + counters->idle_ns;
+        int bucket = total ? (int)( counters->busy_ns * STATS_UTILIZATION_BUCKETS / total ) : STATS_UTILIZATION_BUCKETS - 1;
+        if (bucket >= STATS_UTILIZATION_BUCKETS) bucket = STATS_UTILIZATION_BUCKETS - 1;
+
+        stats->utilization[bucket]++;
+        stats->workers++;
+    }
+}
+
+/**
+ * Merges the counters of a thread that exits (pthread key destructor).
+ *
+ * @param arg           Pointer to the STATS_THREAD of the thread.
+ */
+
+static void thread_exit(void *arg) {
+    STATS_THREAD *local = (STATS_THREAD *)arg;
+
+    pthread_mutex_lock(&stats_mutex);
+    merge_counters(&stats_exited, &local->counters);
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+/**
+ * Creates the key that runs thread_exit() when a thread exits.
+ */
+
+static void create_key() {
+    pthread_key_create(&stats_key, thread_exit);
+}
+
+/**
+ * Gets the counters of the calling thread, registering the thread on its first use.
+ *
+ * @return              The counters.
+ */
+
+static STATS_COUNTERS *get_local_counters() {
+    if (!stats_local.registered) {
+        pthread_once(&stats_key_once, create_key);
+        pthread_setspecific(stats_key, &stats_local);
+        stats_local.registered = 1;
+    }
+
+    return &stats_local.counters;
+}
+
+/**
+ * Enables the counters and starts the wall clock.
+ */
+
+void stats_start() {
+    stats_start_time = stats_now();
+    stats_enabled = 1;
+}
+
+/**
+ * Adds a run of a stage to the counters of the calling thread.
+ *
+ * @param stage         The stage.
+ * @param start         Start time of the run (see STATS_BEGIN()).
+ * @param bytes         Bytes processed by the run.
+ */
+
+void stats_add(STATS_STAGE stage, uint64_t start, uint64_t bytes) {
+    STATS_COUNTERS *counters = get_local_counters();
+
+    counters->ns[stage] += stats_now() - start;
+    counters->calls[stage]++;
+    counters->bytes[stage] += bytes;
+}
+
+/**
+ * Adds a task run by a worker to the counters of the calling thread.
+ *
+ * @param idle_start    Time when the worker started waiting for the task.
+ * @param busy_start    Time when the worker started running the task.
+ */
+
+void stats_add_task(uint64_t idle_start, uint64_t busy_start) {
+    STATS_COUNTERS *counters = get_local_counters();
+
+    counters->idle_ns += busy_start - idle_start;
+    counters->busy_ns += stats_now() - busy_start;
+    counters->tasks++;
+}
+
+/**
+ * Adds a sample of the depth of the task queue to the counters of the calling thread.
+ *
+ * @param depth         Tasks waiting for a worker.
+ */
+
+void stats_add_queue_depth(size_t depth) {
+    int bucket = 0;
+
+    // Bucket n holds the depths from 2^(n-1) to 2^n - 1
+    while (depth && bucket < STATS_QUEUE_BUCKETS - 1) {
+        depth >>= 1;
+        bucket++;
+    }
+
+    get_local_counters()->queue_depth[bucket]++;
+}
+
+/**
+ * Gets the merged counters.
+ *
+ * Only the counters of the calling thread and the threads that already exited are merged, so it
+ * must be called once the threads pool is freed.
+ *
+ * @param stats         Pointer to receive the counters.
+ */
+
+void stats_get(STATS *stats) {
+    pthread_mutex_lock(&stats_mutex);
+    memcpy(stats, &stats_exited, sizeof(STATS));
+    pthread_mutex_unlock(&stats_mutex);
+
+    merge_counters(stats, &stats_local.counters);
+
+    stats->wall_ns = stats_enabled ? stats_now() - stats_start_time : 0;
+}
+
+/**
+ * Gets the name of a stage.
+ *
+ * @param stage         The stage.
+ *
+ * @return              The name of the stage.
+ */
+
+const char *stats_get_stage_name(STATS_STAGE stage) {
+    return stage >= 0 && stage < STATS_NUM_STAGES ? stage_names[stage] : "";
+}
@@ -0,0 +1,150 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file stats.h
+ * @brief Timing counters for the PSARc project (--stats).
+ *
+ * This header file declares the counters and timers of the hot paths: the time spent in each
+ * stage (walking directories, reading, compressing, writing, waiting in the threads pool...),
+ * the depth of the task queue and the utilization of the workers. The counters are kept per
+ * thread and merged when the threads exit, so they don't need any locking while they run.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+// Stages of the hot paths
+typedef enum {
+    STATS_WALK,                             // Reading directories (calls = directories)
+    STATS_READ,                             // Reading input files or the archive
+    STATS_COMPRESS,                         // Compressing blocks
+    STATS_DECOMPRESS,                       // Decompressing blocks
+    STATS_CHECKSUM,                         // CRC32C of the data (--checksum)
+    STATS_DIGEST,                           // MD5 of the entry names
+    STATS_WRITE,                            // Writing the archive or the extracted files
+    STATS_SLOT_WAIT,                        // Waiting for a free slot of the threads pool
+    STATS_ORDER_WAIT,                       // Waiting for the next block in order (writer stage)
+    STATS_NUM_STAGES
+} STATS_STAGE;
+
+#define STATS_QUEUE_BUCKETS         12      // Queue depth histogram: 0, 1, 2-3, 4-7, ..., 1024+
+#define STATS_UTILIZATION_BUCKETS   10      // Worker utilization histogram: 0-10%, ..., 90-100%
+
+typedef struct {
+    uint64_t ns[STATS_NUM_STAGES];          // Time in each stage
+    uint64_t calls[STATS_NUM_STAGES];       // Times each stage was run
+    uint64_t bytes[STATS_NUM_STAGES];       // Bytes processed by each stage
+    uint64_t queue_depth[STATS_QUEUE_BUCKETS]; // Tasks waiting for a worker, sampled as tasks are started
+    uint64_t tasks;                         // Tasks run by workers
+    uint64_t busy_ns;                       // Time workers spent running tasks
+    uint64_t idle_ns;                       // Time workers spent waiting for tasks
+} STATS_COUNTERS;
+
+typedef struct {
+    uint64_t wall_ns;                       // Time since stats_start()
+    STATS_COUNTERS totals;                  // Counters of all the threads
+    uint32_t workers;                       // Workers that ran at least one task
+    uint32_t utilization[STATS_UTILIZATION_BUCKETS]; // Workers by busy time / (busy + idle)
+} STATS;
+
+extern int stats_enabled;                   // Counters are updated (set by stats_start())
+
+/**
+ * Gets the current time of the monotonic clock.
+ *
+ * @return              The time in nanoseconds.
+ */
+static inline uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Macro to start timing a stage, it evaluates to the start time (0 if stats are disabled).
+ */
+#define STATS_BEGIN() ( stats_enabled ? stats_now() : 0 )
+
+/**
+ * Macro to add the time since STATS_BEGIN() and the bytes processed to a stage.
+ */
+#define STATS_END(stage, start, size) do { if (stats_enabled) stats_add(stage, start, size); } while (0)
+
+/**
+ * Enables the counters and starts the wall clock.
+ */
+void stats_start();
+
+/**
+ * Adds a run of a stage to the counters of the calling thread.
+ *
+ * @param stage         The stage.
+ * @param start         Start time of the run (see STATS_BEGIN()).
+ * @param bytes         Bytes processed by the run.
+ */
+void stats_add(STATS_STAGE stage, uint64_t start, uint64_t bytes);
+
+/**
+ * Adds a task run by a worker to the counters of the calling thread.
+ *
+ * @param idle_start    Time when the worker started waiting for the task.
+ * @param busy_start    Time when the worker started running the task.
+ */
+void stats_add_task(uint64_t idle_start, uint64_t busy_start);
+
+/**
+ * Adds a sample of the depth of the task queue to the counters of the calling thread.
+ *
+ * @param depth         Tasks waiting for a worker.
+ */
+void stats_add_queue_depth(size_t depth);
+
+/**
+ * Gets the merged counters.
+ *
+ * Only the counters of the calling thread and the threads that already exited are merged, so it
+ * must be called once the threads pool is freed.
+ *
+ * @param stats         Pointer to receive the counters.
+ */
+void stats_get(STATS *stats);
+
+/**
+ * Gets the name of a stage.
+ *
+ * @param stage         The stage.
+ *
+ * @return              The name of the stage.
+ */
+const char *stats_get_stage_name(STATS_STAGE stage);
+
+#endif /* __STATS_H */
@@ -12,23 +12,56 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#include <malloc.h>
 #else
 #include <unistd.h>
+#include <sys/mman.h>
 #endif
 
 #include "threads.h"
+#include "stats.h"
 
-THREADS_INFO *threads_info = NULL;
+#define THREADS_DATA_ALIGN      64                      // Alignment of the user data of each slot (a cache line)
+#define THREADS_HUGE_PAGE       ( 2 * 1024 * 1024 )     // Pools this big are aligned to huge pages
 
-int threads_current = 1;             // Current active thread
-int threads_last = 1;                // Last thread ID
-int threads_available = 0;           // Number of available threads
-int threads_running = 0;             // Number of threads currently running
+static THREADS_INFO *threads_info = NULL;   // Task slots (user data + task state)
+static void *threads_pool = NULL;           // User data of all the slots
+static pthread_t *threads_workers = NULL;   // Worker threads
+static void **threads_locals = NULL;        // Local data of each worker
+static void (*threads_local_free)(void *) = NULL;
 
-size_t threads_max = 0;              // Total number of threads
+static int threads_current = 1;             // Current active thread (order)
+static int threads_last = 1;                // Last thread ID
 
-pthread_mutex_t threads_shared_mutex;
-pthread_cond_t threads_shared_condition = PTHREAD_COND_INITIALIZER;
+static size_t threads_max = 0;              // Total number of threads
+static size_t threads_slots = 0;            // Total number of slots (tasks in flight)
+static size_t threads_started = 0;          // Number of worker threads created
+static int threads_shutdown = 0;            // Workers must exit when the queue is empty
+
+// Free slots (LIFO, most recently used slot is reused first)
+static int *threads_free_slots = NULL;
+static size_t threads_free_count = 0;
+
+// Bounded task queue (FIFO ring, capacity = threads_slots)
+static int *threads_queue = NULL;
+static size_t threads_queue_head = 0;
+static size_t threads_queue_count = 0;
+
+static size_t threads_pending = 0;          // Slots reserved, queued or running
+
+static pthread_mutex_t threads_queue_mutex;
+static pthread_cond_t threads_task_available;
+static pthread_cond_t threads_slot_available;
+static pthread_cond_t threads_all_done;
+
+static pthread_mutex_t threads_shared_mutex;    // Protects the orderer state
+
+// Writer stage
+static void (*threads_writer)(THREADS_INFO *) = NULL;
+static pthread_t threads_writer_hnd;
+static pthread_cond_t threads_writer_condition;
+static int threads_writer_exit = 0;             // The writer must exit (all tasks committed)
+static THREADS_INFO **threads_done = NULL;      // Finished tasks, indexed by tid % threads_slots
 
 /**
  * Get the number of available CPU threads.
@@ -53,31 +86,122 @@ int threads_get_max() {
 }
 
 /**
- * Thread function that handles the execution of tasks.
+ * Allocates the user data of all the slots at once.
+ *
+ * The pool is aligned to the page (to a huge page if it's big enough, and it's advised to use
+ * them), so the blocks of the slots don't share pages with anything else.
+ *
+ * @param size      Size of the pool.
+ *
+ * @return          The pool, or NULL if memory allocation fails.
+ */
+static void *threads_pool_alloc(size_t size) {
+    void *pool = NULL;
+
+#ifdef _WIN32
+    pool = _aligned_malloc(size, 4096);
+#else
+    size_t align = size >= THREADS_HUGE_PAGE ? THREADS_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
+    size = ( size + align - 1 ) & ~( align - 1 );
+
+    if (posix_memalign(&pool, align, size)) return NULL;
+
+#ifdef MADV_HUGEPAGE
+    if (align == THREADS_HUGE_PAGE) madvise(pool, size, MADV_HUGEPAGE);
+#endif
+#endif
+
+    return pool;
+}
+
+/**
+ * Frees the pool allocated by threads_pool_alloc().
  *
- * @param arg Pointer to the THREADS_INFO structure for the thread.
+ * @param pool      The pool.
  */
-void *threads_fn(void *arg) {
-    THREADS_INFO *ti = (THREADS_INFO *)arg;
+static void threads_pool_free(void *pool) {
+#ifdef _WIN32
+    _aligned_free(pool);
+#else
+    free(pool);
+#endif
+}
 
+/**
+ * Thread function that handles the execution of tasks.
+ *
+ * Workers sleep on the task queue and run tasks in the order they were started.
+ *
+ * @param arg Pointer to the local data of the worker.
+ */
+static void *threads_fn(void *arg) {
     while (1) {
-        // Wait for awake
-        pthread_mutex_lock(&ti->mutex);
-        ti->status = THREADS_STAT_FREE; // free
-        pthread_cond_wait(&ti->condition, &ti->mutex);
-    
-        pthread_mutex_lock(&threads_shared_mutex);
-        threads_running++;
-        pthread_mutex_unlock(&threads_shared_mutex);
+        uint64_t idle_start = STATS_BEGIN();
+
+        pthread_mutex_lock(&threads_queue_mutex);
+        while (!threads_queue_count && !threads_shutdown)
+            pthread_cond_wait(&threads_task_available, &threads_queue_mutex);
 
+        if (!threads_queue_count) {
+            // Shutdown and nothing left to do
+            pthread_mutex_unlock(&threads_queue_mutex);
+            break;
+        }
+
+        int slot = threads_queue[threads_queue_head];
+        if (++threads_queue_head >= threads_slots) threads_queue_head = 0;
+        threads_queue_count--;
+
+        THREADS_INFO *ti = &threads_info[slot];
         ti->status = THREADS_STAT_RUNNING; // running
-        pthread_mutex_unlock(&ti->mutex);
+        ti->local = (void **)arg;
+        pthread_mutex_unlock(&threads_queue_mutex);
 
         // Awake
+        uint64_t busy_start = STATS_BEGIN();
+
         ti->function(ti);
+
+        if (stats_enabled) stats_add_task(idle_start, busy_start);
+    }
+
+    return NULL;
+}
+
+/**
+ * Writer thread function.
+ *
+ * Commits the finished tasks strictly in order: it waits for the task that owns the current turn,
+ * runs the writer function on it and releases its slot.
+ *
+ * @param arg Unused.
+ */
+static void *threads_writer_fn(void *arg) {
+    while (1) {
+        uint64_t wait_start = STATS_BEGIN();
+
+        pthread_mutex_lock(&threads_shared_mutex);
+
+        THREADS_INFO *ti;
+        while (!(ti = threads_done[threads_current % threads_slots]) || ti->tid != threads_current) {
+            if (threads_writer_exit) {
+                pthread_mutex_unlock(&threads_shared_mutex);
+                return NULL;
+            }
+            pthread_cond_wait(&threads_writer_condition, &threads_shared_mutex);
+        }
+
+        threads_done[threads_current % threads_slots] = NULL;
+
+        pthread_mutex_unlock(&threads_shared_mutex);
+
+        STATS_END(STATS_ORDER_WAIT, wait_start, 0);
+
+        threads_writer(ti);
+
+        threads_completed(ti);
     }
 
-    pthread_exit(NULL);
     return NULL;
 }
 
@@ -85,88 +209,234 @@ void *threads_fn(void *arg) {
  * Initializes thread management and user data.
  *
  * @param num_threads       The number of threads to initialize.
+ * @param num_slots         The number of slots (tasks in flight), at least num_threads.
+ *                          With a writer stage, this is the reorder window.
  * @param user_data_size    The size for user data allocation.
  *
  * @return 0 if successful, -1 on error.
  */
-int threads_init(size_t num_threads, uint32_t user_data_size) {
+int threads_init(size_t num_threads, size_t num_slots, uint32_t user_data_size) {
     // Check if the THREADS_INFO has already been initialized
     if (threads_info)
         threads_free();
 
-    // Allocate memory for the array of pointers to thread-specific info
-    threads_info = (THREADS_INFO *)calloc(num_threads, sizeof(THREADS_INFO));
-    if (!threads_info) {
+    if (num_slots < num_threads)
+        num_slots = num_threads;
+
+    // Allocate memory for the array of thread-specific info
+    threads_info = (THREADS_INFO *)calloc(num_slots, sizeof(THREADS_INFO));
+    threads_workers = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+    threads_free_slots = (int *)calloc(num_slots, sizeof(int));
+    threads_queue = (int *)calloc(num_slots, sizeof(int));
+    threads_done = (THREADS_INFO **)calloc(num_slots, sizeof(THREADS_INFO *));
+    threads_locals = (void **)calloc(num_threads ? num_threads : 1, sizeof(void *));
+    if (!threads_info || !threads_workers || !threads_free_slots || !threads_queue || !threads_done || !threads_locals) {
         perror("Error allocating memory for threads_info");
+        free(threads_info);
+        free(threads_workers);
+        free(threads_free_slots);
+        free(threads_queue);
+        free(threads_done);
+        free(threads_locals);
+        threads_info = NULL;
+        threads_workers = NULL;
+        threads_locals = NULL;
+        threads_free_slots = NULL;
+        threads_queue = NULL;
+        threads_done = NULL;
         return -1;
     }
 
     // Store the number of threads globally
     threads_max = num_threads;
+    threads_slots = num_slots;
+    threads_started = 0;
+    threads_shutdown = 0;
+    threads_writer = NULL;
 
     threads_current = 1;                // Current active thread
     threads_last = 1;                   // Last thread ID
-    threads_available = threads_max;    // Number of available threads
-    threads_running = 0;                // Number of threads currently running
-
+    threads_queue_head = 0;
+    threads_queue_count = 0;
+    threads_pending = 0;
+    threads_free_count = 0;
+
+    pthread_mutex_init(&threads_queue_mutex, NULL);
+    pthread_cond_init(&threads_task_available, NULL);
+    pthread_cond_init(&threads_slot_available, NULL);
+    pthread_cond_init(&threads_all_done, NULL);
     pthread_mutex_init(&threads_shared_mutex, NULL);
-    pthread_cond_init(&threads_shared_condition, NULL);
+    pthread_cond_init(&threads_writer_condition, NULL);
 
-    // Initialize each buffer individually
-    for (size_t i = 0; i < threads_max; ++i) {
-        threads_info[i].status = -1; // THREADS_STAT_FREE only when thread is started
-        threads_info[i].data = malloc(user_data_size);
-        if (!threads_info[i].data) {
-            perror("Error allocating memory for user data\n");
-            threads_free();
-            return -1;
-        }
+    // The user data of the slots is carved out of a single pool
+    size_t data_stride = ( (size_t)user_data_size + THREADS_DATA_ALIGN - 1 ) & ~(size_t)( THREADS_DATA_ALIGN - 1 );
+    threads_pool = threads_pool_alloc(data_stride * threads_slots);
+    if (!threads_pool) {
+        perror("Error allocating memory for user data\n");
+        threads_free();
+        return -1;
+    }
+
+    // Initialize each slot individually
+    for (size_t i = 0; i < threads_slots; ++i) {
+        threads_info[i].status = THREADS_STAT_FREE;
+        threads_info[i].data = (uint8_t *)threads_pool + i * data_stride;
 
-        pthread_mutex_init(&threads_info[i].mutex, NULL);
         pthread_cond_init(&threads_info[i].condition, NULL);
 
-        if (pthread_create(&threads_info[i].thread_hnd, NULL, threads_fn, (void *)&threads_info[i])) {
+        // Push in reverse, so slot 0 is handed out first
+        threads_free_slots[threads_free_count++] = threads_slots - 1 - i;
+    }
+
+    for (size_t i = 0; i < threads_max; ++i) {
+        if (pthread_create(&threads_workers[i], NULL, threads_fn, &threads_locals[i])) {
             perror("Error creating thread\n");
             threads_free();
             return -1;
         }
+        threads_started++;
     }
 
     return 0;
 }
 
+/**
+ * Starts the writer stage.
+ *
+ * Once started, a dedicated thread commits the finished tasks in order by calling `writer` on
+ * them. Tasks must call threads_task_done() instead of threads_wait_for_orderer_continue() and
+ * threads_completed(), so workers can pick up new tasks without waiting for their turn.
+ *
+ * @param writer    The function that commits a finished task.
+ *
+ * @return 0 if successful, -1 on error.
+ */
+int threads_start_writer(void (*writer)(THREADS_INFO *ti)) {
+    if (!threads_info || threads_writer)
+        return -1;
+
+    threads_writer = writer;
+    threads_writer_exit = 0;
+    if (pthread_create(&threads_writer_hnd, NULL, threads_writer_fn, NULL)) {
+        perror("Error creating thread\n");
+        threads_writer = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Sets the function used to free the local data of each worker.
+ *
+ * It's called from threads_free() for every worker with non-NULL local data.
+ *
+ * @param local_free    The function that frees the local data.
+ */
+void threads_set_local_data_free(void (*local_free)(void *)) {
+    threads_local_free = local_free;
+}
+
+/**
+ * Hands a finished task to the writer stage.
+ *
+ * The slot stays reserved until the writer commits it.
+ *
+ * @param ti Pointer to the THREADS_INFO structure of the finished task.
+ */
+void threads_task_done(THREADS_INFO *ti) {
+    pthread_mutex_lock(&threads_shared_mutex);
+
+    ti->status = THREADS_STAT_WAIT_FOR_ORDERER_CONTINUE; // wait to be written
+    threads_done[THREAD_GET_ID(ti) % threads_slots] = ti;
+
+    if (THREAD_GET_ID(ti) == threads_current)
+        pthread_cond_signal(&threads_writer_condition);
+
+    pthread_mutex_unlock(&threads_shared_mutex);
+}
+
 /**
  * Frees allocated memory and resources for thread management.
+ *
+ * Queued tasks are completed before the workers exit.
  */
 void threads_free() {
     // Check if the threads_info have been initialized
     if (!threads_info)
         return;
 
-    // Free threads & data individually
-    for (size_t i = 0; i < threads_max; ++i) {
-        pthread_cancel(threads_info[i].thread_hnd);
-        pthread_join(threads_info[i].thread_hnd, NULL);
-        threads_info[i].thread_hnd = 0;
+    // Wake up the workers and let them drain the queue
+    pthread_mutex_lock(&threads_queue_mutex);
+    threads_shutdown = 1;
+    pthread_cond_broadcast(&threads_task_available);
+    pthread_mutex_unlock(&threads_queue_mutex);
+
+    for (size_t i = 0; i < threads_started; ++i)
+        pthread_join(threads_workers[i], NULL);
+
+    if (threads_writer) {
+        // Workers are gone, let the writer commit what's left
+        threads_wait_for_completion();
 
-        pthread_mutex_destroy(&threads_info[i].mutex);
+        pthread_mutex_lock(&threads_shared_mutex);
+        threads_writer_exit = 1;
+        pthread_cond_signal(&threads_writer_condition);
+        pthread_mutex_unlock(&threads_shared_mutex);
+
+        pthread_join(threads_writer_hnd, NULL);
+        threads_writer = NULL;
+    }
 
-        free(threads_info[i].data);
+    for (size_t i = 0; i < threads_slots; ++i) {
+        pthread_cond_destroy(&threads_info[i].condition);
         threads_info[i].data = NULL;
     }
 
+    threads_pool_free(threads_pool);
+    threads_pool = NULL;
+
     free(threads_info);
     threads_info = NULL;
 
+    free(threads_workers);
+    threads_workers = NULL;
+
+    // Free the local data of each worker
+    for (size_t i = 0; i < threads_max; ++i) {
+        if (threads_locals[i] && threads_local_free) threads_local_free(threads_locals[i]);
+    }
+    threads_local_free = NULL;
+
+    free(threads_locals);
+    threads_locals = NULL;
+
+    free(threads_free_slots);
+    threads_free_slots = NULL;
+
+    free(threads_queue);
+    threads_queue = NULL;
+
+    free(threads_done);
+    threads_done = NULL;
+
+    pthread_mutex_destroy(&threads_queue_mutex);
+    pthread_cond_destroy(&threads_task_available);
+    pthread_cond_destroy(&threads_slot_available);
+    pthread_cond_destroy(&threads_all_done);
     pthread_mutex_destroy(&threads_shared_mutex);
-    pthread_cond_destroy(&threads_shared_condition);
+    pthread_cond_destroy(&threads_writer_condition);
 
     threads_max = 0;
+    threads_slots = 0;
+    threads_started = 0;
 
     threads_current = 1;                // Current active thread
     threads_last = 1;                   // Last thread ID
-    threads_available = threads_max;    // Number of available threads
-    threads_running = 0;                // Number of threads currently running
+    threads_queue_head = 0;
+    threads_queue_count = 0;
+    threads_pending = 0;
+    threads_free_count = 0;
 }
 
 /**
@@ -176,27 +446,34 @@ void threads_free() {
  * before proceeding. Each thread is assigned a unique order, and this function ensures that
  * the thread with the specified order finishes before allowing further progress.
  *
+ * The caller sleeps on its own slot condition and is only woken when it's its turn.
+ *
  * @param ti Pointer to the THREADS_INFO structure of the completed thread.
  */
 void threads_wait_for_orderer_continue(THREADS_INFO *ti) {
-    // Wait for the thread with the specified tid to complete
+    uint64_t wait_start = STATS_BEGIN();
+
     pthread_mutex_lock(&threads_shared_mutex);
 
-    pthread_mutex_lock(&ti->mutex);
-    int tid = THREAD_GET_ID(ti);
     ti->status = THREADS_STAT_WAIT_FOR_ORDERER_CONTINUE; // wait to continue
-    pthread_mutex_unlock(&ti->mutex);
+    ti->waiting = 1;
 
-    while (tid != threads_current) {
-        pthread_cond_wait(&threads_shared_condition, &threads_shared_mutex);
+    while (THREAD_GET_ID(ti) != threads_current) {
+        pthread_cond_wait(&ti->condition, &threads_shared_mutex);
     }
 
+    ti->waiting = 0;
+
     pthread_mutex_unlock(&threads_shared_mutex);
+
+    STATS_END(STATS_ORDER_WAIT, wait_start, 0);
 }
 
 /**
  * Notifies that a thread has completed and releases resources.
  *
+ * Passes the turn to the next task in order and returns the slot to the free list.
+ *
  * @param ti Pointer to the THREADS_INFO structure of the completed thread.
  */
 void threads_completed(THREADS_INFO *ti) {
@@ -206,64 +483,72 @@ void threads_completed(THREADS_INFO *ti) {
     if (!threads_current)
         threads_current = 1;
 
-    threads_available++;
-    threads_running--;
-
-    pthread_cond_broadcast(&threads_shared_condition);
+    // Wake up only the task that owns the next turn (if it's already waiting)
+    for (size_t i = 0; i < threads_slots; ++i) {
+        if (threads_info[i].waiting && threads_info[i].tid == threads_current) {
+            pthread_cond_signal(&threads_info[i].condition);
+            break;
+        }
+    }
 
     pthread_mutex_unlock(&threads_shared_mutex);
+
+    pthread_mutex_lock(&threads_queue_mutex);
+
+    ti->status = THREADS_STAT_FREE;
+    threads_free_slots[threads_free_count++] = ti - threads_info;
+    threads_pending--;
+
+    pthread_cond_signal(&threads_slot_available);
+    if (!threads_pending)
+        pthread_cond_broadcast(&threads_all_done);
+
+    pthread_mutex_unlock(&threads_queue_mutex);
 }
 
 /**
  * Waits for all threads to complete their execution.
  *
- * This function continuously checks if there are any threads running and waits for them to finish
- * using a small sleep interval. It ensures that the program waits until all threads have completed
- * their execution before proceeding.
+ * This function sleeps until every reserved slot has been released by threads_completed().
+ * It ensures that the program waits until all threads have completed their execution before
+ * proceeding.
  */
 void threads_wait_for_completion() {
-    while (1) {
-        pthread_mutex_lock(&threads_shared_mutex);
-        int done = !threads_running && threads_available == threads_max;
-        pthread_mutex_unlock(&threads_shared_mutex);
-        if (done)
-            return;
-        usleep(100000); // Sleep for 100 milliseconds on Unix-like systems
-    }
+    pthread_mutex_lock(&threads_queue_mutex);
+    while (threads_pending)
+        pthread_cond_wait(&threads_all_done, &threads_queue_mutex);
+    pthread_mutex_unlock(&threads_queue_mutex);
 }
 
 /**
  * Retrieves a free slot for thread-specific task.
  *
- * This function searches for a free slot in thread-specific task and assigns it. Each thread has
- * its own set of data, and this function looks for an available user data and returns it through the
+ * This function takes a free slot and reserves it, sleeping until one is released if all of
+ * them are in use. Each slot has its own set of data, which is returned through the
  * `user_data` pointer.
  *
  * @param user_data     Pointer to a pointer that will receive the address of the thread-specific user data.
- * @return              The index of the thread where the buffer was assigned.
+ * @return              The index of the slot that was reserved.
  */
 int threads_get_free_slot(void **user_data) {
-    static int last_idx = 0;
-    while (1) {
-        pthread_mutex_lock(&threads_shared_mutex);
-        if (threads_available) {
-            if (++last_idx >= threads_max) last_idx = 0;
-            pthread_mutex_lock(&threads_info[last_idx].mutex);
-            if (threads_info[last_idx].status == THREADS_STAT_FREE) {
-                threads_available--;
-                threads_info[last_idx].status = THREADS_STAT_RESERVED;
-                *user_data = threads_info[last_idx].data;
-                pthread_mutex_unlock(&threads_info[last_idx].mutex);
-                pthread_mutex_unlock(&threads_shared_mutex);
-                return last_idx;
-            }
-            pthread_mutex_unlock(&threads_info[last_idx].mutex);
-        }
-//        pthread_cond_broadcast(&threads_shared_condition);
-        pthread_mutex_unlock(&threads_shared_mutex);
-        usleep(1000);
+    pthread_mutex_lock(&threads_queue_mutex);
+
+    // Only the time the producer is stalled counts
+    if (!threads_free_count) {
+        uint64_t wait_start = STATS_BEGIN();
+        while (!threads_free_count)
+            pthread_cond_wait(&threads_slot_available, &threads_queue_mutex);
+        STATS_END(STATS_SLOT_WAIT, wait_start, 0);
     }
-    return -1;
+
+    int slot = threads_free_slots[--threads_free_count];
+    threads_info[slot].status = THREADS_STAT_RESERVED;
+    threads_pending++;
+    *user_data = threads_info[slot].data;
+
+    pthread_mutex_unlock(&threads_queue_mutex);
+
+    return slot;
 }
 
 /**
@@ -271,7 +556,7 @@ int threads_get_free_slot(void **user_data) {
  *
  * This function starts a task in the specified slot with the provided function and data. It checks
  * if the slot is within the valid range and if it's reserved. If so, it assigns the data and function
- * to the thread and signals it to start.
+ * to the slot and pushes it to the task queue, waking up one worker.
  *
  * @param slot     The slot in which to start the task.
  * @param function The function to be executed.
@@ -279,13 +564,13 @@ int threads_get_free_slot(void **user_data) {
  * @return 0 if successful, 1 otherwise.
  */
 int threads_start_task(int slot, void *(*function)(void *), void *data) {
-    if (slot >= threads_max)
+    if (slot < 0 || slot >= threads_slots)
         return 1;
 
-    pthread_mutex_lock(&threads_info[slot].mutex);
+    pthread_mutex_lock(&threads_queue_mutex);
 
     if (threads_info[slot].status != THREADS_STAT_RESERVED) {
-        pthread_mutex_unlock(&threads_info[slot].mutex);
+        pthread_mutex_unlock(&threads_queue_mutex);
         return 1;
     }
 
@@ -295,14 +580,17 @@ int threads_start_task(int slot, void *(*function)(void *), void *data) {
     if (!threads_last)
         threads_last = 1;
 
-    while (threads_info[slot].status == THREADS_STAT_RESERVED) {
-        pthread_cond_signal(&threads_info[slot].condition);
-        pthread_mutex_unlock(&threads_info[slot].mutex);
-        usleep(1);
-        pthread_mutex_lock(&threads_info[slot].mutex);
-    }
+    if (stats_enabled) stats_add_queue_depth(threads_queue_count);
+
+    // The queue can't overflow: it has a place for every slot
+    size_t tail = threads_queue_head + threads_queue_count;
+    if (tail >= threads_slots) tail -= threads_slots;
+    threads_queue[tail] = slot;
+    threads_queue_count++;
+
+    pthread_cond_signal(&threads_task_available);
 
-    pthread_mutex_unlock(&threads_info[slot].mutex);
+    pthread_mutex_unlock(&threads_queue_mutex);
 
     return 0;
 }
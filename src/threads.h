@@ -11,20 +11,23 @@ enum {
     THREADS_STAT_FREE = 0,                /**< Thread is free. */
     THREADS_STAT_RESERVED,                /**< Thread is reserved for a task. */
     THREADS_STAT_RUNNING,                 /**< Thread is running a task. */
-    THREADS_STAT_WAIT_FOR_ORDERER_CONTINUE /**< Thread is waiting for orderer's signal to continue. */
+    THREADS_STAT_WAIT_FOR_ORDERER_CONTINUE /**< Thread is waiting for orderer's signal to continue (or to be written). */
 };
 
 /**
  * Structure representing thread information.
+ *
+ * Each structure is a task slot: it owns the user data and the state of the task running on it.
+ * Tasks are queued and run by the first idle worker thread.
  */
 typedef struct {
-    int tid;                    /**< Thread ID. */
+    int tid;                    /**< Thread ID (order of the task). */
     int status;                 /**< Thread status: FREE, RESERVED, RUNNING, WAIT_FOR_ORDERER_CONTINUE. */
-    pthread_t thread_hnd;       /**< Thread handle. */
-    pthread_mutex_t mutex;      /**< Thread mutex. */
-    pthread_cond_t condition;   /**< Thread condition. */
+    int waiting;                /**< Set while the task waits for its turn in the orderer. */
+    pthread_cond_t condition;   /**< Thread condition, signaled when it's the task turn. */
     void *data;                 /**< Custom data associated with the thread. */
     void *(*function)(void *);  /**< User-defined function to be executed by the thread. */
+    void **local;               /**< Local data of the worker running the task. */
 } THREADS_INFO;
 
 /**
@@ -37,6 +40,14 @@ typedef struct {
  */
 #define THREAD_GET_ID(ti) ((THREADS_INFO *)(ti))->tid
 
+/**
+ * Macro to retrieve the local data of the worker running a task.
+ *
+ * It starts as NULL and persists across the tasks run by the same worker, so it can hold
+ * state that is expensive to create per task. It's only valid in the task function.
+ */
+#define THREAD_LOCAL_DATA(ti) (*((THREADS_INFO *)(ti))->local)
+
 /**
  * Get the number of available CPU threads.
  *
@@ -48,11 +59,44 @@ int threads_get_max();
  * Initializes thread management and user data.
  *
  * @param num_threads       The number of threads to initialize.
+ * @param num_slots         The number of slots (tasks in flight), at least num_threads.
+ *                          With a writer stage, this is the reorder window.
  * @param user_data_size    The size for user data allocation.
  *
  * @return 0 if successful, -1 on error.
  */
-int threads_init(size_t num_threads, uint32_t user_data_size);
+int threads_init(size_t num_threads, size_t num_slots, uint32_t user_data_size);
+
+/**
+ * Starts the writer stage.
+ *
+ * Once started, a dedicated thread commits the finished tasks in order by calling `writer` on
+ * them. Tasks must call threads_task_done() instead of threads_wait_for_orderer_continue() and
+ * threads_completed(), so workers can pick up new tasks without waiting for their turn.
+ *
+ * @param writer    The function that commits a finished task.
+ *
+ * @return 0 if successful, -1 on error.
+ */
+int threads_start_writer(void (*writer)(THREADS_INFO *ti));
+
+/**
+ * Sets the function used to free the local data of each worker.
+ *
+ * It's called from threads_free() for every worker with non-NULL local data.
+ *
+ * @param local_free    The function that frees the local data.
+ */
+void threads_set_local_data_free(void (*local_free)(void *));
+
+/**
+ * Hands a finished task to the writer stage.
+ *
+ * The slot stays reserved until the writer commits it.
+ *
+ * @param ti Pointer to the THREADS_INFO structure of the finished task.
+ */
+void threads_task_done(THREADS_INFO *ti);
 
 /**
  * Frees allocated memory and resources for thread management.
@@ -80,21 +124,21 @@ void threads_completed(THREADS_INFO *ti);
 /**
  * Waits for all threads to complete their execution.
  *
- * This function continuously checks if there are any threads running and waits for them to finish
- * using a small sleep interval. It ensures that the program waits until all threads have completed
- * their execution before proceeding.
+ * This function sleeps until every reserved slot has been released by threads_completed().
+ * It ensures that the program waits until all threads have completed their execution before
+ * proceeding.
  */
 void threads_wait_for_completion();
 
 /**
  * Retrieves a free slot for thread-specific task.
  *
- * This function searches for a free slot in thread-specific task and assigns it. Each thread has
- * its own set of data, and this function looks for an available user data and returns it through the
+ * This function takes a free slot and reserves it, sleeping until one is released if all of
+ * them are in use. Each slot has its own set of data, which is returned through the
  * `user_data` pointer.
  *
  * @param user_data     Pointer to a pointer that will receive the address of the thread-specific user data.
- * @return              The index of the thread where the buffer was assigned.
+ * @return              The index of the slot that was reserved.
  */
 int threads_get_free_slot(void **user_data);
 
@@ -103,7 +147,7 @@ int threads_get_free_slot(void **user_data);
  *
  * This function starts a task in the specified slot with the provided function and data. It checks
  * if the slot is within the valid range and if it's reserved. If so, it assigns the data and function
- * to the thread and signals it to start.
+ * to the slot and pushes it to the task queue, waking up one worker.
  *
  * @param slot     The slot in which to start the task.
  * @param function The function to be executed.
@@ -0,0 +1,303 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file toc.c
+ * @brief Implementation of the reading of the archive tables for the PSARc project.
+ *
+ * This file decodes the header, the TOC, the block table, the preset dictionary and the
+ * checksums of an archive, for the command line tool and for the archive handle API.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "psarc.h"
+#include "inettypes.h"
+#include "coder.h"
+#include "toc.h"
+
+static const uint8_t toc_empty_data[1] = { 0 };
+
+/**
+ * Reads a range of bytes of the archive, into a new buffer if the source isn't mapped.
+ *
+ * @param source        Where the archive is read from.
+ * @param offset        Offset of the data in the archive.
+ * @param size          Size of the data.
+ * @param buffer        Pointer to receive the buffer to free (NULL if the source is mapped).
+ *
+ * @return              A pointer to the data, or NULL on error.
+ */
+
+static const uint8_t *toc_read_data(const TOC_SOURCE *source, uint64_t offset, size_t size, uint8_t **buffer) {
+    *buffer = NULL;
+    if (!size) return toc_empty_data;
+    if (!source->mapped && !(*buffer = malloc(size))) return NULL;
+
+    const uint8_t *data = source->read(source->context, offset, size, *buffer);
+    if (!data) {
+        free(*buffer);
+        *buffer = NULL;
+    }
+
+    return data;
+}
+
+/**
+ * Reads and checks the header of the archive.
+ *
+ * @param source        Where the archive is read from.
+ * @param info          The header fields to fill.
+ *
+ * @return              0 on success, 1 on error.
+ */
+
+static int toc_read_header(const TOC_SOURCE *source, ARCHIVEINFO *info) {
+    PSARCHEADER buffer;
+
+    const PSARCHEADER *header = (const PSARCHEADER *)source->read(source->context, 0, sizeof(PSARCHEADER), source->mapped ? NULL : (uint8_t *)&buffer);
+    if (!header || memcmp(header->magic, "PSAR", 4)) return 1;
+
+    const uint16_t *pversion = (const uint16_t *)&header->version;
+    info->version.high = ntohs(*pversion);
+    info->version.low = ntohs(*(pversion + 1));
+    info->compression_type = coder_get_type(header->compression_type);
+    info->toc_length = ntohl(header->toc_length);
+    info->toc_entries = ntohl(header->toc_entries);
+    info->block_size = ntohl(header->block_size);
+    info->archive_flags = ntohl(header->archive_flags);
+
+    return !info->block_size || !info->toc_entries;
+}
+
+/**
+ * Reads the TOC entries of the archive.
+ *
+ * @param source        Where the archive is read from.
+ * @param toc           The tables, with the header already read.
+ *
+ * @return              0 on success, 1 on error.
+ */
+
+static int toc_read_entries(const TOC_SOURCE *source, TOC *toc) {
+    uint64_t toc_size = (uint64_t)toc->info.toc_entries * sizeof(PSARCTOC);
+    if (sizeof(PSARCHEADER) + toc_size > toc->info.toc_length) return 1;
+
+    toc->entries = (FILEINFO *)calloc(toc->info.toc_entries, sizeof(FILEINFO));
+    if (!toc->entries) return 1;
+
+    uint8_t *buffer;
+    const PSARCTOC *entry = (const PSARCTOC *)toc_read_data(source, sizeof(PSARCHEADER), toc_size, &buffer);
+    if (!entry) return 1;
+
+    for (uint32_t i = 0; i < toc->info.toc_entries; i++, entry++) {
+        FILEINFO *fi = &toc->entries[i];
+        memmove(fi->name_digest, entry->name_digest, sizeof(fi->name_digest));
+        fi->block_index = ntohl(entry->block_offset);
+        fi->uncompressed_size = ntoh40((const uint8_t *)entry->uncompressed_size);
+        fi->offset = ntoh40((const uint8_t *)entry->file_offset);
+        fi->num_blocks = ( fi->uncompressed_size + toc->info.block_size - 1 ) / toc->info.block_size;
+    }
+
+    free(buffer);
+
+    return 0;
+}
+
+/**
+ * Reads the block table of the archive, and checks that the entries lie within it.
+ *
+ * @param source        Where the archive is read from.
+ * @param toc           The tables, with the TOC entries already read.
+ *
+ * @return              0 on success, 1 on error.
+ */
+
+static int toc_read_blocktable(const TOC_SOURCE *source, TOC *toc) {
+    int bsize = get_blocktable_item_size_of(toc->info.block_size);
+
+    uint64_t blocktable_offset = sizeof(PSARCHEADER) + (uint64_t)toc->info.toc_entries * sizeof(PSARCTOC);
+    toc->num_blocks = (toc->info.toc_length - blocktable_offset) / bsize;
+
+    toc->blocktable = (uint32_t *)malloc((toc->num_blocks ? toc->num_blocks : 1) * sizeof(uint32_t));
+    if (!toc->blocktable) return 1;
+
+    uint8_t *buffer;
+    const uint8_t *blk = toc_read_data(source, blocktable_offset, toc->num_blocks * bsize, &buffer);
+    if (!blk) return 1;
+
+    // Items are big endian, 1 to 4 bytes each
+    for (size_t i = 0; i < toc->num_blocks; i++, blk += bsize) {
+        switch (bsize) {
+            case 1:
+                toc->blocktable[i] = blk[0];
+                break;
+            case 2:
+                toc->blocktable[i] = ((uint32_t)blk[0] << 8) | blk[1];
+                break;
+            case 3:
+                toc->blocktable[i] = ntoh24(blk);
+                break;
+            case 4:
+                toc->blocktable[i] = ((uint32_t)blk[0] << 24) | ((uint32_t)blk[1] << 16) | ((uint32_t)blk[2] << 8) | blk[3];
+                break;
+        }
+    }
+
+    free(buffer);
+
+    // Empty entries have no blocks, their block index isn't meaningful
+    for (uint32_t i = 0; i < toc->info.toc_entries; i++) {
+        if (toc->entries[i].num_blocks && (uint64_t)toc->entries[i].block_index + toc->entries[i].num_blocks > toc->num_blocks) return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the preset dictionary of the archive, if it has one.
+ *
+ * The dictionary is stored between the tables and the manifest.
+ *
+ * @param source        Where the archive is read from.
+ * @param toc           The tables, with the TOC entries already read.
+ *
+ * @return              0 on success, 1 on error.
+ */
+
+static int toc_read_dictionary(const TOC_SOURCE *source, TOC *toc) {
+    if ( !( toc->info.archive_flags & AF_DICTIONARY ) || toc->entries[0].offset <= toc->info.toc_length ) return 0;
+
+    size_t size = toc->entries[0].offset - toc->info.toc_length;
+
+    toc->dictionary = malloc(size);
+    if (!toc->dictionary) return 1;
+
+    const uint8_t *data = source->read(source->context, toc->info.toc_length, size, source->mapped ? NULL : toc->dictionary);
+    if (!data) return 1;
+    if (data != toc->dictionary) memcpy(toc->dictionary, data, size);
+
+    toc->dictionary_size = size;
+
+    return 0;
+}
+
+/**
+ * Reads the checksums of the entries of the archive, if it has them.
+ *
+ * They're stored in a trailer with the CRC32C of each TOC entry, at the end of the archive.
+ *
+ * @param source        Where the archive is read from.
+ * @param toc           The tables, with the TOC entries already read.
+ *
+ * @return              0 on success, 1 on error.
+ */
+
+static int toc_read_checksums(const TOC_SOURCE *source, TOC *toc) {
+    if ( !( toc->info.archive_flags & AF_CHECKSUMS ) ) return 0;
+
+    size_t size = (size_t)toc->info.toc_entries * sizeof(uint32_t);
+    if (source->size < toc->info.toc_length + size) return 1;
+
+    uint8_t *buffer;
+    const uint8_t *data = toc_read_data(source, source->size - size, size, &buffer);
+    if (!data) return 1;
+
+    for (uint32_t i = 0; i < toc->info.toc_entries; i++, data += 4) {
+        toc->entries[i].checksum = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+    }
+
+    free(buffer);
+
+    return 0;
+}
+
+/**
+ * Reads the tables of an archive.
+ *
+ * The header is checked, and the TOC entries must lie within the block table. The preset
+ * dictionary (AF_DICTIONARY) and the checksums (AF_CHECKSUMS) are read if the archive has them.
+ * The file names are not set, the manifest is an entry like the others (see toc_split_names()).
+ *
+ * @param source        Where the archive is read from.
+ * @param toc           The tables to fill (freed with toc_free(), nothing is left to free on error).
+ *
+ * @return              0 on success, otherwise the step that failed (TOC_ERROR_*).
+ */
+
+int toc_read(const TOC_SOURCE *source, TOC *toc) {
+    memset(toc, 0, sizeof(TOC));
+
+    int ret = toc_read_header(source, &toc->info) ? TOC_ERROR_HEADER :
+              toc_read_entries(source, toc) ? TOC_ERROR_ENTRIES :
+              toc_read_blocktable(source, toc) ? TOC_ERROR_BLOCKTABLE :
+              toc_read_dictionary(source, toc) ? TOC_ERROR_DICTIONARY :
+              toc_read_checksums(source, toc) ? TOC_ERROR_CHECKSUMS : 0;
+
+    if (ret) toc_free(toc);
+
+    return ret;
+}
+
+/**
+ * Frees the tables of an archive.
+ *
+ * @param toc           The tables (the structure itself isn't freed).
+ */
+
+void toc_free(TOC *toc) {
+    free(toc->entries);
+    free(toc->blocktable);
+    free(toc->dictionary);
+    toc->entries = NULL;
+    toc->blocktable = NULL;
+    toc->dictionary = NULL;
+}
+
+/**
+ * Splits the decoded manifest in place and sets the file names of the entries.
+ *
+ * Names are separated by newlines. The file names point into the manifest, which must outlive
+ * the entries. Empty lines keep their entry slot.
+ *
+ * @param entries       The TOC entries, entry 0 is the manifest.
+ * @param toc_entries   Number of TOC entries.
+ * @param names         The manifest, null terminated.
+ */
+
+void toc_split_names(FILEINFO *entries, uint32_t toc_entries, char *names) {
+    char *name = names;
+    for (uint32_t i = 1; i < toc_entries && name; i++) {
+        char *next = strchr(name, '\x0a');
+        if (next) *next++ = '\0';
+
+        entries[i].filename = name;
+
+        name = next;
+    }
+}
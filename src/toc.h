@@ -0,0 +1,117 @@
+/**
+ * Copyright (c) 2023 Juan José Ponteprino
+ *
+ * @file toc.h
+ * @brief Reading of the archive tables for the PSARc project.
+ *
+ * This file declares the functions that decode the header, the TOC, the block table, the preset
+ * dictionary and the checksums of an archive. They are shared by the command line tool and the
+ * archive handle API, so the format is parsed in a single place.
+ *
+ * This file is part of the PSARc project.
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * @author Juan José Ponteprino
+ * @date September 2023
+ */
+
+#ifndef __TOC_H
+#define __TOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "common.h"
+
+// Errors of toc_read()
+#define TOC_ERROR_HEADER        1   // Not a valid header
+#define TOC_ERROR_ENTRIES       2   // Error reading the TOC entries
+#define TOC_ERROR_BLOCKTABLE    3   // Error reading the block table
+#define TOC_ERROR_DICTIONARY    4   // Error reading the preset dictionary
+#define TOC_ERROR_CHECKSUMS     5   // Error reading the checksums
+
+/**
+ * Structure describing where the tables of an archive are read from.
+ */
+typedef struct {
+    /**
+     * Reads a range of bytes of the archive.
+     *
+     * @param context   The context of the source.
+     * @param offset    Offset of the data in the archive.
+     * @param size      Size of the data.
+     * @param buffer    Buffer for the data (at least size bytes, NULL if the source is mapped).
+     *
+     * @return          A pointer to the data, or NULL on error.
+     */
+    const uint8_t *(*read)(void *context, uint64_t offset, size_t size, uint8_t *buffer);
+    void *context;                  /**< Context passed to read(). */
+    int mapped;                     /**< The data is returned from a mapping, read() needs no buffer. */
+    uint64_t size;                  /**< Size of the archive. */
+} TOC_SOURCE;
+
+/**
+ * Structure holding the tables of an archive.
+ */
+typedef struct {
+    ARCHIVEINFO info;               /**< Header of the archive. */
+    FILEINFO *entries;              /**< TOC entries, entry 0 is the manifest. */
+    uint32_t *blocktable;           /**< Block sizes (0 = block_size). */
+    size_t num_blocks;              /**< Number of blocks. */
+    uint8_t *dictionary;            /**< Preset dictionary (NULL = none). */
+    size_t dictionary_size;         /**< Size of the preset dictionary. */
+} TOC;
+
+/**
+ * Reads the tables of an archive.
+ *
+ * The header is checked, and the TOC entries must lie within the block table. The preset
+ * dictionary (AF_DICTIONARY) and the checksums (AF_CHECKSUMS) are read if the archive has them.
+ * The file names are not set, the manifest is an entry like the others (see toc_split_names()).
+ *
+ * @param source        Where the archive is read from.
+ * @param toc           The tables to fill (freed with toc_free(), nothing is left to free on error).
+ *
+ * @return              0 on success, otherwise the step that failed (TOC_ERROR_*).
+ */
+int toc_read(const TOC_SOURCE *source, TOC *toc);
+
+/**
+ * Frees the tables of an archive.
+ *
+ * @param toc           The tables (the structure itself isn't freed).
+ */
+void toc_free(TOC *toc);
+
+/**
+ * Splits the decoded manifest in place and sets the file names of the entries.
+ *
+ * Names are separated by newlines. The file names point into the manifest, which must outlive
+ * the entries. Empty lines keep their entry slot.
+ *
+ * @param entries       The TOC entries, entry 0 is the manifest.
+ * @param toc_entries   Number of TOC entries.
+ * @param names         The manifest, null terminated.
+ */
+void toc_split_names(FILEINFO *entries, uint32_t toc_entries, char *names);
+
+#endif /* __TOC_H */
@@ -41,9 +41,8 @@
 #include <math.h>
 #include <locale.h>
 #include <libgen.h>
-#include <zlib.h>
-#include <lzma.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "common.h"
 #include "psarc.h"
@@ -52,310 +51,1168 @@
 #include "hashset.h"
 #include "file_utils.h"
 #include "report.h"
+#include "threads.h"
+#include "coder.h"
+#include "mapfile.h"
+#include "toc.h"
+#include "asyncio.h"
+#include "crc32c.h"
+#include "stats.h"
 
 static uint8_t *source_buffer = NULL;
 static uint8_t *target_buffer = NULL;
+static CODER *archive_coder = NULL;
+static MAPFILE *archive_map = NULL;
+static char *manifest_names = NULL;             // Manifest of the archive, split in place into the entry names
+static uint8_t *archive_dictionary = NULL;      // Preset dictionary of the archive (NULL = none)
+static size_t archive_dictionary_size = 0;      // Size of the preset dictionary
+
+#define READ_AHEAD_SIZE     0x100000            // Compressed data read ahead when the archive isn't mapped
+#define READ_AHEAD_BLOCKS   8                   // Max blocks read ahead when the archive isn't mapped
+#define BLOCK_TASKS_SIZE    0x400000            // Entries this big are decoded by one task per block (threads mode)
+
+/**
+ * Read-ahead of the compressed blocks of an entry, used when the archive isn't mapped.
+ *
+ * The blocks are read in order through an asynchronous queue. Read N is kept in buffer
+ * N % (depth + 1), so the block being decoded isn't overwritten by the reads in flight.
+ */
+typedef struct {
+    ASYNCIO *aio;                   // Queue of reads (NULL = not used)
+    uint8_t *buffers;               // depth + 1 buffers of block_size bytes
+    unsigned depth;                 // Max reads in flight
+    int fd;                         // Archive file
+    uint64_t queued;                // Reads queued
+    uint64_t taken;                 // Reads waited for
+    uint32_t block;                 // Next block to read
+    uint64_t offset;                // Offset of the next block in the archive
+    uint64_t pos;                   // Position of the next block in the entry
+} READAHEAD;
+
+/**
+ * Gets a range of bytes from the PSARC archive.
+ *
+ * If the archive is mapped in memory, the data is returned straight from the mapping.
+ * Otherwise, it's read into the given buffer.
+ *
+ * @param archive_file      The PSARC archive file (not used if the archive is mapped).
+ * @param offset            Offset of the data in the archive.
+ * @param size              Size of the data.
+ * @param buffer            Buffer for the data (at least size bytes, not used if the archive is mapped).
+ *
+ * @return                  A pointer to the data, or NULL on error.
+ */
+
+static const uint8_t *read_archive_data(FILE *archive_file, uint64_t offset, size_t size, uint8_t *buffer) {
+    if (archive_map) {
+        if (offset > archive_map->size || size > archive_map->size - offset) return NULL;
+        return archive_map->data + offset;
+    }
+
+    uint64_t start = STATS_BEGIN();
+
+    if (fseek(archive_file, offset, SEEK_SET) || fread(buffer, size, 1, archive_file) != 1) return NULL;
+
+    STATS_END(STATS_READ, start, size);
+
+    return buffer;
+}
 REPORT *report = NULL;
 
+/**
+ * Gets the number of blocks read ahead when the archive isn't mapped.
+ *
+ * @return                  The depth of the read-ahead.
+ */
+
+static unsigned get_readahead_depth() {
+    unsigned depth = READ_AHEAD_SIZE / _ArchiveInfo.block_size;
+    if (depth < 2) depth = 2;
+    if (depth > READ_AHEAD_BLOCKS) depth = READ_AHEAD_BLOCKS;
+    return depth;
+}
+
+/**
+ * Starts the read-ahead of the blocks of an entry.
+ *
+ * @param ra                The read-ahead.
+ * @param archive_file      The PSARC archive file.
+ * @param block             First block to read.
+ * @param offset            Offset of the first block in the archive.
+ * @param pos               Position of the first block in the entry.
+ *
+ * @return                  0 on success, 1 on error (the blocks must be read synchronously).
+ */
+
+static int readahead_init(READAHEAD *ra, FILE *archive_file, uint32_t block, uint64_t offset, uint64_t pos) {
+    unsigned depth = get_readahead_depth();
+
+    memset(ra, 0, sizeof(READAHEAD));
+
+    ra->buffers = (uint8_t *)malloc((size_t)( depth + 1 ) * _ArchiveInfo.block_size);
+    if (!ra->buffers) return 1;
+
+    ra->aio = asyncio_new(depth);
+    if (!ra->aio) {
+        free(ra->buffers);
+        ra->buffers = NULL;
+        return 1;
+    }
+
+    ra->depth = depth;
+    ra->fd = fileno(archive_file);
+    ra->block = block;
+    ra->offset = offset;
+    ra->pos = pos;
+
+    return 0;
+}
+
+/**
+ * Queues the reads of the next compressed blocks of an entry, up to the depth of the read-ahead.
+ *
+ * Raw blocks are skipped when they're copied straight to the output file.
+ *
+ * @param ra                The read-ahead.
+ * @param fi                Information about the file entry.
+ * @param blocktable        The table containing block sizes for the PSARC archive.
+ * @param range_end         End of the range to decompress in the entry.
+ * @param skip_raw          Flag indicating whether the raw blocks are skipped.
+ */
+
+static void readahead_queue(READAHEAD *ra, FILEINFO *fi, uint32_t *blocktable, uint64_t range_end, int skip_raw) {
+    uint64_t chunk_size = _ArchiveInfo.block_size;
+
+    while (ra->queued - ra->taken < ra->depth && ra->pos < range_end) {
+        uint32_t block_size = blocktable[ra->block] ? blocktable[ra->block] : chunk_size;
+        uint64_t data_size = fi->uncompressed_size - ra->pos;
+        if (data_size > chunk_size) data_size = chunk_size;
+
+        if (!skip_raw || block_size != data_size) {
+            asyncio_read(ra->aio, ra->fd, ra->buffers + ( ra->queued % ( ra->depth + 1 ) ) * chunk_size, block_size, ra->offset);
+            ra->queued++;
+        }
+
+        ra->offset += block_size;
+        ra->pos += data_size;
+        ra->block++;
+    }
+}
+
+/**
+ * Gets the next compressed block of an entry from the read-ahead.
+ *
+ * The reads of the following blocks are queued before returning, so they're done while the block
+ * is decoded.
+ *
+ * @param ra                The read-ahead.
+ * @param fi                Information about the file entry.
+ * @param blocktable        The table containing block sizes for the PSARC archive.
+ * @param range_end         End of the range to decompress in the entry.
+ * @param skip_raw          Flag indicating whether the raw blocks are skipped.
+ * @param block_size        Size of the block.
+ *
+ * @return                  A pointer to the block (valid until the next call), or NULL on error.
+ */
+
+static const uint8_t *readahead_get_block(READAHEAD *ra, FILEINFO *fi, uint32_t *blocktable, uint64_t range_end, int skip_raw, uint32_t block_size) {
+    if (ra->queued == ra->taken) readahead_queue(ra, fi, blocktable, range_end, skip_raw);
+    if (ra->queued == ra->taken) return NULL;
+
+    uint64_t start = STATS_BEGIN();
+    int64_t bytes_read = asyncio_wait(ra->aio);
+    STATS_END(STATS_READ, start, bytes_read > 0 ? bytes_read : 0);
+
+    uint8_t *block = ra->buffers + ( ra->taken % ( ra->depth + 1 ) ) * _ArchiveInfo.block_size;
+    ra->taken++;
+
+    readahead_queue(ra, fi, blocktable, range_end, skip_raw);
+
+    return bytes_read == block_size ? block : NULL;
+}
+
+/**
+ * Stops the read-ahead of an entry and frees its resources.
+ *
+ * @param ra                The read-ahead.
+ */
+
+static void readahead_free(READAHEAD *ra) {
+    asyncio_free(ra->aio);
+    free(ra->buffers);
+    ra->aio = NULL;
+    ra->buffers = NULL;
+}
+
+/**
+ * Copies a run of raw blocks from the PSARC archive to an output file.
+ *
+ * The data is copied inside the kernel when possible, otherwise it's written from the mapping
+ * or read through the buffer. The archive file position is left at the end of the run.
+ *
+ * @param archive_file      The PSARC archive file (not used if the archive is mapped).
+ * @param output_file       The output file.
+ * @param offset            Offset of the run in the archive.
+ * @param size              Size of the run.
+ * @param buffer            Buffer for the data (at least block_size bytes).
+ * @param checksum          CRC32C updated with the data of the run (NULL = not calculated). The
+ *                          data has to pass through memory, so it isn't copied by the kernel.
+ *
+ * @return                  0 on success, 1 on error.
+ */
+
+static int copy_raw_blocks(FILE *archive_file, FILE *output_file, uint64_t offset, uint64_t size, uint8_t *buffer, uint32_t *checksum) {
+    uint64_t start = STATS_BEGIN();
+    uint64_t run_size = size;
+
+    uint64_t copied = checksum ? 0 : file_copy_range(archive_map ? archive_map->fd : fileno(archive_file), offset, output_file, size);
+
+    offset += copied;
+    size -= copied;
+
+    if (archive_map) {
+        if (offset > archive_map->size || size > archive_map->size - offset) return 1;
+        if (size && fwrite(archive_map->data + offset, size, 1, output_file) != 1) return 1;
+        if (checksum) *checksum = crc32c(*checksum, archive_map->data + offset, size);
+        STATS_END(STATS_WRITE, start, run_size);
+        return 0;
+    }
+
+    if (fseek(archive_file, offset, SEEK_SET)) return 1;
+
+    while (size) {
+        size_t len = size > _ArchiveInfo.block_size ? _ArchiveInfo.block_size : size;
+        if (fread(buffer, len, 1, archive_file) != 1 || fwrite(buffer, len, 1, output_file) != 1) return 1;
+        if (checksum) *checksum = crc32c(*checksum, buffer, len);
+        size -= len;
+    }
+
+    STATS_END(STATS_WRITE, start, run_size);
+
+    return 0;
+}
+
 /**
  * Decompresses a file entry from the PSARC archive.
  *
  * This function reads and decompresses a portion of a PSARC archive file, up to a maximum
  * of 65536 bytes at a time. It manages the decompression process, including handling zlib
- * and LZMA compression methods.
+ * and LZMA compression methods. Only the blocks covering the requested range are read, and when
+ * the archive isn't mapped the next blocks are read ahead while the current one is decoded.
+ *
+ * Without output file and output buffer the blocks are only checked: every block has to decode
+ * to its full size, and the decoded data is discarded (see --test).
  *
  * @param archive_file      The PSARC archive file.
  * @param output_file       The output file where the decompressed data is written (can be NULL).
- * @param output_buffer     The buffer for storing the decompressed data (if output_file is NULL).
+ * @param output_buffer     The buffer for storing the decompressed data (if output_file is NULL,
+ *                          NULL to only check the blocks).
  * @param fi                Information about the file entry being decompressed.
  * @param blocktable        The table containing block sizes for the PSARC archive.
+ * @param read_buffer       Buffer for the compressed block (at least block_size bytes).
+ * @param write_buffer      Buffer for the decompressed block (at least block_size bytes).
+ * @param coder             The coder used to decompress the blocks.
+ * @param range_offset      Offset of the range to decompress in the entry.
+ * @param range_size        Size of the range (clamped to the end of the entry).
+ * @param checksum          Pointer to receive the CRC32C of the decoded range (NULL = not
+ *                          calculated).
+ *
+ * @return                  0 on success, 1 on error.
+ */
+
+static int decompress_entry(FILE *archive_file, FILE *output_file, unsigned char *output_buffer, FILEINFO *fi, uint32_t *blocktable, uint8_t *read_buffer, uint8_t *write_buffer, CODER *coder, uint64_t range_offset, uint64_t range_size, uint32_t *checksum) {
+    uint64_t chunk_size = _ArchiveInfo.block_size;
+
+    // Clamp the range to the entry
+    if (range_offset > fi->uncompressed_size) range_offset = fi->uncompressed_size;
+    if (range_size > fi->uncompressed_size - range_offset) range_size = fi->uncompressed_size - range_offset;
+
+    uint64_t range_end = range_offset + range_size;
+
+    // Get the open block for the range, the blocks before it are skipped by their sizes
+    uint32_t open_block = fi->block_index;
+    uint64_t offset = fi->offset;
+    uint64_t pos = 0; // Position of the open block in the entry
+
+    while (pos + chunk_size <= range_offset) {
+        offset += blocktable[open_block] ? blocktable[open_block] : chunk_size;
+        pos += chunk_size;
+        open_block++;
+    }
+
+    // Without a mapping, the next blocks are read while the current one is decoded
+    READAHEAD ra = { 0 };
+    int read_ahead = !archive_map && range_end - pos > chunk_size && readahead_init(&ra, archive_file, open_block, offset, pos) == 0;
+
+    if (!archive_map && !read_ahead) fseek(archive_file, offset, SEEK_SET);
+
+    // Pending run of raw data
+    uint64_t run_offset = 0;
+    uint64_t run_size = 0;
+
+    unsigned char *out = output_buffer;
+    int check_only = !output_file && !output_buffer;
+
+    if (checksum) *checksum = 0;
+
+    while (pos < range_end) {
+        // Get the size of the current block
+        uint32_t block_size = blocktable[open_block];
+
+        // block_size == 0 => is chunk_size
+        if (!block_size) block_size = chunk_size;
+
+        uint64_t data_size = fi->uncompressed_size - pos;
+        if (data_size > chunk_size) data_size = chunk_size;
+
+        // Part of the block in the range
+        size_t skip = range_offset > pos ? range_offset - pos : 0;
+        size_t len = ( range_end < pos + data_size ? range_end : pos + data_size ) - pos - skip;
+
+        // A block as big as its data is stored raw, it's copied along with the next raw blocks
+        if (output_file && block_size == data_size) {
+            if (!run_size) run_offset = offset + skip;
+            run_size += len;
+            offset += block_size;
+            pos += data_size;
+            open_block++;
+            continue;
+        }
+
+        if (run_size) {
+            if (copy_raw_blocks(archive_file, output_file, run_offset, run_size, read_buffer, checksum) != 0) {
+                readahead_free(&ra);
+                return 1;
+            }
+            run_size = 0;
+        }
+
+        // Mapped blocks are decoded in place, without copying them to the read buffer
+        const uint8_t *block;
+        if (archive_map) {
+            block = read_archive_data(archive_file, offset, block_size, read_buffer);
+        } else if (read_ahead) {
+            block = readahead_get_block(&ra, fi, blocktable, range_end, output_file != NULL, block_size);
+        } else {
+            uint64_t start = STATS_BEGIN();
+            block = fread(read_buffer, block_size, 1, archive_file) ? read_buffer : NULL;
+            STATS_END(STATS_READ, start, block_size);
+        }
+        if (!block) {
+            // Error reading compressed data
+            readahead_free(&ra);
+            return 1;
+        }
+
+        size_t bytes_read = block_size;
+        offset += block_size;
+
+        // Raw blocks only have to be readable
+        if (check_only && block_size == data_size) {
+            if (checksum) *checksum = crc32c(*checksum, block, data_size);
+            pos += data_size;
+            open_block++;
+            continue;
+        }
+
+        // Decompress only if it's a valid block, whole blocks go straight to the output buffer
+        size_t dest_len = data_size;
+        uint8_t *dest = out && !skip && len == data_size ? out : write_buffer;
+
+        uint64_t start = STATS_BEGIN();
+
+        int decoded = coder_decode_block(coder, _ArchiveInfo.compression_type, block, bytes_read, dest, data_size, &dest_len);
+        if (decoded > 0 || (decoded == 0 && check_only && dest_len != data_size)) {
+            // Error decompressing data
+            readahead_free(&ra);
+            return 1;
+        }
+
+        if (decoded == 0) {
+            STATS_END(STATS_DECOMPRESS, start, dest_len);
+
+            if (dest_len < skip + len) len = dest_len > skip ? dest_len - skip : 0;
+
+            if (checksum) *checksum = crc32c(*checksum, dest == out ? out : write_buffer + skip, len);
+
+            if (output_file) {
+                start = STATS_BEGIN();
+                fwrite(write_buffer + skip, 1, len, output_file);
+                STATS_END(STATS_WRITE, start, len);
+            } else if (out && dest != out) {
+                memmove(out, write_buffer + skip, len);
+            }
+        } else if (check_only) {
+            // A block smaller than its data that can't be decoded
+            readahead_free(&ra);
+            return 1;
+        } else {
+            // It's not a valid block, dump it as is
+            if (bytes_read < skip + len) len = bytes_read > skip ? bytes_read - skip : 0;
+
+            if (checksum) *checksum = crc32c(*checksum, block + skip, len);
+
+            if (!output_file) {
+                memmove(out, block + skip, len);
+            } else {
+                uint64_t start = STATS_BEGIN();
+                fwrite(block + skip, 1, len, output_file);
+                STATS_END(STATS_WRITE, start, len);
+            }
+        }
+
+        // Update position and open block
+        if (out) out += len;
+        pos += data_size;
+        open_block++;
+    }
+
+    readahead_free(&ra);
+
+    if (run_size && copy_raw_blocks(archive_file, output_file, run_offset, run_size, read_buffer, checksum) != 0) return 1;
+
+    return 0;
+}
+
+/**
+ * Reads a range of bytes of the archive for toc_read() (see read_archive_data()).
+ *
+ * @param context           The PSARC archive file.
+ * @param offset            Offset of the data in the archive.
+ * @param size              Size of the data.
+ * @param buffer            Buffer for the data (not used if the archive is mapped).
+ *
+ * @return                  A pointer to the data, or NULL on error.
+ */
+
+static const uint8_t *read_toc_data(void *context, uint64_t offset, size_t size, uint8_t *buffer) {
+    return read_archive_data((FILE *)context, offset, size, buffer);
+}
+
+/**
+ * Reads the tables of the PSARC archive (see toc_read()).
+ *
+ * The header is stored in _ArchiveInfo. If reading fails, an error is printed.
+ *
+ * @param archive_file      The PSARC archive file.
+ * @param toc               The tables to fill.
+ *
+ * @return                  0 on success, 1 on error.
+ */
+
+static int read_tables(FILE *archive_file, TOC *toc) {
+    TOC_SOURCE source = { .read = read_toc_data, .context = archive_file, .mapped = archive_map != NULL };
+
+    if (archive_map) {
+        source.size = archive_map->size;
+    } else {
+        struct stat archive_stat;
+        if (fstat(fileno(archive_file), &archive_stat)) {
+            fprintf( stderr, APPNAME": error reading header from archive\n" );
+            return 1;
+        }
+        source.size = archive_stat.st_size;
+    }
+
+    int ret = toc_read(&source, toc);
+    if (!ret) {
+        _ArchiveInfo = toc->info;
+        return 0;
+    }
+
+    switch (ret) {
+        case TOC_ERROR_HEADER:
+            fprintf( stderr, APPNAME": error reading header from archive\n" );
+            break;
+        case TOC_ERROR_ENTRIES:
+            fprintf( stderr, APPNAME": error reading files info\n" );
+            break;
+        case TOC_ERROR_BLOCKTABLE:
+            fprintf( stderr, APPNAME": error reading block size table\n" );
+            break;
+        case TOC_ERROR_DICTIONARY:
+            fprintf( stderr, APPNAME": error reading dictionary\n" );
+            break;
+        case TOC_ERROR_CHECKSUMS:
+            fprintf( stderr, APPNAME": error reading checksums\n" );
+            break;
+    }
+
+    return 1;
+}
+
+/**
+ * Reads and associates filenames with file information from the PSARC archive.
+ *
+ * This function reads the filenames from the PSARC archive and associates them with their
+ * corresponding file information. The manifest is decompressed and split in place, so the
+ * filenames of the FILEINFO structures point into it (they must not be freed one by one).
+ *
+ * @param archive_file      The PSARC archive file.
+ * @param files_info_table  An array of FILEINFO structures.
+ * @param blocktable        The table containing block sizes for the PSARC archive.
+ *
+ * @return                  0 on success, 1 on error.
+ */
+
+static int read_filenames(FILE *archive_file, FILEINFO *files_info_table, uint32_t *blocktable) {
+    char *names = malloc(files_info_table[0].uncompressed_size + 1);
+    if (!names) return 1;
+
+    uint32_t checksum;
+    int verify = _ArchiveInfo.archive_flags & AF_CHECKSUMS;
+
+    if (decompress_entry(archive_file, NULL, (unsigned char *)names, &files_info_table[0], blocktable, source_buffer, target_buffer, archive_coder, 0, files_info_table[0].uncompressed_size, verify ? &checksum : NULL) != 0 ||
+        (verify && checksum != files_info_table[0].checksum)) {
+        free(names);
+        return 1;
+    }
+
+    names[files_info_table[0].uncompressed_size] = '\0';
+
+    toc_split_names(files_info_table, _ArchiveInfo.toc_entries, names);
+
+    free(manifest_names);
+    manifest_names = names;
+
+    return 0;
+}
+
+/**
+ * Looks up the requested files through the name digests stored in the TOC.
+ *
+ * The digests are indexed in an open addressing hash table, and every requested name is hashed
+ * and searched in it. This way, the requested files are found without reading the manifest.
+ * The matching FILEINFO structures point their filename to the requested names.
+ *
+ * @param files_info_table  An array of FILEINFO structures.
+ * @param files             Array of requested file names.
+ * @param num_files         Number of requested files.
+ *
+ * @return                  0 if all the files were found, 1 otherwise (no filename is set).
+ */
+
+static int lookup_files(FILEINFO *files_info_table, char **files, size_t num_files) {
+    // Power of 2, at least twice the number of entries
+    size_t index_size = 16;
+    while (index_size < (size_t)_ArchiveInfo.toc_entries * 2) index_size <<= 1;
+    size_t mask = index_size - 1;
+
+    uint32_t *index = (uint32_t *)calloc(index_size, sizeof(uint32_t)); // 0 = empty (entry 0 is the manifest)
+    if (!index) return 1;
+
+    // MD5 is uniform, the first bytes of the digest work as hash
+    for (uint32_t i = 1; i < _ArchiveInfo.toc_entries; i++) {
+        const uint8_t *d = files_info_table[i].name_digest;
+        size_t h = ((uint32_t)d[0] | ((uint32_t)d[1] << 8) | ((uint32_t)d[2] << 16) | ((uint32_t)d[3] << 24)) & mask;
+        while (index[h]) h = (h + 1) & mask;
+        index[h] = i;
+    }
+
+    int ret = 0;
+
+    for (size_t i = 0; i < num_files && !ret; i++) {
+        uint8_t digest[16];
+        if (get_name_digest(files[i], strlen(files[i]), digest)) {
+            ret = 1;
+            break;
+        }
+
+        size_t h = ((uint32_t)digest[0] | ((uint32_t)digest[1] << 8) | ((uint32_t)digest[2] << 16) | ((uint32_t)digest[3] << 24)) & mask;
+        for (; index[h]; h = (h + 1) & mask) {
+            if (!memcmp(files_info_table[index[h]].name_digest, digest, sizeof(digest))) break;
+        }
+
+        if (!index[h]) {
+            ret = 1;
+        } else if (!files_info_table[index[h]].filename) {
+            files_info_table[index[h]].filename = files[i];
+        }
+    }
+
+    free(index);
+
+    if (ret) {
+        for (uint32_t i = 1; i < _ArchiveInfo.toc_entries; i++) files_info_table[i].filename = NULL;
+    }
+
+    return ret;
+}
+
+static uint64_t _total_bytes = 0LL;
+static uint64_t _errors = 0LL;
+static uint64_t _successful = 0LL;
+
+static const char *archive_path = NULL;
+
+// Extraction status of a file entry
+enum {
+    EXTRACT_OK = 0,
+    EXTRACT_FAIL,
+    EXTRACT_EXISTS,
+    EXTRACT_SKIPPED,
+    EXTRACT_BAD_DIGEST,
+    EXTRACT_BAD_CHECKSUM
+};
+
+typedef struct {
+    int status;
+    int is_not_last_file;
+    char *filepath;
+    char *filepath_for_open;
+    FILEINFO *fi;
+    uint32_t *blocktable;
+    // Entries decoded by one task per block (see extract_entry_blocks())
+    int is_block;               // The task is a block of the entry
+    int is_first_block;
+    int is_last_block;
+    FILE *output_file;          // Output file shared by the blocks (NULL = the entry is tested)
+    int archive_fd;             // Archive file, when it isn't mapped
+    uint32_t block;             // Index of the block in the entry
+    uint64_t block_offset;      // Offset of the block in the archive
+    uint64_t pos;               // Position of the block in the entry
+    uint32_t checksum;          // CRC32C of the data of the block
+    size_t data_size;           // Size of the data of the block
+    // allocate buffers data from here
+    uint8_t buffers;
+} UNPAKDATA;
+
+// State kept by each worker across its tasks (see get_worker())
+typedef struct {
+    CODER *coder;
+    FILE *archive_file;         // Handle to the archive, when it isn't mapped
+} UNPAKWORKER;
+
+// Entry decoded by one task per block, being committed by the writer
+static int block_entry_status = 0;
+static uint32_t block_entry_checksum = 0;
+
+/**
+ * Builds the output path for a file entry and creates its directory.
+ *
+ * @param fi                    Information about the file entry.
+ * @param filepath_for_open     Pointer to receive the path to be used for opening the output file
+ *                              (points inside the returned buffer).
+ *
+ * @return                      A dynamically allocated buffer with the output path, or NULL if
+ *                              there is not enough memory. The caller is responsible for freeing it.
+ */
+
+static char *get_output_path(FILEINFO *fi, char **filepath_for_open) {
+    char *outdir_copy = strdup(fi->filename);
+    char *outfile_copy = strdup(fi->filename);
+    if (!outdir_copy || !outfile_copy) {
+        free(outdir_copy);
+        free(outfile_copy);
+        return NULL;
+    }
+
+    char *outdir = dirname(outdir_copy);
+    char *outfile = basename(outfile_copy);
+
+    if (*outdir == '/' || ( *outdir == '.' && !*(outdir+1) ) ) outdir++;
+
+    char *filepath = malloc(strlen(outdir) + strlen(outfile) + 2);
+    if (!filepath) {
+        free(outfile_copy);
+        free(outdir_copy);
+        return NULL;
+    }
+    sprintf(filepath, "%s%s%s", outdir, *outdir ? "/" : "", outfile);
+    free(outfile_copy);
+
+    if ( _Config.trim_path_flag ) {
+        *filepath_for_open = strrchr(filepath, '/');
+        if ( *filepath_for_open ) {
+            (*filepath_for_open)++;
+        } else {
+            *filepath_for_open = filepath;
+        }
+    } else {
+        mkpath(outdir, 0777);
+        *filepath_for_open = filepath;
+    }
+
+    free(outdir_copy);
+
+    return filepath;
+}
+
+/**
+ * Checks whether a file entry can be written to its output path.
+ *
+ * @param filepath_for_open     The path of the output file.
+ *
+ * @return                      EXTRACT_OK if the file can be written, EXTRACT_SKIPPED if it exists
+ *                              and must be silently skipped, EXTRACT_EXISTS if it exists and can't
+ *                              be overwritten.
+ */
+
+static int check_output_path(const char *filepath_for_open) {
+    if (!_Config.overwrite_flag && access(filepath_for_open, F_OK) == 0) {
+        return _Config.skip_existing_files_flag ? EXTRACT_SKIPPED : EXTRACT_EXISTS;
+    }
+    return EXTRACT_OK;
+}
+
+/**
+ * Gets the size of the range to extract from a file entry (see --range).
+ *
+ * @param fi                Information about the file entry.
+ *
+ * @return                  The size of the range, clamped to the end of the entry.
+ */
+
+static uint64_t get_range_size(FILEINFO *fi) {
+    if (_Config.range_offset >= fi->uncompressed_size) return 0;
+
+    uint64_t size = fi->uncompressed_size - _Config.range_offset;
+    if (_Config.range_size && _Config.range_size < size) size = _Config.range_size;
+
+    return size;
+}
+
+/**
+ * Decompresses a file entry into its output file.
+ *
+ * @param archive_file          The PSARC archive file.
+ * @param filepath_for_open     The path of the output file.
+ * @param fi                    Information about the file entry.
+ * @param blocktable            The table containing block sizes for the PSARC archive.
+ * @param read_buffer           Buffer for the compressed block.
+ * @param write_buffer          Buffer for the decompressed block.
+ *
+ * The checksum of the file is verified while it's decoded, unless only a range is extracted.
+ *
+ * @return                      EXTRACT_OK on success, EXTRACT_BAD_CHECKSUM if the checksum of the
+ *                              file doesn't match, EXTRACT_FAIL on error.
+ */
+
+static int extract_entry(FILE *archive_file, const char *filepath_for_open, FILEINFO *fi, uint32_t *blocktable, uint8_t *read_buffer, uint8_t *write_buffer, CODER *coder) {
+    // Creating the files counts as writing, it dominates with many small files
+    uint64_t start = STATS_BEGIN();
+    FILE *output_file = fopen(filepath_for_open, "wb");
+    if (!output_file) return EXTRACT_FAIL;
+    STATS_END(STATS_WRITE, start, 0);
+
+    uint64_t range_size = get_range_size(fi);
+    uint32_t checksum;
+    int verify = ( _ArchiveInfo.archive_flags & AF_CHECKSUMS ) && !_Config.range_offset && range_size == fi->uncompressed_size;
+
+    int ret = decompress_entry(archive_file, output_file, NULL, fi, blocktable, read_buffer, write_buffer, coder, _Config.range_offset, range_size, verify ? &checksum : NULL) != 0 ? EXTRACT_FAIL : EXTRACT_OK;
+
+    if (ret == EXTRACT_OK && verify && checksum != fi->checksum) ret = EXTRACT_BAD_CHECKSUM;
+
+    start = STATS_BEGIN();
+    fclose(output_file);
+    STATS_END(STATS_WRITE, start, 0);
+
+    return ret;
+}
+
+/**
+ * Tests a file entry, decoding all its blocks without writing them (see --test).
+ *
+ * The name digest in the TOC is checked against the name in the manifest, and every block has
+ * to decode to its full size. LZMA blocks are xz streams, so the decoder also checks their CRC64.
+ * In archives with checksums, the CRC32C of the file is checked too.
+ *
+ * @param archive_file          The PSARC archive file.
+ * @param fi                    Information about the file entry.
+ * @param blocktable            The table containing block sizes for the PSARC archive.
+ * @param read_buffer           Buffer for the compressed block.
+ * @param write_buffer          Buffer for the decompressed block.
+ * @param coder                 The coder used to decompress the blocks.
+ *
+ * @return                      EXTRACT_OK on success, EXTRACT_BAD_DIGEST if the name digest doesn't
+ *                              match, EXTRACT_BAD_CHECKSUM if the checksum doesn't match,
+ *                              EXTRACT_FAIL on error.
+ */
+
+static int test_entry(FILE *archive_file, FILEINFO *fi, uint32_t *blocktable, uint8_t *read_buffer, uint8_t *write_buffer, CODER *coder) {
+    uint8_t digest[16];
+
+    if (get_name_digest(fi->filename, strlen(fi->filename), digest) != 0) return EXTRACT_FAIL;
+    if (memcmp(digest, fi->name_digest, sizeof(digest))) return EXTRACT_BAD_DIGEST;
+
+    uint32_t checksum;
+    int verify = _ArchiveInfo.archive_flags & AF_CHECKSUMS;
+
+    if (decompress_entry(archive_file, NULL, NULL, fi, blocktable, read_buffer, write_buffer, coder, 0, fi->uncompressed_size, verify ? &checksum : NULL) != 0) return EXTRACT_FAIL;
+
+    return verify && checksum != fi->checksum ? EXTRACT_BAD_CHECKSUM : EXTRACT_OK;
+}
+
+/**
+ * Reports the result of a file entry extraction and updates the totals.
  *
- * @return                  0 on success, 1 on error.
+ * @param fi                Information about the file entry.
+ * @param status            Extraction status (EXTRACT_*).
+ * @param is_not_last       Flag indicating whether this is the last file in the section.
  */
 
-static int decompress_entry(FILE *archive_file, FILE *output_file, unsigned char *output_buffer, FILEINFO *fi, uint32_t *blocktable) {
-    // Get the open block for this file
-    uint32_t open_block = fi->block_index;
-    int64_t remaining_size = fi->uncompressed_size;
+static void report_extract_status(FILEINFO *fi, int status, int is_not_last) {
+    switch (status) {
+        case EXTRACT_OK:
+            report_close_file_item(report, 0, 0, "ok", is_not_last);
+            _total_bytes += get_range_size(fi);
+            _successful++;
+            break;
 
-    fseek(archive_file, fi->offset, SEEK_SET);
+        case EXTRACT_SKIPPED:
+            report_close_file_item(report, 0, 0, "skipped (file exists)", is_not_last);
+            _total_bytes += get_range_size(fi);
+            _successful++;
+            break;
 
-    int64_t chunk_size = _ArchiveInfo.block_size;
+        case EXTRACT_EXISTS:
+            report_close_file_item(report, 0, 0, "fail (file already exists)", is_not_last);
+            _errors++;
+            break;
 
-    while (remaining_size > 0) {
-        // Get the size of the current block
-        uint32_t block_size = blocktable[open_block];
+        case EXTRACT_BAD_DIGEST:
+            report_close_file_item(report, 0, 0, "fail (name digest mismatch)", is_not_last);
+            _errors++;
+            break;
 
-        // block_size == 0 => is chunk_size
-        if (!block_size) block_size = chunk_size;
+        case EXTRACT_BAD_CHECKSUM:
+            report_close_file_item(report, 0, 0, "fail (checksum mismatch)", is_not_last);
+            _errors++;
+            break;
 
-        size_t bytes_read = fread(source_buffer, block_size, 1, archive_file) * block_size;
-        if (bytes_read != block_size) {
-            // Error reading compressed data
-            return 1;
-        }
+        default:
+            report_close_file_item(report, 0, 0, "fail", is_not_last);
+            _errors++;
+            break;
+    }
+}
 
-        if (remaining_size < chunk_size)
-            chunk_size = remaining_size;
-
-        /*
-        78 01   No Compression (no preset dictionary)
-        78 5E   Best speed (no preset dictionary)
-        78 9C   Default Compression (no preset dictionary)
-        78 DA   Best Compression (no preset dictionary)
-        78 20   No Compression (with preset dictionary)
-        78 7D   Best speed (with preset dictionary)
-        78 BB   Default Compression (with preset dictionary)
-        78 F9   Best Compression (with preset dictionary)
-        */
-
-        // Check if it's a valid zlib block
-        if (bytes_read > 2 && source_buffer[0] == 0x78 &&
-            (source_buffer[1] == 0x01 || source_buffer[1] == 0x5E || source_buffer[1] == 0x9C || source_buffer[1] == 0xDA)) {
-            // Decompress only if it's a valid zlib block
-            uLongf dest_len = chunk_size;
-            if (!output_file) {
-                int result = uncompress(output_buffer + (fi->uncompressed_size - remaining_size), &dest_len, source_buffer, block_size);
-                if (result != Z_OK) {
-                    // Error decompressing data
-                    return 1;
-                }
-            } else {
-                int result = uncompress(target_buffer, &dest_len, source_buffer, block_size);
-                if (result != Z_OK) {
-                    // Error decompressing data
-                    return 1;
-                }
-                fwrite(target_buffer, 1, dest_len, output_file);
-            }
-        }
-        // Check if it's a valid LZMA block
-        else if (bytes_read > 6 && memcmp(source_buffer, "\xFD\x37\x7A\x58\x5A\x00", 6) == 0) {
-            // Decompress only if it's a valid LZMA block
-            size_t dest_len = chunk_size;
-            lzma_stream strm = LZMA_STREAM_INIT;
-
-            if (lzma_stream_decoder(&strm, UINT64_MAX, 0) != LZMA_OK) {
-                // Error initializing LZMA stream
-                return 1;
-            }
+/**
+ * Reports an extracted file entry.
+ *
+ * Runs on the writer stage, so reporting is done in archive order. The blocks of an entry
+ * decoded by one task per block are committed in order too: their checksums are combined, and
+ * the entry is reported once its last block is committed.
+ *
+ * @param ti    Pointer to the THREADS_INFO structure of the finished task.
+ */
 
-            strm.next_in = source_buffer;
-            strm.avail_in = bytes_read;
-            strm.avail_out = dest_len;
+static void extract_entry_writer(THREADS_INFO *ti) {
+    UNPAKDATA *upd = (UNPAKDATA *)THREAD_GET_USER_DATA(ti);
 
-            if (!output_file) {
-                strm.next_out = output_buffer + (fi->uncompressed_size - remaining_size);
-            } else {
-                strm.next_out = target_buffer;
-            }
+    if ( !upd->is_block ) {
+        report_open_file_item(report, upd->fi);
+        report_extract_status(upd->fi, upd->status, upd->is_not_last_file);
+        return;
+    }
 
-            lzma_ret ret;
-            if ((ret = lzma_code(&strm, LZMA_FINISH)) != LZMA_STREAM_END) {
-                // Error decoding LZMA data
-                lzma_end(&strm);
-                return 1;
-            }
-            lzma_end(&strm);
-            if (output_file) fwrite(target_buffer, 1, dest_len, output_file);
-        } else {
-            // It's not a valid block, dump it as is
-            if (!output_file) {
-                memmove(output_buffer + (fi->uncompressed_size - remaining_size), source_buffer, bytes_read);
-            } else {
-                fwrite(source_buffer, 1, bytes_read, output_file);
-            }
+    if ( upd->is_first_block ) {
+        report_open_file_item(report, upd->fi);
+        block_entry_status = EXTRACT_OK;
+        block_entry_checksum = upd->checksum;
+    } else {
+        block_entry_checksum = crc32c_combine(block_entry_checksum, upd->checksum, upd->data_size);
+    }
+
+    if ( block_entry_status == EXTRACT_OK ) block_entry_status = upd->status;
+
+    if ( upd->is_last_block ) {
+        if ( upd->output_file ) {
+            uint64_t start = STATS_BEGIN();
+            if ( fclose(upd->output_file) && block_entry_status == EXTRACT_OK ) block_entry_status = EXTRACT_FAIL;
+            STATS_END(STATS_WRITE, start, 0);
         }
 
-        // Update remaining size and open block
-        remaining_size -= chunk_size;
-        open_block++;
+        if ( block_entry_status == EXTRACT_OK && ( _ArchiveInfo.archive_flags & AF_CHECKSUMS ) && block_entry_checksum != upd->fi->checksum ) block_entry_status = EXTRACT_BAD_CHECKSUM;
+
+        report_extract_status(upd->fi, block_entry_status, upd->is_not_last_file);
     }
+}
 
-    return 0;
+/**
+ * Frees the state of a worker (see get_worker()).
+ *
+ * @param data  Pointer to the UNPAKWORKER structure.
+ */
+
+static void unpak_worker_free(void *data) {
+    UNPAKWORKER *worker = (UNPAKWORKER *)data;
+
+    if (worker->coder) coder_free(worker->coder);
+    if (worker->archive_file) fclose(worker->archive_file);
+    free(worker);
 }
 
 /**
- * Reads and parses the PSARC archive header.
+ * Gets the state of the worker running a task.
  *
- * This function reads and interprets the header of a PSARC archive file. It extracts
- * information such as version, compression type, TOC length, and block size.
+ * The coder and the handle to the archive are kept by the worker and reused for all its tasks.
+ * A mapped archive is shared by all the workers, so they don't open it.
  *
- * @param archive_file      The PSARC archive file.
+ * @param ti    Pointer to the THREADS_INFO structure of the task.
  *
- * @return                  0 on success, 1 on error.
+ * @return      The state of the worker, or NULL on error.
  */
 
-static int read_header(FILE *archive_file) {
-    // Read the header of the compressed file
-    PSARCHEADER header;
-
-    fseek(archive_file, 0, SEEK_SET);
+static UNPAKWORKER *get_worker(THREADS_INFO *ti) {
+    UNPAKWORKER *worker = (UNPAKWORKER *)THREAD_LOCAL_DATA(ti);
+    if (!worker) {
+        worker = THREAD_LOCAL_DATA(ti) = calloc(1, sizeof(UNPAKWORKER));
+        if (!worker) return NULL;
+    }
 
-    size_t bytes_read = fread(&header, sizeof(header), 1, archive_file);
-    if (bytes_read != 1) return 1;
+    if (!worker->coder) {
+        worker->coder = coder_new();
+        if (!worker->coder) return NULL;
+        coder_set_dictionary(worker->coder, archive_dictionary, archive_dictionary_size);
+    }
 
-    // Read the Table of Contents (TOC)
-    uint16_t *pversion = (uint16_t *)&header.version;
-    _ArchiveInfo.version.high = ntohs(*pversion);
-    _ArchiveInfo.version.low = ntohs(*(pversion + 1));
-    _ArchiveInfo.compression_type = !strncmp(header.compression_type, "lzma", 4) ? PSARC_LZMA : PSARC_ZLIB;
-    _ArchiveInfo.toc_length = ntohl(header.toc_length);
-    _ArchiveInfo.toc_entries = ntohl(header.toc_entries);
-    _ArchiveInfo.block_size = htonl(header.block_size);
-    _ArchiveInfo.archive_flags = htonl(header.archive_flags);
+    if (!archive_map && !worker->archive_file) {
+        worker->archive_file = fopen(archive_path, "rb");
+        if (!worker->archive_file) return NULL;
+    }
 
-    return 0;
+    return worker;
 }
 
 /**
- * Reads and stores the table of contents (TOC) from the PSARC archive.
+ * Decodes a block of an entry decoded by one task per block.
  *
- * This function reads and stores the TOC entries from a PSARC archive file. It extracts
- * information about each file entry, including name digest, block index, uncompressed size,
- * and offset.
+ * The block is decoded like decompress_entry() does, and written at its position in the output
+ * file, so the blocks can be decoded in any order. A block that doesn't decode to its full size
+ * is an error, the blocks after it couldn't be placed.
  *
- * @param archive_file      The PSARC archive file.
+ * @param upd               The task of the block.
+ * @param read_buffer       Buffer for the compressed block (at least block_size bytes).
+ * @param write_buffer      Buffer for the decompressed block (at least block_size bytes).
+ * @param coder             The coder used to decompress the block.
  *
- * @return                  An array of FILEINFO structures representing TOC entries.
+ * @return                  0 on success, 1 on error.
  */
 
-static FILEINFO *read_toc_table(FILE *archive_file) {
-    FILEINFO *files_info_table = (FILEINFO *)calloc(_ArchiveInfo.toc_entries, sizeof(FILEINFO));
-    if (!files_info_table) return NULL;
+static int decompress_entry_block(UNPAKDATA *upd, uint8_t *read_buffer, uint8_t *write_buffer, CODER *coder) {
+    uint64_t chunk_size = _ArchiveInfo.block_size;
+
+    uint32_t block_size = upd->blocktable[upd->fi->block_index + upd->block];
+    if (!block_size) block_size = chunk_size;
+
+    uint64_t data_size = upd->fi->uncompressed_size - upd->pos;
+    if (data_size > chunk_size) data_size = chunk_size;
+
+    // Mapped blocks are decoded in place, the rest are read without moving the shared file position
+    const uint8_t *block = NULL;
+    if (archive_map) {
+        block = read_archive_data(NULL, upd->block_offset, block_size, NULL);
+    } else {
+        uint64_t start = STATS_BEGIN();
+        if (file_read_at(upd->archive_fd, read_buffer, block_size, upd->block_offset) == 0) block = read_buffer;
+        STATS_END(STATS_READ, start, block_size);
+    }
+    if (!block) return 1;
+
+    // A block as big as its data is stored raw
+    const uint8_t *data = block;
+
+    if (block_size != data_size) {
+        size_t dest_len = data_size;
 
-    fseek(archive_file, sizeof(PSARCHEADER), SEEK_SET);
+        uint64_t start = STATS_BEGIN();
+        if (coder_decode_block(coder, _ArchiveInfo.compression_type, block, block_size, write_buffer, data_size, &dest_len) != 0 || dest_len != data_size) return 1;
+        STATS_END(STATS_DECOMPRESS, start, dest_len);
 
-    for (uint32_t i = 0; i < _ArchiveInfo.toc_entries; i++) {
-        PSARCTOC toc;
-        size_t bytes_read = fread(&toc, sizeof(toc), 1, archive_file);
-        bytes_read = bytes_read; // Remove warning
-        memmove(files_info_table[i].name_digest, toc.name_digest, sizeof(files_info_table[i].name_digest));
-        files_info_table[i].block_index = ntohl(toc.block_offset);
-        files_info_table[i].uncompressed_size = ntoh40((const uint8_t *)toc.uncompressed_size);
-        files_info_table[i].offset = ntoh40((const uint8_t *)toc.file_offset);
+        data = write_buffer;
     }
 
-    return files_info_table;
+    upd->data_size = data_size;
+    if (_ArchiveInfo.archive_flags & AF_CHECKSUMS) upd->checksum = crc32c(0, data, data_size);
+
+    if (upd->output_file) {
+        uint64_t start = STATS_BEGIN();
+        if (file_write_at(fileno(upd->output_file), data, data_size, upd->pos) != 0) return 1;
+        STATS_END(STATS_WRITE, start, data_size);
+    }
+
+    return 0;
 }
 
 /**
- * Reads and stores the block size table from the PSARC archive.
+ * Worker thread for decoding a block of an entry decoded by one task per block.
  *
- * This function reads and stores the block size table from a PSARC archive file. It determines
- * the size of each data block within the archive.
- *
- * @param archive_file      The PSARC archive file.
- *
- * @return                  An array of block sizes.
+ * @param arg   Pointer to the THREADS_INFO structure of the thread.
  */
 
-static uint32_t *read_blocktable(FILE *archive_file) {
-    int bsize = get_blocktable_item_size();
+static void *extract_block_thread(void *arg) {
+    THREADS_INFO *ti = (THREADS_INFO *) arg;
+    UNPAKDATA *upd = (UNPAKDATA *)THREAD_GET_USER_DATA(ti);
 
-    // Calculate the number of blocks and the size of the block table
-    size_t blocktable_size = (_ArchiveInfo.toc_length - (sizeof(PSARCHEADER) + _ArchiveInfo.toc_entries * sizeof(PSARCTOC))) / bsize;
+    uint8_t *buffers[2] = {
+            &upd->buffers,
+            &upd->buffers + _ArchiveInfo.block_size * 2
+        };
 
-    // Read the block table
-    uint32_t *blocktable = (uint32_t *)malloc(blocktable_size * sizeof(uint32_t));
-    if (!blocktable) return NULL;
+    UNPAKWORKER *worker = get_worker(ti);
 
-    uint32_t blk;
-    for (uint32_t i = 0; i < blocktable_size; i++) {
-        if (!fread(&blk, bsize, 1, archive_file)) {
-            free(blocktable);
-            return NULL;
-        }
-        switch (bsize) {
-            case 1:
-                blocktable[i] = (uint32_t)blk;
-                break;
-            case 2:
-                blocktable[i] = (uint32_t)ntohs((uint16_t)blk);
-                break;
-            case 3:
-                blocktable[i] = ntoh24((uint8_t *)&blk);
-                break;
-            case 4:
-                blocktable[i] = ntohl(blk);
-                break;
+    if (!worker || decompress_entry_block(upd, buffers[0], buffers[1], worker->coder) != 0) upd->status = EXTRACT_FAIL;
+
+    threads_task_done(ti);
+
+    return NULL;
+}
+
+/**
+ * Worker thread for extracting a file entry.
+ *
+ * Each worker keeps its own handle to the archive (or shares the mapping), so entries are
+ * decompressed in parallel.
+ *
+ * @param arg   Pointer to the THREADS_INFO structure of the thread.
+ */
+
+static void *extract_entry_thread(void *arg) {
+    THREADS_INFO *ti = (THREADS_INFO *) arg;
+    UNPAKDATA *upd = (UNPAKDATA *)THREAD_GET_USER_DATA(ti);
+
+    uint8_t *buffers[2] = {
+            &upd->buffers,
+            &upd->buffers + _ArchiveInfo.block_size * 2
+        };
+
+    if (upd->status == EXTRACT_OK) {
+        // The coder and the archive handle are kept by the worker and reused for all its entries
+        UNPAKWORKER *worker = get_worker(ti);
+        if (worker) {
+            // Entries without output path are only tested
+            if (upd->filepath_for_open) {
+                upd->status = extract_entry(worker->archive_file, upd->filepath_for_open, upd->fi, upd->blocktable, buffers[0], buffers[1], worker->coder);
+            } else {
+                upd->status = test_entry(worker->archive_file, upd->fi, upd->blocktable, buffers[0], buffers[1], worker->coder);
+            }
+        } else {
+            upd->status = EXTRACT_FAIL;
         }
     }
 
-    return blocktable;
+    free(upd->filepath);
+
+    threads_task_done(ti);
+
+    return NULL;
 }
 
 /**
- * Reads and associates filenames with file information from the PSARC archive.
+ * Decodes a large file entry with one task per block.
  *
- * This function reads the filenames from the PSARC archive and associates them with their
- * corresponding file information. It decompresses the filenames and fills the FILEINFO
- * structures.
+ * It spreads a single large entry over all the workers. The output file is created and
+ * preallocated here, and each block is written at its own position (see decompress_entry_block()),
+ * while the writer commits the blocks in order (see extract_entry_writer()). In test mode the name
+ * digest is checked first, like test_entry() does.
  *
- * @param archive_file      The PSARC archive file.
- * @param files_info_table  An array of FILEINFO structures.
- * @param blocktable        The table containing block sizes for the PSARC archive.
+ * @param archive_file          The PSARC archive file.
+ * @param fi                    Information about the file entry.
+ * @param blocktable            The table containing block sizes for the PSARC archive.
+ * @param filepath_for_open     The path of the output file (NULL = the entry is tested).
+ * @param is_not_last_file      Flag indicating whether this is the last file in the section.
  *
- * @return                  0 on success, 1 on error.
+ * @return                      EXTRACT_OK if the tasks of the blocks were started, otherwise the
+ *                              status of the entry (EXTRACT_FAIL, EXTRACT_BAD_DIGEST).
  */
 
-static int read_filenames(FILE *archive_file, FILEINFO *files_info_table, uint32_t *blocktable) {
-    char *names = malloc(files_info_table[0].uncompressed_size + 1);
-    if (decompress_entry(archive_file, NULL, (unsigned char *)names, &files_info_table[0], blocktable) != 0) return 1;
+static int extract_entry_blocks(FILE *archive_file, FILEINFO *fi, uint32_t *blocktable, const char *filepath_for_open, int is_not_last_file) {
+    uint64_t chunk_size = _ArchiveInfo.block_size;
+    FILE *output_file = NULL;
 
-    names[files_info_table[0].uncompressed_size] = '\0';
+    if (filepath_for_open) {
+        uint64_t start = STATS_BEGIN();
+        output_file = fopen(filepath_for_open, "wb");
+        if (!output_file) return EXTRACT_FAIL;
 
-    const char *delimiter = "\x0a"; // Newline as delimiter
-    char *token = strtok(names, delimiter); // Get the first name
-
-    // Fill the FILEINFO structure with file names
-    for (uint32_t i = 1; i < _ArchiveInfo.toc_entries && token != NULL; i++) {
-        files_info_table[i].filename = strdup(token); // Copy the file name
-        if (!files_info_table[i].filename) {
-            // If memory fail, free allocated filenames
-            for( --i; i > 0; i--){
-                free(files_info_table[i].filename);
-                files_info_table[i].filename = NULL;
-            }
-            free(names);
-            return 1;
+        // A full disk fails the entry before any block is decoded
+        if (file_preallocate(fileno(output_file), fi->uncompressed_size) != 0) {
+            fclose(output_file);
+            return EXTRACT_FAIL;
         }
-        token = strtok(NULL, delimiter); // Get the next name
+        STATS_END(STATS_WRITE, start, 0);
+    } else {
+        uint8_t digest[16];
+        if (get_name_digest(fi->filename, strlen(fi->filename), digest) != 0) return EXTRACT_FAIL;
+        if (memcmp(digest, fi->name_digest, sizeof(digest))) return EXTRACT_BAD_DIGEST;
     }
 
-    free(names);
+    uint32_t blocks = ( fi->uncompressed_size + chunk_size - 1 ) / chunk_size;
+    uint64_t offset = fi->offset;
+
+    for (uint32_t block = 0; block < blocks; block++) {
+        UNPAKDATA *upd;
+
+        int slot = threads_get_free_slot( (void **) &upd );
+
+        upd->status = EXTRACT_OK;
+        upd->is_not_last_file = is_not_last_file;
+        upd->filepath = NULL;
+        upd->filepath_for_open = NULL;
+        upd->fi = fi;
+        upd->blocktable = blocktable;
+        upd->is_block = 1;
+        upd->is_first_block = block == 0;
+        upd->is_last_block = block == blocks - 1;
+        upd->output_file = output_file;
+        upd->archive_fd = fileno(archive_file);
+        upd->block = block;
+        upd->block_offset = offset;
+        upd->pos = block * chunk_size;
+        upd->checksum = 0;
+        upd->data_size = 0;
+
+        threads_start_task( slot, extract_block_thread, upd );
 
-    return 0;
+        // block_size == 0 => is chunk_size
+        offset += blocktable[fi->block_index + block] ? blocktable[fi->block_index + block] : chunk_size;
+    }
+
+    return EXTRACT_OK;
 }
 
 /**
  * Decompresses files from the PSARC archive and writes them to the output directory.
  *
  * This function decompresses files from a PSARC archive and writes them to the output directory.
- * It creates subdirectories as needed and handles the decompression process.
+ * It creates subdirectories as needed and handles the decompression process. When threads are
+ * enabled, entries are extracted in parallel, and the blocks of each large entry too (see
+ * extract_entry_blocks()).
+ *
+ * In test mode the entries are decoded the same way, but nothing is written (see test_entry()).
  *
  * @param archive_file          The PSARC archive file.
  * @param files_info_table      An array of FILEINFO structures.
  * @param blocktable            The table containing block sizes for the PSARC archive.
  * @param files                 Array of input file paths.
  * @param num_files             Number of input files.
+ * @param test                  Test the entries instead of extracting them.
  *
  * @return                      0 if successful
  *                              1 on error.
  *                              2 on error with output format
  */
 
-static uint64_t _total_bytes = 0LL;
-static uint64_t _errors = 0LL;
-static uint64_t _successful = 0LL;
-
-static int decompress_files(FILE *archive_file, FILEINFO *files_info_table, uint32_t *blocktable, char **files, size_t num_files) {
+static int decompress_files(FILE *archive_file, FILEINFO *files_info_table, uint32_t *blocktable, char **files, size_t num_files, int test) {
     HASHSET *hset = NULL;
 
     size_t files_count = 0;
 
+    // Each task in flight holds its blocks, each worker its coder, and the main thread its buffers and read-ahead
+    size_t coder_size = coder_get_memory_usage(_ArchiveInfo.compression_type, 0, 0, _ArchiveInfo.block_size, 1);
+    size_t fixed_size = (size_t)_ArchiveInfo.block_size * ( 4 + ( archive_map ? 0 : get_readahead_depth() + 1 ) );
+    if ( fit_memory_limit(sizeof(UNPAKDATA) + (size_t)_ArchiveInfo.block_size * 4, coder_size, fixed_size) ) {
+        fprintf( stderr, APPNAME": memory limit too low for blocks of %u bytes\n", _ArchiveInfo.block_size );
+        return 1;
+    }
+
     if ( num_files ) {
-        hset = hashset_init(65536);
+        hset = hashset_init(num_files);
+        if ( !hset ) {
+            fprintf( stderr, APPNAME": not enough memory\n");
+            return 1;
+        }
         for ( size_t i = 0; i < num_files; i++ ) {
             if ( _ArchiveInfo.archive_flags & AF_ICASE ) {
                 char * f = lcase(files[i]);
@@ -376,17 +1233,39 @@ static int decompress_files(FILE *archive_file, FILEINFO *files_info_table, uint
         files_count = _ArchiveInfo.toc_entries - 1;
     }
 
+    if ( _Config.num_threads > 0 ) {
+        if ( threads_init( _Config.num_threads, get_reorder_window(), sizeof(UNPAKDATA) + _ArchiveInfo.block_size * 4 ) || threads_start_writer( extract_entry_writer ) ) {
+            fprintf( stderr, APPNAME": not enough memory\n");
+            threads_free();
+            if ( hset ) hashset_free( hset );
+            return 1;
+        }
+        threads_set_local_data_free(unpak_worker_free);
+    }
+
+    int ret = 0;
+
     report_open_file_section(report);
 
+    if ( _Config.progress_flag ) {
+        // The sizes of the requested files are only known as they are found
+        uint64_t total_bytes = 0;
+        if ( !hset ) for (uint32_t i = 1; i < _ArchiveInfo.toc_entries; i++) if ( files_info_table[i].filename ) total_bytes += files_info_table[i].uncompressed_size;
+        report_set_progress_total(report, files_count, total_bytes);
+    }
+
     // Create destination files and perform decompression
     for (uint32_t i = 1; i < _ArchiveInfo.toc_entries; i++) {
+        // Entries without name are not requested (found by digest) or missing in the manifest
+        if ( !files_info_table[i].filename ) continue;
+
         if ( hset ) {
             if ( _ArchiveInfo.archive_flags & AF_ICASE ) {
                 char * f = lcase(files_info_table[i].filename);
                 if ( !f ) {
                     fprintf( stderr, APPNAME": not enough memory\n");
-                    hashset_free(hset);
-                    return 1;
+                    ret = 1;
+                    break;
                 }
                 int exists = hashset_contains(hset, f);
                 free(f);
@@ -397,89 +1276,69 @@ static int decompress_files(FILE *archive_file, FILEINFO *files_info_table, uint
             hashset_del(hset, files_info_table[i].filename);
         }
 
-        char *outdir_copy = strdup(files_info_table[i].filename);
-        char *outfile_copy = strdup(files_info_table[i].filename);
-        if (!outdir_copy || !outfile_copy) {
-            free(outdir_copy);
-            free(outfile_copy);
-            fprintf( stderr, APPNAME": not enough memory\n");
-            if ( hset ) hashset_free( hset );
-            return 1;
-        }
-
-        char *outdir = dirname(outdir_copy);
-        char *outfile = basename(outfile_copy);
-
-        if (*outdir == '/' || ( *outdir == '.' && !*(outdir+1) ) ) outdir++;
-
-        char *filepath = malloc(strlen(outdir) + strlen(outfile) + 2);
-        if (!filepath) {
-            fprintf( stderr, APPNAME": not enough memory\n");
-            free(outfile_copy);
-            free(outdir_copy);
-            if ( hset ) hashset_free( hset );
-            return 1;
-        }
-        sprintf(filepath, "%s%s%s", outdir, *outdir ? "/" : "", outfile);
-        free(outfile_copy);
-
         char *filepath_for_open = NULL;
+        char *filepath = NULL;
+        int status = EXTRACT_OK;
 
-        if ( _Config.trim_path_flag ) {
-            filepath_for_open = strrchr(filepath, '/');
-            if ( filepath_for_open ) {
-                filepath_for_open++;
-            } else {
-                filepath_for_open = filepath;
+        if ( !test ) {
+            filepath = get_output_path(&files_info_table[i], &filepath_for_open);
+            if (!filepath) {
+                fprintf( stderr, APPNAME": not enough memory\n");
+                ret = 1;
+                break;
             }
-        } else {
-            mkpath(outdir, 0777);
-            filepath_for_open = filepath;
-        }
-
-        free(outdir_copy);
 
-        report_open_file_item(report, &files_info_table[i]);
-
-        int fileexists = access(filepath_for_open, F_OK) == 0;
+            status = check_output_path(filepath_for_open);
+        }
 
         files_count--;
 
-        if (fileexists && !_Config.overwrite_flag) {
-             if ( _Config.skip_existing_files_flag ) {
-                report_close_file_item(report, 0, 0, "skipped (file exists)", files_count);
-                _total_bytes += files_info_table[i].uncompressed_size;
-                _successful++;
-                free(filepath);
-                continue;
-            } else {
-                report_close_file_item(report, 0, 0, "fail (file already exists)", files_count);
-                _errors++; 
+        // Large entries are decoded by all the workers, unless only a range is extracted
+        if ( _Config.num_threads > 0 && status == EXTRACT_OK && files_info_table[i].uncompressed_size >= BLOCK_TASKS_SIZE
+            && ( test || ( !_Config.range_offset && !_Config.range_size ) ) ) {
+            status = extract_entry_blocks(archive_file, &files_info_table[i], blocktable, filepath_for_open, files_count > 0);
+            if ( status == EXTRACT_OK ) {
                 free(filepath);
                 continue;
             }
         }
 
-        FILE *output_file = fopen(filepath_for_open, "wb");
+        if ( _Config.num_threads > 0 ) {
+            UNPAKDATA *upd;
 
-        free(filepath);
+            int slot = threads_get_free_slot( (void **) &upd );
 
-        if (output_file) {
-            if (decompress_entry(archive_file, output_file, NULL, &files_info_table[i], blocktable) != 0) {
-                report_close_file_item(report, 0, 0, "fail", files_count);
-                _errors++;
-            } else {
-                report_close_file_item(report, 0, 0, "ok", files_count);
-                _total_bytes += files_info_table[i].uncompressed_size;
-                _successful++;
-            }
-            fclose(output_file);
+            upd->status = status;
+            upd->is_not_last_file = files_count > 0;
+            upd->filepath = filepath;
+            upd->filepath_for_open = filepath_for_open;
+            upd->fi = &files_info_table[i];
+            upd->blocktable = blocktable;
+            upd->is_block = 0;
+
+            threads_start_task( slot, extract_entry_thread, upd );
         } else {
-            report_close_file_item(report, 0, 0, "fail", files_count);
-            _errors++;
+            report_open_file_item(report, &files_info_table[i]);
+
+            if (status == EXTRACT_OK) {
+                if (test) {
+                    status = test_entry(archive_file, &files_info_table[i], blocktable, source_buffer, target_buffer, archive_coder);
+                } else {
+                    status = extract_entry(archive_file, filepath_for_open, &files_info_table[i], blocktable, source_buffer, target_buffer, archive_coder);
+                }
+            }
+
+            free(filepath);
+
+            report_extract_status(&files_info_table[i], status, files_count > 0);
         }
     }
 
+    if ( _Config.num_threads > 0 ) {
+        threads_wait_for_completion();
+        threads_free();
+    }
+
     if ( hset ) {
 #ifdef SHOW_FILES_NOT_FOUND
         for ( size_t i = 0; i < num_files; i++ ) {
@@ -491,6 +1350,8 @@ static int decompress_files(FILE *archive_file, FILEINFO *files_info_table, uint
         hashset_free( hset );
     }
 
+    if ( ret ) return ret;
+
     report_close_file_section(report);
 
     return _errors > 0 ? 2 : 0;
@@ -523,7 +1384,7 @@ static void list_archive_files(FILEINFO *files_info_table, uint32_t *blocktable)
  *
  * @param input_file         The input PSARC archive file.
  * @param mode               The processing mode (1 for compression, 2 for decompression,
- *                           3 for listing, 4 for detailed info).
+ *                           3 for listing, 4 for detailed info, 6 for testing).
  * @param files              Array names of files to process
  * @param num_files          Number of files in array
  *
@@ -542,74 +1403,89 @@ int process_archive(char *input_file, int mode, char **files, size_t num_files)
         return 1;
     }
 
-    source_buffer = malloc(_ArchiveInfo.block_size * 2);
-    if (!source_buffer) {
-        fprintf( stderr, APPNAME": not enough memory\n");
-        fclose(archive_file);
-        return 1;
-    }
+    archive_path = input_file;
 
-    target_buffer = malloc(_ArchiveInfo.block_size * 2);
-    if (!target_buffer) {
-        fprintf( stderr, APPNAME": not enough memory\n" );
-        free(source_buffer);
-        return 1;
-    }
+    // Map the archive if possible, otherwise it's read through archive_file
+    archive_map = mapfile_open(input_file);
 
-    // Read the PSARC header
-    if (read_header(archive_file) != 0) {
-        fprintf( stderr, APPNAME": error reading header from archive\n" );
-        free(source_buffer);
-        free(target_buffer);
+    // Read the header, the TOC, the block table, the preset dictionary and the checksums
+    TOC toc;
+    if (read_tables(archive_file, &toc) != 0) {
         fclose(archive_file);
+        mapfile_close(archive_map);
         return 1;
     }
 
-    // Read the Table of Contents (TOC)
-    FILEINFO *files_info_table = read_toc_table(archive_file);
-    if (files_info_table == NULL) {
-        fprintf( stderr, APPNAME": error reading files info\n" );
-        free(source_buffer);
-        free(target_buffer);
+    FILEINFO *files_info_table = toc.entries;
+    uint32_t *blocktable = toc.blocktable;
+    archive_dictionary = toc.dictionary;
+    archive_dictionary_size = toc.dictionary_size;
+
+    if (!coder_is_available(_ArchiveInfo.compression_type)) {
+        fprintf( stderr, APPNAME": %s compression isn't supported by this build\n", coder_get_name(_ArchiveInfo.compression_type) );
+        toc_free(&toc);
+        archive_dictionary = NULL;
         fclose(archive_file);
+        mapfile_close(archive_map);
         return 1;
     }
 
-    // Read the block table
-    uint32_t *blocktable = read_blocktable(archive_file);
-    if (blocktable == NULL) {
-        fprintf( stderr, APPNAME": error reading block size table\n" );
+    // Buffers are sized after the header, the archive block size may differ from the default
+    source_buffer = malloc(_ArchiveInfo.block_size * 2);
+    target_buffer = malloc(_ArchiveInfo.block_size * 2);
+    archive_coder = coder_new();
+    if (!source_buffer || !target_buffer || !archive_coder) {
+        fprintf( stderr, APPNAME": not enough memory\n" );
         free(source_buffer);
         free(target_buffer);
-        free(files_info_table);
+        coder_free(archive_coder);
+        toc_free(&toc);
+        archive_dictionary = NULL;
         fclose(archive_file);
+        mapfile_close(archive_map);
         return 1;
     }
 
+    // The workers set the dictionary on their own coders when they are created
+    coder_set_dictionary(archive_coder, archive_dictionary, archive_dictionary_size);
+
+    // Requested files are looked up by digest, the manifest is only read if any of them is not found.
+    // Case-insensitive archives always read it, files are extracted with the stored name case.
+    int names_resolved = mode == 2 && num_files && !( _ArchiveInfo.archive_flags & AF_ICASE ) && !lookup_files(files_info_table, files, num_files);
+
     // Read file names
-    if (read_filenames(archive_file, files_info_table, blocktable) != 0) {
+    if (!names_resolved && read_filenames(archive_file, files_info_table, blocktable) != 0) {
         fprintf( stderr, APPNAME": error reading filenames\n" );
         free(source_buffer);
         free(target_buffer);
+        coder_free(archive_coder);
+        free(archive_dictionary);
+        archive_dictionary = NULL;
         free(files_info_table);
         free(blocktable);
         fclose(archive_file);
+        mapfile_close(archive_map);
         return 1;
     }
 
     switch (mode) {
         case 2:
+        case 6:
             report = report_open(REPORT_TYPE_UNPAK, _Config.archive_file);
             if ( !report ) {
                 fprintf( stderr, APPNAME": not enough memory\n");
                 free(source_buffer);
                 free(target_buffer);
+                coder_free(archive_coder);
+                free(archive_dictionary);
+                archive_dictionary = NULL;
                 free(files_info_table);
                 free(blocktable);
                 fclose(archive_file);
+                mapfile_close(archive_map);
                 return 1;
             }
-            ret = decompress_files(archive_file, files_info_table, blocktable, files, num_files);
+            ret = decompress_files(archive_file, files_info_table, blocktable, files, num_files, mode == 6);
             report_close(report, (_successful + _errors) > 0, 0, _total_bytes, 0, 0, _successful, _errors);
             break;
 
@@ -619,9 +1495,13 @@ int process_archive(char *input_file, int mode, char **files, size_t num_files)
                 fprintf( stderr, APPNAME": not enough memory\n");
                 free(source_buffer);
                 free(target_buffer);
+                coder_free(archive_coder);
+                free(archive_dictionary);
+                archive_dictionary = NULL;
                 free(files_info_table);
                 free(blocktable);
                 fclose(archive_file);
+                mapfile_close(archive_map);
                 return 1;
             }
             list_archive_files(files_info_table, blocktable);
@@ -636,16 +1516,139 @@ int process_archive(char *input_file, int mode, char **files, size_t num_files)
     }
 
     // Free resources
-    for (uint32_t i = 0; i < _ArchiveInfo.toc_entries; i++)
-        free(files_info_table[i].filename);
+    free(manifest_names);
+    manifest_names = NULL;
 
     free(source_buffer);
     free(target_buffer);
+    coder_free(archive_coder);
+    archive_coder = NULL;
+    free(archive_dictionary);
+    archive_dictionary = NULL;
 
     free(files_info_table);
     free(blocktable);
 
     fclose(archive_file);
+    mapfile_close(archive_map);
+    archive_map = NULL;
 
     return ret;
 }
+
+/**
+ * Opens a PSARC archive and reads its index, to reuse its entries in a new archive.
+ *
+ * Reads the header (into _ArchiveInfo), the TOC, the block table and the file names. The
+ * archive stays open until close_archive_index() is called, and its data can be copied with
+ * copy_archive_data().
+ *
+ * @param input_file        Path to the PSARC archive.
+ * @param archive_file      Pointer to receive the open archive.
+ * @param blocktable        Pointer to receive the block table.
+ * @param num_blocks        Pointer to receive the number of blocks in the block table.
+ *
+ * @return                  The TOC entries (with file names), or NULL on error.
+ */
+
+FILEINFO *open_archive_index(char *input_file, FILE **archive_file, uint32_t **blocktable, size_t *num_blocks) {
+    FILE *fp = fopen(input_file, "rb");
+    if (!fp) return NULL;
+
+    archive_path = input_file;
+    archive_map = mapfile_open(input_file);
+
+    TOC toc;
+    if (read_tables(fp, &toc) != 0) {
+        fclose(fp);
+        mapfile_close(archive_map);
+        archive_map = NULL;
+        return NULL;
+    }
+
+    archive_dictionary = toc.dictionary;
+    archive_dictionary_size = toc.dictionary_size;
+
+    if (!coder_is_available(_ArchiveInfo.compression_type) ||
+        !(source_buffer = malloc(_ArchiveInfo.block_size * 2)) ||
+        !(target_buffer = malloc(_ArchiveInfo.block_size * 2)) ||
+        !(archive_coder = coder_new()) ||
+        read_filenames(fp, toc.entries, toc.blocktable) != 0) {
+
+        free(source_buffer);
+        free(target_buffer);
+        coder_free(archive_coder);
+        source_buffer = target_buffer = NULL;
+        archive_coder = NULL;
+        archive_dictionary = NULL;
+        toc_free(&toc);
+        fclose(fp);
+        mapfile_close(archive_map);
+        archive_map = NULL;
+        return NULL;
+    }
+
+    coder_set_dictionary(archive_coder, archive_dictionary, archive_dictionary_size);
+
+    *archive_file = fp;
+    *blocktable = toc.blocktable;
+    if (num_blocks) *num_blocks = toc.num_blocks;
+
+    return toc.entries;
+}
+
+/**
+ * Copies a range of bytes of an archive opened with open_archive_index() to another file.
+ *
+ * @param archive_file      The PSARC archive file.
+ * @param output_file       The output file (the data is written at its current position).
+ * @param offset            Offset of the data in the archive.
+ * @param size              Size of the data.
+ *
+ * @return                  0 on success, 1 on error.
+ */
+
+int copy_archive_data(FILE *archive_file, FILE *output_file, uint64_t offset, uint64_t size) {
+    return copy_raw_blocks(archive_file, output_file, offset, size, source_buffer, NULL);
+}
+
+/**
+ * Gets the preset dictionary of an archive opened with open_archive_index().
+ *
+ * @param size              Pointer to receive the size of the dictionary.
+ *
+ * @return                  The dictionary (valid until the archive is closed), or NULL if the
+ *                          archive doesn't have one.
+ */
+
+const uint8_t *get_archive_dictionary(size_t *size) {
+    *size = archive_dictionary ? archive_dictionary_size : 0;
+    return archive_dictionary;
+}
+
+/**
+ * Closes an archive opened with open_archive_index() and frees its index.
+ *
+ * @param archive_file      The PSARC archive file.
+ * @param files_info_table  The TOC entries.
+ * @param blocktable        The block table.
+ */
+
+void close_archive_index(FILE *archive_file, FILEINFO *files_info_table, uint32_t *blocktable) {
+    free(manifest_names);
+    manifest_names = NULL;
+    free(files_info_table);
+    free(blocktable);
+
+    free(source_buffer);
+    free(target_buffer);
+    coder_free(archive_coder);
+    free(archive_dictionary);
+    source_buffer = target_buffer = NULL;
+    archive_coder = NULL;
+    archive_dictionary = NULL;
+
+    fclose(archive_file);
+    mapfile_close(archive_map);
+    archive_map = NULL;
+}
@@ -36,6 +36,7 @@
 #ifndef __UNPAK_H
 #define __UNPAK_H
 
+#include <stdio.h>
 #include <stdint.h>
 #include "common.h"
 #include "psarc.h"
@@ -54,4 +55,47 @@
  */
 int process_archive(char *input_file, int mode, char **files, size_t num_files);
 
+/**
+ * Opens a PSARC archive and reads its index, to reuse its entries in a new archive.
+ *
+ * @param input_file        Path to the PSARC archive.
+ * @param archive_file      Pointer to receive the open archive.
+ * @param blocktable        Pointer to receive the block table.
+ * @param num_blocks        Pointer to receive the number of blocks in the block table.
+ *
+ * @return                  The TOC entries (with file names), or NULL on error.
+ */
+FILEINFO *open_archive_index(char *input_file, FILE **archive_file, uint32_t **blocktable, size_t *num_blocks);
+
+/**
+ * Copies a range of bytes of an archive opened with open_archive_index() to another file.
+ *
+ * @param archive_file      The PSARC archive file.
+ * @param output_file       The output file (the data is written at its current position).
+ * @param offset            Offset of the data in the archive.
+ * @param size              Size of the data.
+ *
+ * @return                  0 on success, 1 on error.
+ */
+int copy_archive_data(FILE *archive_file, FILE *output_file, uint64_t offset, uint64_t size);
+
+/**
+ * Gets the preset dictionary of an archive opened with open_archive_index().
+ *
+ * @param size              Pointer to receive the size of the dictionary.
+ *
+ * @return                  The dictionary (valid until the archive is closed), or NULL if the
+ *                          archive doesn't have one.
+ */
+const uint8_t *get_archive_dictionary(size_t *size);
+
+/**
+ * Closes an archive opened with open_archive_index() and frees its index.
+ *
+ * @param archive_file      The PSARC archive file.
+ * @param files_info_table  The TOC entries.
+ * @param blocktable        The block table.
+ */
+void close_archive_index(FILE *archive_file, FILEINFO *files_info_table, uint32_t *blocktable);
+
 #endif